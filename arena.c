@@ -0,0 +1,70 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 8
+#define ARENA_MIN_BLOCK_SIZE 1024
+#define ARENA_MAX_BLOCK_SIZE (4 * 1024 * 1024)
+
+/*
+ * block_size is the size of the first block, each new one
+ * is twice as large as the previous (up to 4 MB)
+ */
+void arena_init(struct arena *arena, size_t block_size)
+{
+	arena->blocks = NULL;
+	arena->block_size = block_size < ARENA_MIN_BLOCK_SIZE ? ARENA_MIN_BLOCK_SIZE : block_size;
+}
+
+/*
+ * Returns size bytes (not zeroed) aligned to 8 bytes
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_block *block = arena->blocks;
+	size_t block_size = arena->block_size;
+	void *ptr = NULL;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (!block || block->size - block->used < size) {
+		// large allocations get a block of their own
+		if (block_size < size)
+			block_size = size;
+
+		block = malloc(sizeof(struct arena_block) + block_size);
+		if (!block) {
+			fprintf(stderr, "Error allocating memory for arena!\n");
+			return NULL;
+		}
+
+		block->next = arena->blocks;
+		block->size = block_size;
+		block->used = 0;
+		arena->blocks = block;
+
+		if (arena->block_size < ARENA_MAX_BLOCK_SIZE)
+			arena->block_size *= 2;
+	}
+
+	ptr = block->data + block->used;
+	block->used += size;
+
+	return ptr;
+}
+
+void arena_free(struct arena *arena)
+{
+	struct arena_block *block = arena->blocks;
+	struct arena_block *next = NULL;
+
+	while (block) {
+		next = block->next;
+		free(block);
+		block = next;
+	}
+
+	arena->blocks = NULL;
+}
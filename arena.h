@@ -0,0 +1,29 @@
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for many small objects freed together: a tree
+ * and its entries, or the cache entries of a run. Allocations
+ * are never freed one by one and never move. An arena is not
+ * thread safe.
+ */
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	char data[0];
+};
+
+struct arena {
+	struct arena_block *blocks; // the newest first
+	size_t block_size; // of the next block
+};
+
+void arena_init(struct arena *arena, size_t block_size);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_free(struct arena *arena);
+
+#endif
@@ -1,5 +1,36 @@
 #ifndef BKP_H
 #define BKP_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "codec.h"
+
+#define DEFAULT_RESTORE_MEMORY (256 * 1024 * 1024)
+#define DEFAULT_RESTORE_CACHE (128 * 1024 * 1024)
+
+/*
+ * Run-time options set from the command line
+ */
+struct bkp_options {
+	int threads;
+	int io_uring; // look up directory entries with io_uring when available
+	struct codec_params codec; // type 0: the codec of the repository
+	size_t restore_memory; // decompressed chunks waiting to be written
+	size_t restore_cache; // decompressed chunks kept for reuse, 0: none
+	int restore_in_place; // the output directory may have content
+	int restore_delete; // in place: remove what isn`t in the snapshot
+	int porcelain; // machine readable output
+	int keep_last; // snapshots kept by --prune, 0: rule not used
+	int keep_daily; // the last one of each day
+	int keep_weekly; // the last one of each week
+	int dry_run; // prune and gc only print what they would remove
+	int check_full; // --check verifies every object
+	int check_sample; // percent of the objects verified by --check, 0: new ones and a slice of the old
+	uint64_t cat_offset; // of the range printed by --cat
+	uint64_t cat_length; // CAT_TO_END: up to the end of the file
+};
+
+extern struct bkp_options bkp_opts;
 
 #endif
@@ -24,20 +24,61 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <stddef.h>
+
+#include <zlib.h>
 
 #include "cache.h"
 #include "file.h"
+#include "config.h"
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+#define SHA1_LEN 20
+
+#define CACHE_INDEX_MIN_SIZE 1024
+#define CACHE_WRITE_BUFF_SIZE (1024 * 1024)
 
-static int add_cache_entry_at(struct cache *cache, struct cache_entry *entry, int idx);
-static void free_cache(struct cache *cache);
+/*
+ * Layout of the entries in filecaches written before the
+ * cache header (and the chunk fingerprints) existed
+ */
+struct cache_entry_v0 {
+	mode_t st_mode;
+	off_t st_size;
+	struct timespec st_mtim;
+	struct timespec st_ctim;
+	unsigned char sha1[SHA1_LEN];
+	int path_len;
+	char path[0];
+};
+
+struct cache_writer {
+	int fd;
+	char *buff;
+	size_t len;
+	uint64_t size; // written so far
+	uint32_t crc;
+};
+
+static int append_cache_entry(struct cache_entry ***entries, int *len, int *size, struct cache_entry *entry);
+static int load_legacy_cache(struct cache *cache, void *cmap, size_t size);
+static int load_v3_cache(struct cache *cache, void *cmap, size_t size);
+static int build_cache_index(struct cache *cache);
+static uint32_t *find_index_slot(struct cache *cache, char *path);
+static struct cache_entry *cache_entry_at(struct cache *cache, uint32_t pos);
+static int compare_cache_entries(const void *a, const void *b);
+static int write_record(struct cache_writer *w, struct cache_entry *c, struct cache_entry *prev, int hash_len);
+static int write_cache_data(struct cache_writer *w, const void *data, size_t len);
+static int flush_cache_writer(struct cache_writer *w);
 
 struct cache *load_cache()
 {
+	int ret = 0;
 	int fd = 0;
-	int offset = 0;
 	struct stat cstat;
-	struct cache *cache = malloc(sizeof(struct cache));
-	struct cache_entry *c = NULL;
+	struct cache *cache = calloc(1, sizeof(struct cache));
+	struct cache_header *hdr = NULL;
 	void *cmap = NULL;
 
 	if (!cache) {
@@ -45,17 +86,19 @@ struct cache *load_cache()
 		return NULL;
 	}
 
-	cache->entries = NULL;
-	cache->entries_len = 0;
+	arena_init(&cache->arena, 0);
 
 	fd = open(".bkp-data/filecache", O_RDONLY);	
 	if (fd < 0) 
-		goto end; // not an error, it just doesn`t exist yet
+		goto index; // not an error, it just doesn`t exist yet
 	
 	if (fstat(fd, &cstat)) {	
 		fprintf(stderr, "Error calling fstat on filecache!\n");
 		goto err;
 	}
+
+	if (cstat.st_size == 0)
+		goto index;
 	
 	cmap = mmap(NULL, cstat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
 	if (cmap == MAP_FAILED) {
@@ -63,18 +106,30 @@ struct cache *load_cache()
 		goto err;
 	}
 
-	while(offset < cstat.st_size) {
-		c = cmap + offset;
-		offset += sizeof(struct cache_entry) + c->path_len+1;
-
-		add_cache_entry_at(cache, c, cache->entries_len);
+	hdr = cmap;
+	if ((size_t)cstat.st_size < sizeof(struct cache_header) || memcmp(hdr->magic, CACHE_MAGIC, 4) != 0)
+		ret = load_legacy_cache(cache, cmap, cstat.st_size);
+	else if (hdr->version == CACHE_VERSION)
+		ret = load_v3_cache(cache, cmap, cstat.st_size);
+	else {
+		fprintf(stderr, "Unsupported filecache version %u!\n", hdr->version);
+		ret = -1;
 	}
 
+	munmap(cmap, cstat.st_size);
+
+	if (ret)
+		goto err;
+
+index:
+	if (build_cache_index(cache))
+		goto err;
+
 	goto end;
 
 err:
 	free_cache(cache);
-	return NULL;
+	cache = NULL;
 
 end:
 	if (fd >= 0)
@@ -83,70 +138,257 @@ end:
 	return cache;
 }
 
+/*
+ * Filecaches without a header are converted into regular
+ * entries without chunk fingerprints
+ */
+static int load_legacy_cache(struct cache *cache, void *cmap, size_t size)
+{
+	size_t offset = 0;
+	struct cache_entry_v0 *c0 = NULL;
+	struct cache_entry *c = NULL;
+
+	while(offset < size) {
+		c0 = cmap + offset;
+		offset += sizeof(struct cache_entry_v0) + c0->path_len+1;
+
+		c = arena_alloc(&cache->arena, cache_entry_size(c0->path_len, 0));
+		if (!c)
+			return -ENOMEM;
+
+		memset(c, 0, cache_entry_size(c0->path_len, 0));
+
+		c->st_mode = c0->st_mode;
+		c->st_size = c0->st_size;
+		c->st_mtim = c0->st_mtim;
+		c->st_ctim = c0->st_ctim;
+		memcpy(c->sha1, c0->sha1, SHA1_LEN);
+		c->num_chunks = 0;
+		c->path_len = c0->path_len;
+		memcpy(c->path, c0->path, c0->path_len + 1);
+
+		if (append_cache_entry(&cache->entries, &cache->entries_len, &cache->entries_size, c))
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * The records are checked (and the size of the decoded entries
+ * summed up) before anything is decoded. A damaged filecache is
+ * dropped: it only means that every file is read again.
+ */
+static int load_v3_cache(struct cache *cache, void *cmap, size_t size)
+{
+	struct cache_info *info = cmap + sizeof(struct cache_header);
+	size_t offset = sizeof(struct cache_header) + sizeof(struct cache_info);
+	struct cache_record rec;
+	struct cache_entry *c = NULL;
+	struct chunk_fp *fp = NULL;
+	char *prev_path = "";
+	int prev_len = 0;
+	size_t block_len = 0;
+	size_t rec_size = 0;
+	int hash_len = 0;
+	char *p = NULL;
+
+	if (size < offset || info->size != size - offset ||
+		info->hash_len != (uint32_t)repo_hash_len() ||
+		crc32_z(0, (unsigned char *)cmap + offset, info->size) != info->crc)
+		goto damaged;
+
+	hash_len = info->hash_len;
+
+	for (uint32_t i=0;i<info->num_entries;i++) {
+		if (size - offset < sizeof(struct cache_record))
+			goto damaged;
+
+		memcpy(&rec, (char *)cmap + offset, sizeof(struct cache_record));
+
+		rec_size = sizeof(struct cache_record) + hash_len + rec.suffix_len + 
+					(size_t)rec.num_chunks * (sizeof(uint32_t) + hash_len * 2);
+
+		if (rec.prefix_len > prev_len || rec.prefix_len + rec.suffix_len >= PATH_MAX || 
+			rec.num_chunks > INT32_MAX / sizeof(struct chunk_fp) || rec_size > size - offset)
+			goto damaged;
+
+		prev_len = rec.prefix_len + rec.suffix_len;
+		block_len += cache_entry_size(prev_len, rec.num_chunks);
+		offset += rec_size;
+	}
+
+	if (offset != size)
+		goto damaged;
+
+	if (info->num_entries == 0)
+		return 0;
+
+	// all the entries in one piece, in the order of the records
+	c = arena_alloc(&cache->arena, block_len);
+	if (!c)
+		return -ENOMEM;
+
+	cache->entries = malloc(info->num_entries * sizeof(struct cache_entry *));
+	if (!cache->entries) {
+		fprintf(stderr, "Error allocating memory for cache entries!\n");
+		return -ENOMEM;
+	}
+
+	cache->entries_size = info->num_entries;
+
+	p = (char *)cmap + sizeof(struct cache_header) + sizeof(struct cache_info);
+
+	for (uint32_t i=0;i<info->num_entries;i++) {
+		memcpy(&rec, p, sizeof(struct cache_record));
+		p += sizeof(struct cache_record);
+
+		memset(c, 0, cache_entry_size(rec.prefix_len + rec.suffix_len, rec.num_chunks));
+
+		c->st_mode = rec.st_mode;
+		c->st_size = rec.st_size;
+		c->st_mtim.tv_sec = rec.mtim_sec;
+		c->st_mtim.tv_nsec = rec.mtim_nsec;
+		c->st_ctim.tv_sec = rec.ctim_sec;
+		c->st_ctim.tv_nsec = rec.ctim_nsec;
+		c->num_chunks = rec.num_chunks;
+		c->path_len = rec.prefix_len + rec.suffix_len;
+
+		memcpy(c->sha1, p, hash_len);
+		p += hash_len;
+
+		memcpy(c->path, prev_path, rec.prefix_len);
+		memcpy(c->path + rec.prefix_len, p, rec.suffix_len);
+		p += rec.suffix_len;
+
+		fp = cache_entry_chunks(c);
+
+		for (int j=0;j<c->num_chunks;j++) {
+			memcpy(&fp[j].size, p, sizeof(uint32_t));
+			memcpy(fp[j].fp, p + sizeof(uint32_t), hash_len);
+			memcpy(fp[j].sha1, p + sizeof(uint32_t) + hash_len, hash_len);
+			p += sizeof(uint32_t) + hash_len * 2;
+		}
+
+		cache->entries[cache->entries_len++] = c;
+		prev_path = c->path;
+
+		c = (struct cache_entry *)((char *)c + cache_entry_size(c->path_len, c->num_chunks));
+	}
+
+	return 0;
+
+damaged:
+	fprintf(stderr, "The filecache is damaged, every file will be read again!\n");
+	return 0;
+}
+
+/*
+ * Writes the entries (merging the added ones first) into a new
+ * filecache, which replaces the old one once it is complete
+ */
 int update_cache(struct cache *cache)
 {
-	int fd = open(".bkp-data/filecache.new", O_WRONLY | O_CREAT | O_EXCL, 0666);
-	int size = 0;
+	int ret = 0;
+	int hash_len = repo_hash_len();
+	struct cache_header hdr;
+	struct cache_info info;
+	struct cache_writer w;
+
+	ret = merge_cache_entries(cache);
+	if (ret)
+		return ret;
+
+	memset(&w, 0, sizeof(struct cache_writer));
 
-	if (fd < 0) {
+	w.fd = open(".bkp-data/filecache.new", O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (w.fd < 0) {
 		if (errno == EEXIST) 
 			fprintf(stderr, "filecache.new already exists! Maybe another cache update in progress?\n");
 
 		return -1;
 	}
 
-	if (cache->entries_len > 0) {
-		for (int i=0;i<cache->entries_len;i++) {
-			struct cache_entry *c = cache->entries[i];
-			size = sizeof(struct cache_entry) + c->path_len + 1;		
-			write(fd, c, size);
-		}
+	w.buff = malloc(CACHE_WRITE_BUFF_SIZE);
+	if (!w.buff) {
+		fprintf(stderr, "Error allocating memory for filecache buffer!\n");
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	memset(&hdr, 0, sizeof(struct cache_header));
+	memset(&info, 0, sizeof(struct cache_info));
+	memcpy(hdr.magic, CACHE_MAGIC, 4);
+	hdr.version = CACHE_VERSION;
+
+	// the info is only known at the end, it is rewritten then
+	if (write(w.fd, &hdr, sizeof(hdr)) != sizeof(hdr) || 
+		write(w.fd, &info, sizeof(info)) != sizeof(info)) {
+		ret = -EIO;
+		goto write_err;
+	}
+
+	for (int i=0;i<cache->entries_len && !ret;i++)
+		ret = write_record(&w, cache->entries[i], i > 0 ? cache->entries[i-1] : NULL, hash_len);
+
+	if (!ret)
+		ret = flush_cache_writer(&w);
+
+	if (ret)
+		goto write_err;
+
+	info.num_entries = cache->entries_len;
+	info.hash_len = hash_len;
+	info.size = w.size;
+	info.crc = w.crc;
+
+	if (pwrite(w.fd, &info, sizeof(info), sizeof(hdr)) != sizeof(info)) {
+		ret = -EIO;
+		goto write_err;
 	}
 
-	close(fd);
+	close(w.fd);
+	w.fd = -1;
+
 	rename(".bkp-data/filecache.new", ".bkp-data/filecache");
+	goto end;
 
-	return 0;
-}
+write_err:
+	fprintf(stderr, "Error writing filecache (errno: %d)!\n", -ret);
 
-int find_cache_entry_insert_idx(struct cache *cache, char *path)
-{
-	return find_cache_entry(cache, path, 1);
+end:
+	if (w.fd >= 0) {
+		close(w.fd);
+		unlink(".bkp-data/filecache.new");
+	}
+
+	free(w.buff);
+
+	return ret;
 }
 
-int find_cache_entry(struct cache *cache, char *path, int ret_insert_idx)
+struct cache_entry *find_cache_entry(struct cache *cache, char *path)
 {
-	int num_iter = 0;
-	int low = 0, high = cache->entries_len - 1;
-
-    while (low <= high) {
-        int mid = low + (high - low) / 2; 
-        int cmp = strcmp(cache->entries[mid]->path, path);
-        if (cmp == 0) {
-            return mid;
-		}
-        else if (cmp < 0)
-            low = mid + 1;   // discard left half including mid
-        else
-            high = mid - 1;  // discard right half including mid
-		
-		num_iter++;
-    }
+	uint32_t *slot = find_index_slot(cache, path);
 
-	return ret_insert_idx ? low : -1;
+	return *slot ? cache_entry_at(cache, *slot - 1) : NULL;
 }
 
 int cache_entry_changed(struct cache_entry *entry, struct stat *stat)
 {
 	int change = 0;
 	if ((entry->st_mtim.tv_sec != stat->st_mtim.tv_sec) || 
-		(entry->st_mtim.tv_nsec != stat->st_mtim.tv_nsec) || 
-		(entry->st_ctim.tv_sec != stat->st_ctim.tv_sec) || 
-		(entry->st_ctim.tv_nsec != stat->st_ctim.tv_nsec)) {
+		(entry->st_mtim.tv_nsec != stat->st_mtim.tv_nsec)) {
 		
 		change |= CE_TIME_CHANGED;
 	}
 
+	if ((entry->st_ctim.tv_sec != stat->st_ctim.tv_sec) || 
+		(entry->st_ctim.tv_nsec != stat->st_ctim.tv_nsec)) {
+		
+		change |= CE_CTIME_CHANGED;
+	}
+
 	if (entry->st_mode != stat->st_mode)
 		change |= CE_MODE_CHANGED;
 
@@ -156,52 +398,341 @@ int cache_entry_changed(struct cache_entry *entry, struct stat *stat)
 	return change;
 }
 
+/*
+ * Inserts entry into the cache, replacing the entry with the same
+ * path if there is one. New paths are only sorted into the entries
+ * by merge_cache_entries().
+ */
 int add_cache_entry(struct cache *cache, struct cache_entry *entry)
+{
+	uint32_t *slot = find_index_slot(cache, entry->path);
+	uint32_t pos = 0;
+
+	if (*slot) {
+		pos = *slot - 1;
+
+		if (pos < (uint32_t)cache->entries_len)
+			cache->entries[pos] = entry;
+		else
+			cache->added[pos - cache->entries_len] = entry;
+
+		return 0;
+	}
+
+	if (append_cache_entry(&cache->added, &cache->added_len, &cache->added_size, entry))
+		return -ENOMEM;
+
+	if ((uint64_t)(cache->entries_len + cache->added_len) * 2 > cache->index_size)
+		return build_cache_index(cache);
+
+	*slot = cache->entries_len + cache->added_len;
+
+	return 0;
+}
+
+/*
+ * Sorts the added entries and merges them into the (sorted)
+ * entries in a single pass
+ */
+int merge_cache_entries(struct cache *cache)
+{
+	struct cache_entry **entries = NULL;
+	int len = 0, i = 0, j = 0;
+
+	if (cache->added_len == 0)
+		return 0;
+
+	qsort(cache->added, cache->added_len, sizeof(struct cache_entry *), compare_cache_entries);
+
+	entries = malloc((cache->entries_len + cache->added_len) * sizeof(struct cache_entry *));
+	if (!entries) {
+		fprintf(stderr, "Error allocating memory for cache entries!\n");
+		return -ENOMEM;
+	}
+
+	while (i < cache->entries_len && j < cache->added_len) {
+		if (strcmp(cache->entries[i]->path, cache->added[j]->path) < 0)
+			entries[len++] = cache->entries[i++];
+		else
+			entries[len++] = cache->added[j++];
+	}
+
+	while (i < cache->entries_len)
+		entries[len++] = cache->entries[i++];
+
+	while (j < cache->added_len)
+		entries[len++] = cache->added[j++];
+
+	free(cache->entries);
+	cache->entries = entries;
+	cache->entries_len = len;
+	cache->entries_size = len;
+	cache->added_len = 0;
+
+	return build_cache_index(cache);
+}
+
+/*
+ * Drops the entries keep() returns 0 for (merging the added ones
+ * first). Returns the number of entries dropped.
+ */
+int filter_cache_entries(struct cache *cache, int (*keep)(struct cache_entry *entry, void *arg), void *arg)
 {
 	int ret = 0;
+	int len = 0;
 
-	ret = write_file(entry->path, entry->st_size, entry->sha1);
+	ret = merge_cache_entries(cache);
 	if (ret)
-		return -1;
+		return ret;
+
+	for (int i=0;i<cache->entries_len;i++)
+		if (keep(cache->entries[i], arg))
+			cache->entries[len++] = cache->entries[i];
+
+	if (len == cache->entries_len)
+		return 0;
 
-	int idx = find_cache_entry_insert_idx(cache, entry->path);
-	return add_cache_entry_at(cache, entry, idx);	
+	ret = cache->entries_len - len;
+	cache->entries_len = len;
+
+	if (build_cache_index(cache))
+		return -ENOMEM;
+
+	return ret;
 }
 
-static int add_cache_entry_at(struct cache *cache, struct cache_entry *entry, int idx)
+int cache_entry_size(int path_len, int num_chunks)
 {
-	if (!cache->entries) {
-		cache->entries = calloc(1000, sizeof(struct cache_entry *));
-	}
-	else {
-		if (cache->entries_len % 1000 == 0)
-			cache->entries = realloc(cache->entries, sizeof(struct cache_entry *) * (cache->entries_len + 1000));
+	int size = offsetof(struct cache_entry, path) + ALIGN(path_len + 1, 4) + 
+		num_chunks * sizeof(struct chunk_fp);
+
+	return ALIGN(size, 8);
+}
+
+struct chunk_fp *cache_entry_chunks(struct cache_entry *entry)
+{
+	return (struct chunk_fp *)(entry->path + ALIGN(entry->path_len + 1, 4));
+}
+
+/*
+ * Entries are allocated from the arena of the cache, they are only
+ * freed with the cache. Not thread safe, like every other change
+ * of the cache.
+ */
+struct cache_entry *new_cache_entry(struct cache *cache, char *path, struct stat *stat, struct chunk_fp *chunks, int num_chunks)
+{
+	int path_len = strlen(path);
+	int size = cache_entry_size(path_len, num_chunks);
+	struct cache_entry *c = arena_alloc(&cache->arena, size);
+
+	if (!c)
+		return NULL;
+
+	// keep the padding clean
+	memset(c, 0, size);
+
+	c->st_mode = stat->st_mode;
+	c->st_size = stat->st_size;
+	c->st_mtim = stat->st_mtim;
+	c->st_ctim = stat->st_ctim;
+	c->num_chunks = num_chunks;
+	c->path_len = path_len;
+	memcpy(c->path, path, path_len + 1);
+
+	if (num_chunks > 0)
+		memcpy(cache_entry_chunks(c), chunks, num_chunks * sizeof(struct chunk_fp));
+
+	return c;
+}
+
+static int append_cache_entry(struct cache_entry ***entries, int *len, int *size, struct cache_entry *entry)
+{
+	if (*len == *size) {
+		int new_size = *size > 0 ? *size * 2 : 1024;
+		struct cache_entry **tmp = realloc(*entries, new_size * sizeof(struct cache_entry *));
+
+		if (!tmp) {
+			fprintf(stderr, "Error allocating memory for cache entries!\n");
+			return -ENOMEM;
+		}
+
+		*entries = tmp;
+		*size = new_size;
 	}
-	
-	if (!cache->entries) {
-		fprintf(stderr, "Error allocating memory for cache entries!\n");
+
+	(*entries)[(*len)++] = entry;
+
+	return 0;
+}
+
+/*
+ * Rebuilds the index, with at least twice as many slots as entries
+ */
+static int build_cache_index(struct cache *cache)
+{
+	uint32_t total = cache->entries_len + cache->added_len;
+	uint32_t size = CACHE_INDEX_MIN_SIZE;
+	uint32_t *slot = NULL;
+
+	while (size < total * 2)
+		size *= 2;
+
+	free(cache->index);
+
+	cache->index = calloc(size, sizeof(uint32_t));
+	cache->index_size = size;
+
+	if (!cache->index) {
+		fprintf(stderr, "Error allocating memory for cache index!\n");
+		cache->index_size = 0;
 		return -ENOMEM;
 	}
 
-	if (cache->entries_len > idx) 
-		memmove(&cache->entries[idx+1], &cache->entries[idx], (cache->entries_len - idx) * sizeof(struct cache_entry *));	
- 
-	cache->entries[idx] = entry;
-	cache->entries_len++;
+	for (uint32_t pos=0;pos<total;pos++) {
+		slot = find_index_slot(cache, cache_entry_at(cache, pos)->path);
+		*slot = pos + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the slot of path in the index, or the free
+ * slot where it goes if it is not in the cache (FNV-1a
+ * hash, linear probing)
+ */
+static uint32_t *find_index_slot(struct cache *cache, char *path)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint32_t mask = cache->index_size - 1;
+	uint32_t i = 0;
+
+	for (unsigned char *p=(unsigned char *)path;*p;p++) {
+		hash ^= *p;
+		hash *= 0x100000001b3ULL;
+	}
+
+	i = (hash ^ (hash >> 32)) & mask;
+
+	while (cache->index[i]) {
+		if (strcmp(cache_entry_at(cache, cache->index[i] - 1)->path, path) == 0)
+			break;
+
+		i = (i + 1) & mask;
+	}
+
+	return &cache->index[i];
+}
+
+static struct cache_entry *cache_entry_at(struct cache *cache, uint32_t pos)
+{
+	if (pos < (uint32_t)cache->entries_len)
+		return cache->entries[pos];
+
+	return cache->added[pos - cache->entries_len];
+}
+
+static int compare_cache_entries(const void *a, const void *b)
+{
+	return strcmp((*(struct cache_entry **)a)->path, (*(struct cache_entry **)b)->path);
+}
+
+/*
+ * Paths are front coded: only the part after the prefix shared
+ * with the previous path is written
+ */
+static int write_record(struct cache_writer *w, struct cache_entry *c, struct cache_entry *prev, int hash_len)
+{
+	int ret = 0;
+	int prefix_len = 0;
+	struct cache_record rec;
+	struct chunk_fp *fp = cache_entry_chunks(c);
+
+	if (prev) {
+		while (prefix_len < c->path_len && prefix_len < prev->path_len && 
+				c->path[prefix_len] == prev->path[prefix_len])
+			prefix_len++;
+	}
+
+	memset(&rec, 0, sizeof(struct cache_record));
+	rec.st_size = c->st_size;
+	rec.mtim_sec = c->st_mtim.tv_sec;
+	rec.mtim_nsec = c->st_mtim.tv_nsec;
+	rec.ctim_sec = c->st_ctim.tv_sec;
+	rec.ctim_nsec = c->st_ctim.tv_nsec;
+	rec.st_mode = c->st_mode;
+	rec.num_chunks = c->num_chunks;
+	rec.prefix_len = prefix_len;
+	rec.suffix_len = c->path_len - prefix_len;
+
+	ret = write_cache_data(w, &rec, sizeof(struct cache_record));
+	if (!ret)
+		ret = write_cache_data(w, c->sha1, hash_len);
+	if (!ret)
+		ret = write_cache_data(w, c->path + prefix_len, rec.suffix_len);
+
+	for (int i=0;i<c->num_chunks && !ret;i++) {
+		ret = write_cache_data(w, &fp[i].size, sizeof(uint32_t));
+		if (!ret)
+			ret = write_cache_data(w, fp[i].fp, hash_len);
+		if (!ret)
+			ret = write_cache_data(w, fp[i].sha1, hash_len);
+	}
+
+	return ret;
+}
+
+static int write_cache_data(struct cache_writer *w, const void *data, size_t len)
+{
+	int ret = 0;
+
+	if (w->len + len > CACHE_WRITE_BUFF_SIZE) {
+		ret = flush_cache_writer(w);
+		if (ret)
+			return ret;
+	}
+
+	memcpy(w->buff + w->len, data, len);
+	w->len += len;
 
 	return 0;
 }
 
-static void free_cache(struct cache *cache)
+static int flush_cache_writer(struct cache_writer *w)
+{
+	size_t written = 0;
+	ssize_t n = 0;
+
+	w->crc = crc32_z(w->crc, (unsigned char *)w->buff, w->len);
+
+	while (written < w->len) {
+		n = write(w->fd, w->buff + written, w->len - written);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		written += n;
+	}
+
+	w->size += w->len;
+	w->len = 0;
+
+	return 0;
+}
+
+void free_cache(struct cache *cache)
 {
 	if (!cache)
 		return;
 
-	if (cache->entries_len > 0)
-		for (int i=0;i<cache->entries_len;i++) {
-			free(cache->entries[i]);
-			cache->entries[i] = NULL;
-		}
+	free(cache->entries);
+	free(cache->added);
+	free(cache->index);
+
+	arena_free(&cache->arena);
 
 	free(cache);
 }
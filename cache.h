@@ -21,33 +21,111 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
-#include <openssl/sha.h>
+#include <stdint.h>
+
+#include "hash.h"
+#include "arena.h"
 
 #define CE_MODE_CHANGED 0x01
 #define CE_SIZE_CHANGED 0x02
-#define CE_TIME_CHANGED 0x04
+#define CE_TIME_CHANGED 0x04 // content modification time
+#define CE_CTIME_CHANGED 0x08
+
+#define CACHE_MAGIC "BKPC"
+#define CACHE_VERSION 3
+
+struct cache_header {
+	char magic[4];
+	uint32_t version;
+};
 
+/*
+ * Follows the cache_header. The entries are stored
+ * as cache_records sorted by path, each path sharing its first
+ * prefix_len bytes with the path of the previous entry.
+ */
+struct cache_info {
+	uint32_t num_entries;
+	uint32_t hash_len; // of the ids and chunk fingerprints
+	uint64_t size; // of the records
+	uint32_t crc; // crc32 of the records
+	uint32_t unused;
+};
+
+/*
+ * Followed by the id (hash_len bytes), the path suffix and the
+ * chunk fingerprints: size (4 bytes), fp and id (hash_len bytes)
+ */
+struct cache_record {
+	int64_t st_size;
+	int64_t mtim_sec;
+	int64_t ctim_sec;
+	uint32_t mtim_nsec;
+	uint32_t ctim_nsec;
+	uint32_t st_mode;
+	uint32_t num_chunks;
+	uint16_t prefix_len;
+	uint16_t suffix_len;
+	uint32_t unused;
+};
+
+/*
+ * Fingerprint of one chunk of a backed up file: the hash of the
+ * raw chunk data and the blob object it was stored in. When the
+ * file is modified, chunks with a known fingerprint are reused
+ * without compressing and storing them again.
+ */
+struct chunk_fp {
+	uint32_t size;
+	unsigned char fp[HASH_MAX_LEN];
+	unsigned char sha1[HASH_MAX_LEN];
+};
+
+/*
+ * The chunk fingerprints of an entry are stored right after
+ * the path (see cache_entry_chunks()), both in memory and in 
+ * the filecache
+ */
 struct cache_entry {
 	mode_t st_mode;
 	off_t st_size;
 	struct timespec st_mtim;
 	struct timespec st_ctim;
-	unsigned char sha1[SHA_DIGEST_LENGTH];
+	unsigned char sha1[HASH_MAX_LEN];
+	int num_chunks;
 	int path_len;
 	char path[0];
 };
 
+/*
+ * Entries added since the cache was loaded are kept apart and
+ * merged into the sorted entries in one go (merge_cache_entries()).
+ * All of them can be looked up through the index, a hash table
+ * of positions in entries followed by added.
+ */
 struct cache {
-	struct cache_entry **entries;
+	struct cache_entry **entries; // sorted by path
 	int entries_len;
+	int entries_size;
+	struct cache_entry **added;
+	int added_len;
+	int added_size;
+	uint32_t *index; // position + 1, 0 is a free slot
+	uint32_t index_size; // a power of 2
+	struct arena arena; // the entries
 };
 
 int update_cache(struct cache *cache);
 struct cache *load_cache();
-int find_cache_entry(struct cache *cache, char *path, int ret_insert_idx);
-int find_cache_entry_insert_idx(struct cache *cache, char *path);
+void free_cache(struct cache *cache);
+struct cache_entry *find_cache_entry(struct cache *cache, char *path);
 int cache_entry_changed(struct cache_entry *entry, struct stat *stat);
 int add_cache_entry(struct cache *cache, struct cache_entry *entry);
+int merge_cache_entries(struct cache *cache);
+int filter_cache_entries(struct cache *cache, int (*keep)(struct cache_entry *entry, void *arg), void *arg);
+int cache_entry_size(int path_len, int num_chunks);
+struct chunk_fp *cache_entry_chunks(struct cache_entry *entry);
+struct cache_entry *new_cache_entry(struct cache *cache, char *path, struct stat *stat, struct chunk_fp *chunks, int num_chunks);
 
 
 #endif
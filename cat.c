@@ -0,0 +1,176 @@
+
+/*
+ * Byte ranges of a file of a snapshot, without restoring the file.
+ * Only the trees on the path of the file are read, and the offsets
+ * of the chunks come from the sizes in its "chunkmap" object, so only
+ * the chunks overlapping the range are read and decompressed.
+ *
+ * The chunks lists written before REPO_FORMAT_V4 have no sizes: the
+ * chunks in front of the range are decompressed to find out where
+ * it starts (holes excepted, their ids have the size).
+ */
+
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cat.h"
+#include "snapshot.h"
+#include "tree.h"
+#include "file.h"
+#include "sha1-file.h"
+
+#define ZEROS_LEN (64 * 1024)
+
+static int write_all(int fd, char *buff, size_t len);
+static int write_zeros(int fd, size_t len);
+
+int cat_snapshot_file(unsigned char *snapshot_sha1, char *path, uint64_t offset, uint64_t length)
+{
+	int ret = 0;
+	struct snapshot snap;
+	struct tree_entry *entry = NULL;
+	char norm_path[PATH_MAX];
+	char sha1_hex[HASH_MAX_HEX+1];
+	int len = 0;
+
+	if (read_snapshot_file(snapshot_sha1, &snap))
+		return -1;
+
+	len = normalize_tree_path(path, norm_path);
+	if (len < 0)
+		return -1;
+
+	if (len > 0 && find_tree_path(snap.tree_sha1, norm_path, &entry))
+		return -1;
+
+	if (len == 0 || (entry && S_ISDIR(entry->st_mode))) {
+		fprintf(stderr, "%s is a directory!\n", len ? norm_path : "/");
+		ret = -1;
+		goto end;
+	}
+
+	if (!entry) {
+		sha1_to_hex(snapshot_sha1, sha1_hex);
+		fprintf(stderr, "Path not found in snapshot %s: %s\n", sha1_hex, norm_path);
+		ret = -1;
+		goto end;
+	}
+
+	ret = read_file_range(entry->sha1, offset, length, STDOUT_FILENO);
+
+end:
+	free(entry);
+	return ret;
+}
+
+/*
+ * Writes the range of the file with the chunks list sha1 to fd
+ */
+int read_file_range(unsigned char *sha1, uint64_t offset, uint64_t length, int fd)
+{
+	int ret = 0;
+	struct chunk_map map;
+	unsigned char chunk_sha1[HASH_MAX_LEN];
+	char sha1_hex[HASH_MAX_HEX+1];
+	uint64_t end = length > UINT64_MAX - offset ? UINT64_MAX : offset + length;
+	uint64_t pos = 0; // of chunk i in the file
+	uint64_t from = 0, to = 0; // of the range in chunk i
+	char *buff = NULL;
+	int size = 0;
+	int len = 0;
+	int hole = 0;
+	int i = 0;
+
+	if (read_chunk_map(sha1, &map))
+		return -1;
+
+	if (map.offsets) {
+		i = find_chunk(&map, offset);
+		pos = map.offsets[i];
+	}
+
+	for (;i<map.num_chunks && pos < end;i++) {
+		get_chunk_sha1(map.chunks, i, chunk_sha1);
+		hole = is_hole_id(chunk_sha1, &size);
+
+		if (map.offsets)
+			size = map.offsets[i + 1] - map.offsets[i];
+
+		// without the sizes the chunks in front of the range are read too
+		if (!hole) {
+			ret = read_blob(chunk_sha1, &buff, &len);
+			if (ret)
+				break;
+
+			if (map.offsets && len != size) {
+				sha1_to_hex(chunk_sha1, sha1_hex);
+				fprintf(stderr, "Chunk %s has %d bytes instead of %d!\n", sha1_hex, len, size);
+				ret = -1;
+				break;
+			}
+
+			size = len;
+		}
+
+		if (pos + size > offset) {
+			from = offset > pos ? offset - pos : 0;
+			to = end - pos < (uint64_t)size ? end - pos : (uint64_t)size;
+
+			ret = hole ? write_zeros(fd, to - from) : write_all(fd, buff + from, to - from);
+			if (ret) {
+				fprintf(stderr, "Error writing file content: %s\n", strerror(errno));
+				break;
+			}
+		}
+
+		free(buff);
+		buff = NULL;
+
+		pos += size;
+	}
+
+	free(buff);
+	free_chunk_map(&map);
+	return ret;
+}
+
+static int write_all(int fd, char *buff, size_t len)
+{
+	ssize_t bytes = 0;
+
+	while (len > 0) {
+		bytes = write(fd, buff, len);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		buff += bytes;
+		len -= bytes;
+	}
+
+	return 0;
+}
+
+static int write_zeros(int fd, size_t len)
+{
+	static char zeros[ZEROS_LEN];
+	size_t n = 0;
+
+	while (len > 0) {
+		n = len < ZEROS_LEN ? len : ZEROS_LEN;
+		if (write_all(fd, zeros, n))
+			return -1;
+
+		len -= n;
+	}
+
+	return 0;
+}
@@ -0,0 +1,16 @@
+
+#ifndef CAT_H
+#define CAT_H
+
+#include <stdint.h>
+
+#define CAT_TO_END UINT64_MAX // length of a range up to the end of the file
+
+/*
+ * Writes length bytes of the file at path in the snapshot, starting
+ * at offset, to stdout. Ranges past the end of the file are cut.
+ */
+int cat_snapshot_file(unsigned char *snapshot_sha1, char *path, uint64_t offset, uint64_t length);
+int read_file_range(unsigned char *sha1, uint64_t offset, uint64_t length, int fd);
+
+#endif
@@ -0,0 +1,428 @@
+
+/*
+ * Repository verification. Every object referenced by the trees and
+ * chunks lists of the snapshots has to be in the object index (this
+ * is the mark phase of the garbage collector, see mark_objects()),
+ * then the objects selected by the mode are read, decompressed and
+ * hashed again by a pool of threads, which take the entries of the
+ * object index in batches.
+ */
+
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "check.h"
+#include "gc.h"
+#include "snapshot.h"
+#include "object-index.h"
+#include "sha1-file.h"
+#include "bkp.h"
+
+#define CHECK_BATCH 1024 // index entries taken by a thread at once
+
+enum {
+	CHECK_INCREMENTAL = 0,
+	CHECK_FULL,
+	CHECK_SAMPLE
+};
+
+static struct object_index idx;
+static int mode = CHECK_INCREMENTAL;
+static struct check_state state;
+static char (*verified_packs)[PACK_NAME_LEN] = NULL; // of state, sorted
+static char *new_packs = NULL; // of the pack ids of idx
+static uint32_t slice_start = 0, slice_end = 0; // entries of the slice of old objects
+static uint32_t sample_seed = 0;
+
+static uint32_t next_entry = 0;
+static uint64_t num_verified = 0;
+static uint64_t bytes_verified = 0;
+static uint32_t num_corrupted = 0;
+static uint32_t num_unreadable = 0;
+
+static int check_references(unsigned char *last_sha1);
+static int select_objects();
+static int is_selected(uint32_t pos);
+static void *verify_thread(void *arg);
+static int verify_objects();
+static int read_check_state();
+static int write_check_state(time_t start);
+static int is_verified_pack(char *name);
+static int compare_pack_names(const void *a, const void *b);
+
+int check_repo()
+{
+	int ret = 0;
+	int broken = 0;
+	unsigned char last_sha1[HASH_MAX_LEN];
+	int has_snapshots = 0;
+	time_t start = time(NULL);
+
+	mode = bkp_opts.check_full ? CHECK_FULL : (bkp_opts.check_sample > 0 ? CHECK_SAMPLE : CHECK_INCREMENTAL);
+
+	// objects added after this are not referenced by what is checked
+	has_snapshots = read_last_sha1(last_sha1) == 0;
+
+	printf("Updating the object index... ");
+	fflush(stdout);
+
+	ret = update_object_index();
+	if (ret)
+		return ret;
+
+	printf("done\n");
+
+	if (load_object_index(&idx) || idx.hdr->num_entries == 0) {
+		printf("No objects to check\n");
+		free_object_index(&idx);
+		return has_snapshots ? -1 : 0;
+	}
+
+	if (has_snapshots) {
+		broken = check_references(last_sha1);
+		if (broken < 0) {
+			ret = broken;
+			goto end;
+		}
+	}
+
+	ret = select_objects();
+	if (ret)
+		goto end;
+
+	ret = verify_objects();
+	if (ret)
+		goto end;
+
+	printf("Verified %llu of %u objects (%llu bytes): %u corrupted, %u unreadable\n",
+			(unsigned long long)num_verified, idx.hdr->num_entries, (unsigned long long)bytes_verified,
+			num_corrupted, num_unreadable);
+
+	if (broken > 0 || num_corrupted > 0 || num_unreadable > 0) {
+		fprintf(stderr, "The repository is damaged!\n");
+		ret = -1;
+		goto end;
+	}
+
+	// only what was verified successfully is skipped next time
+	if (mode != CHECK_SAMPLE)
+		ret = write_check_state(start);
+
+end:
+	free(new_packs);
+	new_packs = NULL;
+	free(verified_packs);
+	verified_packs = NULL;
+	free_object_index(&idx);
+
+	return ret;
+}
+
+/*
+ * Returns the number of references to missing or unreadable objects
+ */
+static int check_references(unsigned char *last_sha1)
+{
+	int ret = 0;
+	uint32_t num_entries = idx.hdr->num_entries;
+	uint64_t *live = NULL;
+	struct mark_stats stats;
+
+	live = calloc((num_entries + 63) / 64, sizeof(uint64_t));
+	if (!live) {
+		fprintf(stderr, "Error allocating memory for the referenced objects!\n");
+		return -ENOMEM;
+	}
+
+	printf("Checking references... ");
+	fflush(stdout);
+
+	ret = mark_objects(&idx, last_sha1, live, MARK_KEEP_GOING, &stats);
+	if (ret == 0) {
+		printf("done (%u objects referenced, %u broken references)\n", stats.live, stats.broken);
+
+		if (stats.live < num_entries)
+			printf("%u objects are not used by any snapshot, --gc removes them\n", num_entries - stats.live);
+
+		ret = stats.broken;
+	}
+
+	free(live);
+	return ret;
+}
+
+/*
+ * Incremental checks verify the objects of the packs not verified
+ * by the last check (and the loose objects modified since), plus
+ * the next slice of the others
+ */
+static int select_objects()
+{
+	uint32_t num_packs = idx.hdr->num_packs;
+	uint32_t first = 0, last = 0;
+
+	next_entry = 0;
+	num_verified = 0;
+	bytes_verified = 0;
+	num_corrupted = 0;
+	num_unreadable = 0;
+
+	if (mode == CHECK_FULL) {
+		printf("Verifying every object... ");
+		fflush(stdout);
+		return read_check_state();
+	}
+
+	if (mode == CHECK_SAMPLE) {
+		sample_seed = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+		printf("Verifying about %d%% of the objects... ", bkp_opts.check_sample);
+		fflush(stdout);
+		return 0;
+	}
+
+	if (read_check_state())
+		return -1;
+
+	new_packs = calloc(num_packs + 1, 1);
+	if (!new_packs) {
+		fprintf(stderr, "Error allocating memory for the packs to check!\n");
+		return -ENOMEM;
+	}
+
+	for (uint32_t i=0;i<num_packs;i++)
+		new_packs[i] = !is_verified_pack(idx.pack_names[i]);
+
+	// ids starting with a byte of [first, last]
+	first = state.slice * 256 / CHECK_SLICES;
+	last = (state.slice + 1) * 256 / CHECK_SLICES - 1;
+
+	slice_start = first > 0 ? idx.fanout[first - 1] : 0;
+	slice_end = idx.fanout[last];
+
+	if (state.time == 0)
+		printf("Verifying every object (first check)... ");
+	else
+		printf("Verifying the new objects and slice %u of %u of the old ones... ", state.slice + 1, CHECK_SLICES);
+
+	fflush(stdout);
+	return 0;
+}
+
+static int is_selected(uint32_t pos)
+{
+	struct object_index_entry *entry = &idx.entries[pos];
+	char path[PATH_MAX];
+	char sha1_hex[HASH_MAX_HEX+1];
+	struct stat sb;
+	uint32_t r = 0;
+
+	if (mode == CHECK_FULL)
+		return 1;
+
+	if (mode == CHECK_SAMPLE) {
+		// the ids are as good as random numbers already
+		memcpy(&r, entry->sha1 + 4, sizeof(r));
+		return (r ^ sample_seed) % 100 < (uint32_t)bkp_opts.check_sample;
+	}
+
+	if (pos >= slice_start && pos < slice_end)
+		return 1;
+
+	if (entry->pack != OBJECT_INDEX_LOOSE)
+		return new_packs[entry->pack];
+
+	sha1_to_hex(entry->sha1, sha1_hex);
+	snprintf(path, PATH_MAX, ".bkp-data/%s", sha1_hex);
+
+	return stat(path, &sb) != 0 || sb.st_mtime >= state.time;
+}
+
+static void *verify_thread(void *arg)
+{
+	uint32_t num_entries = idx.hdr->num_entries;
+	uint32_t pos = 0, end = 0;
+	int len = 0;
+	int ret = 0;
+
+	(void)arg;
+
+	for (;;) {
+		pos = __atomic_fetch_add(&next_entry, CHECK_BATCH, __ATOMIC_RELAXED);
+		if (pos >= num_entries)
+			break;
+
+		end = pos + CHECK_BATCH < num_entries ? pos + CHECK_BATCH : num_entries;
+
+		for (;pos<end;pos++) {
+			if (!is_selected(pos))
+				continue;
+
+			ret = verify_sha1_file(idx.entries[pos].sha1, &len);
+
+			if (ret == -EIO)
+				__atomic_fetch_add(&num_corrupted, 1, __ATOMIC_RELAXED);
+			else if (ret)
+				__atomic_fetch_add(&num_unreadable, 1, __ATOMIC_RELAXED);
+
+			__atomic_fetch_add(&num_verified, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&bytes_verified, len, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+static int verify_objects()
+{
+	pthread_t *threads = NULL;
+	int num_threads = 0;
+
+	threads = calloc(bkp_opts.threads, sizeof(pthread_t));
+	if (!threads) {
+		fprintf(stderr, "Error allocating memory for check threads!\n");
+		return -ENOMEM;
+	}
+
+	for (int i=0;i<bkp_opts.threads;i++) {
+		if (pthread_create(&threads[i], NULL, verify_thread, NULL)) {
+			fprintf(stderr, "Error starting check thread!\n");
+			break;
+		}
+		num_threads++;
+	}
+
+	// the threads started can do all the work, or this one alone
+	if (num_threads == 0)
+		verify_thread(NULL);
+
+	for (int i=0;i<num_threads;i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	printf("done\n");
+	return 0;
+}
+
+/*
+ * Without a (valid) state every object is new
+ */
+static int read_check_state()
+{
+	int fd = open(CHECK_STATE_FILE, O_RDONLY);
+	size_t len = 0;
+
+	memset(&state, 0, sizeof(state));
+	free(verified_packs);
+	verified_packs = NULL;
+
+	if (fd < 0)
+		return 0;
+
+	if (read(fd, &state, sizeof(state)) != sizeof(state) ||
+		memcmp(state.magic, CHECK_STATE_MAGIC, 4) != 0 ||
+		state.version != CHECK_STATE_VERSION ||
+		state.slice >= CHECK_SLICES)
+		goto invalid;
+
+	len = (size_t)state.num_packs * PACK_NAME_LEN;
+	verified_packs = malloc(len > 0 ? len : 1);
+	if (!verified_packs) {
+		close(fd);
+		fprintf(stderr, "Error allocating memory for the verified packs!\n");
+		return -ENOMEM;
+	}
+
+	if (read(fd, verified_packs, len) != (ssize_t)len)
+		goto invalid;
+
+	for (uint32_t i=0;i<state.num_packs;i++) {
+		if (memchr(verified_packs[i], '\0', PACK_NAME_LEN) == NULL)
+			goto invalid;
+	}
+
+	close(fd);
+	return 0;
+
+invalid:
+	memset(&state, 0, sizeof(state));
+	free(verified_packs);
+	verified_packs = NULL;
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Every pack of the index was verified, by this check or an earlier
+ * one. Packs finished after the index was loaded are not in it, the
+ * next check verifies them.
+ */
+static int write_check_state(time_t start)
+{
+	int fd = -1;
+	int ret = 0;
+	size_t len = (size_t)idx.hdr->num_packs * PACK_NAME_LEN;
+	char (*packs)[PACK_NAME_LEN] = NULL;
+
+	packs = malloc(len > 0 ? len : 1);
+	if (!packs) {
+		fprintf(stderr, "Error allocating memory for the verified packs!\n");
+		return -ENOMEM;
+	}
+
+	memcpy(packs, idx.pack_names, len);
+	qsort(packs, idx.hdr->num_packs, PACK_NAME_LEN, compare_pack_names);
+
+	memcpy(state.magic, CHECK_STATE_MAGIC, 4);
+	state.version = CHECK_STATE_VERSION;
+
+	// a first check verified every slice already
+	if (mode == CHECK_INCREMENTAL && state.time > 0)
+		state.slice = (state.slice + 1) % CHECK_SLICES;
+
+	state.time = start;
+	state.num_packs = idx.hdr->num_packs;
+
+	fd = open(CHECK_STATE_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 || write(fd, &state, sizeof(state)) != sizeof(state) ||
+		write(fd, packs, len) != (ssize_t)len) {
+		fprintf(stderr, "Error writing %s.tmp (errno: %d)!\n", CHECK_STATE_FILE, errno);
+		ret = -1;
+	}
+
+	if (fd >= 0 && close(fd))
+		ret = -1;
+
+	if (!ret && rename(CHECK_STATE_FILE ".tmp", CHECK_STATE_FILE)) {
+		fprintf(stderr, "Error renaming %s.tmp (errno: %d)!\n", CHECK_STATE_FILE, errno);
+		ret = -1;
+	}
+
+	if (ret)
+		unlink(CHECK_STATE_FILE ".tmp");
+
+	free(packs);
+	return ret;
+}
+
+static int is_verified_pack(char *name)
+{
+	if (!verified_packs || state.num_packs == 0)
+		return 0;
+
+	return bsearch(name, verified_packs, state.num_packs, PACK_NAME_LEN, compare_pack_names) != NULL;
+}
+
+static int compare_pack_names(const void *a, const void *b)
+{
+	return strncmp((const char *)a, (const char *)b, PACK_NAME_LEN);
+}
@@ -0,0 +1,37 @@
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdint.h>
+
+#include "pack.h"
+
+#define CHECK_STATE_FILE ".bkp-data/check-state"
+#define CHECK_STATE_MAGIC "BKPK"
+#define CHECK_STATE_VERSION 2
+
+/*
+ * Besides the objects added since the previous check, every check
+ * verifies one of CHECK_SLICES slices of the older objects (by the
+ * first byte of their ids), so every object is verified again once
+ * in CHECK_SLICES checks
+ */
+#define CHECK_SLICES 32
+
+/*
+ * Where the last successful check left off: the header is followed
+ * by the names of the packs verified so far (num_packs of them,
+ * sorted, PACK_NAME_LEN bytes each). Packs not in the list were added
+ * since, whatever their names.
+ */
+struct check_state {
+	char magic[4];
+	uint32_t version;
+	int64_t time; // loose objects modified since then are new
+	uint32_t slice; // of the old objects, verified by the next check
+	uint32_t num_packs;
+};
+
+int check_repo();
+
+#endif
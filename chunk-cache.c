@@ -0,0 +1,229 @@
+
+/*
+ * Cache of decompressed chunks for restores. In repositories with a
+ * lot of duplicated files (vendored libraries, container layers...)
+ * the same blob is restored many times, with the cache it is read
+ * and decompressed only once while it stays hot.
+ *
+ * Chunks bigger than 1/CHUNK_CACHE_MAX_SHARE of the cache are not
+ * cached: a large unique file would otherwise flush everything else.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "chunk-cache.h"
+
+#define CHUNK_CACHE_MAX_SHARE 16
+#define CHUNK_CACHE_AVG_CHUNK (64 * 1024) // sizes the table
+
+static struct cached_chunk **bucket(struct chunk_cache *cache, unsigned char *sha1);
+static void unlink_chunk(struct chunk_cache *cache, struct cached_chunk *chunk);
+static void free_chunk(struct cached_chunk *chunk);
+
+int chunk_cache_init(struct chunk_cache *cache, size_t max_size)
+{
+	memset(cache, 0, sizeof(struct chunk_cache));
+	pthread_mutex_init(&cache->lock, NULL);
+
+	cache->max_size = max_size;
+	if (max_size == 0)
+		return 0;
+
+	cache->table_size = 1024;
+	while (cache->table_size < max_size / CHUNK_CACHE_AVG_CHUNK && cache->table_size < (1U << 24))
+		cache->table_size *= 2;
+
+	cache->table = calloc(cache->table_size, sizeof(struct cached_chunk *));
+	if (!cache->table) {
+		fprintf(stderr, "Error allocating memory for chunk cache!\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Every chunk must have been put back by now
+ */
+void chunk_cache_destroy(struct chunk_cache *cache)
+{
+	struct cached_chunk *chunk = cache->head;
+	struct cached_chunk *next = NULL;
+
+	while (chunk) {
+		next = chunk->next;
+		free_chunk(chunk);
+		chunk = next;
+	}
+
+	free(cache->table);
+	pthread_mutex_destroy(&cache->lock);
+
+	cache->table = NULL;
+	cache->head = NULL;
+	cache->tail = NULL;
+	cache->size = 0;
+}
+
+/*
+ * Returns the chunk (referenced) or NULL on a miss
+ */
+struct cached_chunk *chunk_cache_get(struct chunk_cache *cache, unsigned char *sha1)
+{
+	struct cached_chunk **slot = NULL;
+	struct cached_chunk *chunk = NULL;
+
+	if (!cache->table)
+		return NULL;
+
+	pthread_mutex_lock(&cache->lock);
+
+	slot = bucket(cache, sha1);
+
+	for (chunk=*slot;chunk;chunk=chunk->hash_next) {
+		if (memcmp(chunk->sha1, sha1, HASH_MAX_LEN) == 0)
+			break;
+	}
+
+	if (chunk) {
+		cache->hits++;
+		chunk->refs++;
+
+		// most recently used
+		if (chunk != cache->head) {
+			unlink_chunk(cache, chunk);
+
+			chunk->next = cache->head;
+			cache->head->prev = chunk;
+			cache->head = chunk;
+		}
+	}
+	else
+		cache->misses++;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return chunk;
+}
+
+/*
+ * Hands buff over to the cache and returns the (referenced) chunk
+ * holding it. Returns NULL if it isn`t cached, buff then stays
+ * with the caller. If another thread added the same chunk in the
+ * meantime, buff is freed and that one is returned.
+ */
+struct cached_chunk *chunk_cache_add(struct chunk_cache *cache, unsigned char *sha1, char *buff, int len)
+{
+	struct cached_chunk **slot = NULL;
+	struct cached_chunk *chunk = NULL;
+
+	if (!cache->table || (size_t)len > cache->max_size / CHUNK_CACHE_MAX_SHARE)
+		return NULL;
+
+	pthread_mutex_lock(&cache->lock);
+
+	slot = bucket(cache, sha1);
+
+	for (chunk=*slot;chunk;chunk=chunk->hash_next) {
+		if (memcmp(chunk->sha1, sha1, HASH_MAX_LEN) == 0) {
+			chunk->refs++;
+			pthread_mutex_unlock(&cache->lock);
+
+			free(buff);
+			return chunk;
+		}
+	}
+
+	chunk = malloc(sizeof(struct cached_chunk));
+	if (!chunk) {
+		pthread_mutex_unlock(&cache->lock);
+		return NULL;
+	}
+
+	memcpy(chunk->sha1, sha1, HASH_MAX_LEN);
+	chunk->buff = buff;
+	chunk->len = len;
+	chunk->refs = 1;
+	chunk->cached = 1;
+
+	chunk->hash_next = *slot;
+	*slot = chunk;
+
+	chunk->prev = NULL;
+	chunk->next = cache->head;
+	if (cache->head)
+		cache->head->prev = chunk;
+	else
+		cache->tail = chunk;
+	cache->head = chunk;
+
+	cache->size += len;
+
+	// the least recently used ones go, whether still referenced or not
+	while (cache->size > cache->max_size && cache->tail != chunk) {
+		struct cached_chunk *victim = cache->tail;
+		struct cached_chunk **victim_slot = bucket(cache, victim->sha1);
+
+		while (*victim_slot != victim)
+			victim_slot = &(*victim_slot)->hash_next;
+		*victim_slot = victim->hash_next;
+
+		unlink_chunk(cache, victim);
+		cache->size -= victim->len;
+		victim->cached = 0;
+
+		if (victim->refs == 0)
+			free_chunk(victim);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return chunk;
+}
+
+void chunk_cache_put(struct chunk_cache *cache, struct cached_chunk *chunk)
+{
+	int unused = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	unused = --chunk->refs == 0 && !chunk->cached;
+	pthread_mutex_unlock(&cache->lock);
+
+	if (unused)
+		free_chunk(chunk);
+}
+
+/*
+ * Ids are hashes already, their first bytes are as good as any hash
+ */
+static struct cached_chunk **bucket(struct chunk_cache *cache, unsigned char *sha1)
+{
+	uint32_t h = ((uint32_t)sha1[0] << 24) | (sha1[1] << 16) | (sha1[2] << 8) | sha1[3];
+
+	return &cache->table[h & (cache->table_size - 1)];
+}
+
+static void unlink_chunk(struct chunk_cache *cache, struct cached_chunk *chunk)
+{
+	if (chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		cache->head = chunk->next;
+
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+	else
+		cache->tail = chunk->prev;
+
+	chunk->prev = NULL;
+	chunk->next = NULL;
+}
+
+static void free_chunk(struct cached_chunk *chunk)
+{
+	free(chunk->buff);
+	free(chunk);
+}
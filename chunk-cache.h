@@ -0,0 +1,46 @@
+
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "hash.h"
+
+/*
+ * LRU cache of decompressed chunks, shared by the restore workers.
+ * A chunk found in (or added to) the cache is referenced until
+ * chunk_cache_put(): an evicted chunk is only freed once nobody
+ * uses its buffer anymore.
+ */
+struct cached_chunk {
+	unsigned char sha1[HASH_MAX_LEN];
+	char *buff;
+	int len;
+	int refs;
+	int cached; // still in the table and the LRU list
+	struct cached_chunk *prev; // more recently used
+	struct cached_chunk *next; // less recently used
+	struct cached_chunk *hash_next;
+};
+
+struct chunk_cache {
+	struct cached_chunk **table;
+	uint32_t table_size;
+	struct cached_chunk *head; // most recently used
+	struct cached_chunk *tail;
+	size_t size; // of the cached buffers
+	size_t max_size; // 0: nothing is cached
+	uint64_t hits;
+	uint64_t misses;
+	pthread_mutex_t lock;
+};
+
+int chunk_cache_init(struct chunk_cache *cache, size_t max_size);
+void chunk_cache_destroy(struct chunk_cache *cache);
+struct cached_chunk *chunk_cache_get(struct chunk_cache *cache, unsigned char *sha1);
+struct cached_chunk *chunk_cache_add(struct chunk_cache *cache, unsigned char *sha1, char *buff, int len);
+void chunk_cache_put(struct chunk_cache *cache, struct cached_chunk *chunk);
+
+#endif
@@ -0,0 +1,216 @@
+
+/*
+ * Splitting of file contents into chunks.
+ *
+ * CHUNKER_FIXED cuts the files at fixed offsets (the way bkp always
+ * did), CHUNKER_CDC is a gear based content-defined chunker in the
+ * style of FastCDC: a rolling hash is computed over the bytes and a
+ * chunk ends wherever the hash matches a mask. Because the cut points
+ * only depend on the nearby content, inserting or deleting bytes only
+ * changes the chunks around the modification.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "chunker.h"
+#include "file.h"
+
+#define CHUNKER_SIZE_LIMIT (64 * (1024 * 1024))
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void init_gear();
+static int parse_size(char *str, int *size);
+static int log2_int(int val);
+
+void chunker_init(struct chunker_params *params, int type)
+{
+	params->type = type;
+
+	if (type == CHUNKER_CDC) {
+		params->min_size = CDC_MIN_SIZE;
+		params->avg_size = CDC_AVG_SIZE;
+		params->max_size = CDC_MAX_SIZE;
+	}
+	else {
+		params->min_size = FILE_CHUNK_SIZE;
+		params->avg_size = FILE_CHUNK_SIZE;
+		params->max_size = FILE_CHUNK_SIZE;
+	}
+}
+
+/*
+ * Parses chunker specifications like:
+ *	fixed
+ *	fixed:4M
+ *	cdc
+ *	cdc:256K:1M:4M
+ */
+int chunker_parse(char *spec, struct chunker_params *params)
+{
+	char buff[128];
+	char *type = NULL;
+	char *sizes[3] = {NULL, NULL, NULL};
+	int num_sizes = 0;
+	char *saveptr = NULL;
+
+	snprintf(buff, sizeof(buff), "%s", spec);
+
+	type = strtok_r(buff, ":", &saveptr);
+	if (!type)
+		return -1;
+
+	while (num_sizes < 3 && (sizes[num_sizes] = strtok_r(NULL, ":", &saveptr)) != NULL)
+		num_sizes++;
+
+	if (strtok_r(NULL, ":", &saveptr) != NULL)
+		return -1;
+
+	if (strcmp(type, "fixed") == 0) {
+		chunker_init(params, CHUNKER_FIXED);
+
+		if (num_sizes == 0)
+			return 0;
+
+		if (num_sizes != 1 || parse_size(sizes[0], &params->max_size))
+			return -1;
+
+		params->min_size = params->avg_size = params->max_size;
+		return 0;
+	}
+
+	if (strcmp(type, "cdc") == 0) {
+		chunker_init(params, CHUNKER_CDC);
+
+		if (num_sizes == 0)
+			return 0;
+
+		if (num_sizes != 3 ||
+			parse_size(sizes[0], &params->min_size) ||
+			parse_size(sizes[1], &params->avg_size) ||
+			parse_size(sizes[2], &params->max_size))
+			return -1;
+
+		if (params->min_size < 64 ||
+			params->min_size >= params->avg_size ||
+			params->avg_size >= params->max_size)
+			return -1;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+int chunker_format(struct chunker_params *params, char *out, int out_len)
+{
+	if (params->type == CHUNKER_CDC)
+		return snprintf(out, out_len, "cdc %d %d %d", params->min_size, params->avg_size, params->max_size);
+
+	return snprintf(out, out_len, "fixed %d", params->max_size);
+}
+
+/*
+ * Returns the length of the next chunk starting at buff. The caller
+ * must pass at least max_size bytes unless the end of the file was
+ * reached, otherwise the cut point would depend on the read sizes.
+ */
+int chunker_next_cut(struct chunker_params *params, const unsigned char *buff, int len)
+{
+	uint64_t fp = 0;
+	uint64_t mask_s = 0;
+	uint64_t mask_l = 0;
+	int bits = 0;
+	int normal = 0;
+	int i = 0;
+
+	if (len > params->max_size)
+		len = params->max_size;
+
+	if (params->type != CHUNKER_CDC || len <= params->min_size)
+		return len;
+
+	pthread_once(&gear_once, init_gear);
+
+	/*
+	 * Normalized chunking: below the average size a stricter mask
+	 * (more bits) is used, above it a looser one, which pulls the
+	 * chunk sizes towards avg_size
+	 */
+	bits = log2_int(params->avg_size);
+	mask_s = ~0ULL << (64 - (bits + 2));
+	mask_l = ~0ULL << (64 - (bits - 2));
+	normal = params->avg_size < len ? params->avg_size : len;
+
+	for (i = params->min_size; i < normal; i++) {
+		fp = (fp << 1) + gear[buff[i]];
+		if (!(fp & mask_s))
+			return i + 1;
+	}
+
+	for (; i < len; i++) {
+		fp = (fp << 1) + gear[buff[i]];
+		if (!(fp & mask_l))
+			return i + 1;
+	}
+
+	return len;
+}
+
+/*
+ * The gear table is generated with splitmix64 from a fixed seed.
+ * It must never change, otherwise the chunk boundaries (and so the
+ * deduplication) of existing repositories would change too.
+ */
+static void init_gear()
+{
+	uint64_t seed = 0x626b702d63646321ULL; // "bkp-cdc!"
+
+	for (int i=0;i<256;i++) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+static int parse_size(char *str, int *size)
+{
+	char *end = NULL;
+	long long val = strtoll(str, &end, 10);
+
+	if (end == str || val <= 0)
+		return -1;
+
+	if (*end == 'k' || *end == 'K') {
+		val *= 1024;
+		end++;
+	}
+	else if (*end == 'm' || *end == 'M') {
+		val *= 1024 * 1024;
+		end++;
+	}
+
+	if (*end != '\0' || val > CHUNKER_SIZE_LIMIT)
+		return -1;
+
+	*size = val;
+	return 0;
+}
+
+static int log2_int(int val)
+{
+	int bits = 0;
+
+	while (val > 1) {
+		val >>= 1;
+		bits++;
+	}
+
+	return bits;
+}
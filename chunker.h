@@ -0,0 +1,26 @@
+
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+enum chunker_type {
+	CHUNKER_FIXED=1,
+	CHUNKER_CDC
+};
+
+#define CDC_MIN_SIZE (512 * 1024)
+#define CDC_AVG_SIZE (2 * (1024 * 1024))
+#define CDC_MAX_SIZE (8 * (1024 * 1024))
+
+struct chunker_params {
+	int type;
+	int min_size;
+	int avg_size;
+	int max_size;
+};
+
+void chunker_init(struct chunker_params *params, int type);
+int chunker_parse(char *spec, struct chunker_params *params);
+int chunker_format(struct chunker_params *params, char *out, int out_len);
+int chunker_next_cut(struct chunker_params *params, const unsigned char *buff, int len);
+
+#endif
@@ -0,0 +1,575 @@
+
+/*
+ * Compression codecs of stored objects.
+ *
+ * zlib is always available. zstd and lz4 are built in when bkp is
+ * compiled with HAVE_ZSTD / HAVE_LZ4, which the Makefile sets when
+ * pkg-config finds libzstd / liblz4; objects written with them can
+ * only be read by such builds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#define LZ4_FEED_SIZE (32 * 1024) // keeps LZ4F_compressBound() below the output buffer
+#endif
+
+#include "codec.h"
+
+static const char *codec_names[] = {
+	[CODEC_ZLIB] = "zlib",
+	[CODEC_NONE] = "none",
+	[CODEC_ZSTD] = "zstd",
+	[CODEC_LZ4] = "lz4"
+};
+
+static int codec_supported(int type);
+static int emit_header(struct codec_stream *cs, size_t size);
+static int zlib_update(struct codec_stream *cs, char *buff, size_t len, int flush);
+static int inflate_zlib(char *in_buff, size_t in_size, char **out_buff, int *out_size);
+#ifdef HAVE_ZSTD
+static int zstd_update(struct codec_stream *cs, char *buff, size_t len, ZSTD_EndDirective end);
+#endif
+#ifdef HAVE_LZ4
+static int lz4_decode(char *in_buff, size_t in_size, char *out_buff, size_t out_size);
+#endif
+
+void codec_init(struct codec_params *params, int type)
+{
+	params->type = type;
+	params->level = CODEC_LEVEL_DEFAULT;
+}
+
+/*
+ * Parses "NAME[:LEVEL]", like "zlib:9" or "none". Returns -ENOTSUP
+ * for codecs this build has no support for.
+ */
+int codec_parse(char *spec, struct codec_params *params)
+{
+	char buff[64];
+	char *level = NULL;
+	char *end = NULL;
+	int type = 0;
+
+	snprintf(buff, sizeof(buff), "%s", spec);
+
+	level = strchr(buff, ':');
+	if (level)
+		*level++ = '\0';
+
+	for (type=CODEC_LZ4;type>=CODEC_ZLIB;type--)
+		if (strcmp(buff, codec_names[type]) == 0)
+			break;
+
+	if (type < CODEC_ZLIB)
+		return -1;
+
+	if (!codec_supported(type)) {
+		fprintf(stderr, "This build of bkp has no %s support, it needs lib%s when it is built!\n",
+				codec_names[type], codec_names[type]);
+		return -ENOTSUP;
+	}
+
+	codec_init(params, type);
+
+	if (!level)
+		return 0;
+
+	params->level = strtol(level, &end, 10);
+	if (*level == '\0' || *end != '\0' || type == CODEC_NONE)
+		return -1;
+
+	if (type == CODEC_ZLIB && (params->level < 0 || params->level > 9))
+		return -1;
+
+	return 0;
+}
+
+int codec_format(struct codec_params *params, char *out, int out_len)
+{
+	if (params->level == CODEC_LEVEL_DEFAULT)
+		return snprintf(out, out_len, "%s", codec_names[params->type]);
+
+	return snprintf(out, out_len, "%s:%d", codec_names[params->type], params->level);
+}
+
+/*
+ * Estimates the entropy of the data from a few evenly spaced
+ * samples. Compressed formats (JPEG, video, archives...) come
+ * close to 8 bits per byte, compressing them only wastes time.
+ */
+int is_incompressible(struct iovec *iov, int iovcnt)
+{
+	unsigned int counts[256];
+	size_t total = 0;
+	size_t step = 0;
+	unsigned int sampled = 0;
+	double entropy = 0;
+
+	for (int i=0;i<iovcnt;i++)
+		total += iov[i].iov_len;
+
+	// small objects (trees, headers) are cheap to compress anyway
+	if (total < CODEC_SAMPLES * CODEC_SAMPLE_SIZE * 4)
+		return 0;
+
+	memset(counts, 0, sizeof(counts));
+	step = total / CODEC_SAMPLES;
+
+	for (int s=0;s<CODEC_SAMPLES;s++) {
+		size_t pos = s * step;
+		int seg = 0;
+
+		// find the segment holding pos
+		while (seg < iovcnt && pos >= iov[seg].iov_len) {
+			pos -= iov[seg].iov_len;
+			seg++;
+		}
+
+		for (int i=0;i<CODEC_SAMPLE_SIZE && seg < iovcnt;i++) {
+			counts[((unsigned char *)iov[seg].iov_base)[pos]]++;
+			sampled++;
+
+			if (++pos == iov[seg].iov_len) {
+				pos = 0;
+				seg++;
+			}
+		}
+	}
+
+	for (int i=0;i<256;i++) {
+		if (counts[i] > 0) {
+			double p = (double)counts[i] / sampled;
+			entropy -= p * log2(p);
+		}
+	}
+
+	return entropy > CODEC_ENTROPY_LIMIT;
+}
+
+/*
+ * Starts encoding an object of size bytes. The encoded data is
+ * passed to emit() in pieces of at most out_size bytes.
+ */
+int codec_stream_init(struct codec_stream *cs, struct codec_params *params, size_t size,
+						unsigned char *out, int out_size, codec_emit_fn emit, void *emit_arg)
+{
+	int ret = 0;
+
+	memset(cs, 0, sizeof(struct codec_stream));
+	cs->params = *params;
+	cs->out = out;
+	cs->out_size = out_size;
+	cs->emit = emit;
+	cs->emit_arg = emit_arg;
+
+	switch (params->type) {
+		case CODEC_ZLIB: {
+			z_stream *strm = calloc(1, sizeof(z_stream));
+			if (!strm)
+				return -ENOMEM;
+
+			if (deflateInit(strm, params->level) != Z_OK) {
+				free(strm);
+				return -1;
+			}
+
+			cs->ctx = strm;
+			return 0;
+		}
+		case CODEC_NONE:
+			return emit_header(cs, size);
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD: {
+			ZSTD_CCtx *cctx = ZSTD_createCCtx();
+			if (!cctx)
+				return -ENOMEM;
+
+			cs->ctx = cctx;
+
+			if (params->level != CODEC_LEVEL_DEFAULT)
+				ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, params->level);
+			ZSTD_CCtx_setPledgedSrcSize(cctx, size);
+
+			ret = emit_header(cs, size);
+			break;
+		}
+#endif
+#ifdef HAVE_LZ4
+		case CODEC_LZ4: {
+			LZ4F_cctx *cctx = NULL;
+			LZ4F_preferences_t prefs;
+			size_t bytes = 0;
+
+			if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)))
+				return -ENOMEM;
+
+			cs->ctx = cctx;
+
+			memset(&prefs, 0, sizeof(prefs));
+			prefs.compressionLevel = params->level == CODEC_LEVEL_DEFAULT ? 0 : params->level;
+			prefs.frameInfo.contentSize = size;
+
+			ret = emit_header(cs, size);
+			if (ret)
+				break;
+
+			bytes = LZ4F_compressBegin(cctx, cs->out, cs->out_size, &prefs);
+			if (LZ4F_isError(bytes))
+				ret = -1;
+			else
+				ret = cs->emit(cs->emit_arg, (char *)cs->out, bytes);
+			break;
+		}
+#endif
+		default:
+			fprintf(stderr, "Unsupported codec %d!\n", params->type);
+			return -1;
+	}
+
+	return ret;
+}
+
+int codec_stream_update(struct codec_stream *cs, char *buff, size_t len)
+{
+	switch (cs->params.type) {
+		case CODEC_ZLIB:
+			return zlib_update(cs, buff, len, Z_NO_FLUSH);
+		case CODEC_NONE:
+			while (len > 0) {
+				int piece = len > (size_t)cs->out_size ? cs->out_size : (int)len;
+				int ret = cs->emit(cs->emit_arg, buff, piece);
+
+				if (ret)
+					return ret;
+
+				buff += piece;
+				len -= piece;
+			}
+			return 0;
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD:
+			return zstd_update(cs, buff, len, ZSTD_e_continue);
+#endif
+#ifdef HAVE_LZ4
+		case CODEC_LZ4:
+			while (len > 0) {
+				size_t piece = len > LZ4_FEED_SIZE ? LZ4_FEED_SIZE : len;
+				size_t bytes = LZ4F_compressUpdate(cs->ctx, cs->out, cs->out_size, buff, piece, NULL);
+				int ret = 0;
+
+				if (LZ4F_isError(bytes))
+					return -1;
+
+				if (bytes > 0 && (ret = cs->emit(cs->emit_arg, (char *)cs->out, bytes)))
+					return ret;
+
+				buff += piece;
+				len -= piece;
+			}
+			return 0;
+#endif
+	}
+
+	return -1;
+}
+
+int codec_stream_finish(struct codec_stream *cs)
+{
+	switch (cs->params.type) {
+		case CODEC_ZLIB:
+			return zlib_update(cs, NULL, 0, Z_FINISH);
+		case CODEC_NONE:
+			return 0;
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD:
+			return zstd_update(cs, NULL, 0, ZSTD_e_end);
+#endif
+#ifdef HAVE_LZ4
+		case CODEC_LZ4: {
+			size_t bytes = LZ4F_compressEnd(cs->ctx, cs->out, cs->out_size, NULL);
+
+			if (LZ4F_isError(bytes))
+				return -1;
+
+			return cs->emit(cs->emit_arg, (char *)cs->out, bytes);
+		}
+#endif
+	}
+
+	return -1;
+}
+
+void codec_stream_end(struct codec_stream *cs)
+{
+	if (!cs->ctx)
+		return;
+
+	switch (cs->params.type) {
+		case CODEC_ZLIB:
+			deflateEnd(cs->ctx);
+			free(cs->ctx);
+			break;
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD:
+			ZSTD_freeCCtx(cs->ctx);
+			break;
+#endif
+#ifdef HAVE_LZ4
+		case CODEC_LZ4:
+			LZ4F_freeCompressionContext(cs->ctx);
+			break;
+#endif
+	}
+
+	cs->ctx = NULL;
+}
+
+/*
+ * Decodes a stored object, whatever codec it was written with.
+ * The caller is responsible for freeing *out_buff.
+ */
+int codec_decode(char *in_buff, size_t in_size, char **out_buff, int *out_size)
+{
+	struct codec_header *hdr = (struct codec_header *)in_buff;
+	uint32_t size = 0;
+	char *buff = NULL;
+	int ret = 0;
+
+	if (in_size < sizeof(struct codec_header) || hdr->magic != CODEC_MAGIC)
+		return inflate_zlib(in_buff, in_size, out_buff, out_size);
+
+	size = hdr->size[0] | hdr->size[1] << 8 | hdr->size[2] << 16 | (uint32_t)hdr->size[3] << 24;
+	in_buff += sizeof(struct codec_header);
+	in_size -= sizeof(struct codec_header);
+
+	buff = malloc(size > 0 ? size : 1);
+	if (!buff)
+		return -ENOMEM;
+
+	switch (hdr->codec) {
+		case CODEC_NONE:
+			if (in_size != size)
+				ret = -1;
+			else
+				memcpy(buff, in_buff, size);
+			break;
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD: {
+			size_t bytes = ZSTD_decompress(buff, size, in_buff, in_size);
+			if (ZSTD_isError(bytes) || bytes != size)
+				ret = -1;
+			break;
+		}
+#endif
+#ifdef HAVE_LZ4
+		case CODEC_LZ4:
+			ret = lz4_decode(in_buff, in_size, buff, size);
+			break;
+#endif
+		default:
+			if (hdr->codec == CODEC_ZSTD || hdr->codec == CODEC_LZ4)
+				fprintf(stderr, "Object compressed with %s, this build of bkp has no %s support!\n",
+						codec_names[hdr->codec], codec_names[hdr->codec]);
+			else
+				fprintf(stderr, "Object compressed with unsupported codec %d!\n", hdr->codec);
+			ret = -1;
+	}
+
+	if (ret) {
+		free(buff);
+		return ret;
+	}
+
+	*out_buff = buff;
+	*out_size = size;
+
+	return 0;
+}
+
+static int codec_supported(int type)
+{
+	switch (type) {
+		case CODEC_ZLIB:
+		case CODEC_NONE:
+			return 1;
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD:
+			return 1;
+#endif
+#ifdef HAVE_LZ4
+		case CODEC_LZ4:
+			return 1;
+#endif
+	}
+
+	return 0;
+}
+
+static int emit_header(struct codec_stream *cs, size_t size)
+{
+	struct codec_header hdr;
+
+	if (size > UINT32_MAX) {
+		fprintf(stderr, "Object too large for codec %s!\n", codec_names[cs->params.type]);
+		return -1;
+	}
+
+	hdr.magic = CODEC_MAGIC;
+	hdr.codec = cs->params.type;
+	hdr.size[0] = size & 0xff;
+	hdr.size[1] = (size >> 8) & 0xff;
+	hdr.size[2] = (size >> 16) & 0xff;
+	hdr.size[3] = (size >> 24) & 0xff;
+
+	return cs->emit(cs->emit_arg, (char *)&hdr, sizeof(hdr));
+}
+
+static int zlib_update(struct codec_stream *cs, char *buff, size_t len, int flush)
+{
+	z_stream *strm = cs->ctx;
+	int zret = Z_OK;
+	int have = 0;
+	int ret = 0;
+
+	strm->next_in = (Bytef *)buff;
+	strm->avail_in = len;
+
+	do {
+		strm->next_out = cs->out;
+		strm->avail_out = cs->out_size;
+
+		zret = deflate(strm, flush);
+		if (zret == Z_STREAM_ERROR) {
+			fprintf(stderr, "Compression of SHA1 file content failed!\n");
+			return -1;
+		}
+
+		have = cs->out_size - strm->avail_out;
+		if (have > 0 && (ret = cs->emit(cs->emit_arg, (char *)cs->out, have)))
+			return ret;
+	} while (strm->avail_out == 0 || (flush == Z_FINISH && zret != Z_STREAM_END));
+
+	return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_update(struct codec_stream *cs, char *buff, size_t len, ZSTD_EndDirective end)
+{
+	ZSTD_inBuffer in = { buff, len, 0 };
+	size_t remaining = 0;
+	int ret = 0;
+
+	do {
+		ZSTD_outBuffer out = { cs->out, cs->out_size, 0 };
+
+		remaining = ZSTD_compressStream2(cs->ctx, &out, &in, end);
+		if (ZSTD_isError(remaining)) {
+			fprintf(stderr, "zstd compression failed: %s!\n", ZSTD_getErrorName(remaining));
+			return -1;
+		}
+
+		if (out.pos > 0 && (ret = cs->emit(cs->emit_arg, (char *)cs->out, out.pos)))
+			return ret;
+	} while (end == ZSTD_e_end ? remaining != 0 : in.pos < in.size);
+
+	return 0;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static int lz4_decode(char *in_buff, size_t in_size, char *out_buff, size_t out_size)
+{
+	LZ4F_dctx *dctx = NULL;
+	size_t in_pos = 0, out_pos = 0;
+	size_t hint = 1;
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+		return -ENOMEM;
+
+	while (hint != 0 && in_pos < in_size) {
+		size_t src_size = in_size - in_pos;
+		size_t dst_size = out_size - out_pos;
+
+		hint = LZ4F_decompress(dctx, out_buff + out_pos, &dst_size, in_buff + in_pos, &src_size, NULL);
+		if (LZ4F_isError(hint))
+			break;
+
+		in_pos += src_size;
+		out_pos += dst_size;
+	}
+
+	LZ4F_freeDecompressionContext(dctx);
+
+	return (hint == 0 && out_pos == out_size) ? 0 : -1;
+}
+#endif
+
+static int inflate_zlib(char *in_buff, size_t in_size, char **out_buff, int *out_size)
+{
+	int ret = 0;
+	unsigned char *buff = NULL;
+	int chunk_size = 1024 * 1024; // 1MB chunks
+	int offset = 0;
+
+	z_stream strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree  = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = in_size;
+	strm.next_in  = (Bytef *)in_buff;
+
+	ret = inflateInit(&strm);
+	if (ret != Z_OK) {
+		fprintf(stderr, "Error inflating SHA1 file!\n");
+		return -1;
+	}
+
+	buff = malloc(chunk_size);
+	if (!buff) {
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	do {
+		if (!buff)
+			buff = malloc(chunk_size);
+		else if (offset % chunk_size == 0)
+			buff = realloc(buff, offset + chunk_size);
+
+		if (!buff) {
+			ret = -ENOMEM;
+			fprintf(stderr, "Error allocating memory for zstream chunk!\n");
+			goto end;
+		}
+
+		strm.avail_out = chunk_size;
+		strm.next_out = buff + offset;
+
+		if ((ret = inflate(&strm, Z_NO_FLUSH)) < 0) {
+			fprintf(stderr, "SHA1 file inflate returned code %d!\n", ret);
+			ret = -1;
+			goto end;
+		}
+
+		offset += chunk_size - strm.avail_out;
+	} while (ret != Z_STREAM_END);
+
+	*out_buff = (char *) buff;
+	*out_size = offset;
+	ret = 0;
+
+end:
+	inflateEnd(&strm);
+	return ret;
+}
@@ -0,0 +1,68 @@
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+enum codec_type {
+	CODEC_ZLIB=1,
+	CODEC_NONE,
+	CODEC_ZSTD,
+	CODEC_LZ4
+};
+
+/*
+ * zlib objects are stored as a bare zlib stream, like they always
+ * were. Every other codec prefixes the object with a codec_header,
+ * whose first byte can`t start a zlib stream.
+ */
+#define CODEC_MAGIC 0xbf
+
+struct codec_header {
+	unsigned char magic;
+	unsigned char codec;
+	unsigned char size[4]; // uncompressed size, little endian
+};
+
+#define CODEC_LEVEL_DEFAULT -1
+
+/*
+ * Chunks whose sampled bytes have a higher entropy (in bits per
+ * byte) are considered already compressed and stored as they are
+ */
+#define CODEC_ENTROPY_LIMIT 7.5
+#define CODEC_SAMPLES 16
+#define CODEC_SAMPLE_SIZE 1024
+
+struct codec_params {
+	int type;
+	int level;
+};
+
+typedef int (*codec_emit_fn)(void *arg, char *buff, int len);
+
+struct codec_stream {
+	struct codec_params params;
+	void *ctx;
+	unsigned char *out;
+	int out_size;
+	codec_emit_fn emit;
+	void *emit_arg;
+};
+
+void codec_init(struct codec_params *params, int type);
+int codec_parse(char *spec, struct codec_params *params);
+int codec_format(struct codec_params *params, char *out, int out_len);
+int is_incompressible(struct iovec *iov, int iovcnt);
+
+int codec_stream_init(struct codec_stream *cs, struct codec_params *params, size_t size,
+						unsigned char *out, int out_size, codec_emit_fn emit, void *emit_arg);
+int codec_stream_update(struct codec_stream *cs, char *buff, size_t len);
+int codec_stream_finish(struct codec_stream *cs);
+void codec_stream_end(struct codec_stream *cs);
+
+int codec_decode(char *in_buff, size_t in_size, char **out_buff, int *out_size);
+
+#endif
@@ -0,0 +1,186 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "config.h"
+
+struct repo_config repo_cfg;
+
+static int repo_is_new = 0;
+
+static int set_config_value(char *key, char *value);
+
+/*
+ * Loads .bkp-data/config. Repositories created before the config
+ * file existed simply get the defaults (fixed size chunks) and
+ * the first format, new repositories the latest one.
+ */
+int load_config()
+{
+	FILE *fp = NULL;
+	char line[256];
+	char key[64];
+	char value[128];
+	int line_no = 0;
+
+	chunker_init(&repo_cfg.chunker, CHUNKER_FIXED);
+	repo_cfg.format = REPO_FORMAT_V1;
+	repo_cfg.hash = HASH_SHA1;
+	codec_init(&repo_cfg.codec, CODEC_ZLIB);
+
+	fp = fopen(".bkp-data/config", "r");
+	if (!fp) {
+		// not an error, it just doesn`t exist yet
+		if (access(".bkp-data/last_snapshot", F_OK) != 0 && access(".bkp-data/filecache", F_OK) != 0) {
+			repo_cfg.format = REPO_FORMAT_LATEST;
+			repo_is_new = 1;
+		}
+
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		line_no++;
+
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (sscanf(line, "%63s = %127s", key, value) != 2 || set_config_value(key, value)) {
+			fprintf(stderr, "Invalid line %d in .bkp-data/config!\n", line_no);
+			fclose(fp);
+			return -1;
+		}
+	}
+
+	fclose(fp);
+
+	if (repo_cfg.format < REPO_FORMAT_V1 || repo_cfg.format > REPO_FORMAT_LATEST) {
+		fprintf(stderr, "Repository format %d is not supported by this version of bkp!\n", repo_cfg.format);
+		return -1;
+	}
+
+	/*
+	 * Ids only depend on the uncompressed content since REPO_FORMAT_V2,
+	 * other hashes than SHA1 were never used with the older formats
+	 */
+	if (repo_cfg.hash != HASH_SHA1 && repo_cfg.format < REPO_FORMAT_V2) {
+		fprintf(stderr, "Invalid hash for repository format %d in .bkp-data/config!\n", repo_cfg.format);
+		return -1;
+	}
+
+	if (repo_cfg.chunker.max_size <= 0 ||
+		repo_cfg.chunker.min_size > repo_cfg.chunker.avg_size ||
+		repo_cfg.chunker.avg_size > repo_cfg.chunker.max_size) {
+		fprintf(stderr, "Invalid chunk sizes in .bkp-data/config!\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int save_config()
+{
+	char codec[64];
+	FILE *fp = fopen(".bkp-data/config.new", "w");
+
+	if (!fp) {
+		fprintf(stderr, "Error writing .bkp-data/config (errno: %d)!\n", errno);
+		return -1;
+	}
+
+	fprintf(fp, "format = %d\n", repo_cfg.format);
+	fprintf(fp, "hash = %s\n", hash_name(repo_cfg.hash));
+	fprintf(fp, "chunker = %s\n", repo_cfg.chunker.type == CHUNKER_CDC ? "cdc" : "fixed");
+	fprintf(fp, "chunk_min = %d\n", repo_cfg.chunker.min_size);
+	fprintf(fp, "chunk_avg = %d\n", repo_cfg.chunker.avg_size);
+	fprintf(fp, "chunk_max = %d\n", repo_cfg.chunker.max_size);
+
+	codec_format(&repo_cfg.codec, codec, sizeof(codec));
+	fprintf(fp, "codec = %s\n", codec);
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Error writing .bkp-data/config (errno: %d)!\n", errno);
+		return -1;
+	}
+
+	return rename(".bkp-data/config.new", ".bkp-data/config");
+}
+
+/*
+ * Switches the repository to the latest format. Nothing needs
+ * to be rewritten: unchanged files keep their old objects, only
+ * new objects get ids in the new format.
+ */
+int upgrade_repo()
+{
+	if (repo_cfg.format == REPO_FORMAT_LATEST) {
+		printf("Repository is already at format %d.\n", repo_cfg.format);
+		return 0;
+	}
+
+	printf("Upgrading repository from format %d to %d.\n", repo_cfg.format, REPO_FORMAT_LATEST);
+	repo_cfg.format = REPO_FORMAT_LATEST;
+
+	return save_config();
+}
+
+/*
+ * The hash can only be chosen for a new repository: every object,
+ * tree and snapshot is referenced by an id of this hash
+ */
+int set_repo_hash(int type)
+{
+	if (type == repo_cfg.hash)
+		return 0;
+
+	if (!repo_is_new) {
+		fprintf(stderr, "The hash of an existing repository can`t be changed, it uses %s!\n",
+				hash_name(repo_cfg.hash));
+		return -1;
+	}
+
+	repo_cfg.hash = type;
+	return 0;
+}
+
+/*
+ * Length of the object ids in this repository
+ */
+int repo_hash_len()
+{
+	return hash_size(repo_cfg.hash);
+}
+
+static int set_config_value(char *key, char *value)
+{
+	if (strcmp(key, "format") == 0)
+		repo_cfg.format = atoi(value);
+	else if (strcmp(key, "hash") == 0) {
+		repo_cfg.hash = hash_parse(value);
+		if (repo_cfg.hash < 0)
+			return -1;
+	}
+	else if (strcmp(key, "chunker") == 0) {
+		if (strcmp(value, "cdc") == 0)
+			repo_cfg.chunker.type = CHUNKER_CDC;
+		else if (strcmp(value, "fixed") == 0)
+			repo_cfg.chunker.type = CHUNKER_FIXED;
+		else
+			return -1;
+	}
+	else if (strcmp(key, "chunk_min") == 0)
+		repo_cfg.chunker.min_size = atoi(value);
+	else if (strcmp(key, "chunk_avg") == 0)
+		repo_cfg.chunker.avg_size = atoi(value);
+	else if (strcmp(key, "chunk_max") == 0)
+		repo_cfg.chunker.max_size = atoi(value);
+	else if (strcmp(key, "codec") == 0)
+		return codec_parse(value, &repo_cfg.codec);
+	else
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,40 @@
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "chunker.h"
+#include "codec.h"
+#include "hash.h"
+
+/*
+ * Repository formats. A repository keeps its format until it is
+ * upgraded with --upgrade-repo; objects written in an older format
+ * stay readable since they are only ever referenced by their id.
+ */
+#define REPO_FORMAT_V1 1 // object id = hash of the compressed object
+#define REPO_FORMAT_V2 2 // object id = hash of the uncompressed object
+#define REPO_FORMAT_V3 3 // chunks of zeros are hole markers, not blobs
+#define REPO_FORMAT_V4 4 // chunks lists store the sizes of the chunks ("chunkmap")
+#define REPO_FORMAT_LATEST REPO_FORMAT_V4
+
+/*
+ * Repository settings stored in .bkp-data/config. They are saved
+ * with every snapshot, so a repository keeps using the settings
+ * it was created with, even if the defaults change later.
+ */
+struct repo_config {
+	int format;
+	int hash; // fixed when the repository is created
+	struct chunker_params chunker;
+	struct codec_params codec;
+};
+
+extern struct repo_config repo_cfg;
+
+int load_config();
+int save_config();
+int upgrade_repo();
+int set_repo_hash(int type);
+int repo_hash_len();
+
+#endif
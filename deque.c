@@ -0,0 +1,191 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "deque.h"
+
+#define DEQUE_MIN_SIZE 64
+
+static int grow_deque(struct deque *deque);
+static void *pop_bottom(struct deque *deque);
+static void *steal_top(struct deque *deque, int wait);
+
+int deque_set_init(struct deque_set *set, int num_deques)
+{
+	set->deques = calloc(num_deques, sizeof(struct deque));
+	if (!set->deques) {
+		fprintf(stderr, "Error allocating memory for deques!\n");
+		return -ENOMEM;
+	}
+
+	for (int i=0;i<num_deques;i++)
+		pthread_mutex_init(&set->deques[i].lock, NULL);
+
+	set->num_deques = num_deques;
+	set->queued = 0;
+	set->idle = 0;
+	set->closed = 0;
+
+	pthread_mutex_init(&set->lock, NULL);
+	pthread_cond_init(&set->work, NULL);
+
+	return 0;
+}
+
+void deque_set_destroy(struct deque_set *set)
+{
+	for (int i=0;i<set->num_deques;i++) {
+		free(set->deques[i].items);
+		pthread_mutex_destroy(&set->deques[i].lock);
+	}
+
+	free(set->deques);
+	set->deques = NULL;
+
+	pthread_mutex_destroy(&set->lock);
+	pthread_cond_destroy(&set->work);
+}
+
+int deque_push(struct deque_set *set, int self, void *item)
+{
+	struct deque *deque = &set->deques[self];
+
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->len == deque->size && grow_deque(deque)) {
+		pthread_mutex_unlock(&deque->lock);
+		return -ENOMEM;
+	}
+
+	deque->items[(deque->head + deque->len) % deque->size] = item;
+	deque->len++;
+
+	pthread_mutex_unlock(&deque->lock);
+
+	__atomic_add_fetch(&set->queued, 1, __ATOMIC_SEQ_CST);
+
+	/*
+	 * Sleepers register in idle before checking queued, so either
+	 * they see the new item or we see them and wake one up
+	 */
+	if (__atomic_load_n(&set->idle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&set->lock);
+		pthread_cond_signal(&set->work);
+		pthread_mutex_unlock(&set->lock);
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the newest item of the own deque, or else the oldest one
+ * of another deque. Blocks while there is no work at all and returns
+ * NULL once the set is closed.
+ */
+void *deque_pop(struct deque_set *set, int self)
+{
+	void *item = NULL;
+
+	while (!__atomic_load_n(&set->closed, __ATOMIC_SEQ_CST)) {
+		item = pop_bottom(&set->deques[self]);
+
+		for (int i=1;i<set->num_deques && !item;i++)
+			item = steal_top(&set->deques[(self + i) % set->num_deques], 0);
+
+		/*
+		 * The deques holding the work were all busy, rather than
+		 * spinning on them we wait for their locks
+		 */
+		if (!item && __atomic_load_n(&set->queued, __ATOMIC_SEQ_CST) > 0) {
+			for (int i=1;i<set->num_deques && !item;i++)
+				item = steal_top(&set->deques[(self + i) % set->num_deques], 1);
+		}
+
+		if (item) {
+			__atomic_sub_fetch(&set->queued, 1, __ATOMIC_SEQ_CST);
+			return item;
+		}
+
+		pthread_mutex_lock(&set->lock);
+		__atomic_add_fetch(&set->idle, 1, __ATOMIC_SEQ_CST);
+
+		while (__atomic_load_n(&set->queued, __ATOMIC_SEQ_CST) == 0 && !set->closed)
+			pthread_cond_wait(&set->work, &set->lock);
+
+		__atomic_sub_fetch(&set->idle, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&set->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Wakes up all the waiting threads, items left in the
+ * deques are not returned anymore
+ */
+void deque_close(struct deque_set *set)
+{
+	pthread_mutex_lock(&set->lock);
+	__atomic_store_n(&set->closed, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&set->work);
+	pthread_mutex_unlock(&set->lock);
+}
+
+static int grow_deque(struct deque *deque)
+{
+	int size = deque->size > 0 ? deque->size * 2 : DEQUE_MIN_SIZE;
+	void **items = malloc(size * sizeof(void *));
+
+	if (!items) {
+		fprintf(stderr, "Error allocating memory for deque!\n");
+		return -ENOMEM;
+	}
+
+	for (int i=0;i<deque->len;i++)
+		items[i] = deque->items[(deque->head + i) % deque->size];
+
+	free(deque->items);
+	deque->items = items;
+	deque->size = size;
+	deque->head = 0;
+
+	return 0;
+}
+
+static void *pop_bottom(struct deque *deque)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->len > 0) {
+		deque->len--;
+		item = deque->items[(deque->head + deque->len) % deque->size];
+	}
+
+	pthread_mutex_unlock(&deque->lock);
+	return item;
+}
+
+static void *steal_top(struct deque *deque, int wait)
+{
+	void *item = NULL;
+
+	// a busy deque isn`t worth waiting for on the first round, there are others to try
+	if (wait)
+		pthread_mutex_lock(&deque->lock);
+	else if (pthread_mutex_trylock(&deque->lock))
+		return NULL;
+
+	if (deque->len > 0) {
+		item = deque->items[deque->head];
+		deque->head = (deque->head + 1) % deque->size;
+		deque->len--;
+	}
+
+	pthread_mutex_unlock(&deque->lock);
+	return item;
+}
@@ -0,0 +1,36 @@
+
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <pthread.h>
+
+/*
+ * Work-stealing deques of pointers, one per thread. A thread pushes
+ * and pops its own work at the bottom of its deque (newest first),
+ * idle threads steal the oldest work from the top of the others.
+ */
+struct deque {
+	void **items;
+	int size;
+	int head;
+	int len;
+	pthread_mutex_t lock;
+};
+
+struct deque_set {
+	struct deque *deques;
+	int num_deques;
+	int queued; // items in all the deques
+	int idle; // threads waiting for work
+	int closed;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+};
+
+int deque_set_init(struct deque_set *set, int num_deques);
+void deque_set_destroy(struct deque_set *set);
+int deque_push(struct deque_set *set, int self, void *item);
+void *deque_pop(struct deque_set *set, int self);
+void deque_close(struct deque_set *set);
+
+#endif
@@ -0,0 +1,307 @@
+
+/*
+ * The two snapshots are compared by walking their trees side by
+ * side. Entries with the same id (and mode) are equal with all
+ * their content, so a subtree which didn`t change is skipped
+ * without being read: only the trees leading to changes are read.
+ */
+
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "diff.h"
+#include "snapshot.h"
+#include "tree.h"
+#include "sha1-file.h"
+#include "bkp.h"
+
+#define DIFF_ADDED 0x01
+#define DIFF_REMOVED 0x02
+#define DIFF_MODIFIED 0x04
+#define DIFF_MODE 0x08
+
+static int num_added = 0;
+static int num_removed = 0;
+static int num_modified = 0;
+
+static int diff_trees(unsigned char *sha1_a, unsigned char *sha1_b, char *path);
+static int diff_entries(struct tree_entry *a, struct tree_entry *b, char *path);
+static int report_entry(struct tree_entry *entry, char *path, int change);
+static void print_change(struct tree_entry *a, struct tree_entry *b, char *path, int change);
+static void print_escaped(char *str);
+static void sort_tree_entries(struct tree *tree);
+static int compare_entries(const void *a, const void *b);
+
+int diff_snapshots(unsigned char *sha1_a, unsigned char *sha1_b, char *path)
+{
+	int ret = 0;
+	struct snapshot snap_a;
+	struct snapshot snap_b;
+	struct tree_entry *entry_a = NULL;
+	struct tree_entry *entry_b = NULL;
+	char norm_path[PATH_MAX];
+	int len = 0;
+
+	if (read_snapshot_file(sha1_a, &snap_a) || read_snapshot_file(sha1_b, &snap_b))
+		return -1;
+
+	num_added = 0;
+	num_removed = 0;
+	num_modified = 0;
+
+	len = normalize_tree_path(path, norm_path);
+	if (len < 0)
+		return -1;
+
+	if (len == 0) {
+		ret = diff_trees(snap_a.tree_sha1, snap_b.tree_sha1, "");
+		goto end;
+	}
+
+	if (find_tree_path(snap_a.tree_sha1, norm_path, &entry_a) ||
+		find_tree_path(snap_b.tree_sha1, norm_path, &entry_b)) {
+		ret = -1;
+		goto end;
+	}
+
+	if (!entry_a && !entry_b) {
+		fprintf(stderr, "Path not found in either snapshot: %s\n", norm_path);
+		ret = -1;
+		goto end;
+	}
+
+	ret = diff_entries(entry_a, entry_b, norm_path);
+
+end:
+	free(entry_a);
+	free(entry_b);
+
+	if (!ret && !bkp_opts.porcelain)
+		printf("%d added, %d removed, %d modified\n", num_added, num_removed, num_modified);
+
+	return ret;
+}
+
+/*
+ * Merges the sorted entries of the two trees, path is the path
+ * of the trees (without the trailing /)
+ */
+static int diff_trees(unsigned char *sha1_a, unsigned char *sha1_b, char *path)
+{
+	int ret = 0;
+	struct tree tree_a;
+	struct tree tree_b;
+	int i = 0, j = 0;
+	int cmp = 0;
+	char full_path[PATH_MAX];
+
+	if (read_tree_file(sha1_a, &tree_a))
+		return -1;
+
+	if (read_tree_file(sha1_b, &tree_b)) {
+		free_tree_entries(&tree_a);
+		return -1;
+	}
+
+	sort_tree_entries(&tree_a);
+	sort_tree_entries(&tree_b);
+
+	while (i < tree_a.entries_len || j < tree_b.entries_len) {
+		struct tree_entry *a = i < tree_a.entries_len ? tree_a.entries[i] : NULL;
+		struct tree_entry *b = j < tree_b.entries_len ? tree_b.entries[j] : NULL;
+
+		if (!a)
+			cmp = 1;
+		else if (!b)
+			cmp = -1;
+		else
+			cmp = compare_tree_names(a->name, a->name_len, b->name, b->name_len);
+
+		if (cmp < 0) {
+			b = NULL;
+			i++;
+		}
+		else if (cmp > 0) {
+			a = NULL;
+			j++;
+		}
+		else {
+			i++;
+			j++;
+		}
+
+		snprintf(full_path, PATH_MAX, "%s/%s", path, a ? a->name : b->name);
+
+		if (diff_entries(a, b, full_path)) {
+			ret = -1;
+			break;
+		}
+	}
+
+	free_tree_entries(&tree_a);
+	free_tree_entries(&tree_b);
+
+	return ret;
+}
+
+/*
+ * Compares the entries of the same path, either of them may be
+ * missing (but not both)
+ */
+static int diff_entries(struct tree_entry *a, struct tree_entry *b, char *path)
+{
+	int change = 0;
+
+	if (a && b && memcmp(a->sha1, b->sha1, HASH_MAX_LEN) == 0 && a->st_mode == b->st_mode)
+		return 0;
+
+	// a file became a directory (or the other way around)
+	if (!a || !b || (a->st_mode & S_IFMT) != (b->st_mode & S_IFMT)) {
+		if (a && report_entry(a, path, DIFF_REMOVED))
+			return -1;
+
+		if (b && report_entry(b, path, DIFF_ADDED))
+			return -1;
+
+		return 0;
+	}
+
+	if (a->st_mode != b->st_mode)
+		change |= DIFF_MODE;
+
+	if (S_ISDIR(a->st_mode)) {
+		if (change)
+			print_change(a, b, path, change);
+
+		if (memcmp(a->sha1, b->sha1, HASH_MAX_LEN) != 0)
+			return diff_trees(a->sha1, b->sha1, path);
+
+		return 0;
+	}
+
+	if (memcmp(a->sha1, b->sha1, HASH_MAX_LEN) != 0)
+		change |= DIFF_MODIFIED;
+
+	print_change(a, b, path, change);
+
+	return 0;
+}
+
+/*
+ * An added or removed entry, with everything below it
+ */
+static int report_entry(struct tree_entry *entry, char *path, int change)
+{
+	int ret = 0;
+	struct tree tree;
+	char full_path[PATH_MAX];
+
+	if (change == DIFF_ADDED)
+		print_change(NULL, entry, path, change);
+	else
+		print_change(entry, NULL, path, change);
+
+	if (!S_ISDIR(entry->st_mode))
+		return 0;
+
+	if (read_tree_file(entry->sha1, &tree))
+		return -1;
+
+	sort_tree_entries(&tree);
+
+	for (int i=0;i<tree.entries_len;i++) {
+		snprintf(full_path, PATH_MAX, "%s/%s", path, tree.entries[i]->name);
+
+		if (report_entry(tree.entries[i], full_path, change)) {
+			ret = -1;
+			break;
+		}
+	}
+
+	free_tree_entries(&tree);
+	return ret;
+}
+
+static void print_change(struct tree_entry *a, struct tree_entry *b, char *path, int change)
+{
+	char status[3];
+	char hex_a[HASH_MAX_HEX+1];
+	char hex_b[HASH_MAX_HEX+1];
+	int len = 0;
+	int is_dir = S_ISDIR((a ? a : b)->st_mode);
+
+	if (change & DIFF_ADDED) {
+		status[len++] = 'A';
+		num_added++;
+	}
+	else if (change & DIFF_REMOVED) {
+		status[len++] = 'D';
+		num_removed++;
+	}
+	else {
+		if (change & DIFF_MODIFIED)
+			status[len++] = 'M';
+
+		if (change & DIFF_MODE)
+			status[len++] = 'P';
+
+		num_modified++;
+	}
+
+	status[len] = '\0';
+
+	if (!bkp_opts.porcelain) {
+		printf("%-2s %s%s", status, path, is_dir ? "/" : "");
+
+		if (change & DIFF_MODE)
+			printf(" (%o -> %o)", a->st_mode, b->st_mode);
+
+		printf("\n");
+		return;
+	}
+
+	strcpy(hex_a, "-");
+	strcpy(hex_b, "-");
+
+	if (a)
+		sha1_to_hex(a->sha1, hex_a);
+
+	if (b)
+		sha1_to_hex(b->sha1, hex_b);
+
+	printf("%s\t%o\t%o\t%s\t%s\t", status, a ? a->st_mode : 0, b ? b->st_mode : 0, hex_a, hex_b);
+	print_escaped(path);
+	printf("%s\n", is_dir ? "/" : "");
+}
+
+static void print_escaped(char *str)
+{
+	for (;*str;str++) {
+		if (*str == '\t')
+			fputs("\\t", stdout);
+		else if (*str == '\n')
+			fputs("\\n", stdout);
+		else if (*str == '\\')
+			fputs("\\\\", stdout);
+		else
+			putchar(*str);
+	}
+}
+
+static void sort_tree_entries(struct tree *tree)
+{
+	if (tree->entries_len > 1)
+		qsort(tree->entries, tree->entries_len, sizeof(struct tree_entry *), compare_entries);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct tree_entry *e1 = *(const struct tree_entry **)a;
+	const struct tree_entry *e2 = *(const struct tree_entry **)b;
+
+	return compare_tree_names((char *)e1->name, e1->name_len, (char *)e2->name, e2->name_len);
+}
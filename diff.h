@@ -0,0 +1,19 @@
+
+#ifndef DIFF_H
+#define DIFF_H
+
+/*
+ * Changes between two snapshots, optionally only below path.
+ * With bkp_opts.porcelain every change is printed as one line of
+ * tab separated fields:
+ *
+ *   STATUS OLD_MODE NEW_MODE OLD_ID NEW_ID PATH
+ *
+ * STATUS is A (added), D (removed), M (content modified), P (mode
+ * changed) or MP (both). Missing modes are 0, missing ids are "-".
+ * Directories end with a /, tabs, newlines and backslashes in the
+ * paths are escaped as \t, \n and \\.
+ */
+int diff_snapshots(unsigned char *sha1_a, unsigned char *sha1_b, char *path);
+
+#endif
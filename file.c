@@ -22,153 +22,350 @@
 #include <unistd.h>
 #include <limits.h>
 #include <errno.h>
-#include <openssl/sha.h>
 #include <zconf.h>
 #include "file.h"
 #include "sha1-file.h"
+#include "config.h"
+#include "cache.h"
 
-static int write_blob(char *buffer, int size, unsigned char *sha1);
+/*
+ * Compresses and stores the blob object of one file chunk. The
+ * "blob\0" header and the data are streamed as separate segments,
+ * without copying them together.
+ */
+int write_blob(unsigned char *sha1, char *buffer, int size)
+{
+	struct iovec iov[2];
 
+	iov[0].iov_base = "blob"; // with its \0
+	iov[0].iov_len = 5;
+	iov[1].iov_base = buffer;
+	iov[1].iov_len = size;
+
+	return write_sha1_iov(sha1, iov, 2);
+}
 
-int write_file(char *path, off_t size, unsigned char *sha1)
+/*
+ * Id of the blob object of a chunk in REPO_FORMAT_V2 repositories,
+ * computed without building the object
+ */
+int hash_blob(char *buffer, int size, unsigned char *sha1)
 {
 	int ret = 0;
-	int bytes_read = 0;
-	int fd = open(path, O_RDONLY);
-	char *buff = NULL;
-	char *chunks_buff = NULL;
-	unsigned char chunk_sha1[SHA_DIGEST_LENGTH];
-	int chunks_offset = 0;
-	int num_chunks = (size / FILE_CHUNK_SIZE) + (size % FILE_CHUNK_SIZE == 0 ? 0 : 1);
-	int chunks_buff_size = num_chunks * SHA_DIGEST_LENGTH; 
-
-	if (fd < 0) {
-		fprintf(stderr, "Error opening file %s for backup (errno: %d)\n", path, errno);
+	struct hash_ctx ctx;
+
+	if (hash_init(&ctx, repo_cfg.hash))
 		return -1;
-	}
 
-	buff = malloc(FILE_CHUNK_SIZE);
-	if (!buff) {
-		fprintf(stderr, "Error allocating memory for read buffer while backing up file!\n");
-		ret = -ENOMEM;
-		goto end;
+	if (hash_update(&ctx, "blob", 5) || // "blob\0"
+		hash_update(&ctx, buffer, size) ||
+		hash_final(&ctx, sha1)) {
+		fprintf(stderr, "Error hashing blob!\n");
+		ret = -1;
 	}
 
-	chunks_buff = malloc(100 + chunks_buff_size);
-	if (!chunks_buff) {
+	hash_end(&ctx);
+	return ret;
+}
+
+int read_blob(unsigned char *sha1, char **out_buff, int *out_size)
+{
+	return read_sha1_file(sha1, "blob", out_buff, out_size);
+}
+
+/*
+ * Since REPO_FORMAT_V4 the chunks of a file are listed by a "chunkmap"
+ * object instead of a "chunks" one: the same ids, followed by the size
+ * of every chunk (CHUNK_SIZE_LEN bytes, big endian). The offset of a
+ * chunk in the file is then known without reading the chunks before it.
+ */
+int write_chunks_file(unsigned char *sha1, struct chunk_fp *chunks, int num_chunks)
+{
+	int ret = 0;
+	int len = repo_hash_len();
+	int sized = repo_cfg.format >= REPO_FORMAT_V4;
+	unsigned char *buff = NULL;
+	unsigned char *sizes = NULL;
+	int offset = 0;
+
+	buff = malloc(100 + (size_t)num_chunks * (len + CHUNK_SIZE_LEN));
+	if (!buff) {
 		fprintf(stderr, "Error allocating memory for sha1 chunks buffer!\n");
-		ret = -ENOMEM;
-		goto end;
+		return -ENOMEM;
 	}
 
-	memset(chunks_buff, 0, 100 + chunks_buff_size);
-	chunks_offset = sprintf(chunks_buff, "chunks") + 1; // \0 too
+	offset = sprintf((char *)buff, "%s", sized ? "chunkmap" : "chunks") + 1; // \0 too
 
-	while((bytes_read = read(fd, buff, FILE_CHUNK_SIZE)) > 0)
-	{
-		ret = write_blob(buff, bytes_read, chunk_sha1);
+	for (int i=0;i<num_chunks;i++) {
+		memcpy(buff + offset, chunks[i].sha1, len);
+		offset += len;
+	}
 
-		if (ret) {
-			free(chunks_buff);
-			chunks_buff = NULL;
-			goto end;
-		}
+	sizes = buff + offset;
+	for (int i=0;i<num_chunks && sized;i++) {
+		sizes[0] = (chunks[i].size >> 24) & 0xff;
+		sizes[1] = (chunks[i].size >> 16) & 0xff;
+		sizes[2] = (chunks[i].size >> 8) & 0xff;
+		sizes[3] = chunks[i].size & 0xff;
 
-		memcpy(chunks_buff+chunks_offset, chunk_sha1, SHA_DIGEST_LENGTH);
-		chunks_offset += SHA_DIGEST_LENGTH;
+		sizes += CHUNK_SIZE_LEN;
+		offset += CHUNK_SIZE_LEN;
 	}
 
-	ret = write_sha1_file(sha1, chunks_buff, chunks_offset);
-
-end:
-	if (buff)
-		free(buff);
-	
-	if (chunks_buff)
-		free(chunks_buff);
+	ret = write_sha1_file(sha1, (char *)buff, offset);
 
-	close(fd);
+	free(buff);
 	return ret;
 }
 
-static int write_blob(char *buffer, int size, unsigned char *sha1)
+/*
+ * Reads either kind of chunks list. The ids come first in out_buff
+ * for both, sized tells if the sizes of a "chunkmap" follow them.
+ */
+static int read_chunks_object(unsigned char *sha1, unsigned char **out_buff, int *num_chunks, int *sized)
 {
 	int ret = 0;
-	int offset = 0;
-	int buff_len = size + 5; // 5 = "blob\0"
-	char *buff = malloc(buff_len);
+	int buff_len = 0;
+	char type[16] = "";
+	char sha1_hex[HASH_MAX_HEX+1];
 
-	if (!buff)
-		return -ENOMEM;
+	ret = read_sha1_file(sha1, type, (char **)out_buff, &buff_len);
+	if (ret)
+		return ret;
 
-	offset = sprintf(buff, "blob");
-	offset += 1; // we want to keep the \0 too
-	memcpy(buff+offset, buffer, size);
-	offset += size;
+	*sized = strcmp(type, "chunkmap") == 0;
+
+	if (*sized)
+		ret = read_chunkmap_buffer(buff_len, num_chunks);
+	else if (strcmp(type, "chunks") == 0)
+		ret = read_chunks_buffer(buff_len, num_chunks);
+	else {
+		sha1_to_hex(sha1, sha1_hex);
+		fprintf(stderr, "Object %s is a %s, not a chunks list!\n", sha1_hex, type);
+		ret = -1;
+	}
+
+	if (ret) {
+		free(*out_buff);
+		*out_buff = NULL;
+	}
 
-	ret = write_sha1_file(sha1, buff, buff_len);
-	
-	free(buff);
 	return ret;
 }
 
-int read_blob(unsigned char *sha1, char **out_buff, int *out_size)
+int read_chunks_file(unsigned char *sha1, unsigned char **out_buff, int *num_chunks)
 {
-	return read_sha1_file(sha1, "blob", out_buff, out_size);
+	int sized = 0;
+
+	return read_chunks_object(sha1, out_buff, num_chunks, &sized);
 }
 
-int read_chunks_file(unsigned char *sha1, unsigned char **out_buff, int *num_chunks)
+/*
+ * The offsets of the chunks are the prefix sums of their sizes, so
+ * the chunk of any offset is found by a binary search. Chunks lists
+ * written before REPO_FORMAT_V4 have no sizes, offsets is NULL then.
+ */
+int read_chunk_map(unsigned char *sha1, struct chunk_map *map)
 {
 	int ret = 0;
-	int buff_len = 0;
+	int sized = 0;
+	unsigned char *sizes = NULL;
 
-	ret = read_sha1_file(sha1, "chunks", (char **)out_buff, &buff_len);
-	if (ret)
+	memset(map, 0, sizeof(struct chunk_map));
+
+	ret = read_chunks_object(sha1, &map->chunks, &map->num_chunks, &sized);
+	if (ret || !sized)
 		return ret;
 
-	ret = read_chunks_buffer(buff_len, num_chunks);
-	if (ret) {
-		free(*out_buff);
-		*out_buff = NULL;
+	map->offsets = malloc((map->num_chunks + 1) * sizeof(uint64_t));
+	if (!map->offsets) {
+		fprintf(stderr, "Error allocating memory for chunk offsets!\n");
+		free_chunk_map(map);
+		return -ENOMEM;
 	}
 
-	return ret;
+	sizes = map->chunks + (size_t)map->num_chunks * repo_hash_len();
+
+	map->offsets[0] = 0;
+	for (int i=0;i<map->num_chunks;i++) {
+		map->offsets[i + 1] = map->offsets[i] + 
+				(((uint32_t)sizes[0] << 24) | (sizes[1] << 16) | (sizes[2] << 8) | sizes[3]);
+		sizes += CHUNK_SIZE_LEN;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the chunk containing offset, num_chunks if it is past the
+ * end of the file
+ */
+int find_chunk(struct chunk_map *map, uint64_t offset)
+{
+	int lo = 0, hi = map->num_chunks;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (map->offsets[mid + 1] <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+void free_chunk_map(struct chunk_map *map)
+{
+	free(map->chunks);
+	free(map->offsets);
+	memset(map, 0, sizeof(struct chunk_map));
 }
 
 int read_chunks_buffer(int buff_len, int *num_chunks)
 {
 	int ret = 0;
 
-	if (buff_len % SHA_DIGEST_LENGTH != 0) {
-		fprintf(stderr, "Invalid or corrupted chunks file! The size of the chunks should be a multiple of %d bytes.\n", SHA_DIGEST_LENGTH);
+	int len = repo_hash_len();
+
+	if (buff_len % len != 0) {
+		fprintf(stderr, "Invalid or corrupted chunks file! The size of the chunks should be a multiple of %d bytes.\n", len);
 		ret = -1;
 		goto end;
 	}
 
-	*num_chunks = buff_len / SHA_DIGEST_LENGTH;
+	*num_chunks = buff_len / len;
 
 end:
 	return ret;
 }
 
+int read_chunkmap_buffer(int buff_len, int *num_chunks)
+{
+	int len = repo_hash_len() + CHUNK_SIZE_LEN;
+
+	if (buff_len % len != 0) {
+		fprintf(stderr, "Invalid or corrupted chunkmap file! The size of the chunks should be a multiple of %d bytes.\n", len);
+		return -1;
+	}
+
+	*num_chunks = buff_len / len;
+	return 0;
+}
+
 int print_chunks_buffer(char *buff, int buff_len)
 {
 	unsigned char *tmp_buff = NULL;
 	int num_chunks = 0;
-	char sha1_hex[40+1];
+	unsigned char sha1[HASH_MAX_LEN];
+	char sha1_hex[HASH_MAX_HEX+1];
 
 	if (read_chunks_buffer(buff_len, &num_chunks)) 
 		return -1;
 	
 	tmp_buff = (unsigned char *)buff;
 	while(num_chunks > 0) {
-		sha1_to_hex(tmp_buff, sha1_hex);
+		get_chunk_sha1(tmp_buff, 0, sha1);
+		sha1_to_hex(sha1, sha1_hex);
 		printf("%s\n", sha1_hex);
 
-		tmp_buff += SHA_DIGEST_LENGTH;
+		tmp_buff += repo_hash_len();
 		num_chunks--;
 	}
 	
 	return 0;
 }
 
+int print_chunkmap_buffer(char *buff, int buff_len)
+{
+	unsigned char *sizes = NULL;
+	int num_chunks = 0;
+	uint64_t offset = 0;
+	uint32_t size = 0;
+	unsigned char sha1[HASH_MAX_LEN];
+	char sha1_hex[HASH_MAX_HEX+1];
+
+	if (read_chunkmap_buffer(buff_len, &num_chunks)) 
+		return -1;
+
+	sizes = (unsigned char *)buff + (size_t)num_chunks * repo_hash_len();
+	for (int i=0;i<num_chunks;i++) {
+		get_chunk_sha1((unsigned char *)buff, i, sha1);
+		sha1_to_hex(sha1, sha1_hex);
+
+		size = ((uint32_t)sizes[0] << 24) | (sizes[1] << 16) | (sizes[2] << 8) | sizes[3];
+		printf("%s %12llu %u\n", sha1_hex, (unsigned long long)offset, size);
+
+		offset += size;
+		sizes += CHUNK_SIZE_LEN;
+	}
+
+	return 0;
+}
+
+/*
+ * Copies the id of chunk idx out of a chunks object, where ids
+ * are stored with the length of the repository hash
+ */
+void get_chunk_sha1(unsigned char *chunks, int idx, unsigned char *sha1)
+{
+	int len = repo_hash_len();
+
+	memset(sha1, 0, HASH_MAX_LEN);
+	memcpy(sha1, chunks + (size_t)idx * len, len);
+}
+
+/*
+ * Since REPO_FORMAT_V3 chunks of zeros (holes of sparse files, or
+ * zeros written out) are not stored. Their id in the chunks object
+ * is a hole marker instead: HOLE_ID_MAGIC, the size of the chunk 
+ * (big endian) and zeros up to the length of the repository hash.
+ */
+#define HOLE_ID_MAGIC "\0\0\0\0bkp-hole"
+#define HOLE_ID_MAGIC_LEN 12
+
+void hole_id(int size, unsigned char *sha1)
+{
+	memset(sha1, 0, HASH_MAX_LEN);
+	memcpy(sha1, HOLE_ID_MAGIC, HOLE_ID_MAGIC_LEN);
+
+	sha1[HOLE_ID_MAGIC_LEN] = (size >> 24) & 0xff;
+	sha1[HOLE_ID_MAGIC_LEN + 1] = (size >> 16) & 0xff;
+	sha1[HOLE_ID_MAGIC_LEN + 2] = (size >> 8) & 0xff;
+	sha1[HOLE_ID_MAGIC_LEN + 3] = size & 0xff;
+}
+
+/*
+ * Returns 1 (and the size of the hole) if sha1 is a hole marker
+ */
+int is_hole_id(unsigned char *sha1, int *size)
+{
+	if (memcmp(sha1, HOLE_ID_MAGIC, HOLE_ID_MAGIC_LEN) != 0)
+		return 0;
+
+	for (int i=HOLE_ID_MAGIC_LEN+4;i<repo_hash_len();i++) {
+		if (sha1[i])
+			return 0;
+	}
+
+	if (size)
+		*size = (sha1[HOLE_ID_MAGIC_LEN] << 24) | (sha1[HOLE_ID_MAGIC_LEN + 1] << 16) |
+				(sha1[HOLE_ID_MAGIC_LEN + 2] << 8) | sha1[HOLE_ID_MAGIC_LEN + 3];
+
+	return 1;
+}
+
+/*
+ * Once the first byte is known to be 0, comparing the buffer with 
+ * itself shifted by one byte tells if all of them are. memcmp() is 
+ * vectorized by the C library, and returns at the first non-zero
+ * byte, which is usually right at the start.
+ */
+int is_zero_buffer(char *buff, int len)
+{
+	if (len <= 0)
+		return 0;
+
+	return buff[0] == 0 && memcmp(buff, buff + 1, len - 1) == 0;
+}
@@ -17,11 +17,37 @@
 #ifndef FILE_H
 #define FILE_H
 
+#include <stdint.h>
+
 #define FILE_CHUNK_SIZE (10 * (1024 * 1024))
+#define CHUNK_SIZE_LEN 4 // of a chunk size in a "chunkmap" object
+
+struct chunk_fp;
+
+/*
+ * The chunks list of a file, with the offsets of its chunks if
+ * the list has their sizes
+ */
+struct chunk_map {
+	unsigned char *chunks; // ids, as in a "chunks" object
+	uint64_t *offsets; // num_chunks + 1 (the size of the file last), or NULL
+	int num_chunks;
+};
 
-int write_file(char *path, off_t size, unsigned char *sha1);
+int write_blob(unsigned char *sha1, char *buffer, int size);
+int hash_blob(char *buffer, int size, unsigned char *sha1);
 int read_blob(unsigned char *sha1, char **out_buff, int *out_size);
 int read_chunks_file(unsigned char *sha1, unsigned char **out_buff, int *num_chunks);
 int read_chunks_buffer(int buff_len, int *num_chunks);
+int read_chunkmap_buffer(int buff_len, int *num_chunks);
 int print_chunks_buffer(char *buff, int buff_len);
+int print_chunkmap_buffer(char *buff, int buff_len);
+int write_chunks_file(unsigned char *sha1, struct chunk_fp *chunks, int num_chunks);
+int read_chunk_map(unsigned char *sha1, struct chunk_map *map);
+int find_chunk(struct chunk_map *map, uint64_t offset);
+void free_chunk_map(struct chunk_map *map);
+void get_chunk_sha1(unsigned char *chunks, int idx, unsigned char *sha1);
+void hole_id(int size, unsigned char *sha1);
+int is_hole_id(unsigned char *sha1, int *size);
+int is_zero_buffer(char *buff, int len);
 #endif
@@ -0,0 +1,601 @@
+
+/*
+ * Garbage collection: every object reachable from the snapshot chain
+ * is marked live, the others are removed (see sweep_objects()).
+ *
+ * The objects are numbered by their position in the object index,
+ * so the live ones are tracked in a bitmap of one bit per object
+ * (12.5 MB for 100M objects), set atomically by the mark threads.
+ * An object whose bit was already set is not entered again, so
+ * subtrees shared by several snapshots (or several directories)
+ * are only read once. Only the trees still to be read are queued,
+ * the chunks lists of the files are read right away.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "gc.h"
+#include "snapshot.h"
+#include "snapshot-log.h"
+#include "tree.h"
+#include "file.h"
+#include "cache.h"
+#include "pack.h"
+#include "object-index.h"
+#include "sha1-file.h"
+#include "config.h"
+#include "bkp.h"
+
+static struct object_index *mark_idx = NULL;
+static uint64_t *mark_live = NULL;
+static int mark_flags = 0;
+static uint32_t num_marked = 0;
+static uint32_t num_broken = 0;
+
+static pthread_mutex_t mark_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mark_cond = PTHREAD_COND_INITIALIZER;
+static unsigned char *trees = NULL; // ids of the trees to read, HASH_MAX_LEN bytes each
+static size_t trees_len = 0;
+static size_t trees_size = 0;
+static int pending = 0; // trees queued or being read
+static int mark_error = 0;
+
+static void *mark_thread(void *arg);
+static int mark_tree(unsigned char *sha1);
+static int mark_chunks(unsigned char *sha1);
+static int mark_object(unsigned char *sha1, unsigned char *parent_sha1);
+static int mark_failed(unsigned char *sha1);
+static int push_tree(unsigned char *sha1);
+static int is_live(struct object_index *idx, uint64_t *live, unsigned char *sha1);
+static int is_cache_entry_live(struct cache_entry *entry, void *arg);
+static int filter_cache(struct object_index *idx, uint64_t *live);
+
+// what filter_cache() needs to know
+struct live_objects {
+	struct object_index *idx;
+	uint64_t *live;
+};
+
+int lock_repo(int exclusive)
+{
+	int fd = open(REPO_LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+
+	if (fd < 0) {
+		fprintf(stderr, "Error opening %s (errno: %d)!\n", REPO_LOCK_FILE, errno);
+		return -1;
+	}
+
+	if (flock(fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB)) {
+		fprintf(stderr, exclusive ? "The repository is used by another bkp process!\n" :
+									"The repository is being garbage collected!\n");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void unlock_repo(int fd)
+{
+	if (fd < 0)
+		return;
+
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+/*
+ * Removes the snapshots not kept by any of the rules of bkp_opts
+ * (the last one is always kept), then garbage collects the objects
+ * only they used
+ */
+int prune_snapshots()
+{
+	int ret = 0;
+	struct snapshot_log log;
+	char *keep = NULL;
+	char day[16], last_day[16] = "";
+	char week[16], last_week[16] = "";
+	char date[20];
+	char sha1_hex[HASH_MAX_HEX+1];
+	int days = 0, weeks = 0, kept = 0;
+	struct tm tm;
+	time_t when = 0;
+
+	if (bkp_opts.keep_last <= 0 && bkp_opts.keep_daily <= 0 && bkp_opts.keep_weekly <= 0) {
+		fprintf(stderr, "Nothing would be kept! Use --keep-last, --keep-daily or --keep-weekly\n");
+		return -1;
+	}
+
+	if (load_snapshot_log(&log))
+		return -1;
+
+	if (log.num_records == 0) {
+		fprintf(stderr, "No snapshots found!\n");
+		return -1;
+	}
+
+	keep = calloc(log.num_records, 1);
+	if (!keep) {
+		fprintf(stderr, "Error allocating memory for the snapshots to keep!\n");
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	// newest first, so the first one of a day (or week) is its last
+	for (int i=log.num_records-1;i>=0;i--) {
+		int age = log.num_records - 1 - i;
+
+		when = log.records[i].time;
+		localtime_r(&when, &tm);
+		strftime(day, sizeof(day), "%Y%m%d", &tm);
+		strftime(week, sizeof(week), "%G%V", &tm);
+
+		if (age == 0 || age < bkp_opts.keep_last)
+			keep[i] = 1;
+
+		if (days < bkp_opts.keep_daily && strcmp(day, last_day) != 0) {
+			keep[i] = 1;
+			days++;
+			strcpy(last_day, day);
+		}
+
+		if (weeks < bkp_opts.keep_weekly && strcmp(week, last_week) != 0) {
+			keep[i] = 1;
+			weeks++;
+			strcpy(last_week, week);
+		}
+	}
+
+	for (int i=0;i<log.num_records;i++) {
+		if (keep[i]) {
+			kept++;
+			continue;
+		}
+
+		when = log.records[i].time;
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime_r(&when, &tm));
+		sha1_to_hex(log.records[i].sha1, sha1_hex);
+
+		printf("%s snapshot %s (%s)\n", bkp_opts.dry_run ? "Would remove" : "Removing", sha1_hex, date);
+	}
+
+	printf("Keeping %d of %d snapshots\n", kept, log.num_records);
+
+	if (bkp_opts.dry_run || kept == log.num_records)
+		goto end;
+
+	ret = prune_snapshot_log(&log, keep);
+	if (ret)
+		goto end;
+
+	ret = gc_repo();
+
+end:
+	free(keep);
+	free_snapshot_log(&log);
+
+	return ret;
+}
+
+int gc_repo()
+{
+	int ret = 0;
+	struct object_index idx;
+	uint64_t *live = NULL;
+	unsigned char last_sha1[HASH_MAX_LEN];
+	struct mark_stats mark_stats;
+	struct sweep_stats stats;
+	uint32_t num_entries = 0;
+
+	// without a snapshot everything would be removed
+	if (read_last_sha1(last_sha1)) {
+		fprintf(stderr, "No snapshots found!\n");
+		return -1;
+	}
+
+	printf("Updating the object index... ");
+	fflush(stdout);
+
+	ret = update_object_index();
+	if (ret)
+		return ret;
+
+	printf("done\n");
+
+	if (load_object_index(&idx) || idx.hdr->num_entries == 0) {
+		printf("No objects to collect\n");
+		free_object_index(&idx);
+		return 0;
+	}
+
+	num_entries = idx.hdr->num_entries;
+
+	live = calloc((num_entries + 63) / 64, sizeof(uint64_t));
+	if (!live) {
+		fprintf(stderr, "Error allocating memory for the live objects!\n");
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	printf("Marking live objects... ");
+	fflush(stdout);
+
+	ret = mark_objects(&idx, last_sha1, live, 0, &mark_stats);
+	if (ret) {
+		fprintf(stderr, "Error marking live objects, nothing was removed!\n");
+		goto end;
+	}
+
+	printf("done (%u of %u objects live)\n", mark_stats.live, num_entries);
+
+	if (bkp_opts.dry_run) {
+		printf("Would remove %u objects\n", num_entries - mark_stats.live);
+		goto end;
+	}
+
+	if (mark_stats.live == num_entries)
+		goto end;
+
+	// the filecache must not lead the next snapshot to removed objects
+	ret = filter_cache(&idx, live);
+	if (ret)
+		goto end;
+
+	ret = sweep_objects(&idx, live, &stats);
+	if (ret) {
+		fprintf(stderr, "Error removing dead objects!\n");
+		goto end;
+	}
+
+	printf("Removed %llu objects, freed %llu bytes\n",
+			(unsigned long long)stats.removed, (unsigned long long)stats.freed);
+
+	if (stats.left > 0)
+		printf("%llu bytes of removed objects are left in packs not worth rewriting yet\n",
+				(unsigned long long)stats.left);
+
+end:
+	free(live);
+	free_object_index(&idx);
+
+	return ret;
+}
+
+/*
+ * Marks the snapshots of the parent chain starting at last_sha1
+ * and queues their trees (except for the pruned ones), then marks
+ * everything below them with bkp_opts.threads threads
+ */
+int mark_objects(struct object_index *idx, unsigned char *last_sha1, uint64_t *live, int flags, struct mark_stats *stats)
+{
+	int ret = 0;
+	unsigned char sha1[HASH_MAX_LEN];
+	struct snapshot snapshot;
+	unsigned char *pruned = NULL;
+	int num_pruned = 0;
+	pthread_t *threads = NULL;
+	int num_threads = 0;
+	int marked = 0;
+
+	mark_idx = idx;
+	mark_live = live;
+	mark_flags = flags;
+	num_marked = 0;
+	num_broken = 0;
+	pending = 0;
+	mark_error = 0;
+
+	if (read_pruned_snapshots(&pruned, &num_pruned))
+		return -1;
+
+	memcpy(sha1, last_sha1, HASH_MAX_LEN);
+
+	for (;;) {
+		// the older snapshots can`t be found without this one
+		marked = mark_object(sha1, NULL);
+		if (marked < 0) {
+			ret = -1;
+			goto end;
+		}
+		else if (marked == 0)
+			break;
+
+		if (read_snapshot_file(sha1, &snapshot)) {
+			ret = mark_failed(sha1);
+			if (ret)
+				goto end;
+
+			break;
+		}
+
+		if (!is_pruned_snapshot(pruned, num_pruned, sha1)) {
+			marked = mark_object(snapshot.tree_sha1, sha1);
+
+			ret = marked > 0 ? push_tree(snapshot.tree_sha1) : marked;
+			if (ret)
+				goto end;
+		}
+
+		if (!sha1_is_valid(snapshot.parent_sha1))
+			break;
+
+		memcpy(sha1, snapshot.parent_sha1, HASH_MAX_LEN);
+	}
+
+	threads = calloc(bkp_opts.threads, sizeof(pthread_t));
+	if (!threads) {
+		fprintf(stderr, "Error allocating memory for mark threads!\n");
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	for (int i=0;i<bkp_opts.threads;i++) {
+		if (pthread_create(&threads[i], NULL, mark_thread, NULL)) {
+			fprintf(stderr, "Error starting mark thread!\n");
+			break;
+		}
+		num_threads++;
+	}
+
+	// the threads started can do all the work, or this one alone
+	if (num_threads == 0)
+		mark_thread(NULL);
+
+	for (int i=0;i<num_threads;i++)
+		pthread_join(threads[i], NULL);
+
+	ret = mark_error ? -1 : 0;
+
+end:
+	stats->live = num_marked;
+	stats->broken = num_broken;
+
+	free(threads);
+	free(pruned);
+	free(trees);
+	trees = NULL;
+	trees_len = trees_size = 0;
+
+	return ret;
+}
+
+static void *mark_thread(void *arg)
+{
+	unsigned char sha1[HASH_MAX_LEN];
+	int ret = 0;
+
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&mark_lock);
+
+		while (trees_len == 0 && pending > 0 && !mark_error)
+			pthread_cond_wait(&mark_cond, &mark_lock);
+
+		// nothing queued and nothing being read, or an error
+		if (trees_len == 0 || mark_error) {
+			pthread_mutex_unlock(&mark_lock);
+			break;
+		}
+
+		trees_len--;
+		memcpy(sha1, trees + trees_len * HASH_MAX_LEN, HASH_MAX_LEN);
+
+		pthread_mutex_unlock(&mark_lock);
+
+		ret = mark_tree(sha1);
+
+		pthread_mutex_lock(&mark_lock);
+
+		pending--;
+		if (ret)
+			mark_error = 1;
+
+		if (pending == 0 || mark_error)
+			pthread_cond_broadcast(&mark_cond);
+
+		pthread_mutex_unlock(&mark_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * The tree itself is marked already (by whoever queued it)
+ */
+static int mark_tree(unsigned char *sha1)
+{
+	int ret = 0;
+	struct tree tree;
+	struct tree_entry *entry = NULL;
+	int marked = 0;
+
+	if (read_tree_file(sha1, &tree))
+		return mark_failed(sha1);
+
+	for (int i=0;i<tree.entries_len && !ret;i++) {
+		entry = tree.entries[i];
+
+		marked = mark_object(entry->sha1, sha1);
+		if (marked < 0)
+			ret = -1;
+		else if (marked == 0)
+			continue;
+		else if (S_ISDIR(entry->st_mode))
+			ret = push_tree(entry->sha1);
+		else
+			ret = mark_chunks(entry->sha1);
+	}
+
+	free_tree_entries(&tree);
+	return ret;
+}
+
+static int mark_chunks(unsigned char *sha1)
+{
+	int ret = 0;
+	unsigned char *chunks_buff = NULL;
+	int num_chunks = 0;
+	unsigned char chunk_sha1[HASH_MAX_LEN];
+
+	if (read_chunks_file(sha1, &chunks_buff, &num_chunks))
+		return mark_failed(sha1);
+
+	for (int i=0;i<num_chunks && !ret;i++) {
+		get_chunk_sha1(chunks_buff, i, chunk_sha1);
+
+		// holes are not stored
+		if (!is_hole_id(chunk_sha1, NULL) && mark_object(chunk_sha1, sha1) < 0)
+			ret = -1;
+	}
+
+	free(chunks_buff);
+	return ret;
+}
+
+/*
+ * Returns 1 if the object got marked now, 0 if it was live already
+ * (or it is missing, with MARK_KEEP_GOING)
+ */
+static int mark_object(unsigned char *sha1, unsigned char *parent_sha1)
+{
+	char sha1_hex[HASH_MAX_HEX+1];
+	char parent_hex[HASH_MAX_HEX+1];
+	struct object_index_entry *entry = find_object_index(mark_idx, sha1);
+	uint32_t pos = 0;
+	uint64_t bit = 0;
+
+	if (!entry) {
+		sha1_to_hex(sha1, sha1_hex);
+
+		if (parent_sha1) {
+			sha1_to_hex(parent_sha1, parent_hex);
+			fprintf(stderr, "\nObject %s (referenced by %s) is missing!\n", sha1_hex, parent_hex);
+		}
+		else
+			fprintf(stderr, "\nSnapshot %s is missing!\n", sha1_hex);
+
+		if (!(mark_flags & MARK_KEEP_GOING))
+			return -1;
+
+		__atomic_fetch_add(&num_broken, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	pos = entry - mark_idx->entries;
+	bit = 1ULL << (pos % 64);
+
+	if (__atomic_fetch_or(&mark_live[pos / 64], bit, __ATOMIC_RELAXED) & bit)
+		return 0;
+
+	__atomic_fetch_add(&num_marked, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * An object which is there but can`t be read. With MARK_KEEP_GOING
+ * it is counted and whatever is below it is skipped.
+ */
+static int mark_failed(unsigned char *sha1)
+{
+	char sha1_hex[HASH_MAX_HEX+1];
+
+	if (!(mark_flags & MARK_KEEP_GOING))
+		return -1;
+
+	sha1_to_hex(sha1, sha1_hex);
+	fprintf(stderr, "\nObject %s can`t be read!\n", sha1_hex);
+
+	__atomic_fetch_add(&num_broken, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int is_live(struct object_index *idx, uint64_t *live, unsigned char *sha1)
+{
+	struct object_index_entry *entry = find_object_index(idx, sha1);
+	uint32_t pos = 0;
+
+	if (!entry)
+		return 0;
+
+	pos = entry - idx->entries;
+	return (live[pos / 64] >> (pos % 64)) & 1;
+}
+
+static int push_tree(unsigned char *sha1)
+{
+	unsigned char *tmp = NULL;
+
+	pthread_mutex_lock(&mark_lock);
+
+	if (trees_len == trees_size) {
+		trees_size = trees_size > 0 ? trees_size * 2 : 1024;
+
+		tmp = realloc(trees, trees_size * HASH_MAX_LEN);
+		if (!tmp) {
+			fprintf(stderr, "Error allocating memory for the trees to mark!\n");
+			pthread_mutex_unlock(&mark_lock);
+			return -ENOMEM;
+		}
+
+		trees = tmp;
+	}
+
+	memcpy(trees + trees_len * HASH_MAX_LEN, sha1, HASH_MAX_LEN);
+	trees_len++;
+	pending++;
+
+	pthread_cond_signal(&mark_cond);
+	pthread_mutex_unlock(&mark_lock);
+
+	return 0;
+}
+
+static int is_cache_entry_live(struct cache_entry *entry, void *arg)
+{
+	struct live_objects *objects = arg;
+	struct chunk_fp *chunks = cache_entry_chunks(entry);
+
+	if (sha1_is_valid(entry->sha1) && !is_live(objects->idx, objects->live, entry->sha1))
+		return 0;
+
+	for (int i=0;i<entry->num_chunks;i++)
+		if (!is_hole_id(chunks[i].sha1, NULL) && !is_live(objects->idx, objects->live, chunks[i].sha1))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Drops the filecache entries of objects which are about to be
+ * removed, their files are read again by the next snapshot
+ */
+static int filter_cache(struct object_index *idx, uint64_t *live)
+{
+	int ret = 0;
+	struct live_objects objects = { idx, live };
+	struct cache *cache = load_cache();
+
+	if (!cache)
+		return -1;
+
+	ret = filter_cache_entries(cache, is_cache_entry_live, &objects);
+
+	if (ret > 0) {
+		printf("Dropping %d filecache entries of removed objects\n", ret);
+		ret = update_cache(cache);
+	}
+
+	free_cache(cache);
+	return ret;
+}
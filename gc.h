@@ -0,0 +1,30 @@
+
+#ifndef GC_H
+#define GC_H
+
+#include <stdint.h>
+
+#include "object-index.h"
+
+#define REPO_LOCK_FILE ".bkp-data/repo.lock"
+
+#define MARK_KEEP_GOING 0x01 // report broken references instead of failing
+
+struct mark_stats {
+	uint32_t live; // objects marked
+	uint32_t broken; // references to missing or unreadable objects
+};
+
+/*
+ * Snapshots and restores share the repository, garbage collection
+ * needs it for itself. Returns the fd of the lock, to be passed to
+ * unlock_repo(), or -1 if it is held by somebody else.
+ */
+int lock_repo(int exclusive);
+void unlock_repo(int fd);
+
+int prune_snapshots();
+int gc_repo();
+int mark_objects(struct object_index *idx, unsigned char *last_sha1, uint64_t *live, int flags, struct mark_stats *stats);
+
+#endif
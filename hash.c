@@ -0,0 +1,478 @@
+/*
+ * Content hashes used for object ids.
+ *
+ * SHA1 (the hash bkp always used) and SHA256 come from OpenSSL, which
+ * picks the SHA instruction set extensions of the CPU when there are
+ * any. BLAKE3 is implemented here, following the reference
+ * implementation: the input is split in 1K chunks, each of them is
+ * compressed on its own and the chaining values of the chunks are
+ * merged in a binary tree kept on a small stack. Since the chunks
+ * are independent, BLAKE3_LANES of them are compressed at once
+ * with vector instructions when the input is large enough.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+#define BLAKE3_CHUNK_START (1 << 0)
+#define BLAKE3_CHUNK_END (1 << 1)
+#define BLAKE3_PARENT (1 << 2)
+#define BLAKE3_ROOT (1 << 3)
+
+#define BLAKE3_LANES 8
+
+typedef uint32_t blake3_vec __attribute__((vector_size(BLAKE3_LANES * sizeof(uint32_t))));
+
+/*
+ * Built for AVX2 as well where available, picked at run time
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define BLAKE3_SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define BLAKE3_SIMD_CLONES
+#endif
+
+static const uint32_t blake3_iv[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const unsigned char blake3_schedule[7][16] = {
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+	{3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+	{10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+	{12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+	{9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+	{11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}
+};
+
+static void blake3_init(struct blake3_hasher *h);
+static void blake3_update(struct blake3_hasher *h, const unsigned char *buff, size_t len);
+static void blake3_final(struct blake3_hasher *h, unsigned char *out);
+static void blake3_compress(const uint32_t cv[8], const unsigned char block[BLAKE3_BLOCK_LEN],
+							uint64_t counter, uint32_t block_len, uint32_t flags, uint32_t out[16]);
+static void blake3_chunk_init(struct blake3_chunk_state *cs, uint64_t chunk_counter);
+static void blake3_chunk_update(struct blake3_chunk_state *cs, const unsigned char *buff, size_t len);
+static void blake3_push_cv(struct blake3_hasher *h, uint32_t cv[8], uint64_t total_chunks);
+static void blake3_parent_cv(const uint32_t left[8], const uint32_t right[8], uint32_t out[8]);
+static void blake3_hash_chunks(const unsigned char *buff, uint64_t counter, uint32_t out[BLAKE3_LANES][8]);
+
+int hash_parse(char *name)
+{
+	if (strcmp(name, "sha1") == 0)
+		return HASH_SHA1;
+	else if (strcmp(name, "sha256") == 0)
+		return HASH_SHA256;
+	else if (strcmp(name, "blake3") == 0)
+		return HASH_BLAKE3;
+
+	return -1;
+}
+
+const char *hash_name(int type)
+{
+	switch (type) {
+		case HASH_SHA1:
+			return "sha1";
+		case HASH_SHA256:
+			return "sha256";
+		case HASH_BLAKE3:
+			return "blake3";
+	}
+
+	return "unknown";
+}
+
+int hash_size(int type)
+{
+	return type == HASH_SHA1 ? 20 : 32;
+}
+
+int hash_init(struct hash_ctx *ctx, int type)
+{
+	const EVP_MD *md = NULL;
+
+	ctx->type = type;
+	ctx->md = NULL;
+
+	if (type == HASH_BLAKE3) {
+		blake3_init(&ctx->b3);
+		return 0;
+	}
+
+	md = type == HASH_SHA256 ? EVP_sha256() : EVP_sha1();
+
+	ctx->md = EVP_MD_CTX_new();
+	if (!ctx->md || !EVP_DigestInit_ex(ctx->md, md, NULL)) {
+		fprintf(stderr, "Error initializing %s!\n", hash_name(type));
+		EVP_MD_CTX_free(ctx->md);
+		ctx->md = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int hash_update(struct hash_ctx *ctx, const void *buff, size_t len)
+{
+	if (ctx->type == HASH_BLAKE3) {
+		blake3_update(&ctx->b3, buff, len);
+		return 0;
+	}
+
+	return EVP_DigestUpdate(ctx->md, buff, len) ? 0 : -1;
+}
+
+/*
+ * Writes HASH_MAX_LEN bytes to out, the digest followed by zeros
+ */
+int hash_final(struct hash_ctx *ctx, unsigned char *out)
+{
+	memset(out, 0, HASH_MAX_LEN);
+
+	if (ctx->type == HASH_BLAKE3) {
+		blake3_final(&ctx->b3, out);
+		return 0;
+	}
+
+	return EVP_DigestFinal_ex(ctx->md, out, NULL) ? 0 : -1;
+}
+
+void hash_end(struct hash_ctx *ctx)
+{
+	EVP_MD_CTX_free(ctx->md);
+	ctx->md = NULL;
+}
+
+int hash_buffer(int type, const void *buff, size_t len, unsigned char *out)
+{
+	int ret = 0;
+	struct hash_ctx ctx;
+
+	if (type == HASH_SHA1) {
+		memset(out, 0, HASH_MAX_LEN);
+		return EVP_Digest(buff, len, out, NULL, EVP_sha1(), NULL) ? 0 : -1;
+	}
+
+	ret = hash_init(&ctx, type);
+	if (!ret)
+		ret = hash_update(&ctx, buff, len);
+	if (!ret)
+		ret = hash_final(&ctx, out);
+
+	hash_end(&ctx);
+	return ret;
+}
+
+static inline uint32_t rotr32(uint32_t w, int c)
+{
+	return (w >> c) | (w << (32 - c));
+}
+
+static inline uint32_t load32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32(unsigned char *p, uint32_t w)
+{
+	p[0] = w;
+	p[1] = w >> 8;
+	p[2] = w >> 16;
+	p[3] = w >> 24;
+}
+
+#define G(a, b, c, d, x, y) do { \
+	s[a] = s[a] + s[b] + (x); s[d] = rotr32(s[d] ^ s[a], 16); \
+	s[c] = s[c] + s[d];       s[b] = rotr32(s[b] ^ s[c], 12); \
+	s[a] = s[a] + s[b] + (y); s[d] = rotr32(s[d] ^ s[a], 8); \
+	s[c] = s[c] + s[d];       s[b] = rotr32(s[b] ^ s[c], 7); \
+} while (0)
+
+static void blake3_compress(const uint32_t cv[8], const unsigned char block[BLAKE3_BLOCK_LEN],
+							uint64_t counter, uint32_t block_len, uint32_t flags, uint32_t out[16])
+{
+	uint32_t m[16];
+	uint32_t s[16];
+
+	for (int i=0;i<16;i++)
+		m[i] = load32(block + i * 4);
+
+	memcpy(s, cv, 8 * sizeof(uint32_t));
+	memcpy(s + 8, blake3_iv, 4 * sizeof(uint32_t));
+	s[12] = (uint32_t)counter;
+	s[13] = (uint32_t)(counter >> 32);
+	s[14] = block_len;
+	s[15] = flags;
+
+	for (int r=0;r<7;r++) {
+		const unsigned char *sc = blake3_schedule[r];
+
+		G(0, 4, 8, 12, m[sc[0]], m[sc[1]]);
+		G(1, 5, 9, 13, m[sc[2]], m[sc[3]]);
+		G(2, 6, 10, 14, m[sc[4]], m[sc[5]]);
+		G(3, 7, 11, 15, m[sc[6]], m[sc[7]]);
+
+		G(0, 5, 10, 15, m[sc[8]], m[sc[9]]);
+		G(1, 6, 11, 12, m[sc[10]], m[sc[11]]);
+		G(2, 7, 8, 13, m[sc[12]], m[sc[13]]);
+		G(3, 4, 9, 14, m[sc[14]], m[sc[15]]);
+	}
+
+	for (int i=0;i<8;i++) {
+		out[i] = s[i] ^ s[i + 8];
+		out[i + 8] = s[i + 8] ^ cv[i];
+	}
+}
+
+static void blake3_chunk_init(struct blake3_chunk_state *cs, uint64_t chunk_counter)
+{
+	memcpy(cs->cv, blake3_iv, sizeof(cs->cv));
+	cs->chunk_counter = chunk_counter;
+	memset(cs->block, 0, sizeof(cs->block));
+	cs->block_len = 0;
+	cs->blocks_compressed = 0;
+}
+
+static inline int blake3_chunk_len(struct blake3_chunk_state *cs)
+{
+	return cs->blocks_compressed * BLAKE3_BLOCK_LEN + cs->block_len;
+}
+
+static inline uint32_t blake3_chunk_flags(struct blake3_chunk_state *cs)
+{
+	return cs->blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0;
+}
+
+/*
+ * The last block of a chunk is only compressed once it is known
+ * to be the last one, which is why a full block is kept buffered
+ */
+static void blake3_chunk_update(struct blake3_chunk_state *cs, const unsigned char *buff, size_t len)
+{
+	uint32_t out[16];
+
+	while (len > 0) {
+		size_t take = 0;
+
+		if (cs->block_len == BLAKE3_BLOCK_LEN) {
+			blake3_compress(cs->cv, cs->block, cs->chunk_counter, BLAKE3_BLOCK_LEN,
+							blake3_chunk_flags(cs), out);
+			memcpy(cs->cv, out, sizeof(cs->cv));
+			cs->blocks_compressed++;
+			cs->block_len = 0;
+			memset(cs->block, 0, sizeof(cs->block));
+		}
+
+		take = BLAKE3_BLOCK_LEN - cs->block_len;
+		if (take > len)
+			take = len;
+
+		memcpy(cs->block + cs->block_len, buff, take);
+		cs->block_len += take;
+		buff += take;
+		len -= take;
+	}
+}
+
+static void blake3_parent_cv(const uint32_t left[8], const uint32_t right[8], uint32_t out[8])
+{
+	unsigned char block[BLAKE3_BLOCK_LEN];
+	uint32_t tmp[16];
+
+	for (int i=0;i<8;i++) {
+		store32(block + i * 4, left[i]);
+		store32(block + 32 + i * 4, right[i]);
+	}
+
+	blake3_compress(blake3_iv, block, 0, BLAKE3_BLOCK_LEN, BLAKE3_PARENT, tmp);
+	memcpy(out, tmp, 8 * sizeof(uint32_t));
+}
+
+/*
+ * Every completed subtree is merged with its left neighbour, so
+ * the stack holds one chaining value per set bit of total_chunks
+ */
+static void blake3_push_cv(struct blake3_hasher *h, uint32_t cv[8], uint64_t total_chunks)
+{
+	while ((total_chunks & 1) == 0) {
+		h->cv_stack_len--;
+		blake3_parent_cv(h->cv_stack[h->cv_stack_len], cv, cv);
+		total_chunks >>= 1;
+	}
+
+	memcpy(h->cv_stack[h->cv_stack_len++], cv, 8 * sizeof(uint32_t));
+}
+
+static void blake3_init(struct blake3_hasher *h)
+{
+	blake3_chunk_init(&h->chunk, 0);
+	h->cv_stack_len = 0;
+}
+
+static void blake3_update(struct blake3_hasher *h, const unsigned char *buff, size_t len)
+{
+	uint32_t out[16];
+	uint32_t cvs[BLAKE3_LANES][8];
+
+	while (len > 0) {
+		size_t take = 0;
+
+		/*
+		 * Whole chunks which are known not to be the last one (the
+		 * root) are compressed BLAKE3_LANES at a time
+		 */
+		if (blake3_chunk_len(&h->chunk) == 0 && len > BLAKE3_LANES * BLAKE3_CHUNK_LEN) {
+			uint64_t counter = h->chunk.chunk_counter;
+
+			blake3_hash_chunks(buff, counter, cvs);
+
+			for (int i=0;i<BLAKE3_LANES;i++)
+				blake3_push_cv(h, cvs[i], counter + i + 1);
+
+			blake3_chunk_init(&h->chunk, counter + BLAKE3_LANES);
+			buff += BLAKE3_LANES * BLAKE3_CHUNK_LEN;
+			len -= BLAKE3_LANES * BLAKE3_CHUNK_LEN;
+			continue;
+		}
+
+		if (blake3_chunk_len(&h->chunk) == BLAKE3_CHUNK_LEN) {
+			struct blake3_chunk_state *cs = &h->chunk;
+			uint64_t total_chunks = cs->chunk_counter + 1;
+
+			blake3_compress(cs->cv, cs->block, cs->chunk_counter, cs->block_len,
+							blake3_chunk_flags(cs) | BLAKE3_CHUNK_END, out);
+			blake3_push_cv(h, out, total_chunks);
+			blake3_chunk_init(cs, total_chunks);
+		}
+
+		take = BLAKE3_CHUNK_LEN - blake3_chunk_len(&h->chunk);
+		if (take > len)
+			take = len;
+
+		blake3_chunk_update(&h->chunk, buff, take);
+		buff += take;
+		len -= take;
+	}
+}
+
+/*
+ * Only the root node is compressed with BLAKE3_ROOT, so the
+ * pending chunk and the stacked subtrees are merged first
+ */
+static void blake3_final(struct blake3_hasher *h, unsigned char *out)
+{
+	struct blake3_chunk_state *cs = &h->chunk;
+	unsigned char block[BLAKE3_BLOCK_LEN];
+	uint32_t cv[8];
+	uint32_t tmp[16];
+	uint64_t counter = cs->chunk_counter;
+	uint32_t block_len = cs->block_len;
+	uint32_t flags = blake3_chunk_flags(cs) | BLAKE3_CHUNK_END;
+	int remaining = h->cv_stack_len;
+
+	memcpy(cv, cs->cv, sizeof(cv));
+	memcpy(block, cs->block, sizeof(block));
+
+	while (remaining > 0) {
+		remaining--;
+
+		blake3_compress(cv, block, counter, block_len, flags, tmp);
+
+		for (int i=0;i<8;i++) {
+			store32(block + i * 4, h->cv_stack[remaining][i]);
+			store32(block + 32 + i * 4, tmp[i]);
+		}
+
+		memcpy(cv, blake3_iv, sizeof(cv));
+		counter = 0;
+		block_len = BLAKE3_BLOCK_LEN;
+		flags = BLAKE3_PARENT;
+	}
+
+	blake3_compress(cv, block, counter, block_len, flags | BLAKE3_ROOT, tmp);
+
+	for (int i=0;i<8;i++)
+		store32(out + i * 4, tmp[i]);
+}
+
+#define GV(a, b, c, d, x, y) do { \
+	v[a] = v[a] + v[b] + (x); v[d] = v[d] ^ v[a]; v[d] = (v[d] >> 16) | (v[d] << 16); \
+	v[c] = v[c] + v[d];       v[b] = v[b] ^ v[c]; v[b] = (v[b] >> 12) | (v[b] << 20); \
+	v[a] = v[a] + v[b] + (y); v[d] = v[d] ^ v[a]; v[d] = (v[d] >> 8) | (v[d] << 24); \
+	v[c] = v[c] + v[d];       v[b] = v[b] ^ v[c]; v[b] = (v[b] >> 7) | (v[b] << 25); \
+} while (0)
+
+/*
+ * Chaining values of BLAKE3_LANES consecutive whole chunks, lane i
+ * of every vector belonging to the chunk at buff + i * BLAKE3_CHUNK_LEN
+ */
+BLAKE3_SIMD_CLONES
+static void blake3_hash_chunks(const unsigned char *buff, uint64_t counter, uint32_t out[BLAKE3_LANES][8])
+{
+	blake3_vec cv[8];
+	blake3_vec m[16];
+	blake3_vec v[16];
+	blake3_vec counter_lo, counter_hi;
+
+	for (int i=0;i<8;i++)
+		for (int l=0;l<BLAKE3_LANES;l++)
+			cv[i][l] = blake3_iv[i];
+
+	for (int l=0;l<BLAKE3_LANES;l++) {
+		counter_lo[l] = (uint32_t)(counter + l);
+		counter_hi[l] = (uint32_t)((counter + l) >> 32);
+	}
+
+	for (int b=0;b<BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN;b++) {
+		uint32_t flags = 0;
+
+		if (b == 0)
+			flags |= BLAKE3_CHUNK_START;
+		if (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1)
+			flags |= BLAKE3_CHUNK_END;
+
+		for (int i=0;i<16;i++)
+			for (int l=0;l<BLAKE3_LANES;l++)
+				m[i][l] = load32(buff + l * BLAKE3_CHUNK_LEN + b * BLAKE3_BLOCK_LEN + i * 4);
+
+		for (int i=0;i<8;i++)
+			v[i] = cv[i];
+
+		for (int l=0;l<BLAKE3_LANES;l++) {
+			for (int i=0;i<4;i++)
+				v[8 + i][l] = blake3_iv[i];
+
+			v[14][l] = BLAKE3_BLOCK_LEN;
+			v[15][l] = flags;
+		}
+
+		v[12] = counter_lo;
+		v[13] = counter_hi;
+
+		for (int r=0;r<7;r++) {
+			const unsigned char *sc = blake3_schedule[r];
+
+			GV(0, 4, 8, 12, m[sc[0]], m[sc[1]]);
+			GV(1, 5, 9, 13, m[sc[2]], m[sc[3]]);
+			GV(2, 6, 10, 14, m[sc[4]], m[sc[5]]);
+			GV(3, 7, 11, 15, m[sc[6]], m[sc[7]]);
+
+			GV(0, 5, 10, 15, m[sc[8]], m[sc[9]]);
+			GV(1, 6, 11, 12, m[sc[10]], m[sc[11]]);
+			GV(2, 7, 8, 13, m[sc[12]], m[sc[13]]);
+			GV(3, 4, 9, 14, m[sc[14]], m[sc[15]]);
+		}
+
+		for (int i=0;i<8;i++)
+			cv[i] = v[i] ^ v[i + 8];
+	}
+
+	for (int l=0;l<BLAKE3_LANES;l++)
+		for (int i=0;i<8;i++)
+			out[l][i] = cv[i][l];
+}
@@ -0,0 +1,56 @@
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+enum hash_type {
+	HASH_SHA1=1,
+	HASH_SHA256,
+	HASH_BLAKE3
+};
+
+/*
+ * Object ids are kept in HASH_MAX_LEN sized buffers, whatever
+ * the hash of the repository is. Shorter ids are zero padded.
+ */
+#define HASH_MAX_LEN 32
+#define HASH_MAX_HEX (HASH_MAX_LEN * 2)
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+struct blake3_chunk_state {
+	uint32_t cv[8];
+	uint64_t chunk_counter;
+	unsigned char block[BLAKE3_BLOCK_LEN];
+	int block_len;
+	int blocks_compressed;
+};
+
+struct blake3_hasher {
+	struct blake3_chunk_state chunk;
+	uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+	int cv_stack_len;
+};
+
+struct hash_ctx {
+	int type;
+	EVP_MD_CTX *md; // SHA1 and SHA256
+	struct blake3_hasher b3;
+};
+
+int hash_parse(char *name);
+const char *hash_name(int type);
+int hash_size(int type);
+
+int hash_init(struct hash_ctx *ctx, int type);
+int hash_update(struct hash_ctx *ctx, const void *buff, size_t len);
+int hash_final(struct hash_ctx *ctx, unsigned char *out);
+void hash_end(struct hash_ctx *ctx);
+int hash_buffer(int type, const void *buff, size_t len, unsigned char *out);
+
+#endif
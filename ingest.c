@@ -0,0 +1,689 @@
+
+/*
+ * Staged ingest pipeline used to back up file contents:
+ *
+ *   reader threads  - read the files and split them with the chunker
+ *   worker threads  - hash the chunks and stream the new ones,
+ *                     compressed, into their own pack file
+ *
+ * The stages are connected by bounded queues, so the amount of
+ * chunk data in flight is limited no matter how fast the readers are.
+ * Every chunk remembers its index inside the file, which keeps the
+ * order of the resulting "chunks" object deterministic regardless
+ * of the number of threads.
+ *
+ * When a modified file is backed up again, the workers fingerprint
+ * every chunk and reuse the blob of the previous version when the
+ * fingerprint is known, skipping compression and storing entirely.
+ *
+ * Chunks of zeros are not stored (in REPO_FORMAT_V3 repositories),
+ * they get hole markers in the chunks object. The holes of sparse
+ * files are not even read, the readers skip them with SEEK_DATA and
+ * fill in the zeros themselves.
+ */
+
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ingest.h"
+#include "queue.h"
+#include "file.h"
+#include "sha1-file.h"
+#include "config.h"
+
+struct ingest_job {
+	char *path;
+	off_t size;
+	int sparse; // has holes, they are looked up while reading
+	struct ingest_result *result;
+	struct chunk_fp *chunks;
+	int chunks_cap;
+	int num_chunks;
+	struct cache_entry *prev; // previous version of the file, if any
+	struct chunk_fp **prev_sorted; // chunks of prev sorted by fingerprint
+	int pending; // chunks in flight + 1 reference held by the reader
+	int error;
+	pthread_mutex_t lock;
+	struct ingest_batch *batch;
+};
+
+struct ingest_chunk {
+	struct ingest_job *job;
+	int idx;
+	char *buff;
+	int len;
+	int raw_len;
+	unsigned char fp[HASH_MAX_LEN];
+	unsigned char sha1[HASH_MAX_LEN];
+};
+
+struct ingest_stage {
+	pthread_t *threads;
+	int num_threads;
+};
+
+static struct queue files_queue;
+static struct queue chunks_queue;
+
+static struct chunker_params chunker;
+
+struct ingest_stats ingest_stats;
+
+static struct ingest_stage readers;
+static struct ingest_stage workers;
+
+static int start_stage(struct ingest_stage *stage, int num_threads, void *(*fn)(void *));
+static void join_stage(struct ingest_stage *stage);
+static void *reader_thread(void *arg);
+static void *worker_thread(void *arg);
+static void read_job(struct ingest_job *job);
+static int read_chunk(int fd, char *buff, int size);
+static int read_sparse_chunk(int fd, char *buff, int size, off_t file_size);
+static int sort_prev_chunks(struct ingest_job *job);
+static int cmp_chunk_fp(const void *a, const void *b);
+static struct chunk_fp *find_prev_chunk(struct ingest_job *job, unsigned char *fp, int size);
+static int grow_chunks(struct ingest_job *job, int num_chunks);
+static int reserve_chunk(struct ingest_job *job, int idx);
+static void record_chunk(struct ingest_chunk *chunk);
+static void fail_job(struct ingest_job *job);
+static void put_job(struct ingest_job *job);
+static void finish_job(struct ingest_job *job);
+static void batch_done(struct ingest_batch *batch, int error);
+
+int ingest_start(int threads, struct chunker_params *params)
+{
+	int ret = 0;
+	int io_threads = threads / 4 > 0 ? threads / 4 : 1;
+
+	if (threads < 1)
+		threads = 1;
+
+	chunker = *params;
+	memset(&ingest_stats, 0, sizeof(ingest_stats));
+
+	ret = queue_init(&files_queue, threads * 4);
+	if (!ret)
+		ret = queue_init(&chunks_queue, threads);
+	if (ret)
+		return ret;
+
+	ret = start_stage(&workers, threads, worker_thread);
+	if (!ret)
+		ret = start_stage(&readers, io_threads, reader_thread);
+
+	if (ret) {
+		ingest_stop();
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Drains the pipeline stage by stage and stops all threads
+ */
+int ingest_stop()
+{
+	queue_close(&files_queue);
+	join_stage(&readers);
+
+	queue_close(&chunks_queue);
+	join_stage(&workers);
+
+	queue_destroy(&files_queue);
+	queue_destroy(&chunks_queue);
+
+	return 0;
+}
+
+void ingest_batch_init(struct ingest_batch *batch)
+{
+	batch->pending = 0;
+	batch->error = 0;
+	pthread_mutex_init(&batch->lock, NULL);
+	pthread_cond_init(&batch->done, NULL);
+}
+
+/*
+ * Waits for all files of the batch to be stored. Returns
+ * non-zero if any of them failed. Waiting on an already
+ * drained batch returns immediately.
+ */
+int ingest_batch_wait(struct ingest_batch *batch)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&batch->lock);
+	while (batch->pending > 0)
+		pthread_cond_wait(&batch->done, &batch->lock);
+
+	ret = batch->error;
+	pthread_mutex_unlock(&batch->lock);
+
+	return ret;
+}
+
+/*
+ * Queues a file for backup. path, prev and result must stay valid 
+ * until the batch completes. prev is the cache entry of the previous
+ * version of a modified file (NULL for new files), its chunks are 
+ * reused where the content did not change.
+ */
+int ingest_file(struct ingest_batch *batch, char *path, struct stat *sb, struct cache_entry *prev, struct ingest_result *result)
+{
+	struct ingest_job *job = malloc(sizeof(struct ingest_job));
+
+	if (!job) {
+		fprintf(stderr, "Error allocating memory for ingest job!\n");
+		return -ENOMEM;
+	}
+
+	job->path = path;
+	job->size = sb->st_size;
+	job->sparse = repo_cfg.format >= REPO_FORMAT_V3 && (off_t)sb->st_blocks * 512 < sb->st_size;
+	job->result = result;
+	job->chunks = NULL;
+	job->chunks_cap = 0;
+	job->num_chunks = 0;
+	job->prev = prev && prev->num_chunks > 0 ? prev : NULL;
+	job->prev_sorted = NULL;
+
+	result->chunks = NULL;
+	result->num_chunks = 0;
+	job->pending = 1;
+	job->error = 0;
+	job->batch = batch;
+	pthread_mutex_init(&job->lock, NULL);
+
+	pthread_mutex_lock(&batch->lock);
+	batch->pending++;
+	pthread_mutex_unlock(&batch->lock);
+
+	if (queue_push(&files_queue, job)) {
+		fail_job(job);
+		put_job(job);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int start_stage(struct ingest_stage *stage, int num_threads, void *(*fn)(void *))
+{
+	stage->num_threads = 0;
+	stage->threads = calloc(num_threads, sizeof(pthread_t));
+
+	if (!stage->threads) {
+		fprintf(stderr, "Error allocating memory for ingest threads!\n");
+		return -ENOMEM;
+	}
+
+	for (int i=0;i<num_threads;i++) {
+		if (pthread_create(&stage->threads[i], NULL, fn, NULL)) {
+			fprintf(stderr, "Error starting ingest thread!\n");
+			return -1;
+		}
+		stage->num_threads++;
+	}
+
+	return 0;
+}
+
+static void join_stage(struct ingest_stage *stage)
+{
+	for (int i=0;i<stage->num_threads;i++)
+		pthread_join(stage->threads[i], NULL);
+
+	free(stage->threads);
+	stage->threads = NULL;
+	stage->num_threads = 0;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct ingest_job *job = NULL;
+
+	(void)arg;
+
+	while ((job = queue_pop(&files_queue)) != NULL)
+		read_job(job);
+
+	return NULL;
+}
+
+static void read_job(struct ingest_job *job)
+{
+	int fd = open(job->path, O_RDONLY);
+	int idx = 0;
+	int bytes = 0;
+	int filled = 0;
+	int cut = 0;
+	char *buff = NULL;
+	char *next_buff = NULL;
+	struct ingest_chunk *chunk = NULL;
+
+	if (fd < 0) {
+		fprintf(stderr, "Error opening file %s for backup (errno: %d)\n", job->path, errno);
+		fail_job(job);
+		put_job(job);
+		return;
+	}
+
+	__atomic_add_fetch(&ingest_stats.files, 1, __ATOMIC_RELAXED);
+
+	if (job->prev && sort_prev_chunks(job)) {
+		fprintf(stderr, "Error allocating memory for read buffer while backing up file!\n");
+		fail_job(job);
+		goto end;
+	}
+
+	while (1) {
+		if (!buff)
+			buff = malloc(chunker.max_size);
+
+		chunk = malloc(sizeof(struct ingest_chunk));
+
+		if (!chunk || !buff) {
+			fprintf(stderr, "Error allocating memory for read buffer while backing up file!\n");
+			fail_job(job);
+			break;
+		}
+
+		/*
+		 * The buffer always gets filled up to max_size (unless EOF
+		 * is reached), so the chunker sees the same data no matter
+		 * how the bytes arrived
+		 */
+		if (job->sparse)
+			bytes = read_sparse_chunk(fd, buff + filled, chunker.max_size - filled, job->size);
+		else
+			bytes = read_chunk(fd, buff + filled, chunker.max_size - filled);
+
+		if (bytes < 0) {
+			fprintf(stderr, "Error reading file %s for backup (errno: %d)\n", job->path, errno);
+			fail_job(job);
+			break;
+		}
+
+		filled += bytes;
+		if (filled == 0)
+			break;
+
+		cut = chunker_next_cut(&chunker, (unsigned char *)buff, filled);
+
+		/*
+		 * Bytes after the cut point are the beginning of the
+		 * next chunk
+		 */
+		if (cut < filled) {
+			next_buff = malloc(chunker.max_size);
+			if (!next_buff) {
+				fprintf(stderr, "Error allocating memory for read buffer while backing up file!\n");
+				fail_job(job);
+				break;
+			}
+
+			memcpy(next_buff, buff + cut, filled - cut);
+		}
+
+		if (reserve_chunk(job, idx)) {
+			free(next_buff);
+			next_buff = NULL;
+			fail_job(job);
+			break;
+		}
+
+		chunk->job = job;
+		chunk->idx = idx++;
+		chunk->buff = buff;
+		chunk->len = cut;
+		chunk->raw_len = cut;
+
+		// on failure chunk and buff are freed after the loop
+		if (queue_push(&chunks_queue, chunk)) {
+			free(next_buff);
+			fail_job(job);
+			put_job(job); // the reference reserve_chunk() took
+			break;
+		}
+
+		chunk = NULL;
+
+		buff = next_buff;
+		next_buff = NULL;
+		filled -= cut;
+	}
+
+	if (chunk)
+		free(chunk);
+
+end:
+	if (buff)
+		free(buff);
+
+	close(fd);
+
+	pthread_mutex_lock(&job->lock);
+	job->num_chunks = idx;
+	pthread_mutex_unlock(&job->lock);
+
+	put_job(job);
+}
+
+/*
+ * Fills buff completely unless EOF is reached
+ */
+static int read_chunk(int fd, char *buff, int size)
+{
+	int offset = 0;
+	int bytes = 0;
+
+	while (offset < size) {
+		bytes = read(fd, buff + offset, size - offset);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (bytes == 0)
+			break;
+
+		offset += bytes;
+	}
+
+	return offset;
+}
+
+/*
+ * Like read_chunk(), but the parts of buff which fall into holes are
+ * zeroed instead of read. The chunker sees the same data either way.
+ */
+static int read_sparse_chunk(int fd, char *buff, int size, off_t file_size)
+{
+	int offset = 0;
+	int bytes = 0;
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+	off_t data = 0;
+
+	if (pos < 0)
+		return read_chunk(fd, buff, size);
+
+	while (offset < size && pos < file_size) {
+		data = lseek(fd, pos, SEEK_DATA);
+		if (data < 0) {
+			// ENXIO: only a hole up to the end of the file
+			if (errno != ENXIO) {
+				lseek(fd, pos, SEEK_SET);
+				bytes = read_chunk(fd, buff + offset, size - offset);
+				return bytes < 0 ? bytes : offset + bytes;
+			}
+
+			data = file_size;
+		}
+
+		if (data > pos) {
+			bytes = data - pos < size - offset ? data - pos : size - offset;
+			memset(buff + offset, 0, bytes);
+			offset += bytes;
+			pos += bytes;
+
+			if (lseek(fd, pos, SEEK_SET) != pos)
+				return -1;
+
+			continue;
+		}
+
+		// data up to the next hole (or the end of the buffer)
+		data = lseek(fd, pos, SEEK_HOLE);
+		if (data < 0)
+			data = file_size;
+
+		if (lseek(fd, pos, SEEK_SET) != pos)
+			return -1;
+
+		bytes = read_chunk(fd, buff + offset, data - pos < size - offset ? data - pos : size - offset);
+		if (bytes < 0)
+			return -1;
+
+		if (bytes == 0)
+			break;
+
+		offset += bytes;
+		pos += bytes;
+	}
+
+	return offset;
+}
+
+static int sort_prev_chunks(struct ingest_job *job)
+{
+	struct chunk_fp *prev_chunks = cache_entry_chunks(job->prev);
+	int num_chunks = job->prev->num_chunks;
+
+	job->prev_sorted = malloc(num_chunks * sizeof(struct chunk_fp *));
+	if (!job->prev_sorted)
+		return -ENOMEM;
+
+	for (int i=0;i<num_chunks;i++)
+		job->prev_sorted[i] = &prev_chunks[i];
+
+	qsort(job->prev_sorted, num_chunks, sizeof(struct chunk_fp *), cmp_chunk_fp);
+	return 0;
+}
+
+static int cmp_chunk_fp(const void *a, const void *b)
+{
+	const struct chunk_fp *c1 = *(const struct chunk_fp **)a;
+	const struct chunk_fp *c2 = *(const struct chunk_fp **)b;
+
+	return memcmp(c1->fp, c2->fp, HASH_MAX_LEN);
+}
+
+static struct chunk_fp *find_prev_chunk(struct ingest_job *job, unsigned char *fp, int size)
+{
+	int low = 0, high = 0;
+
+	if (!job->prev_sorted)
+		return NULL;
+
+	high = job->prev->num_chunks - 1;
+
+	while (low <= high) {
+		int mid = low + (high - low) / 2;
+		int cmp = memcmp(job->prev_sorted[mid]->fp, fp, HASH_MAX_LEN);
+
+		if (cmp == 0)
+			return (int)job->prev_sorted[mid]->size == size ? job->prev_sorted[mid] : NULL;
+		else if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return NULL;
+}
+
+static int grow_chunks(struct ingest_job *job, int num_chunks)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&job->lock);
+
+	if (num_chunks > job->chunks_cap) {
+		int cap = job->chunks_cap > 0 ? job->chunks_cap * 2 : (job->size / chunker.avg_size) + 1;
+		struct chunk_fp *chunks = NULL;
+
+		if (cap < num_chunks)
+			cap = num_chunks;
+
+		chunks = realloc(job->chunks, cap * sizeof(struct chunk_fp));
+		if (!chunks) {
+			fprintf(stderr, "Error allocating memory for sha1 chunks buffer!\n");
+			ret = -ENOMEM;
+		}
+		else {
+			job->chunks = chunks;
+			job->chunks_cap = cap;
+		}
+	}
+
+	pthread_mutex_unlock(&job->lock);
+	return ret;
+}
+
+/*
+ * Makes room for chunk idx in the job`s chunk list and takes a
+ * reference on the job for the chunk in flight
+ */
+static int reserve_chunk(struct ingest_job *job, int idx)
+{
+	int ret = grow_chunks(job, idx + 1);
+
+	if (ret)
+		return ret;
+
+	pthread_mutex_lock(&job->lock);
+	job->pending++;
+	pthread_mutex_unlock(&job->lock);
+
+	return 0;
+}
+
+static void record_chunk(struct ingest_chunk *chunk)
+{
+	struct ingest_job *job = chunk->job;
+	struct chunk_fp *c = NULL;
+
+	pthread_mutex_lock(&job->lock);
+
+	c = &job->chunks[chunk->idx];
+	c->size = chunk->raw_len;
+	memcpy(c->fp, chunk->fp, HASH_MAX_LEN);
+	memcpy(c->sha1, chunk->sha1, HASH_MAX_LEN);
+
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct ingest_chunk *chunk = NULL;
+
+	(void)arg;
+
+	while ((chunk = queue_pop(&chunks_queue)) != NULL) {
+		struct chunk_fp *prev = NULL;
+		int ret = 0;
+
+		if (repo_cfg.format >= REPO_FORMAT_V3 && is_zero_buffer(chunk->buff, chunk->len)) {
+			hole_id(chunk->len, chunk->sha1);
+			memcpy(chunk->fp, chunk->sha1, HASH_MAX_LEN);
+			goto done;
+		}
+
+		/*
+		 * Since REPO_FORMAT_V2 the blob id doubles as fingerprint,
+		 * the content is only hashed once
+		 */
+		if (repo_cfg.format >= REPO_FORMAT_V2) {
+			ret = hash_blob(chunk->buff, chunk->len, chunk->sha1);
+			memcpy(chunk->fp, chunk->sha1, HASH_MAX_LEN);
+		}
+		else
+			ret = hash_buffer(repo_cfg.hash, chunk->buff, chunk->len, chunk->fp);
+
+		// unchanged chunk of a modified file
+		prev = ret ? NULL : find_prev_chunk(chunk->job, chunk->fp, chunk->len);
+		if (prev)
+			memcpy(chunk->sha1, prev->sha1, HASH_MAX_LEN);
+
+		// already stored chunk, no need to compress it
+		if (ret || prev || (repo_cfg.format >= REPO_FORMAT_V2 && has_sha1_file(chunk->sha1)))
+			goto done;
+
+		ret = write_blob(chunk->sha1, chunk->buff, chunk->len);
+		if (!ret)
+			__atomic_add_fetch(&ingest_stats.new_bytes, chunk->len, __ATOMIC_RELAXED);
+
+done:
+		if (ret)
+			fail_job(chunk->job);
+		else
+			record_chunk(chunk);
+
+		free(chunk->buff);
+		put_job(chunk->job);
+		free(chunk);
+	}
+
+	return NULL;
+}
+
+static void fail_job(struct ingest_job *job)
+{
+	pthread_mutex_lock(&job->lock);
+	job->error = -1;
+	pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Drops a reference on the job. Whoever drops the last one
+ * (the reader or the worker storing the last chunk) writes
+ * the "chunks" object of the file.
+ */
+static void put_job(struct ingest_job *job)
+{
+	int last = 0;
+
+	pthread_mutex_lock(&job->lock);
+	last = --job->pending == 0;
+	pthread_mutex_unlock(&job->lock);
+
+	if (last)
+		finish_job(job);
+}
+
+static void finish_job(struct ingest_job *job)
+{
+	int ret = job->error;
+
+	if (ret)
+		goto end;
+
+	ret = write_chunks_file(job->result->sha1, job->chunks, job->num_chunks);
+	if (ret)
+		goto end;
+
+	job->result->chunks = job->chunks;
+	job->result->num_chunks = job->num_chunks;
+	job->chunks = NULL;
+
+end:
+	batch_done(job->batch, ret);
+
+	pthread_mutex_destroy(&job->lock);
+	free(job->chunks);
+	free(job->prev_sorted);
+	free(job);
+}
+
+static void batch_done(struct ingest_batch *batch, int error)
+{
+	pthread_mutex_lock(&batch->lock);
+
+	if (error)
+		batch->error = error;
+
+	if (--batch->pending == 0)
+		pthread_cond_broadcast(&batch->done);
+
+	pthread_mutex_unlock(&batch->lock);
+}
@@ -0,0 +1,54 @@
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "chunker.h"
+#include "cache.h"
+
+/*
+ * A group of files submitted to the ingest pipeline whose
+ * completion is awaited together (for example all files
+ * of one directory, before its tree object is written)
+ */
+struct ingest_batch {
+	int pending;
+	int error;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+/*
+ * Outcome of backing up one file: the sha1 of its "chunks"
+ * object and the fingerprints of its chunks (malloc`d, to be
+ * freed by the caller)
+ */
+struct ingest_result {
+	unsigned char sha1[HASH_MAX_LEN];
+	struct chunk_fp *chunks;
+	int num_chunks;
+};
+
+/*
+ * Counted since ingest_start()
+ */
+struct ingest_stats {
+	uint64_t files; // read and chunked
+	uint64_t new_bytes; // of the chunks stored, before compression
+};
+
+extern struct ingest_stats ingest_stats;
+
+int ingest_start(int threads, struct chunker_params *chunker);
+int ingest_stop();
+
+void ingest_batch_init(struct ingest_batch *batch);
+int ingest_batch_wait(struct ingest_batch *batch);
+
+int ingest_file(struct ingest_batch *batch, char *path, struct stat *sb, struct cache_entry *prev, struct ingest_result *result);
+
+#endif
@@ -17,30 +17,71 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <getopt.h>
-#include <openssl/sha.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <unistd.h>
 
 
+#include "bkp.h"
+#include "config.h"
 #include "snapshot.h"
 #include "restore.h"
 #include "sha1-file.h"
 #include "print-file.h"
+#include "pack.h"
+#include "watch.h"
+#include "diff.h"
+#include "gc.h"
+#include "check.h"
+#include "cat.h"
 
 static struct option cmdline_options[] = {
 	{"create-snapshot",  no_argument,       0, 0},
 	{"snapshots",        no_argument,       0, 0},
+	{"snapshot-at", required_argument, 0, 0},
 	{"restore-snapshot", required_argument, 0, 0},
+	{"paths-file", required_argument, 0, 0},
 	{"show-file", required_argument, 0, 0},
+	{"repack", no_argument, 0, 0},
+	{"upgrade-repo", no_argument, 0, 0},
+	{"watch", no_argument, 0, 0},
+	{"diff", required_argument, 0, 0},
+	{"porcelain", no_argument, 0, 0},
+	{"prune", no_argument, 0, 0},
+	{"gc", no_argument, 0, 0},
+	{"keep-last", required_argument, 0, 0},
+	{"keep-daily", required_argument, 0, 0},
+	{"keep-weekly", required_argument, 0, 0},
+	{"dry-run", no_argument, 0, 0},
+	{"check", no_argument, 0, 0},
+	{"full", no_argument, 0, 0},
+	{"sample", required_argument, 0, 0},
+	{"cat", required_argument, 0, 0},
+	{"offset", required_argument, 0, 0},
+	{"length", required_argument, 0, 0},
+	{"threads", required_argument, 0, 0},
+	{"chunker", required_argument, 0, 0},
+	{"codec", required_argument, 0, 0},
+	{"hash", required_argument, 0, 0},
+	{"no-io-uring", no_argument, 0, 0},
+	{"restore-memory", required_argument, 0, 0},
+	{"restore-cache", required_argument, 0, 0},
+	{"in-place", no_argument, 0, 0},
+	{"delete", no_argument, 0, 0},
 	{"help", no_argument, 0, 'h'},
 	{0, 0, 0, 0}
 };
 
+struct bkp_options bkp_opts;
+
 static int init();
 static void print_help();
 static int handle_cmdline_args(int argc, char **argv);
+static int parse_mem_size(char *str, size_t *size);
+static int run_command(const char *command, char *command_arg, char *paths_file, int argc, char **argv);
 
 int main(int argc, char **argv)
 {
@@ -55,6 +96,15 @@ int main(int argc, char **argv)
 
 static int init()
 {
+	bkp_opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (bkp_opts.threads < 1)
+		bkp_opts.threads = 1;
+
+	bkp_opts.io_uring = 1;
+	bkp_opts.restore_memory = DEFAULT_RESTORE_MEMORY;
+	bkp_opts.restore_cache = DEFAULT_RESTORE_CACHE;
+	bkp_opts.cat_length = CAT_TO_END;
+
 	DIR *dir = opendir(".bkp-data");
 	if (dir) 
 		closedir(dir);
@@ -63,44 +113,129 @@ static int init()
 		mkdir(".bkp-data", 0755);
 	}
 
-	return 0;
+	return load_config();
 }
 
 static int handle_cmdline_args(int argc, char **argv)
 {
 	int opt_idx = 0;
 	int opt = 0;
+	int ret = 0;
+	const char *command = NULL;
+	char *command_arg = NULL;
+	char *paths_file = NULL;
 
+	/*
+	 * Options (like --threads) may come before or after the command,
+	 * so the command is only executed once all of them were parsed
+	 */
 	while ((opt = getopt_long(argc, argv, "h", cmdline_options, &opt_idx)) != -1) {
 		switch(opt) {
 			case 0:
-				if (strcmp(cmdline_options[opt_idx].name, "create-snapshot") == 0) {
-					return create_snapshot();
+				if (strcmp(cmdline_options[opt_idx].name, "threads") == 0) {
+					bkp_opts.threads = atoi(optarg);
+					if (bkp_opts.threads < 1) {
+						printf("Invalid thread count: %s!\n", optarg);
+						return -1;
+					}
+				}
+				else if (strcmp(cmdline_options[opt_idx].name, "chunker") == 0) {
+					if (chunker_parse(optarg, &repo_cfg.chunker)) {
+						printf("Invalid chunker: %s!\n"
+								"Use \"fixed[:SIZE]\" or \"cdc[:MIN:AVG:MAX]\"\n", optarg);
+						return -1;
+					}
+				}
+				else if (strcmp(cmdline_options[opt_idx].name, "codec") == 0) {
+					ret = codec_parse(optarg, &bkp_opts.codec);
+					if (ret == -ENOTSUP)
+						return -1;
+					else if (ret) {
+						printf("Invalid codec: %s!\n"
+								"Use \"zlib[:LEVEL]\", \"zstd[:LEVEL]\", \"lz4[:LEVEL]\" or \"none\"\n", optarg);
+						return -1;
+					}
 				}
-				else if (strcmp(cmdline_options[opt_idx].name, "snapshots") == 0) {
-					int limit = (opt_idx + 1) < argc ? atoi(argv[opt_idx+1]) : 10; 
-					printf("Listing a maximum number of %d created snapshots.\n"
-							"To change the limit use \"bkp --snapshots [LIMIT]\"\n\n", limit);
-					return list_snapshots(limit);
+				else if (strcmp(cmdline_options[opt_idx].name, "no-io-uring") == 0)
+					bkp_opts.io_uring = 0;
+				else if (strcmp(cmdline_options[opt_idx].name, "restore-memory") == 0) {
+					if (parse_mem_size(optarg, &bkp_opts.restore_memory) || bkp_opts.restore_memory == 0) {
+						printf("Invalid memory size: %s!\n"
+								"Use a number of bytes with an optional K, M or G suffix\n", optarg);
+						return -1;
+					}
 				}
-				else if (strcmp(cmdline_options[opt_idx].name, "restore-snapshot") == 0) {
-					if (argc < 4) {
-						printf("Invalid usage of --restore-snapshot!\n"
-								"Command should be: \""
-								"bkp --restore-snapshot [SHA1] [OUTPUT_DIR] [optional: SUB_PATH]\"\n");
+				else if (strcmp(cmdline_options[opt_idx].name, "paths-file") == 0)
+					paths_file = optarg;
+				else if (strcmp(cmdline_options[opt_idx].name, "in-place") == 0)
+					bkp_opts.restore_in_place = 1;
+				else if (strcmp(cmdline_options[opt_idx].name, "delete") == 0)
+					bkp_opts.restore_delete = 1;
+				else if (strcmp(cmdline_options[opt_idx].name, "porcelain") == 0)
+					bkp_opts.porcelain = 1;
+				else if (strcmp(cmdline_options[opt_idx].name, "dry-run") == 0)
+					bkp_opts.dry_run = 1;
+				else if (strcmp(cmdline_options[opt_idx].name, "full") == 0)
+					bkp_opts.check_full = 1;
+				else if (strcmp(cmdline_options[opt_idx].name, "sample") == 0) {
+					bkp_opts.check_sample = atoi(optarg);
+					if (bkp_opts.check_sample < 1 || bkp_opts.check_sample > 100) {
+						printf("Invalid sample percentage: %s!\n", optarg);
 						return -1;
 					}
-					
-					char *sha1_hex = argv[opt_idx];
-					char *out_path = argv[opt_idx+1];
-					char *sub_path = argc > 4 ? argv[opt_idx+2] : NULL;
-					unsigned char sha1[SHA_DIGEST_LENGTH];
-
-					hex_to_sha1(sha1_hex, sha1);
-					return restore_snapshot(sha1, out_path, sub_path);
 				}
-				else if (strcmp(cmdline_options[opt_idx].name, "show-file") == 0) {
-					return print_sha1_file(optarg);
+				else if (strcmp(cmdline_options[opt_idx].name, "offset") == 0 ||
+						strcmp(cmdline_options[opt_idx].name, "length") == 0) {
+					size_t bytes = 0;
+
+					if (parse_mem_size(optarg, &bytes)) {
+						printf("Invalid byte count: %s!\n"
+								"Use a number of bytes with an optional K, M or G suffix\n", optarg);
+						return -1;
+					}
+
+					if (strcmp(cmdline_options[opt_idx].name, "offset") == 0)
+						bkp_opts.cat_offset = bytes;
+					else
+						bkp_opts.cat_length = bytes;
+				}
+				else if (strncmp(cmdline_options[opt_idx].name, "keep-", 5) == 0) {
+					int count = atoi(optarg);
+
+					if (count < 1) {
+						printf("Invalid snapshot count: %s!\n", optarg);
+						return -1;
+					}
+
+					if (strcmp(cmdline_options[opt_idx].name, "keep-last") == 0)
+						bkp_opts.keep_last = count;
+					else if (strcmp(cmdline_options[opt_idx].name, "keep-daily") == 0)
+						bkp_opts.keep_daily = count;
+					else
+						bkp_opts.keep_weekly = count;
+				}
+				else if (strcmp(cmdline_options[opt_idx].name, "restore-cache") == 0) {
+					if (parse_mem_size(optarg, &bkp_opts.restore_cache)) {
+						printf("Invalid memory size: %s!\n"
+								"Use a number of bytes with an optional K, M or G suffix\n", optarg);
+						return -1;
+					}
+				}
+				else if (strcmp(cmdline_options[opt_idx].name, "hash") == 0) {
+					int hash = hash_parse(optarg);
+
+					if (hash < 0) {
+						printf("Invalid hash: %s!\n"
+								"Use \"sha1\", \"sha256\" or \"blake3\"\n", optarg);
+						return -1;
+					}
+
+					if (set_repo_hash(hash))
+						return -1;
+				}
+				else {
+					command = cmdline_options[opt_idx].name;
+					command_arg = optarg;
 				}
 
 			break;
@@ -109,12 +244,190 @@ static int handle_cmdline_args(int argc, char **argv)
 				// fall through
 			case 'h':
 				print_help();
-				break;
+				return 0;
 			default:
 				printf("Invalid command line option!\n");
 		}
 	}
 
+	if (!command)
+		return 0;
+
+	/*
+	 * Commands writing or reading objects share the repository,
+	 * the garbage collector removes objects, so it needs it alone
+	 */
+	if (strcmp(command, "create-snapshot") == 0 || strcmp(command, "restore-snapshot") == 0 ||
+		strcmp(command, "repack") == 0 || strcmp(command, "upgrade-repo") == 0 ||
+		strcmp(command, "check") == 0 || strcmp(command, "cat") == 0 ||
+		strcmp(command, "prune") == 0 || strcmp(command, "gc") == 0) {
+		int exclusive = strcmp(command, "prune") == 0 || strcmp(command, "gc") == 0;
+		int lock_fd = lock_repo(exclusive);
+
+		if (lock_fd < 0)
+			return -1;
+
+		ret = run_command(command, command_arg, paths_file, argc, argv);
+
+		unlock_repo(lock_fd);
+		return ret;
+	}
+
+	return run_command(command, command_arg, paths_file, argc, argv);
+}
+
+static int run_command(const char *command, char *command_arg, char *paths_file, int argc, char **argv)
+{
+	if (strcmp(command, "create-snapshot") == 0) {
+		return create_snapshot();
+	}
+	else if (strcmp(command, "snapshots") == 0) {
+		int limit = optind < argc ? atoi(argv[optind]) : 10; 
+		printf("Listing a maximum number of %d created snapshots.\n"
+				"To change the limit use \"bkp --snapshots [LIMIT]\"\n\n", limit);
+		return list_snapshots(limit);
+	}
+	else if (strcmp(command, "snapshot-at") == 0) {
+		return find_snapshot(command_arg);
+	}
+	else if (strcmp(command, "restore-snapshot") == 0) {
+		if (optind >= argc) {
+			printf("Invalid usage of --restore-snapshot!\n"
+					"Command should be: \""
+					"bkp --restore-snapshot [SHA1] [OUTPUT_DIR] [optional: SUB_PATH...]\"\n");
+			return -1;
+		}
+		
+		char *sha1_hex = command_arg;
+		char *out_path = argv[optind];
+		int num_args = argc - optind - 1;
+		char **sub_paths = NULL;
+		int num_sub_paths = num_args;
+		unsigned char sha1[HASH_MAX_LEN];
+		int ret = 0;
+
+		if (hex_to_sha1(sha1_hex, sha1)) {
+			printf("Invalid snapshot SHA1: %s!\n", sha1_hex);
+			return -1;
+		}
+
+		if (bkp_opts.restore_delete && !bkp_opts.restore_in_place) {
+			printf("--delete can only be used with --in-place!\n");
+			return -1;
+		}
+
+		sub_paths = malloc((num_args > 0 ? num_args : 1) * sizeof(char *));
+		if (!sub_paths) {
+			printf("Error allocating memory for the paths to restore!\n");
+			return -1;
+		}
+
+		memcpy(sub_paths, argv + optind + 1, num_args * sizeof(char *));
+
+		// the paths of the file come after the ones of the command line
+		if (paths_file)
+			ret = read_paths_file(paths_file, &sub_paths, &num_sub_paths);
+
+		if (!ret)
+			ret = restore_snapshot(sha1, out_path, sub_paths, num_sub_paths);
+
+		for (int i=num_args;i<num_sub_paths;i++)
+			free(sub_paths[i]);
+
+		free(sub_paths);
+		return ret;
+	}
+	else if (strcmp(command, "show-file") == 0) {
+		return print_sha1_file(command_arg);
+	}
+	else if (strcmp(command, "repack") == 0) {
+		return repack_objects();
+	}
+	else if (strcmp(command, "upgrade-repo") == 0) {
+		return upgrade_repo();
+	}
+	else if (strcmp(command, "watch") == 0) {
+		return watch_repo();
+	}
+	else if (strcmp(command, "diff") == 0) {
+		unsigned char sha1_a[HASH_MAX_LEN];
+		unsigned char sha1_b[HASH_MAX_LEN];
+
+		if (optind >= argc || argc - optind > 2) {
+			printf("Invalid usage of --diff!\n"
+					"Command should be: \""
+					"bkp --diff [SHA1_A] [SHA1_B] [optional: PATH]\"\n");
+			return -1;
+		}
+
+		if (hex_to_sha1(command_arg, sha1_a)) {
+			printf("Invalid snapshot SHA1: %s!\n", command_arg);
+			return -1;
+		}
+
+		if (hex_to_sha1(argv[optind], sha1_b)) {
+			printf("Invalid snapshot SHA1: %s!\n", argv[optind]);
+			return -1;
+		}
+
+		return diff_snapshots(sha1_a, sha1_b, optind + 1 < argc ? argv[optind + 1] : NULL);
+	}
+	else if (strcmp(command, "cat") == 0) {
+		unsigned char sha1[HASH_MAX_LEN];
+
+		if (optind + 1 != argc) {
+			printf("Invalid usage of --cat!\n"
+					"Command should be: \""
+					"bkp --cat [SHA1] [PATH] [optional: --offset N] [optional: --length M]\"\n");
+			return -1;
+		}
+
+		if (hex_to_sha1(command_arg, sha1)) {
+			printf("Invalid snapshot SHA1: %s!\n", command_arg);
+			return -1;
+		}
+
+		return cat_snapshot_file(sha1, argv[optind], bkp_opts.cat_offset, bkp_opts.cat_length);
+	}
+	else if (strcmp(command, "prune") == 0) {
+		return prune_snapshots();
+	}
+	else if (strcmp(command, "gc") == 0) {
+		return gc_repo();
+	}
+	else if (strcmp(command, "check") == 0) {
+		if (bkp_opts.check_full && bkp_opts.check_sample > 0) {
+			printf("--full and --sample can`t be used together!\n");
+			return -1;
+		}
+
+		return check_repo();
+	}
+
+	return 0;
+}
+
+static int parse_mem_size(char *str, size_t *size)
+{
+	char *end = NULL;
+	long long val = strtoll(str, &end, 10);
+
+	if (end == str || val < 0)
+		return -1;
+
+	if (*end == 'k' || *end == 'K')
+		val *= 1024LL;
+	else if (*end == 'm' || *end == 'M')
+		val *= 1024LL * 1024;
+	else if (*end == 'g' || *end == 'G')
+		val *= 1024LL * 1024 * 1024;
+	else if (*end != '\0')
+		return -1;
+
+	if (*end != '\0' && *(end + 1) != '\0')
+		return -1;
+
+	*size = val;
 	return 0;
 }
 
@@ -126,9 +439,40 @@ static void print_help()
     printf("Options:\n");
     printf("  --create-snapshot                                   Create a new snapshot of the backed up directory\n");
     printf("  --snapshots [LIMIT]                                 Print a list of snapshots done so far\n");
-    printf("  --restore-snapshot [SHA1] [OUTPUT_DIR] [SUB_PATH]   Restores the snapshot with SHA1 to OUTPUT_DIR with the optional possibility\n");
-    printf("                                                      to restore only a SUB_PATH of the snapshot like /home/user/only_this_file \n");
+    printf("  --snapshot-at [DATE]                                Print the last snapshot made at or before DATE (YYYY-MM-DD [HH:MM[:SS]])\n");
+    printf("  --restore-snapshot [SHA1] [OUTPUT_DIR] [SUB_PATH...] Restores the snapshot with SHA1 to OUTPUT_DIR with the optional possibility\n");
+    printf("                                                      to restore only some SUB_PATHs of the snapshot like /home/user/only_this_file \n");
+    printf("  --paths-file [FILE]                                 Restore the sub paths listed in FILE (one per line) too\n");
+    printf("  --in-place                                          Restore into a non-empty OUTPUT_DIR, writing only what differs from the snapshot\n");
+    printf("  --delete                                            With --in-place, remove the paths which are not in the snapshot\n");
+    printf("  --show-file [SHA1]                                  Print the content of a stored object\n");
+    printf("  --repack                                            Move loose objects into pack files\n");
+    printf("  --upgrade-repo                                      Switch the repository to the latest format\n");
+    printf("  --watch                                             Journal the changes of the backed up directory, so snapshots only walk those\n");
+    printf("  --diff [SHA1_A] [SHA1_B] [PATH]                     Print what changed from snapshot SHA1_A to SHA1_B, optionally only below PATH\n");
+    printf("  --porcelain                                         Print the changes found by --diff in a machine readable format\n");
+    printf("  --cat [SHA1] [PATH]                                 Write the content of the file at PATH in the snapshot with SHA1 to stdout\n");
+    printf("  --offset [N]                                        With --cat, start at byte N of the file (K, M or G suffix allowed)\n");
+    printf("  --length [M]                                        With --cat, write at most M bytes (default: up to the end of the file)\n");
+    printf("  --prune                                             Remove the snapshots not kept by --keep-last, --keep-daily or --keep-weekly\n");
+    printf("                                                      (the last snapshot is always kept), then run --gc\n");
+    printf("  --keep-last [N]                                     Keep the last N snapshots\n");
+    printf("  --keep-daily [N]                                    Keep the last snapshot of each of the last N days with snapshots\n");
+    printf("  --keep-weekly [N]                                   Keep the last snapshot of each of the last N weeks with snapshots\n");
+    printf("  --gc                                                Remove the objects no snapshot uses anymore\n");
+    printf("  --dry-run                                           Only print what --prune or --gc would remove\n");
+    printf("  --check                                             Verify that the objects used by the snapshots exist, and rehash the objects added\n");
+    printf("                                                      since the last check plus a slice of the older ones\n");
+    printf("  --full                                              With --check, rehash every object\n");
+    printf("  --sample [PERCENT]                                  With --check, rehash a random PERCENT of the objects\n");
 	printf("\n");
+    printf("  --threads [N]                                       Number of threads used to walk, back up and restore files (default: number of CPUs)\n");
+    printf("  --chunker [fixed[:SIZE] | cdc[:MIN:AVG:MAX]]        Chunking used for new snapshots, saved in the repository (default: fixed 10M)\n");
+    printf("  --codec [zlib|zstd|lz4[:LEVEL] | none]              Compression of new objects for this run (default: codec in .bkp-data/config, zlib)\n");
+    printf("  --hash [sha1|sha256|blake3]                         Hash of the object ids, only for new repositories (default: sha1)\n");
+    printf("  --no-io-uring                                       Look up directory entries one by one instead of in io_uring batches\n");
+    printf("  --restore-memory [SIZE]                             Memory for decompressed chunks waiting to be written while restoring (default: 256M)\n");
+    printf("  --restore-cache [SIZE]                              Memory for decompressed chunks reused by later files of a restore, 0 turns it off (default: 128M)\n");
 	printf("  -h, --help                                      Show this help message and exit\n");
 	printf("\n");
 }
@@ -0,0 +1,248 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "object-index.h"
+
+static int bloom_has(struct object_index *idx, unsigned char *sha1);
+static void bloom_add(unsigned char *bloom, uint32_t bits_log2, uint32_t hashes, unsigned char *sha1);
+static int cmp_index_entry(const void *a, const void *b);
+
+int load_object_index(struct object_index *idx)
+{
+	struct stat st;
+	struct object_index_header *hdr = NULL;
+	size_t expected = 0;
+	int fd = open(".bkp-data/objects.idx", O_RDONLY);
+
+	memset(idx, 0, sizeof(struct object_index));
+
+	if (fd < 0)
+		return errno == ENOENT ? -ENOENT : -1;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct object_index_header)) {
+		close(fd);
+		return -1;
+	}
+
+	idx->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (idx->map == MAP_FAILED) {
+		idx->map = NULL;
+		return -1;
+	}
+
+	idx->map_len = st.st_size;
+	hdr = idx->map;
+
+	// indexes of older versions are simply rebuilt
+	if (memcmp(hdr->magic, OBJECT_INDEX_MAGIC, 4) == 0 && hdr->version < OBJECT_INDEX_VERSION) {
+		free_object_index(idx);
+		return -ENOENT;
+	}
+
+	if (memcmp(hdr->magic, OBJECT_INDEX_MAGIC, 4) != 0 || hdr->version != OBJECT_INDEX_VERSION ||
+		hdr->bloom_bits_log2 < 3 || hdr->bloom_bits_log2 > 40)
+		goto invalid;
+
+	expected = sizeof(struct object_index_header) +
+				(size_t)hdr->num_packs * PACK_NAME_LEN +
+				256 * sizeof(uint32_t) +
+				(size_t)hdr->num_entries * sizeof(struct object_index_entry) +
+				((size_t)1 << hdr->bloom_bits_log2) / 8;
+
+	if (expected != idx->map_len)
+		goto invalid;
+
+	idx->hdr = hdr;
+	idx->pack_names = (char (*)[PACK_NAME_LEN])(hdr + 1);
+	idx->fanout = (uint32_t *)(idx->pack_names + hdr->num_packs);
+	idx->entries = (struct object_index_entry *)(idx->fanout + 256);
+	idx->bloom = (unsigned char *)(idx->entries + hdr->num_entries);
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid .bkp-data/objects.idx, ignoring it!\n");
+	free_object_index(idx);
+	return -1;
+}
+
+void free_object_index(struct object_index *idx)
+{
+	if (idx->map)
+		munmap(idx->map, idx->map_len);
+
+	memset(idx, 0, sizeof(struct object_index));
+}
+
+struct object_index_entry *find_object_index(struct object_index *idx, unsigned char *sha1)
+{
+	int64_t low = 0, high = 0;
+
+	if (!idx->hdr || !bloom_has(idx, sha1))
+		return NULL;
+
+	low = sha1[0] > 0 ? idx->fanout[sha1[0] - 1] : 0;
+	high = (int64_t)idx->fanout[sha1[0]] - 1;
+
+	while (low <= high) {
+		int64_t mid = low + (high - low) / 2;
+		int cmp = memcmp(idx->entries[mid].sha1, sha1, HASH_MAX_LEN);
+
+		if (cmp == 0)
+			return &idx->entries[mid];
+		else if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Sorts entries (in place), drops duplicates and replaces
+ * .bkp-data/objects.idx with the result. When an object is both
+ * packed and loose, the packed copy is kept.
+ */
+int write_object_index(char (*pack_names)[PACK_NAME_LEN], uint32_t num_packs,
+						struct object_index_entry *entries, uint32_t num_entries)
+{
+	int ret = 0;
+	int fd = -1;
+	struct object_index_header hdr;
+	uint32_t fanout[256];
+	unsigned char *bloom = NULL;
+	size_t bloom_len = 0;
+	uint32_t bits_log2 = 10;
+	uint32_t count = 0;
+	uint32_t flags = OBJECT_INDEX_NO_LOOSE;
+
+	if (num_entries > 0)
+		qsort(entries, num_entries, sizeof(struct object_index_entry), cmp_index_entry);
+
+	for (uint32_t i=0;i<num_entries;i++) {
+		if (count > 0 && memcmp(entries[count-1].sha1, entries[i].sha1, HASH_MAX_LEN) == 0)
+			continue;
+
+		if (entries[i].pack == OBJECT_INDEX_LOOSE)
+			flags &= ~OBJECT_INDEX_NO_LOOSE;
+
+		entries[count++] = entries[i];
+	}
+
+	while (((uint64_t)1 << bits_log2) < (uint64_t)count * BLOOM_BITS_PER_ENTRY)
+		bits_log2++;
+
+	bloom_len = ((size_t)1 << bits_log2) / 8;
+	bloom = calloc(1, bloom_len);
+	if (!bloom) {
+		fprintf(stderr, "Error allocating memory for object index!\n");
+		return -ENOMEM;
+	}
+
+	memset(fanout, 0, sizeof(fanout));
+
+	for (uint32_t i=0;i<count;i++) {
+		fanout[entries[i].sha1[0]]++;
+		bloom_add(bloom, bits_log2, BLOOM_HASHES, entries[i].sha1);
+	}
+
+	for (int i=1;i<256;i++)
+		fanout[i] += fanout[i-1];
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, OBJECT_INDEX_MAGIC, 4);
+	hdr.version = OBJECT_INDEX_VERSION;
+	hdr.num_packs = num_packs;
+	hdr.num_entries = count;
+	hdr.bloom_bits_log2 = bits_log2;
+	hdr.bloom_hashes = BLOOM_HASHES;
+	hdr.flags = flags;
+
+	fd = open(".bkp-data/objects.idx.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "Error creating .bkp-data/objects.idx.tmp (errno: %d)!\n", errno);
+		ret = -1;
+		goto end;
+	}
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		write(fd, pack_names, (size_t)num_packs * PACK_NAME_LEN) != (ssize_t)num_packs * PACK_NAME_LEN ||
+		write(fd, fanout, sizeof(fanout)) != sizeof(fanout) ||
+		write(fd, entries, (size_t)count * sizeof(struct object_index_entry)) != (ssize_t)(count * sizeof(struct object_index_entry)) ||
+		write(fd, bloom, bloom_len) != (ssize_t)bloom_len ||
+		fsync(fd)) {
+		fprintf(stderr, "Error writing .bkp-data/objects.idx.tmp!\n");
+		close(fd);
+		unlink(".bkp-data/objects.idx.tmp");
+		ret = -1;
+		goto end;
+	}
+
+	close(fd);
+	ret = rename(".bkp-data/objects.idx.tmp", ".bkp-data/objects.idx");
+
+end:
+	free(bloom);
+	return ret;
+}
+
+/*
+ * The sha1 is already uniformly distributed, so the bloom
+ * filter positions are derived from it by double hashing
+ */
+static int bloom_has(struct object_index *idx, unsigned char *sha1)
+{
+	uint64_t h1 = 0, h2 = 0;
+	uint64_t mask = ((uint64_t)1 << idx->hdr->bloom_bits_log2) - 1;
+
+	memcpy(&h1, sha1, sizeof(h1));
+	memcpy(&h2, sha1 + 8, sizeof(h2));
+	h2 |= 1;
+
+	for (uint32_t i=0;i<idx->hdr->bloom_hashes;i++) {
+		uint64_t bit = (h1 + i * h2) & mask;
+
+		if (!(idx->bloom[bit >> 3] & (1 << (bit & 7))))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void bloom_add(unsigned char *bloom, uint32_t bits_log2, uint32_t hashes, unsigned char *sha1)
+{
+	uint64_t h1 = 0, h2 = 0;
+	uint64_t mask = ((uint64_t)1 << bits_log2) - 1;
+
+	memcpy(&h1, sha1, sizeof(h1));
+	memcpy(&h2, sha1 + 8, sizeof(h2));
+	h2 |= 1;
+
+	for (uint32_t i=0;i<hashes;i++) {
+		uint64_t bit = (h1 + i * h2) & mask;
+		bloom[bit >> 3] |= 1 << (bit & 7);
+	}
+}
+
+static int cmp_index_entry(const void *a, const void *b)
+{
+	const struct object_index_entry *ea = a;
+	const struct object_index_entry *eb = b;
+	int cmp = memcmp(ea->sha1, eb->sha1, HASH_MAX_LEN);
+
+	if (cmp)
+		return cmp;
+
+	// packed copies first
+	return (ea->pack == OBJECT_INDEX_LOOSE) - (eb->pack == OBJECT_INDEX_LOOSE);
+}
@@ -0,0 +1,69 @@
+
+#ifndef OBJECT_INDEX_H
+#define OBJECT_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pack.h"
+
+#define OBJECT_INDEX_MAGIC "BKPX"
+#define OBJECT_INDEX_VERSION 2
+
+#define OBJECT_INDEX_LOOSE 0xffffffff // pack id of loose objects
+
+#define OBJECT_INDEX_NO_LOOSE 0x1 // no loose objects were left in .bkp-data
+
+/*
+ * Number of packs not covered by .bkp-data/objects.idx
+ * after which the index is rebuilt
+ */
+#define OBJECT_INDEX_MAX_PACKS 16
+
+#define BLOOM_BITS_PER_ENTRY 10
+#define BLOOM_HASHES 7
+
+/*
+ * .bkp-data/objects.idx merges the indexes of many packs (and the
+ * loose objects of older repositories) in one file:
+ *
+ *	header | pack names | fanout[256] | entries | bloom filter
+ *
+ * fanout[b] is the number of entries whose sha1 starts with a byte
+ * <= b. The file is never modified, only replaced with rename().
+ */
+struct object_index_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t num_packs;
+	uint32_t num_entries;
+	uint32_t bloom_bits_log2;
+	uint32_t bloom_hashes;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+struct object_index_entry {
+	unsigned char sha1[HASH_MAX_LEN];
+	uint32_t pack; // index in the pack names, or OBJECT_INDEX_LOOSE
+	uint32_t len;
+	uint64_t offset;
+};
+
+struct object_index {
+	void *map;
+	size_t map_len;
+	struct object_index_header *hdr;
+	char (*pack_names)[PACK_NAME_LEN];
+	uint32_t *fanout;
+	struct object_index_entry *entries;
+	unsigned char *bloom;
+};
+
+int load_object_index(struct object_index *idx);
+void free_object_index(struct object_index *idx);
+struct object_index_entry *find_object_index(struct object_index *idx, unsigned char *sha1);
+int write_object_index(char (*pack_names)[PACK_NAME_LEN], uint32_t num_packs,
+						struct object_index_entry *entries, uint32_t num_entries);
+
+#endif
@@ -0,0 +1,1603 @@
+
+/*
+ * Packed object storage.
+ *
+ * Instead of creating one file per object under .bkp-data/, new
+ * objects are appended to pack files in .bkp-data/packs/. Every
+ * process writes its own pack (locked with flock() while it is being
+ * written), so concurrent backups never append to the same file.
+ * When a pack is finished (or reaches PACK_MAX_SIZE) its sorted
+ * .idx file is written next to it. Packs left without an index by
+ * a crashed process are scanned when they are loaded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+
+#include "pack.h"
+#include "sha1-file.h"
+#include "object-index.h"
+#include "config.h"
+
+struct pack {
+	char name[PACK_NAME_LEN]; // file name without extension
+	int fd;
+	struct pack_idx_entry *entries;
+	uint32_t num_entries;
+	void *idx_map;
+	size_t idx_map_len;
+	int has_idx; // its .idx file exists
+	int covered; // listed in .bkp-data/objects.idx
+	uint32_t id; // position in the object index being written
+};
+
+/*
+ * A pack new objects are appended to. Its entries are kept unsorted
+ * (in write order) with a small hash table on top. A writer serves
+ * one object stream at a time, so only the thread owning that stream
+ * writes the pack file; the entries are shared and protected by
+ * packs_lock. Idle writers are reused by the next stream, whichever
+ * thread starts it, so the number of packs written by a process
+ * follows the number of objects written at the same time.
+ */
+struct pack_writer {
+	struct pack *pack;
+	int busy;
+	off_t offset;
+	uint32_t entries_cap;
+	uint32_t *hash; // entry index + 1, 0 means empty slot
+	uint32_t hash_size;
+	struct pack_writer *next;
+};
+
+static pthread_mutex_t packs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pack **packs = NULL;
+static int num_packs = 0;
+static int packs_loaded = 0;
+static struct pack_writer *writers = NULL;
+static int pack_seq = 0;
+static struct object_index obj_idx;
+static struct pack **idx_packs = NULL; // pack of every pack id of obj_idx
+
+enum {
+	OBJECT_MISSING = 0,
+	OBJECT_PACKED,
+	OBJECT_LOOSE
+};
+
+static int init_packs();
+static int load_packs();
+static int attach_object_index();
+static int rebuild_object_index();
+static int count_uncovered_packs();
+static struct pack *find_pack_by_name(char *name);
+static int find_object(unsigned char *sha1, int *fd, uint64_t *offset, uint32_t *len);
+static int find_unindexed(unsigned char *sha1, int *fd, uint64_t *offset, uint32_t *len);
+static int find_moved_object(unsigned char *sha1, int found, int *fd, uint64_t *offset, uint32_t *len);
+static int is_pack_loaded(char *name);
+static int open_pack(char *name);
+static int load_pack_idx(struct pack *pack);
+static int scan_pack(struct pack *pack);
+static int write_pack_idx(struct pack *pack);
+static int add_pack(struct pack *pack);
+static void free_pack(struct pack *pack);
+static struct pack_idx_entry *find_in_pack(struct pack *pack, unsigned char *sha1);
+static struct pack_idx_entry *find_in_writer(struct pack_writer *w, unsigned char *sha1);
+static struct pack_idx_entry *find_packed(unsigned char *sha1, int *fd);
+static int pack_object(unsigned char *sha1, char *buff, int len);
+static int end_stream(struct pack_stream *ps, unsigned char *sha1, int packed_only);
+static int commit_stream(struct pack_stream *ps, unsigned char *sha1);
+static int copy_object(int fd, struct object_index_entry *entry);
+static void reset_packs();
+static void truncate_stream(struct pack_stream *ps);
+static struct pack_writer *get_writer();
+static void release_writer(struct pack_writer *w);
+static int start_pack(struct pack_writer *w);
+static int finish_writer(struct pack_writer *w);
+static int add_writer_entry(struct pack_writer *w, struct pack_idx_entry *entry);
+static int grow_writer_hash(struct pack_writer *w);
+static int cmp_idx_entry(const void *a, const void *b);
+static int is_loose_object_name(char *name);
+static int read_whole_file(char *path, char **out_buff, int *out_len);
+
+int has_packed_object(unsigned char *sha1)
+{
+	int found = OBJECT_MISSING;
+
+	pthread_mutex_lock(&packs_lock);
+
+	if (init_packs() == 0)
+		found = find_object(sha1, NULL, NULL, NULL);
+
+	pthread_mutex_unlock(&packs_lock);
+
+	/*
+	 * Objects the index doesn't know about are new, looking for
+	 * them in new packs would scan the directory for every object
+	 * we write. Only an indexed loose object may have been packed.
+	 */
+	if (found == OBJECT_LOOSE)
+		found = find_moved_object(sha1, found, NULL, NULL, NULL);
+
+	return found == OBJECT_PACKED;
+}
+
+/*
+ * Reads the (compressed) content of a packed object. Returns
+ * -ENOENT if the object is loose or doesn`t exist.
+ */
+int read_packed_object(unsigned char *sha1, char **out_buff, int *out_len)
+{
+	int found = OBJECT_MISSING;
+	int fd = -1;
+	uint32_t len = 0;
+	uint64_t offset = 0;
+	char *buff = NULL;
+	ssize_t bytes = 0;
+
+	pthread_mutex_lock(&packs_lock);
+
+	if (init_packs() == 0)
+		found = find_object(sha1, &fd, &offset, &len);
+
+	pthread_mutex_unlock(&packs_lock);
+
+	found = find_moved_object(sha1, found, &fd, &offset, &len);
+	if (found != OBJECT_PACKED)
+		return -ENOENT;
+
+	buff = malloc(len > 0 ? len : 1);
+	if (!buff) {
+		fprintf(stderr, "Error allocating memory for packed object!\n");
+		return -ENOMEM;
+	}
+
+	bytes = pread(fd, buff, len, offset);
+	if (bytes != (ssize_t)len) {
+		fprintf(stderr, "Error reading packed object (errno: %d)!\n", errno);
+		free(buff);
+		return -1;
+	}
+
+	*out_buff = buff;
+	*out_len = len;
+
+	return 0;
+}
+
+/*
+ * Tells if .bkp-data may hold loose objects, as repositories
+ * written by older versions do. Since nothing writes loose objects
+ * anymore, the object index knows for sure when there are none.
+ */
+int has_loose_objects()
+{
+	int ret = 1;
+
+	pthread_mutex_lock(&packs_lock);
+
+	if (init_packs() == 0 && obj_idx.hdr)
+		ret = !(obj_idx.hdr->flags & OBJECT_INDEX_NO_LOOSE);
+
+	pthread_mutex_unlock(&packs_lock);
+	return ret;
+}
+
+/*
+ * The object may be in a pack written by another process (a
+ * concurrent backup or repack) since the packs were loaded, even
+ * if the object index still lists it as loose: --repack deletes
+ * the loose files it packed. Returns OBJECT_LOOSE if the loose
+ * file is there.
+ */
+static int find_moved_object(unsigned char *sha1, int found, int *fd, uint64_t *offset, uint32_t *len)
+{
+	char path[PATH_MAX];
+	char sha1_hex[HASH_MAX_HEX+1];
+
+	if (found == OBJECT_PACKED)
+		return found;
+
+	sha1_to_hex(sha1, sha1_hex);
+	sprintf(path, ".bkp-data/%s", sha1_hex);
+
+	if (access(path, F_OK) == 0)
+		return OBJECT_LOOSE;
+
+	pthread_mutex_lock(&packs_lock);
+
+	if (load_packs() == 0)
+		found = find_unindexed(sha1, fd, offset, len);
+
+	pthread_mutex_unlock(&packs_lock);
+
+	return found;
+}
+
+/*
+ * Writes the index of the packs being written, which makes them
+ * regular, read-only packs. Must not be called while objects are
+ * still being written. Once too many packs are missing from the
+ * object index, it is rebuilt.
+ */
+int finish_pack()
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&packs_lock);
+
+	for (struct pack_writer *w=writers;w;w=w->next)
+		ret |= finish_writer(w);
+
+	if (!ret && count_uncovered_packs() >= OBJECT_INDEX_MAX_PACKS)
+		rebuild_object_index();
+
+	pthread_mutex_unlock(&packs_lock);
+
+	return ret;
+}
+
+/*
+ * Starts appending an object whose compressed size is not known
+ * yet to the pack of the calling thread. Its record header is
+ * written by pack_stream_end(), once the data is complete.
+ */
+int pack_stream_begin(struct pack_stream *ps)
+{
+	int ret = 0;
+	struct pack_record rec;
+	struct pack_writer *w = NULL;
+
+	pthread_mutex_lock(&packs_lock);
+
+	ret = init_packs();
+	if (ret)
+		goto end;
+
+	w = get_writer();
+	if (!w) {
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	if (w->pack && w->offset >= PACK_MAX_SIZE) {
+		ret = finish_writer(w);
+		if (ret)
+			goto end;
+	}
+
+	if (!w->pack) {
+		ret = start_pack(w);
+		if (ret)
+			goto end;
+	}
+
+end:
+	if (ret && w)
+		w->busy = 0;
+
+	pthread_mutex_unlock(&packs_lock);
+
+	if (ret)
+		return ret;
+
+	ps->writer = w;
+	ps->len = 0;
+
+	/*
+	 * A zeroed header marks an incomplete record, for
+	 * scan_pack() to stop at if we die before the end
+	 */
+	memset(&rec, 0, sizeof(rec));
+	if (pwrite(w->pack->fd, &rec, sizeof(rec), w->offset) != sizeof(rec)) {
+		fprintf(stderr, "Error writing to pack %s (errno: %d)!\n", w->pack->name, errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+int pack_stream_write(struct pack_stream *ps, char *buff, int len)
+{
+	struct pack_writer *w = ps->writer;
+	off_t offset = w->offset + sizeof(struct pack_record) + ps->len;
+
+	if (pwrite(w->pack->fd, buff, len, offset) != len) {
+		fprintf(stderr, "Error writing to pack %s (errno: %d)!\n", w->pack->name, errno);
+		return -1;
+	}
+
+	ps->len += len;
+	return 0;
+}
+
+/*
+ * Completes the record of a streamed object. If the object got
+ * stored meanwhile (by another thread, or it was only identified
+ * by its compressed content), the record is dropped instead.
+ * checked tells the caller made sure the object wasn't stored
+ * before it was written, so only the packs can have it now.
+ */
+int pack_stream_end(struct pack_stream *ps, unsigned char *sha1, int checked)
+{
+	int ret = end_stream(ps, sha1, checked);
+
+	release_writer(ps->writer);
+	return ret;
+}
+
+/*
+ * Drops the data written since pack_stream_begin()
+ */
+void pack_stream_abort(struct pack_stream *ps)
+{
+	truncate_stream(ps);
+	release_writer(ps->writer);
+}
+
+static void truncate_stream(struct pack_stream *ps)
+{
+	struct pack_writer *w = ps->writer;
+
+	if (ftruncate(w->pack->fd, w->offset))
+		fprintf(stderr, "Error truncating pack %s (errno: %d)!\n", w->pack->name, errno);
+
+	ps->len = 0;
+}
+
+static int end_stream(struct pack_stream *ps, unsigned char *sha1, int packed_only)
+{
+	int ret = 0;
+	int found = OBJECT_MISSING;
+	int loose = 0;
+	char path[PATH_MAX];
+	char sha1_hex[HASH_MAX_HEX+1];
+
+	sha1_to_hex(sha1, sha1_hex);
+	sprintf(path, ".bkp-data/%s", sha1_hex);
+
+	if (!packed_only && has_loose_objects())
+		loose = access(path, F_OK) == 0;
+
+	pthread_mutex_lock(&packs_lock);
+
+	found = find_object(sha1, NULL, NULL, NULL);
+
+	if (found == OBJECT_PACKED || (!packed_only && (found == OBJECT_LOOSE || loose))) {
+		pthread_mutex_unlock(&packs_lock);
+		truncate_stream(ps);
+		return 0;
+	}
+
+	ret = commit_stream(ps, sha1);
+
+	pthread_mutex_unlock(&packs_lock);
+
+	if (ret)
+		truncate_stream(ps);
+
+	return ret;
+}
+
+/*
+ * Writes the record header of the streamed object and adds it to
+ * the pack. Called with packs_lock held.
+ */
+static int commit_stream(struct pack_stream *ps, unsigned char *sha1)
+{
+	int ret = 0;
+	struct pack_writer *w = ps->writer;
+	struct pack_record rec;
+	struct pack_idx_entry entry;
+
+	memcpy(rec.sha1, sha1, HASH_MAX_LEN);
+	rec.len = ps->len;
+
+	if (pwrite(w->pack->fd, &rec, sizeof(rec), w->offset) != sizeof(rec)) {
+		fprintf(stderr, "Error writing to pack %s (errno: %d)!\n", w->pack->name, errno);
+		ret = -1;
+		goto end;
+	}
+
+	memcpy(entry.sha1, sha1, HASH_MAX_LEN);
+	entry.len = ps->len;
+	entry.offset = w->offset + sizeof(rec);
+
+	ret = add_writer_entry(w, &entry);
+	if (!ret)
+		w->offset += sizeof(rec) + ps->len;
+
+end:
+	return ret;
+}
+
+/*
+ * Moves all loose objects into packs. The loose files are
+ * only deleted once the packs holding them are finished.
+ */
+int repack_objects()
+{
+	int ret = 0;
+	DIR *dir = opendir(".bkp-data");
+	struct dirent *dirent = NULL;
+	char path[PATH_MAX];
+	char *buff = NULL;
+	int len = 0;
+	unsigned char sha1[HASH_MAX_LEN];
+	char (*names)[HASH_MAX_HEX+1] = NULL;
+	int num_names = 0;
+
+	if (!dir) {
+		fprintf(stderr, "Error opening .bkp-data!\n");
+		return -1;
+	}
+
+	while ((dirent = readdir(dir)) != NULL) {
+		if (!is_loose_object_name(dirent->d_name))
+			continue;
+
+		snprintf(path, PATH_MAX, ".bkp-data/%s", dirent->d_name);
+		hex_to_sha1(dirent->d_name, sha1);
+
+		ret = read_whole_file(path, &buff, &len);
+		if (ret)
+			goto end;
+
+		ret = pack_object(sha1, buff, len);
+		free(buff);
+		if (ret)
+			goto end;
+
+		if (num_names % 1000 == 0) {
+			char (*tmp)[HASH_MAX_HEX+1] = realloc(names, (num_names + 1000) * sizeof(*names));
+			if (!tmp) {
+				fprintf(stderr, "Error allocating memory for repacked objects!\n");
+				ret = -ENOMEM;
+				goto end;
+			}
+			names = tmp;
+		}
+
+		strcpy(names[num_names++], dirent->d_name);
+
+		if (num_names % 10000 == 0) {
+			printf("\rPacked %d loose objects...", num_names);
+			fflush(stdout);
+		}
+	}
+
+	ret = finish_pack();
+	if (ret)
+		goto end;
+
+	for (int i=0;i<num_names;i++) {
+		snprintf(path, PATH_MAX, ".bkp-data/%s", names[i]);
+		unlink(path);
+	}
+
+	printf("\rPacked %d loose objects.   \n", num_names);
+
+	pthread_mutex_lock(&packs_lock);
+	ret = rebuild_object_index();
+	pthread_mutex_unlock(&packs_lock);
+
+end:
+	if (names)
+		free(names);
+
+	closedir(dir);
+	return ret;
+}
+
+/*
+ * Brings .bkp-data/objects.idx up to date with every finished pack
+ * and loose object
+ */
+int update_object_index()
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&packs_lock);
+
+	ret = init_packs();
+	if (!ret)
+		ret = rebuild_object_index();
+
+	pthread_mutex_unlock(&packs_lock);
+
+	return ret;
+}
+
+/*
+ * Removes the objects of idx (.bkp-data/objects.idx, brought up to
+ * date by update_object_index()) whose bit is not set in live. Dead
+ * loose objects are deleted, just like packs without live objects.
+ * Packs with enough dead bytes (see SWEEP_REWRITE_RATIO) get their
+ * live objects copied to new packs before they are deleted. Nothing
+ * may be writing objects meanwhile.
+ */
+int sweep_objects(struct object_index *idx, uint64_t *live, struct sweep_stats *stats)
+{
+	int ret = 0;
+	uint32_t num_idx_packs = idx->hdr->num_packs;
+	struct object_index_entry *entry = NULL;
+	char path[PATH_MAX];
+	char sha1_hex[HASH_MAX_HEX+1];
+	struct stat sb;
+	int *fds = NULL; // of the packs to rewrite
+	uint64_t *live_bytes = NULL;
+	uint64_t *dead_bytes = NULL;
+	uint32_t *dead = NULL;
+
+	memset(stats, 0, sizeof(struct sweep_stats));
+
+	fds = malloc((num_idx_packs + 1) * sizeof(int));
+	live_bytes = calloc(num_idx_packs + 1, sizeof(uint64_t));
+	dead_bytes = calloc(num_idx_packs + 1, sizeof(uint64_t));
+	dead = calloc(num_idx_packs + 1, sizeof(uint32_t));
+
+	if (!fds || !live_bytes || !dead_bytes || !dead) {
+		fprintf(stderr, "Error allocating memory for the packs to sweep!\n");
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	for (uint32_t i=0;i<num_idx_packs;i++)
+		fds[i] = -1;
+
+	for (uint32_t i=0;i<idx->hdr->num_entries;i++) {
+		int is_live = (live[i / 64] >> (i % 64)) & 1;
+
+		entry = &idx->entries[i];
+
+		if (entry->pack != OBJECT_INDEX_LOOSE) {
+			if (is_live)
+				live_bytes[entry->pack] += sizeof(struct pack_record) + entry->len;
+			else {
+				dead_bytes[entry->pack] += sizeof(struct pack_record) + entry->len;
+				dead[entry->pack]++;
+			}
+			continue;
+		}
+
+		if (is_live)
+			continue;
+
+		sha1_to_hex(entry->sha1, sha1_hex);
+		snprintf(path, PATH_MAX, ".bkp-data/%s", sha1_hex);
+
+		if (stat(path, &sb) == 0 && unlink(path) == 0) {
+			stats->removed++;
+			stats->freed += sb.st_size;
+		}
+	}
+
+	// the packs worth rewriting
+	for (uint32_t i=0;i<num_idx_packs;i++) {
+		if (dead[i] == 0 || live_bytes[i] == 0)
+			continue;
+
+		if (dead_bytes[i] * SWEEP_REWRITE_RATIO < live_bytes[i] + dead_bytes[i]) {
+			stats->left += dead_bytes[i];
+			continue;
+		}
+
+		snprintf(path, PATH_MAX, ".bkp-data/packs/%s.pack", idx->pack_names[i]);
+
+		fds[i] = open(path, O_RDONLY);
+		if (fds[i] < 0) {
+			fprintf(stderr, "Error opening pack %s!\n", path);
+			ret = -1;
+			goto end;
+		}
+	}
+
+	for (uint32_t i=0;i<idx->hdr->num_entries;i++) {
+		entry = &idx->entries[i];
+
+		if (entry->pack == OBJECT_INDEX_LOOSE || fds[entry->pack] < 0 || !((live[i / 64] >> (i % 64)) & 1))
+			continue;
+
+		ret = copy_object(fds[entry->pack], entry);
+		if (ret)
+			goto end;
+	}
+
+	pthread_mutex_lock(&packs_lock);
+
+	for (struct pack_writer *w=writers;w;w=w->next)
+		ret |= finish_writer(w);
+
+	pthread_mutex_unlock(&packs_lock);
+
+	if (ret)
+		goto end;
+
+	// the live objects are safe in the new packs by now
+	for (uint32_t i=0;i<num_idx_packs;i++) {
+		if (dead[i] == 0 || (live_bytes[i] > 0 && fds[i] < 0))
+			continue;
+
+		snprintf(path, PATH_MAX, ".bkp-data/packs/%s.pack", idx->pack_names[i]);
+		unlink(path);
+		snprintf(path, PATH_MAX, ".bkp-data/packs/%s.idx", idx->pack_names[i]);
+		unlink(path);
+
+		stats->removed += dead[i];
+		stats->freed += dead_bytes[i];
+	}
+
+	// the packs loaded so far may be gone, the index is written from scratch
+	pthread_mutex_lock(&packs_lock);
+
+	reset_packs();
+
+	ret = init_packs();
+	if (!ret)
+		ret = rebuild_object_index();
+
+	pthread_mutex_unlock(&packs_lock);
+
+end:
+	for (uint32_t i=0;fds && i<num_idx_packs;i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+
+	free(fds);
+	free(live_bytes);
+	free(dead_bytes);
+	free(dead);
+
+	return ret;
+}
+
+/*
+ * Appends an object of another pack as it is, even though the
+ * object index still finds it in the old one
+ */
+static int copy_object(int fd, struct object_index_entry *entry)
+{
+	int ret = 0;
+	char *buff = malloc(entry->len > 0 ? entry->len : 1);
+	struct pack_stream ps;
+
+	if (!buff) {
+		fprintf(stderr, "Error allocating memory for packed object!\n");
+		return -ENOMEM;
+	}
+
+	if (pread(fd, buff, entry->len, entry->offset) != (ssize_t)entry->len) {
+		fprintf(stderr, "Error reading packed object (errno: %d)!\n", errno);
+		free(buff);
+		return -1;
+	}
+
+	ret = pack_stream_begin(&ps);
+	if (ret) {
+		free(buff);
+		return ret;
+	}
+
+	ret = pack_stream_write(&ps, buff, entry->len);
+
+	if (!ret) {
+		pthread_mutex_lock(&packs_lock);
+		ret = commit_stream(&ps, entry->sha1);
+		pthread_mutex_unlock(&packs_lock);
+	}
+
+	if (ret)
+		truncate_stream(&ps);
+
+	release_writer(ps.writer);
+	free(buff);
+
+	return ret;
+}
+
+/*
+ * Forgets every loaded pack and the object index. Called with
+ * packs_lock held.
+ */
+static void reset_packs()
+{
+	for (int i=0;i<num_packs;i++)
+		free_pack(packs[i]);
+
+	free(packs);
+	packs = NULL;
+	num_packs = 0;
+
+	free_object_index(&obj_idx);
+	free(idx_packs);
+	idx_packs = NULL;
+
+	packs_loaded = 0;
+}
+
+/*
+ * Loads the object index and the packs it doesn`t cover, the first
+ * time objects are looked up. Called with packs_lock held.
+ */
+static int init_packs()
+{
+	if (packs_loaded)
+		return 0;
+
+	if (load_object_index(&obj_idx) == 0 && attach_object_index())
+		free_object_index(&obj_idx);
+
+	if (load_packs())
+		return -1;
+
+	packs_loaded = 1;
+
+	/*
+	 * Repositories created by older versions have no object index
+	 * yet, but may have lots of loose objects to put in it
+	 */
+	if (!obj_idx.hdr)
+		rebuild_object_index();
+
+	return 0;
+}
+
+/*
+ * Loads the packs which are not yet known. Called with packs_lock held.
+ */
+static int load_packs()
+{
+	DIR *dir = opendir(".bkp-data/packs");
+	struct dirent *dirent = NULL;
+	char name[PACK_NAME_LEN];
+	int len = 0;
+
+	if (!dir)
+		return errno == ENOENT ? 0 : -1;
+
+	while ((dirent = readdir(dir)) != NULL) {
+		len = strlen(dirent->d_name);
+
+		if (len < 6 || len - 5 >= (int)sizeof(name) || strcmp(dirent->d_name + len - 5, ".pack") != 0)
+			continue;
+
+		memcpy(name, dirent->d_name, len - 5);
+		name[len - 5] = '\0';
+
+		if (is_pack_loaded(name))
+			continue;
+
+		if (open_pack(name)) {
+			closedir(dir);
+			return -1;
+		}
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+static int is_pack_loaded(char *name)
+{
+	for (struct pack_writer *w=writers;w;w=w->next)
+		if (w->pack && strcmp(w->pack->name, name) == 0)
+			return 1;
+
+	for (int i=0;i<num_packs;i++)
+		if (strcmp(packs[i]->name, name) == 0)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Maps the pack ids of obj_idx to packs, opening the packs which
+ * are not loaded yet. Their own .idx files are not needed.
+ */
+static int attach_object_index()
+{
+	char path[PATH_MAX];
+	struct pack *pack = NULL;
+
+	idx_packs = calloc(obj_idx.hdr->num_packs + 1, sizeof(struct pack *));
+	if (!idx_packs) {
+		fprintf(stderr, "Error allocating memory for object index!\n");
+		return -ENOMEM;
+	}
+
+	for (uint32_t i=0;i<obj_idx.hdr->num_packs;i++) {
+		pack = find_pack_by_name(obj_idx.pack_names[i]);
+
+		if (!pack) {
+			pack = calloc(1, sizeof(struct pack));
+			if (!pack) {
+				fprintf(stderr, "Error allocating memory for pack!\n");
+				return -ENOMEM;
+			}
+
+			snprintf(pack->name, sizeof(pack->name), "%s", obj_idx.pack_names[i]);
+			snprintf(path, PATH_MAX, ".bkp-data/packs/%s.pack", pack->name);
+
+			pack->fd = open(path, O_RDONLY);
+			if (pack->fd < 0) {
+				// removed since the index was written
+				free(pack);
+				continue;
+			}
+
+			if (add_pack(pack))
+				return -ENOMEM;
+		}
+
+		pack->has_idx = 1;
+		pack->covered = 1;
+		idx_packs[i] = pack;
+	}
+
+	return 0;
+}
+
+/*
+ * Merges the object index, the indexes of all finished packs and
+ * the loose objects in a new .bkp-data/objects.idx. Processes
+ * rebuilding the index are serialized with .bkp-data/objects.lock,
+ * everybody else keeps using the old one until it is replaced.
+ * Called with packs_lock held.
+ */
+static int rebuild_object_index()
+{
+	int ret = 0;
+	int lock_fd = -1;
+	DIR *dir = NULL;
+	struct dirent *dirent = NULL;
+	char (*names)[PACK_NAME_LEN] = NULL;
+	uint32_t num_names = 0;
+	struct object_index_entry *entries = NULL;
+	struct object_index_entry *entry = NULL;
+	uint32_t num_entries = 0;
+	uint32_t cap = 0;
+	struct pack *pack = NULL;
+
+	lock_fd = open(".bkp-data/objects.lock", O_RDWR | O_CREAT, 0666);
+	if (lock_fd < 0)
+		return -1;
+
+	// somebody else is rebuilding it right now
+	if (flock(lock_fd, LOCK_EX | LOCK_NB)) {
+		close(lock_fd);
+		return 0;
+	}
+
+	ret = load_packs();
+	if (ret)
+		goto end;
+
+	names = calloc(num_packs + 1, PACK_NAME_LEN);
+	if (!names) {
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	for (int i=0;i<num_packs;i++) {
+		if (!packs[i]->has_idx)
+			continue;
+
+		packs[i]->id = num_names;
+		strcpy(names[num_names++], packs[i]->name);
+
+		cap += packs[i]->covered ? 0 : packs[i]->num_entries;
+	}
+
+	cap += (obj_idx.hdr ? obj_idx.hdr->num_entries : 0) + 1024;
+
+	entries = malloc(cap * sizeof(struct object_index_entry));
+	if (!entries) {
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	if (obj_idx.hdr) {
+		for (uint32_t i=0;i<obj_idx.hdr->num_entries;i++) {
+			if (obj_idx.entries[i].pack == OBJECT_INDEX_LOOSE || !idx_packs[obj_idx.entries[i].pack])
+				continue;
+
+			entries[num_entries] = obj_idx.entries[i];
+			entries[num_entries++].pack = idx_packs[obj_idx.entries[i].pack]->id;
+		}
+	}
+
+	for (int i=0;i<num_packs;i++) {
+		pack = packs[i];
+
+		if (!pack->has_idx || pack->covered)
+			continue;
+
+		for (uint32_t j=0;j<pack->num_entries;j++) {
+			entry = &entries[num_entries++];
+			memset(entry, 0, sizeof(struct object_index_entry));
+			memcpy(entry->sha1, pack->entries[j].sha1, HASH_MAX_LEN);
+			entry->pack = pack->id;
+			entry->len = pack->entries[j].len;
+			entry->offset = pack->entries[j].offset;
+		}
+	}
+
+	dir = opendir(".bkp-data");
+	if (!dir) {
+		ret = -1;
+		goto end;
+	}
+
+	while ((dirent = readdir(dir)) != NULL) {
+		if (!is_loose_object_name(dirent->d_name))
+			continue;
+
+		if (num_entries == cap) {
+			struct object_index_entry *tmp = realloc(entries, cap * 2 * sizeof(struct object_index_entry));
+			if (!tmp) {
+				ret = -ENOMEM;
+				goto end;
+			}
+			entries = tmp;
+			cap *= 2;
+		}
+
+		entry = &entries[num_entries++];
+		memset(entry, 0, sizeof(struct object_index_entry));
+		hex_to_sha1(dirent->d_name, entry->sha1);
+		entry->pack = OBJECT_INDEX_LOOSE;
+	}
+
+	ret = write_object_index(names, num_names, entries, num_entries);
+	if (ret)
+		goto end;
+
+	// switching to the new index
+	free_object_index(&obj_idx);
+	free(idx_packs);
+	idx_packs = NULL;
+
+	if (load_object_index(&obj_idx) == 0 && attach_object_index())
+		free_object_index(&obj_idx);
+
+end:
+	if (ret == -ENOMEM)
+		fprintf(stderr, "Error allocating memory for object index!\n");
+
+	if (dir)
+		closedir(dir);
+
+	if (names)
+		free(names);
+
+	if (entries)
+		free(entries);
+
+	flock(lock_fd, LOCK_UN);
+	close(lock_fd);
+
+	return ret;
+}
+
+static int count_uncovered_packs()
+{
+	int count = 0;
+
+	for (int i=0;i<num_packs;i++)
+		if (packs[i]->has_idx && !packs[i]->covered)
+			count++;
+
+	return count;
+}
+
+static struct pack *find_pack_by_name(char *name)
+{
+	for (int i=0;i<num_packs;i++)
+		if (strcmp(packs[i]->name, name) == 0)
+			return packs[i];
+
+	return NULL;
+}
+
+static int open_pack(char *name)
+{
+	char path[PATH_MAX];
+	struct pack *pack = calloc(1, sizeof(struct pack));
+
+	if (!pack) {
+		fprintf(stderr, "Error allocating memory for pack!\n");
+		return -ENOMEM;
+	}
+
+	snprintf(pack->name, sizeof(pack->name), "%s", name);
+	snprintf(path, PATH_MAX, ".bkp-data/packs/%s.pack", name);
+
+	pack->fd = open(path, O_RDONLY);
+	if (pack->fd < 0) {
+		fprintf(stderr, "Error opening pack %s!\n", path);
+		free(pack);
+		return -1;
+	}
+
+	if (load_pack_idx(pack) == 0)
+		pack->has_idx = 1;
+	else {
+		if (scan_pack(pack)) {
+			free_pack(pack);
+			return -1;
+		}
+
+		/*
+		 * Nobody holds the lock of a pack without index only if
+		 * its writer died, in which case the index can be written
+		 */
+		if (flock(pack->fd, LOCK_SH | LOCK_NB) == 0) {
+			pack->has_idx = write_pack_idx(pack) == 0;
+			flock(pack->fd, LOCK_UN);
+		}
+	}
+
+	return add_pack(pack);
+}
+
+static int load_pack_idx(struct pack *pack)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	struct pack_idx_header *hdr = NULL;
+	int fd = -1;
+
+	snprintf(path, PATH_MAX, ".bkp-data/packs/%s.idx", pack->name);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct pack_idx_header)) {
+		close(fd);
+		return -1;
+	}
+
+	pack->idx_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (pack->idx_map == MAP_FAILED) {
+		pack->idx_map = NULL;
+		return -1;
+	}
+
+	pack->idx_map_len = st.st_size;
+	hdr = pack->idx_map;
+
+	if (memcmp(hdr->magic, PACK_IDX_MAGIC, 4) != 0 || hdr->version != PACK_VERSION ||
+		pack->idx_map_len != sizeof(struct pack_idx_header) + hdr->num_entries * sizeof(struct pack_idx_entry)) {
+		fprintf(stderr, "Invalid pack index %s, scanning the pack instead!\n", path);
+		munmap(pack->idx_map, pack->idx_map_len);
+		pack->idx_map = NULL;
+		return -1;
+	}
+
+	pack->entries = (struct pack_idx_entry *)(hdr + 1);
+	pack->num_entries = hdr->num_entries;
+
+	return 0;
+}
+
+/*
+ * Rebuilds the index of a pack by walking its records. A partially
+ * written record at the end (crash, or a pack still being written)
+ * is ignored.
+ */
+static int scan_pack(struct pack *pack)
+{
+	struct stat st;
+	struct pack_header hdr;
+	struct pack_record rec;
+	off_t rec_len = sizeof(rec);
+	off_t offset = sizeof(struct pack_header);
+	uint32_t cap = 0;
+
+	if (fstat(pack->fd, &st))
+		return -1;
+
+	if (pread(pack->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		memcmp(hdr.magic, PACK_MAGIC, 4) != 0 || hdr.version != PACK_VERSION) {
+		fprintf(stderr, "Invalid pack %s!\n", pack->name);
+		return -1;
+	}
+
+	while (offset + rec_len <= st.st_size) {
+		if (pread(pack->fd, &rec, sizeof(rec), offset) != sizeof(rec))
+			break;
+
+		// record whose writer died before completing it
+		if (!sha1_is_valid(rec.sha1))
+			break;
+
+		if (offset + rec_len + rec.len > st.st_size)
+			break;
+
+		if (pack->num_entries == cap) {
+			struct pack_idx_entry *tmp = NULL;
+
+			cap = cap > 0 ? cap * 2 : 1024;
+			tmp = realloc(pack->entries, cap * sizeof(struct pack_idx_entry));
+			if (!tmp) {
+				fprintf(stderr, "Error allocating memory for pack index!\n");
+				return -ENOMEM;
+			}
+			pack->entries = tmp;
+		}
+
+		memcpy(pack->entries[pack->num_entries].sha1, rec.sha1, HASH_MAX_LEN);
+		pack->entries[pack->num_entries].len = rec.len;
+		pack->entries[pack->num_entries].offset = offset + rec_len;
+		pack->num_entries++;
+
+		offset += rec_len + rec.len;
+	}
+
+	if (pack->num_entries > 0)
+		qsort(pack->entries, pack->num_entries, sizeof(struct pack_idx_entry), cmp_idx_entry);
+
+	return 0;
+}
+
+static int write_pack_idx(struct pack *pack)
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+	struct pack_idx_header hdr;
+	size_t size = pack->num_entries * sizeof(struct pack_idx_entry);
+	int fd = -1;
+
+	snprintf(path, PATH_MAX, ".bkp-data/packs/%s.idx", pack->name);
+	snprintf(tmp_path, PATH_MAX, ".bkp-data/packs/%s.idx.tmp", pack->name);
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "Error creating pack index %s!\n", tmp_path);
+		return -1;
+	}
+
+	memcpy(hdr.magic, PACK_IDX_MAGIC, 4);
+	hdr.version = PACK_VERSION;
+	hdr.num_entries = pack->num_entries;
+	hdr.reserved = 0;
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		(size > 0 && write(fd, pack->entries, size) != (ssize_t)size) ||
+		fsync(fd)) {
+		fprintf(stderr, "Error writing pack index %s!\n", tmp_path);
+		close(fd);
+		unlink(tmp_path);
+		return -1;
+	}
+
+	close(fd);
+	return rename(tmp_path, path);
+}
+
+static int add_pack(struct pack *pack)
+{
+	if (num_packs % 64 == 0) {
+		struct pack **tmp = realloc(packs, (num_packs + 64) * sizeof(struct pack *));
+		if (!tmp) {
+			fprintf(stderr, "Error allocating memory for packs!\n");
+			free_pack(pack);
+			return -ENOMEM;
+		}
+		packs = tmp;
+	}
+
+	packs[num_packs++] = pack;
+	return 0;
+}
+
+static void free_pack(struct pack *pack)
+{
+	if (pack->idx_map)
+		munmap(pack->idx_map, pack->idx_map_len);
+	else if (pack->entries)
+		free(pack->entries);
+
+	if (pack->fd >= 0)
+		close(pack->fd);
+
+	free(pack);
+}
+
+static struct pack_idx_entry *find_in_pack(struct pack *pack, unsigned char *sha1)
+{
+	int64_t low = 0, high = (int64_t)pack->num_entries - 1;
+
+	while (low <= high) {
+		int64_t mid = low + (high - low) / 2;
+		int cmp = memcmp(pack->entries[mid].sha1, sha1, HASH_MAX_LEN);
+
+		if (cmp == 0)
+			return &pack->entries[mid];
+		else if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return NULL;
+}
+
+static struct pack_idx_entry *find_in_writer(struct pack_writer *w, unsigned char *sha1)
+{
+	uint32_t slot = 0;
+
+	if (!w->pack || !w->hash)
+		return NULL;
+
+	memcpy(&slot, sha1, sizeof(slot));
+	slot &= w->hash_size - 1;
+
+	while (w->hash[slot]) {
+		struct pack_idx_entry *entry = &w->pack->entries[w->hash[slot] - 1];
+
+		if (memcmp(entry->sha1, sha1, HASH_MAX_LEN) == 0)
+			return entry;
+
+		slot = (slot + 1) & (w->hash_size - 1);
+	}
+
+	return NULL;
+}
+
+/*
+ * Called with packs_lock held
+ */
+static struct pack_idx_entry *find_packed(unsigned char *sha1, int *fd)
+{
+	struct pack_idx_entry *entry = NULL;
+
+	for (int i=num_packs-1;i>=0;i--) {
+		entry = find_in_pack(packs[i], sha1);
+		if (entry) {
+			if (fd)
+				*fd = packs[i]->fd;
+			return entry;
+		}
+	}
+
+	for (struct pack_writer *w=writers;w;w=w->next) {
+		entry = find_in_writer(w, sha1);
+		if (entry) {
+			if (fd)
+				*fd = w->pack->fd;
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Looks up an object in the object index first, then in the packs
+ * it doesn`t cover. Called with packs_lock held.
+ */
+static int find_object(unsigned char *sha1, int *fd, uint64_t *offset, uint32_t *len)
+{
+	struct object_index_entry *idx_entry = find_object_index(&obj_idx, sha1);
+
+	if (idx_entry) {
+		if (idx_entry->pack == OBJECT_INDEX_LOOSE)
+			return OBJECT_LOOSE;
+
+		if (idx_packs[idx_entry->pack]) {
+			if (fd) {
+				*fd = idx_packs[idx_entry->pack]->fd;
+				*offset = idx_entry->offset;
+				*len = idx_entry->len;
+			}
+			return OBJECT_PACKED;
+		}
+	}
+
+	return find_unindexed(sha1, fd, offset, len);
+}
+
+/*
+ * Looks up an object in the packs, whatever the object index says.
+ * Called with packs_lock held.
+ */
+static int find_unindexed(unsigned char *sha1, int *fd, uint64_t *offset, uint32_t *len)
+{
+	struct pack_idx_entry *entry = NULL;
+	int pack_fd = -1;
+
+	entry = find_packed(sha1, &pack_fd);
+	if (!entry)
+		return OBJECT_MISSING;
+
+	if (fd) {
+		*fd = pack_fd;
+		*offset = entry->offset;
+		*len = entry->len;
+	}
+
+	return OBJECT_PACKED;
+}
+
+static int pack_object(unsigned char *sha1, char *buff, int len)
+{
+	int ret = 0;
+	int found = OBJECT_MISSING;
+	struct pack_stream ps;
+
+	pthread_mutex_lock(&packs_lock);
+
+	ret = init_packs();
+	if (!ret)
+		found = find_object(sha1, NULL, NULL, NULL);
+
+	pthread_mutex_unlock(&packs_lock);
+
+	if (ret || found == OBJECT_PACKED)
+		return ret;
+
+	ret = pack_stream_begin(&ps);
+	if (ret)
+		return ret;
+
+	ret = pack_stream_write(&ps, buff, len);
+	if (ret) {
+		pack_stream_abort(&ps);
+		return ret;
+	}
+
+	// while repacking, the object is still loose
+	ret = end_stream(&ps, sha1, 1);
+	release_writer(ps.writer);
+
+	return ret;
+}
+
+/*
+ * Takes an idle writer, or a new one if all of them are busy.
+ * Called with packs_lock held.
+ */
+static struct pack_writer *get_writer()
+{
+	struct pack_writer *w = NULL;
+
+	for (w=writers;w;w=w->next)
+		if (!w->busy)
+			break;
+
+	if (!w) {
+		w = calloc(1, sizeof(struct pack_writer));
+		if (!w) {
+			fprintf(stderr, "Error allocating memory for pack writer!\n");
+			return NULL;
+		}
+
+		w->next = writers;
+		writers = w;
+	}
+
+	w->busy = 1;
+	return w;
+}
+
+static void release_writer(struct pack_writer *w)
+{
+	pthread_mutex_lock(&packs_lock);
+	w->busy = 0;
+	pthread_mutex_unlock(&packs_lock);
+}
+
+static int start_pack(struct pack_writer *w)
+{
+	char path[PATH_MAX];
+	struct pack_header hdr;
+	struct pack *pack = calloc(1, sizeof(struct pack));
+
+	if (!pack) {
+		fprintf(stderr, "Error allocating memory for pack!\n");
+		return -ENOMEM;
+	}
+
+	mkdir(".bkp-data/packs", 0755);
+
+	snprintf(pack->name, sizeof(pack->name), "pack-%010ld-%d-%d", (long)time(NULL), getpid(), pack_seq++);
+	snprintf(path, PATH_MAX, ".bkp-data/packs/%s.pack", pack->name);
+
+	pack->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (pack->fd < 0) {
+		fprintf(stderr, "Error creating pack %s (errno: %d)!\n", path, errno);
+		free(pack);
+		return -1;
+	}
+
+	// tells other processes the pack is still being written
+	flock(pack->fd, LOCK_EX);
+
+	memcpy(hdr.magic, PACK_MAGIC, 4);
+	hdr.version = PACK_VERSION;
+
+	if (write(pack->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		fprintf(stderr, "Error writing pack header %s!\n", path);
+		free_pack(pack);
+		return -1;
+	}
+
+	w->pack = pack;
+	w->offset = sizeof(hdr);
+	w->entries_cap = 0;
+
+	return 0;
+}
+
+/*
+ * Called with packs_lock held
+ */
+static int finish_writer(struct pack_writer *w)
+{
+	int ret = 0;
+	struct pack *pack = w->pack;
+
+	if (!pack)
+		return 0;
+
+	if (pack->num_entries > 0)
+		qsort(pack->entries, pack->num_entries, sizeof(struct pack_idx_entry), cmp_idx_entry);
+
+	if (fsync(pack->fd)) {
+		fprintf(stderr, "Error syncing pack %s!\n", pack->name);
+		ret = -1;
+	}
+
+	if (!ret)
+		ret = write_pack_idx(pack);
+
+	pack->has_idx = ret == 0;
+
+	flock(pack->fd, LOCK_UN);
+
+	free(w->hash);
+	w->hash = NULL;
+	w->hash_size = 0;
+	w->pack = NULL;
+
+	if (add_pack(pack))
+		return -ENOMEM;
+
+	return ret;
+}
+
+static int add_writer_entry(struct pack_writer *w, struct pack_idx_entry *entry)
+{
+	struct pack *pack = w->pack;
+	uint32_t slot = 0;
+
+	if (pack->num_entries == w->entries_cap) {
+		uint32_t cap = w->entries_cap > 0 ? w->entries_cap * 2 : 1024;
+		struct pack_idx_entry *tmp = realloc(pack->entries, cap * sizeof(struct pack_idx_entry));
+
+		if (!tmp) {
+			fprintf(stderr, "Error allocating memory for pack index!\n");
+			return -ENOMEM;
+		}
+
+		pack->entries = tmp;
+		w->entries_cap = cap;
+	}
+
+	if ((pack->num_entries + 1) * 2 > w->hash_size && grow_writer_hash(w))
+		return -ENOMEM;
+
+	pack->entries[pack->num_entries++] = *entry;
+
+	memcpy(&slot, entry->sha1, sizeof(slot));
+	slot &= w->hash_size - 1;
+
+	while (w->hash[slot])
+		slot = (slot + 1) & (w->hash_size - 1);
+
+	w->hash[slot] = pack->num_entries;
+
+	return 0;
+}
+
+static int grow_writer_hash(struct pack_writer *w)
+{
+	uint32_t size = w->hash_size > 0 ? w->hash_size * 2 : 4096;
+	uint32_t *hash = calloc(size, sizeof(uint32_t));
+	uint32_t slot = 0;
+
+	if (!hash) {
+		fprintf(stderr, "Error allocating memory for pack hash!\n");
+		return -ENOMEM;
+	}
+
+	for (uint32_t i=0;i<w->pack->num_entries;i++) {
+		memcpy(&slot, w->pack->entries[i].sha1, sizeof(slot));
+		slot &= size - 1;
+
+		while (hash[slot])
+			slot = (slot + 1) & (size - 1);
+
+		hash[slot] = i + 1;
+	}
+
+	free(w->hash);
+	w->hash = hash;
+	w->hash_size = size;
+
+	return 0;
+}
+
+static int cmp_idx_entry(const void *a, const void *b)
+{
+	return memcmp(((struct pack_idx_entry *)a)->sha1, ((struct pack_idx_entry *)b)->sha1, HASH_MAX_LEN);
+}
+
+static int is_loose_object_name(char *name)
+{
+	int len = 0;
+
+	for (; name[len]; len++)
+		if (!((name[len] >= '0' && name[len] <= '9') || (name[len] >= 'a' && name[len] <= 'f')))
+			return 0;
+
+	return len == repo_hash_len() * 2;
+}
+
+static int read_whole_file(char *path, char **out_buff, int *out_len)
+{
+	struct stat st;
+	char *buff = NULL;
+	int offset = 0;
+	int bytes = 0;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "Error opening %s!\n", path);
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+
+	buff = malloc(st.st_size > 0 ? st.st_size : 1);
+	if (!buff) {
+		fprintf(stderr, "Error allocating memory for %s!\n", path);
+		close(fd);
+		return -ENOMEM;
+	}
+
+	while (offset < st.st_size && (bytes = read(fd, buff + offset, st.st_size - offset)) > 0)
+		offset += bytes;
+
+	close(fd);
+
+	if (offset != st.st_size) {
+		fprintf(stderr, "Error reading %s!\n", path);
+		free(buff);
+		return -1;
+	}
+
+	*out_buff = buff;
+	*out_len = offset;
+
+	return 0;
+}
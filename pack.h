@@ -0,0 +1,83 @@
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+
+#include "hash.h"
+
+#define PACK_MAGIC "BKPK"
+#define PACK_IDX_MAGIC "BKPI"
+#define PACK_VERSION 2
+
+#define PACK_MAX_SIZE (1024L * 1024 * 1024) // 1GB
+#define PACK_NAME_LEN 64
+
+/*
+ * A pack is a segment file holding many objects one after
+ * the other, each of them prefixed with a pack_record:
+ *
+ *	pack_header | pack_record | data | pack_record | data | ...
+ *
+ * The .idx file next to a finished pack holds the pack_idx_entry
+ * of every object, sorted by sha1.
+ */
+struct pack_header {
+	char magic[4];
+	uint32_t version;
+};
+
+struct pack_record {
+	unsigned char sha1[HASH_MAX_LEN];
+	uint32_t len;
+};
+
+struct pack_idx_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t num_entries;
+	uint32_t reserved;
+};
+
+struct pack_idx_entry {
+	unsigned char sha1[HASH_MAX_LEN];
+	uint32_t len;
+	uint64_t offset; // offset of the object data
+};
+
+struct pack_writer;
+struct object_index;
+
+/*
+ * Packs with at least 1/SWEEP_REWRITE_RATIO of their bytes in dead
+ * objects are rewritten by sweep_objects(), the others are kept
+ */
+#define SWEEP_REWRITE_RATIO 10
+
+struct sweep_stats {
+	uint64_t removed; // dead objects removed
+	uint64_t freed; // bytes
+	uint64_t left; // bytes of dead objects left in packs
+};
+
+/*
+ * An object being appended to a pack, see pack_stream_begin()
+ */
+struct pack_stream {
+	struct pack_writer *writer;
+	uint32_t len;
+};
+
+int has_packed_object(unsigned char *sha1);
+int read_packed_object(unsigned char *sha1, char **out_buff, int *out_len);
+int has_loose_objects();
+int pack_stream_begin(struct pack_stream *ps);
+int pack_stream_write(struct pack_stream *ps, char *buff, int len);
+int pack_stream_end(struct pack_stream *ps, unsigned char *sha1, int checked);
+void pack_stream_abort(struct pack_stream *ps);
+int finish_pack();
+int repack_objects();
+int update_object_index();
+int sweep_objects(struct object_index *idx, uint64_t *live, struct sweep_stats *stats);
+
+#endif
@@ -1,4 +1,3 @@
-#include <openssl/sha.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,7 +14,7 @@
 int print_sha1_file(char *sha1_hex)
 {
 	int ret = 0;
-	unsigned char sha1[SHA_DIGEST_LENGTH];
+	unsigned char sha1[HASH_MAX_LEN];
 	char ftype[10] = {0};
 	char *out_buff;
 	int out_buff_len = 0;
@@ -39,6 +38,9 @@ int print_sha1_file(char *sha1_hex)
 
 	if (strcmp(ftype, "chunks") == 0) 
 		return print_chunks_buffer(out_buff, out_buff_len);
+
+	if (strcmp(ftype, "chunkmap") == 0) 
+		return print_chunkmap_buffer(out_buff, out_buff_len);
 	
 	// blob
 	// chunks
@@ -0,0 +1,92 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "queue.h"
+
+int queue_init(struct queue *queue, int size)
+{
+	queue->items = calloc(size, sizeof(void *));
+	if (!queue->items) {
+		fprintf(stderr, "Error allocating memory for queue!\n");
+		return -ENOMEM;
+	}
+
+	queue->size = size;
+	queue->head = 0;
+	queue->len = 0;
+	queue->closed = 0;
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+
+	return 0;
+}
+
+void queue_destroy(struct queue *queue)
+{
+	free(queue->items);
+	queue->items = NULL;
+
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+}
+
+int queue_push(struct queue *queue, void *item)
+{
+	pthread_mutex_lock(&queue->lock);
+
+	while (queue->len == queue->size && !queue->closed)
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+
+	if (queue->closed) {
+		pthread_mutex_unlock(&queue->lock);
+		return -1;
+	}
+
+	queue->items[(queue->head + queue->len) % queue->size] = item;
+	queue->len++;
+
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+
+	return 0;
+}
+
+/*
+ * Returns NULL only when the queue was closed and
+ * all the remaining items were consumed
+ */
+void *queue_pop(struct queue *queue)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+
+	while (queue->len == 0 && !queue->closed)
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+	if (queue->len > 0) {
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->size;
+		queue->len--;
+
+		pthread_cond_signal(&queue->not_full);
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+	return item;
+}
+
+void queue_close(struct queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->closed = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->lock);
+}
@@ -0,0 +1,30 @@
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <pthread.h>
+
+/*
+ * Bounded, blocking FIFO of pointers shared between threads.
+ * queue_push() blocks while the queue is full and queue_pop()
+ * blocks while it is empty, so a slow stage automatically
+ * throttles the stage feeding it.
+ */
+struct queue {
+	void **items;
+	int size;
+	int head;
+	int len;
+	int closed;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+int queue_init(struct queue *queue, int size);
+void queue_destroy(struct queue *queue);
+int queue_push(struct queue *queue, void *item);
+void *queue_pop(struct queue *queue);
+void queue_close(struct queue *queue);
+
+#endif
@@ -14,8 +14,9 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.  
  */
 
+#define _GNU_SOURCE // fallocate(), nftw()
+
 #include <linux/limits.h>
-#include <openssl/sha.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,23 +26,198 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <ftw.h>
 
 #include "restore.h"
 #include "snapshot.h"
 #include "tree.h"
 #include "file.h"
 #include "sha1-file.h"
+#include "queue.h"
+#include "chunk-cache.h"
+#include "chunker.h"
+#include "cache.h"
+#include "config.h"
+#include "bkp.h"
+
+/*
+ * Restores run as a small pipeline, like backups do:
+ *
+ *   main thread     - walks the trees, creates the directories and
+ *                     queues their files
+ *   file threads    - open the output files, read their "chunks"
+ *                     objects and queue the chunks one by one
+ *   worker threads  - read and decompress the chunks
+ *
+ * Chunks of the same file are decompressed in parallel, but written
+ * in order: a decompressed chunk waits in its job until all chunks
+ * before it were written, and whoever completes the next chunk of
+ * a file writes it (and the ones waiting after it). No new chunks
+ * are queued while the waiting chunks take up more than
+ * bkp_opts.restore_memory bytes. Decompressed chunks are kept in an
+ * LRU cache (of bkp_opts.restore_cache bytes), so chunks shared by
+ * many files are mostly read and decompressed once.
+ *
+ * Hole markers (chunks of zeros) are not read, the file is seeked
+ * over them (and over blocks of zeros inside the other chunks) and
+ * truncated to its size at the end, so sparse files come back sparse.
+ *
+ * With --in-place the output directory may already have content.
+ * Existing files are updated by the file threads themselves: their
+ * chunks are compared with the chunks of the snapshot and only the
+ * ones which differ are written (see inplace_file()).
+ */
+#define SPARSE_BLOCK_SIZE 4096
+
+struct restore_job {
+	int fd;
+	int perms;
+	unsigned char sha1[HASH_MAX_LEN]; // of the "chunks" object
+	int num_chunks;
+	struct restore_chunk **done; // decompressed, not written yet
+	int next; // index of the next chunk to be written
+	int writing; // a thread is writing the chunks from next on
+	int holes; // the size has to be set at the end
+	int in_place; // the file exists, only the changed chunks are written
+	int pending; // chunks in flight + 1 reference held by the file thread
+	int error;
+	pthread_mutex_t lock;
+	char path[0];
+};
+
+struct restore_chunk {
+	struct restore_job *job;
+	int idx;
+	unsigned char sha1[HASH_MAX_LEN];
+	char *buff; // NULL for holes
+	int len;
+	struct cached_chunk *cached; // owner of buff, if it is cached
+};
+
+/*
+ * A component of the paths to restore
+ */
+struct path_node {
+	struct path_node *parent;
+	struct path_node **children; // sorted by name once the trie is built
+	int children_len;
+	int children_size;
+	int all; // restored with everything below it
+	int requested; // one of the paths to restore ends here
+	int found; // in the snapshot
+	int name_len;
+	char name[0];
+};
+
+/*
+ * A chunk of an existing file, updated in place
+ */
+struct target_chunk {
+	unsigned char sha1[HASH_MAX_LEN];
+	off_t offset;
+	int len;
+};
+
+struct restore_stage {
+	pthread_t *threads;
+	int num_threads;
+};
+
+static struct queue files_queue;
+static struct queue chunks_queue;
+
+static struct restore_stage file_threads;
+static struct restore_stage workers;
 
-static int restore_tree(unsigned char *sha1, char *out_path, char *sub_path, int sub_path_len);
-static int restore_dir(struct tree_entry *entry, char *out_path, char *sub_path, int sub_path_len);
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mem_freed = PTHREAD_COND_INITIALIZER;
+static size_t mem_used = 0; // by decompressed chunks not written yet
+
+static struct chunk_cache chunk_cache;
+
+static int restore_error = 0;
+
+/*
+ * Restoring in place into the backed up directory: its filecache
+ * tells the chunks of the files which weren`t modified since
+ */
+static struct cache *target_cache = NULL;
+static int out_root_len = 0;
+
+static uint64_t files_in_place = 0;
+static uint64_t bytes_kept = 0;
+static uint64_t bytes_written = 0;
+
+/*
+ * Directories without write permission for the owner are created
+ * writable (their files are restored later, by other threads) and
+ * only get their permissions once everything was restored
+ */
+struct locked_dir {
+	char *path;
+	int perms;
+};
+
+static struct locked_dir *locked_dirs = NULL;
+static int locked_dirs_len = 0;
+static int locked_dirs_size = 0;
+
+static int restore_start(int threads);
+static int restore_stop();
+static int start_stage(struct restore_stage *stage, int num_threads, void *(*fn)(void *));
+static void join_stage(struct restore_stage *stage);
+static void *file_thread(void *arg);
+static void *worker_thread(void *arg);
+static void queue_chunks(struct restore_job *job);
+static void inplace_file(struct restore_job *job);
+static int read_target_chunks(struct restore_job *job, struct stat *sb, struct target_chunk **out_chunks, int *num_chunks);
+static int chunk_target_file(struct restore_job *job, struct stat *sb, struct target_chunk **out_chunks, int *num_chunks);
+static int add_target_chunk(struct target_chunk **chunks, int *len, int *size, unsigned char *sha1, off_t offset, int chunk_len);
+static int compare_target_chunks(const void *a, const void *b);
+static struct target_chunk *find_target_chunk(struct target_chunk *chunks, int num_chunks, unsigned char *sha1, off_t offset);
+static int update_chunk(struct restore_job *job, unsigned char *sha1, off_t offset, struct target_chunk *old, int *len);
+static int pread_all(int fd, char *buff, int len, off_t offset);
+static int pwrite_sparse(int fd, char *buff, int len, off_t offset);
+static int write_run(int fd, char *buff, int len, off_t offset, int zeros);
+static int punch_hole(int fd, off_t offset, int len);
+static int pwrite_all(int fd, char *buff, int len, off_t offset);
+static void write_chunks(struct restore_job *job, struct restore_chunk *chunk);
+static int write_chunk(struct restore_job *job, struct restore_chunk *chunk);
+static int write_all(int fd, char *buff, int len);
+static void use_mem(ssize_t len);
+static void wait_mem();
+static void free_chunk(struct restore_chunk *chunk);
+static void fail_job(struct restore_job *job);
+static void put_job(struct restore_job *job);
+static int add_locked_dir(char *path, int perms);
+static int unlock_dirs();
+static struct path_node *build_path_trie(char **paths, int num_paths);
+static struct path_node *new_path_node(struct path_node *parent, char *name, int name_len);
+static struct path_node *find_path_node(struct path_node *node, char *name, int name_len, int create);
+static int compare_names(char *name1, int len1, char *name2, int len2);
+static int compare_path_nodes(const void *a, const void *b);
+static void sort_path_trie(struct path_node *node);
+static void free_path_trie(struct path_node *node);
+static int report_missing_paths(struct path_node *node);
+static int print_node_path(struct path_node *node, char *buff, int size);
+static int restore_tree(unsigned char *sha1, char *out_path, struct path_node *node);
+static int restore_dir(struct tree_entry *entry, char *out_path, struct path_node *node);
 static int restore_file(struct tree_entry *entry, char *out_path);
+static int clear_path(char *path, int dir, int *exists);
+static int remove_path(char *path);
+static int remove_entry(const char *path, const struct stat *sb, int type, struct FTW *ftw);
+static int remove_extra_entries(struct tree *tree, char *out_path);
+static int compare_tree_entries(const void *a, const void *b);
+static int has_tree_entry(struct tree_entry **entries, int num_entries, char *name);
 
-int restore_snapshot(unsigned char *sha1, char *path, char *sub_path)
+int restore_snapshot(unsigned char *sha1, char *path, char **sub_paths, int num_sub_paths)
 {
 	int ret = 0;
 	DIR *dir = NULL;
 	struct dirent *dentry;
 	struct snapshot snapshot;
+	struct path_node *paths = NULL;
 
 	ret = read_snapshot_file(sha1, &snapshot);
 	if (ret)
@@ -53,50 +229,72 @@ int restore_snapshot(unsigned char *sha1, char *path, char *sub_path)
 		return -1;
 	}
 
-	/*
-	 * Check if output directory is empty.
-	 *
-	 * TODO - in the future we will need to accept
-	 * directories which are not empty, even the same
-	 * directory we are backing up
-	 */
-	while ((dentry = readdir(dir)) != NULL) {
+	// check if output directory is empty, unless restoring in place
+	while (!bkp_opts.restore_in_place && (dentry = readdir(dir)) != NULL) {
 		if (strcmp(dentry->d_name, ".") == 0 || strcmp(dentry->d_name, "..") == 0)
 			continue;
 		
-		fprintf(stderr, "Output directory not empty! For now only empty output directories are accepted!\n");
+		fprintf(stderr, "Output directory not empty! Use --in-place to restore into it!\n");
 		closedir(dir);
 		return -1;
 	}
 	closedir(dir);
 
-	/*
-	 * TODO - here we need to sanitize path and sub_path so 
-	 * we can be sure they have the same structure (regarding
-	 * slashes at the beginning, end etc.) no matter what the 
-	 * user wrote
-	 */
-	if (sub_path) {
-		char full_sub_path[PATH_MAX];
-		int sub_path_len = strlen(sub_path);
-		
-		// remove leading / (if exists)
-		if (sub_path[0] == '/') {
-			sub_path++;
-			sub_path_len--;	
-		}
+	out_root_len = strlen(path);
 
-		// remove ending / (if exists)
-		if (sub_path[sub_path_len-1] == '/') {
-			sub_path[sub_path_len-1] = '\0';
-			sub_path_len--;
+	if (bkp_opts.restore_in_place) {
+		char out_real[PATH_MAX];
+		char cwd_real[PATH_MAX];
+
+		if (realpath(path, out_real) && realpath(".", cwd_real) && strcmp(out_real, cwd_real) == 0) {
+			printf("Loading filecache into memory... ");
+			fflush(stdout);
+
+			target_cache = load_cache();
+			if (!target_cache)
+				return -1;
+
+			printf("done\n");
 		}
+	}
 
-		snprintf(full_sub_path, PATH_MAX, "%s%s", path, sub_path);
-		ret = restore_tree(snapshot.tree_sha1, path, full_sub_path, strlen(full_sub_path));
+	// no sub paths: everything is restored
+	if (num_sub_paths > 0) {
+		paths = build_path_trie(sub_paths, num_sub_paths);
+		if (!paths) {
+			ret = -1;
+			goto end;
+		}
 	}
-	else 
-		ret = restore_tree(snapshot.tree_sha1, path, NULL, 0); 
+
+	ret = restore_start(bkp_opts.threads);
+	if (ret)
+		goto end;
+
+	ret = restore_tree(snapshot.tree_sha1, path, paths);
+
+	if (ret)
+		__atomic_store_n(&restore_error, 1, __ATOMIC_RELAXED);
+
+	// waits for the queued files, even after an error
+	if (restore_stop())
+		ret = -1;
+
+	if (unlock_dirs())
+		ret = -1;
+
+	if (!ret && paths && report_missing_paths(paths))
+		ret = -1;
+
+	if (bkp_opts.restore_in_place)
+		printf("Updated %llu files in place: %llu bytes kept, %llu bytes written\n", 
+				(unsigned long long)files_in_place, (unsigned long long)bytes_kept, 
+				(unsigned long long)bytes_written);
+
+end:
+	free_path_trie(paths);
+	free_cache(target_cache);
+	target_cache = NULL;
 
 	if (ret)
 		return -1;
@@ -104,65 +302,308 @@ int restore_snapshot(unsigned char *sha1, char *path, char *sub_path)
 	return 0;
 }
 
-static int restore_tree(unsigned char *sha1, char *out_path, char *sub_path, int sub_path_len)
+/*
+ * Reads the paths to restore from a file, one per line. Empty lines
+ * and lines starting with # are skipped.
+ */
+int read_paths_file(char *file, char ***paths, int *num_paths)
+{
+	FILE *fp = NULL;
+	char line[PATH_MAX];
+	int len = 0;
+	int size = *num_paths;
+	char **tmp = NULL;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		fprintf(stderr, "Error opening %s - %s!\n", file, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		len = strlen(line);
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = '\0';
+
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		if (*num_paths == size) {
+			size = size > 0 ? size * 2 : 64;
+			tmp = realloc(*paths, size * sizeof(char *));
+			if (!tmp) {
+				fprintf(stderr, "Error allocating memory for the paths to restore!\n");
+				fclose(fp);
+				return -ENOMEM;
+			}
+
+			*paths = tmp;
+		}
+
+		(*paths)[*num_paths] = strdup(line);
+		if (!(*paths)[*num_paths]) {
+			fprintf(stderr, "Error allocating memory for the paths to restore!\n");
+			fclose(fp);
+			return -ENOMEM;
+		}
+
+		(*num_paths)++;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * Compiles the paths to restore into a trie of their components, so
+ * a single walk of the snapshot visits every tree leading to any of
+ * them (and no other tree). A path restored as a whole has no
+ * children, paths below it are redundant.
+ */
+static struct path_node *build_path_trie(char **paths, int num_paths)
+{
+	struct path_node *root = new_path_node(NULL, "", 0);
+
+	if (!root)
+		return NULL;
+
+	for (int i=0;i<num_paths;i++) {
+		struct path_node *node = root;
+		char *p = paths[i];
+
+		while (*p && !node->all) {
+			char *name = p;
+			int name_len = 0;
+
+			while (*p && *p != '/')
+				p++;
+
+			name_len = p - name;
+
+			while (*p == '/')
+				p++;
+
+			// "a//b", "/a", "./a" and "a/" are all just "a"
+			if (name_len == 0 || (name_len == 1 && name[0] == '.'))
+				continue;
+
+			node = find_path_node(node, name, name_len, 1);
+			if (!node) {
+				free_path_trie(root);
+				return NULL;
+			}
+		}
+
+		node->all = 1;
+		node->requested = 1;
+
+		// anything below it was already requested is covered now
+		for (int j=0;j<node->children_len;j++)
+			free_path_trie(node->children[j]);
+
+		node->children_len = 0;
+	}
+
+	sort_path_trie(root);
+
+	return root;
+}
+
+static struct path_node *new_path_node(struct path_node *parent, char *name, int name_len)
+{
+	struct path_node *node = calloc(1, sizeof(struct path_node) + name_len + 1);
+
+	if (!node) {
+		fprintf(stderr, "Error allocating memory for the paths to restore!\n");
+		return NULL;
+	}
+
+	node->parent = parent;
+	node->name_len = name_len;
+	memcpy(node->name, name, name_len);
+
+	return node;
+}
+
+/*
+ * While the trie is built (create set) the children are searched
+ * one by one, afterwards they are sorted and searched by halving
+ */
+static struct path_node *find_path_node(struct path_node *node, char *name, int name_len, int create)
+{
+	struct path_node *child = NULL;
+	struct path_node **tmp = NULL;
+
+	if (!create) {
+		int low = 0, high = node->children_len - 1;
+
+		while (low <= high) {
+			int mid = low + (high - low) / 2;
+			int cmp = compare_names(node->children[mid]->name, node->children[mid]->name_len, name, name_len);
+
+			if (cmp == 0)
+				return node->children[mid];
+			else if (cmp < 0)
+				low = mid + 1;
+			else
+				high = mid - 1;
+		}
+
+		return NULL;
+	}
+
+	for (int i=0;i<node->children_len;i++) {
+		child = node->children[i];
+		if (child->name_len == name_len && memcmp(child->name, name, name_len) == 0)
+			return child;
+	}
+
+	if (node->children_len == node->children_size) {
+		int size = node->children_size > 0 ? node->children_size * 2 : 4;
+
+		tmp = realloc(node->children, size * sizeof(struct path_node *));
+		if (!tmp) {
+			fprintf(stderr, "Error allocating memory for the paths to restore!\n");
+			return NULL;
+		}
+
+		node->children = tmp;
+		node->children_size = size;
+	}
+
+	child = new_path_node(node, name, name_len);
+	if (child)
+		node->children[node->children_len++] = child;
+
+	return child;
+}
+
+static int compare_names(char *name1, int len1, char *name2, int len2)
+{
+	int cmp = memcmp(name1, name2, len1 < len2 ? len1 : len2);
+
+	if (cmp)
+		return cmp;
+
+	return len1 - len2;
+}
+
+static int compare_path_nodes(const void *a, const void *b)
+{
+	const struct path_node *n1 = *(const struct path_node **)a;
+	const struct path_node *n2 = *(const struct path_node **)b;
+
+	return compare_names((char *)n1->name, n1->name_len, (char *)n2->name, n2->name_len);
+}
+
+static void sort_path_trie(struct path_node *node)
+{
+	qsort(node->children, node->children_len, sizeof(struct path_node *), compare_path_nodes);
+
+	for (int i=0;i<node->children_len;i++)
+		sort_path_trie(node->children[i]);
+}
+
+static void free_path_trie(struct path_node *node)
+{
+	if (!node)
+		return;
+
+	for (int i=0;i<node->children_len;i++)
+		free_path_trie(node->children[i]);
+
+	free(node->children);
+	free(node);
+}
+
+/*
+ * Requested paths which were not in the snapshot
+ */
+static int report_missing_paths(struct path_node *node)
+{
+	int ret = 0;
+	char path[PATH_MAX];
+
+	if (node->requested && !node->found) {
+		print_node_path(node, path, sizeof(path));
+		fprintf(stderr, "Path not found in the snapshot: %s\n", path);
+		ret = -1;
+	}
+
+	for (int i=0;i<node->children_len;i++) {
+		if (report_missing_paths(node->children[i]))
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static int print_node_path(struct path_node *node, char *buff, int size)
+{
+	int len = 0;
+
+	if (!node->parent)
+		return snprintf(buff, size, "/");
+
+	len = print_node_path(node->parent, buff, size);
+	if (len >= size)
+		return len;
+
+	return len + snprintf(buff + len, size - len, "%.*s%s", node->name_len, node->name, node->children_len > 0 ? "/" : "");
+}
+
+/*
+ * Restores the entries of the tree which are below node (every entry
+ * if node is NULL)
+ */
+static int restore_tree(unsigned char *sha1, char *out_path, struct path_node *node)
 {
 	int ret = 0;
 	struct tree tree;
 	struct tree_entry *entry = NULL;
+	struct path_node *child = NULL;
 	char full_out_path[PATH_MAX];
-	int full_out_path_len = 0;
-	
+
+	if (node && node->all) {
+		node->found = 1;
+		node = NULL;
+	}
+
 	ret = read_tree_file(sha1, &tree);
 	if (ret)
 		return -1;
 
+	// everything below is restored, what isn`t in the snapshot may go
+	if (!node && bkp_opts.restore_in_place && bkp_opts.restore_delete && remove_extra_entries(&tree, out_path)) {
+		ret = -1;
+		goto end;
+	}
+
 	for (int i=0;i<tree.entries_len;i++) {
 		entry = tree.entries[i];
-		full_out_path_len = snprintf(full_out_path, PATH_MAX, "%s%s", out_path, entry->name);
+		child = NULL;
 
-		if (sub_path) {
-			/*
-			 * cond0 - will be true when full_output_path passed sub_path 
-			 *		 (meanin we are in a subdirectory of the sub_path)
-			 * example: 
-			 *	sub_path = 'entry1/entry2'
-			 *	out_path = 'entry1/entry2/entry3' (ok)
-			 *			 = 'entry1/entry2/entry3/entry4' (ok)
-			 *
-			 * cond1 - will be true when the two path lengths are equal and 
-			 *		 the paths themselves are equal
-			 * example:
-			 *	sub_path = 'entry1/entry2'
-			 *	out_path = 'entry1/entry2'
-			 *
-			 * cond2 - will be true when full_out_path not yet reached the full 
-			 *		 sub_path, but as far as we know, we are at a directory which is 
-			 *		 part of sub_path 
-			 * example
-			 *	sub_path = 'entry1/entry2/entry3'
-			 *	out_path = 'entry1' (ok)
-			 *			 = 'entry1/entry2' (ok)
-			 *
-			 * If one of these 3 conditions are true, it means the path we are at needs
-			 * to be included in the restore
-			 */
-			int cond0 = full_out_path_len < sub_path_len &&
-						sub_path[full_out_path_len] == '/' &&
-						memcmp(full_out_path, sub_path, full_out_path_len) == 0;
-			int cond1 = full_out_path_len == sub_path_len && 
-						memcmp(full_out_path, sub_path, sub_path_len) == 0;
-			int cond2 = full_out_path_len > sub_path_len && 
-						full_out_path[sub_path_len] == '/' && 
-						memcmp(full_out_path, sub_path, sub_path_len) == 0;
-
-			if ( !cond0 && !cond1 && !cond2)
+		if (node) {
+			child = find_path_node(node, entry->name, entry->name_len, 0);
+			if (!child)
 				continue;
+
+			child->found = 1;
+
+			// only whole files can be restored
+			if (!child->all && !S_ISDIR(entry->st_mode))
+				continue;
+
+			if (child->all)
+				child = NULL;
 		}
 
+		snprintf(full_out_path, PATH_MAX, "%s%s", out_path, entry->name);
+
 		if (S_ISDIR(entry->st_mode)) {
 			strcat(full_out_path, "/");
 
-			if (restore_dir(entry, full_out_path, sub_path, sub_path_len)) {
+			if (restore_dir(entry, full_out_path, child)) {
 				ret = -1;
 				goto end;
 			}
@@ -188,77 +629,1074 @@ end:
 	return ret;
 }
 
-static int restore_dir(struct tree_entry *entry, char *out_path, char *sub_path, int sub_path_len)
+static int restore_dir(struct tree_entry *entry, char *out_path, struct path_node *node)
 {
 	int perms = entry->st_mode & 0777;
-	
-	if (mkdir(out_path, perms)) {
+	int exists = 0;
+
+	if (bkp_opts.restore_in_place && clear_path(out_path, 1, &exists))
+		return -1;
+
+	if (exists) {
+		if (chmod(out_path, perms | S_IRWXU)) {
+			fprintf(stderr, "Error setting permissions of directory: %s\n", out_path);
+			return -1;
+		}
+	}
+	else if (mkdir(out_path, perms | S_IRWXU)) {
 		fprintf(stderr, "Error creating directory: %s\n", out_path);
 		return -1;
 	}
 
-	return restore_tree(entry->sha1, out_path, sub_path, sub_path_len);
+	if ((perms & S_IRWXU) != S_IRWXU && add_locked_dir(out_path, perms))
+		return -1;
+
+	return restore_tree(entry->sha1, out_path, node);
 }
 
+/*
+ * Queues the file for the file threads, its directory exists by now
+ */
 static int restore_file(struct tree_entry *entry, char *out_path)
 {
-	int fd = 0;
+	int path_len = strlen(out_path);
+	int exists = 0;
+	struct restore_job *job = NULL;
+
+	if (bkp_opts.restore_in_place && clear_path(out_path, 0, &exists))
+		return -1;
+
+	job = malloc(sizeof(struct restore_job) + path_len + 1);
+	if (!job) {
+		fprintf(stderr, "Error allocating memory for restore job!\n");
+		return -ENOMEM;
+	}
+
+	job->fd = -1;
+	job->perms = entry->st_mode & 0777;
+	memcpy(job->sha1, entry->sha1, HASH_MAX_LEN);
+	job->num_chunks = 0;
+	job->done = NULL;
+	job->next = 0;
+	job->writing = 0;
+	job->holes = 0;
+	job->in_place = exists;
+	job->pending = 1;
+	job->error = 0;
+	pthread_mutex_init(&job->lock, NULL);
+	memcpy(job->path, out_path, path_len + 1);
+
+	if (queue_push(&files_queue, job)) {
+		fail_job(job);
+		put_job(job);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Makes room for a directory (dir set) or a regular file at path.
+ * Whatever else is there is removed, exists is set if the path can
+ * be reused as it is.
+ */
+static int clear_path(char *path, int dir, int *exists)
+{
+	char tmp[PATH_MAX];
+	int len = strlen(path);
+	struct stat sb;
+
+	*exists = 0;
+
+	// with the trailing / lstat() would follow a symlink
+	memcpy(tmp, path, len + 1);
+	while (len > 1 && tmp[len-1] == '/')
+		tmp[--len] = '\0';
+
+	if (lstat(tmp, &sb)) {
+		if (errno == ENOENT)
+			return 0;
+
+		fprintf(stderr, "Error calling lstat on %s - %s\n", tmp, strerror(errno));
+		return -1;
+	}
+
+	/*
+	 * Files with other hard links are replaced, updating them
+	 * would change the other paths too
+	 */
+	if (dir ? S_ISDIR(sb.st_mode) : (S_ISREG(sb.st_mode) && sb.st_nlink == 1)) {
+		*exists = 1;
+		return 0;
+	}
+
+	return remove_path(tmp);
+}
+
+static int remove_path(char *path)
+{
+	if (nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS)) {
+		fprintf(stderr, "Error removing %s - %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+	(void)sb;
+	(void)ftw;
+
+	return type == FTW_DP ? rmdir(path) : unlink(path);
+}
+
+/*
+ * Removes the entries of the output directory which aren`t in the
+ * tree (the repository itself is never removed)
+ */
+static int remove_extra_entries(struct tree *tree, char *out_path)
+{
 	int ret = 0;
-	unsigned char *chunks_buff = NULL;
-	char *blob_buff = NULL;
-	int num_chunks = 0;
-	int offset = 0;
-	int bytes = 0;
-	int blob_size = 0;
-	int perms = entry->st_mode & 0777;
+	DIR *dir = NULL;
+	struct dirent *dentry = NULL;
+	struct tree_entry **entries = NULL;
+	char path[PATH_MAX];
 
-	fd = open(out_path, O_WRONLY | O_CREAT, perms);
-	if (fd < 0) {
-		ret = -1;
-		fprintf(stderr, "Error opening output file: %s - %s\n", out_path, strerror(errno));
+	dir = opendir(out_path);
+	if (!dir) {
+		fprintf(stderr, "Error opening %s - %s!\n", out_path, strerror(errno));
+		return -1;
+	}
+
+	entries = malloc((tree->entries_len > 0 ? tree->entries_len : 1) * sizeof(struct tree_entry *));
+	if (!entries) {
+		fprintf(stderr, "Error allocating memory for tree entries!\n");
+		ret = -ENOMEM;
 		goto end;
 	}
 
-	ret = read_chunks_file(entry->sha1, &chunks_buff, &num_chunks);
-	if (ret)
-		return -1;
+	if (tree->entries_len > 0) {
+		memcpy(entries, tree->entries, tree->entries_len * sizeof(struct tree_entry *));
+		qsort(entries, tree->entries_len, sizeof(struct tree_entry *), compare_tree_entries);
+	}
+
+	while ((dentry = readdir(dir)) != NULL) {
+		if (strcmp(dentry->d_name, ".") == 0 || strcmp(dentry->d_name, "..") == 0)
+			continue;
+
+		if ((int)strlen(out_path) == out_root_len && strcmp(dentry->d_name, ".bkp-data") == 0)
+			continue;
 
-	while(num_chunks > 0) {
-		unsigned char *sha1 = chunks_buff+offset;
-		offset += SHA_DIGEST_LENGTH;
-		num_chunks--;
+		if (has_tree_entry(entries, tree->entries_len, dentry->d_name))
+			continue;
 
-		/*
-		 * Let`s write the blob chunks
-		 */	
-		ret = read_blob(sha1, &blob_buff, &blob_size);
+		snprintf(path, PATH_MAX, "%s%s", out_path, dentry->d_name);
 
-		if (ret) 
+		if (remove_path(path)) {
+			ret = -1;
 			goto end;
-	
-		if (blob_size > 0) {
-			bytes = write(fd, blob_buff, blob_size);
-			if (bytes != blob_size) {
-				ret = -1;
-				fprintf(stderr, "Error writing to output file: %s - %s\n", out_path, strerror(errno));
-				goto end;
-			}
 		}
-
-		free(blob_buff);
-		blob_buff = NULL;
 	}
 
 end:
-	if (chunks_buff)
-		free(chunks_buff);
-
-	if (blob_buff)
-		free(blob_buff);
+	free(entries);
+	closedir(dir);
+	return ret;
+}
 
-	if (fd >= 0)
-		close(fd);
+static int compare_tree_entries(const void *a, const void *b)
+{
+	const struct tree_entry *e1 = *(const struct tree_entry **)a;
+	const struct tree_entry *e2 = *(const struct tree_entry **)b;
 
-	return ret;
+	return compare_names((char *)e1->name, e1->name_len, (char *)e2->name, e2->name_len);
 }
 
+static int has_tree_entry(struct tree_entry **entries, int num_entries, char *name)
+{
+	int name_len = strlen(name);
+	int low = 0, high = num_entries - 1;
+
+	while (low <= high) {
+		int mid = low + (high - low) / 2;
+		int cmp = compare_names(entries[mid]->name, entries[mid]->name_len, name, name_len);
+
+		if (cmp == 0)
+			return 1;
+		else if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return 0;
+}
+
+static int restore_start(int threads)
+{
+	int ret = 0;
+	int num_file_threads = threads / 4 > 0 ? threads / 4 : 1;
+
+	if (threads < 1)
+		threads = 1;
+
+	// existing files are compared and written by the file threads
+	if (bkp_opts.restore_in_place)
+		num_file_threads = threads;
+
+	restore_error = 0;
+	mem_used = 0;
+	files_in_place = 0;
+	bytes_kept = 0;
+	bytes_written = 0;
+
+	ret = chunk_cache_init(&chunk_cache, bkp_opts.restore_cache);
+	if (ret)
+		return ret;
+
+	ret = queue_init(&files_queue, threads * 4);
+	if (!ret)
+		ret = queue_init(&chunks_queue, threads * 2);
+	if (ret)
+		return ret;
+
+	ret = start_stage(&workers, threads, worker_thread);
+	if (!ret)
+		ret = start_stage(&file_threads, num_file_threads, file_thread);
+
+	if (ret) {
+		restore_error = 1;
+		restore_stop();
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Waits for the queued files to be restored and stops all threads
+ */
+static int restore_stop()
+{
+	queue_close(&files_queue);
+	join_stage(&file_threads);
+
+	queue_close(&chunks_queue);
+	join_stage(&workers);
+
+	queue_destroy(&files_queue);
+	queue_destroy(&chunks_queue);
+
+	if (chunk_cache.max_size > 0 && chunk_cache.hits + chunk_cache.misses > 0)
+		printf("Chunk cache: %llu hits, %llu misses\n", 
+				(unsigned long long)chunk_cache.hits, (unsigned long long)chunk_cache.misses);
+
+	chunk_cache_destroy(&chunk_cache);
+
+	return restore_error ? -1 : 0;
+}
+
+static int start_stage(struct restore_stage *stage, int num_threads, void *(*fn)(void *))
+{
+	stage->num_threads = 0;
+	stage->threads = calloc(num_threads, sizeof(pthread_t));
+
+	if (!stage->threads) {
+		fprintf(stderr, "Error allocating memory for restore threads!\n");
+		return -ENOMEM;
+	}
+
+	for (int i=0;i<num_threads;i++) {
+		if (pthread_create(&stage->threads[i], NULL, fn, NULL)) {
+			fprintf(stderr, "Error starting restore thread!\n");
+			return -1;
+		}
+		stage->num_threads++;
+	}
+
+	return 0;
+}
+
+static void join_stage(struct restore_stage *stage)
+{
+	for (int i=0;i<stage->num_threads;i++)
+		pthread_join(stage->threads[i], NULL);
+
+	free(stage->threads);
+	stage->threads = NULL;
+	stage->num_threads = 0;
+}
+
+static void *file_thread(void *arg)
+{
+	struct restore_job *job = NULL;
+
+	(void)arg;
+
+	while ((job = queue_pop(&files_queue)) != NULL) {
+		if (job->in_place)
+			inplace_file(job);
+		else
+			queue_chunks(job);
+
+		put_job(job);
+	}
+
+	return NULL;
+}
+
+static void queue_chunks(struct restore_job *job)
+{
+	unsigned char *chunks_buff = NULL;
+	struct restore_chunk *chunk = NULL;
+
+	// nothing new is started after an error
+	if (job->error || __atomic_load_n(&restore_error, __ATOMIC_RELAXED)) {
+		fail_job(job);
+		return;
+	}
+
+	job->fd = open(job->path, O_WRONLY | O_CREAT | O_CLOEXEC, job->perms);
+	if (job->fd < 0) {
+		fprintf(stderr, "Error opening output file: %s - %s\n", job->path, strerror(errno));
+		fail_job(job);
+		return;
+	}
+
+	if (read_chunks_file(job->sha1, &chunks_buff, &job->num_chunks)) {
+		fail_job(job);
+		return;
+	}
+
+	if (job->num_chunks > 0) {
+		job->done = calloc(job->num_chunks, sizeof(struct restore_chunk *));
+		if (!job->done) {
+			fprintf(stderr, "Error allocating memory for restore job!\n");
+			fail_job(job);
+			goto end;
+		}
+	}
+
+	for (int i=0;i<job->num_chunks;i++) {
+		wait_mem();
+
+		if (job->error || __atomic_load_n(&restore_error, __ATOMIC_RELAXED)) {
+			fail_job(job);
+			break;
+		}
+
+		chunk = malloc(sizeof(struct restore_chunk));
+		if (!chunk) {
+			fprintf(stderr, "Error allocating memory for restore chunk!\n");
+			fail_job(job);
+			break;
+		}
+
+		chunk->job = job;
+		chunk->idx = i;
+		chunk->buff = NULL;
+		chunk->len = 0;
+		chunk->cached = NULL;
+		get_chunk_sha1(chunks_buff, i, chunk->sha1);
+
+		pthread_mutex_lock(&job->lock);
+		job->pending++;
+		pthread_mutex_unlock(&job->lock);
+
+		if (queue_push(&chunks_queue, chunk)) {
+			free(chunk);
+			fail_job(job);
+			put_job(job);
+			break;
+		}
+	}
+
+end:
+	free(chunks_buff);
+}
+
+/*
+ * Brings an existing file to the content it has in the snapshot.
+ * Chunks already at the right offset are kept, chunks found later
+ * in the file are copied from there (they weren`t overwritten yet,
+ * the file is written from the beginning) and only the others are
+ * read from the repository.
+ */
+static void inplace_file(struct restore_job *job)
+{
+	unsigned char *chunks_buff = NULL;
+	struct target_chunk *old = NULL;
+	int num_old = 0;
+	struct stat sb;
+	unsigned char sha1[HASH_MAX_LEN];
+	off_t offset = 0;
+	int len = 0;
+
+	if (job->error || __atomic_load_n(&restore_error, __ATOMIC_RELAXED)) {
+		fail_job(job);
+		return;
+	}
+
+	job->fd = open(job->path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+	if (job->fd < 0 || fstat(job->fd, &sb)) {
+		fprintf(stderr, "Error opening output file: %s - %s\n", job->path, strerror(errno));
+		fail_job(job);
+		return;
+	}
+
+	if (read_target_chunks(job, &sb, &old, &num_old)) {
+		fail_job(job);
+		return;
+	}
+
+	// unchanged since it was backed up as this very file
+	if (num_old < 0) {
+		__atomic_add_fetch(&bytes_kept, sb.st_size, __ATOMIC_RELAXED);
+		goto perms;
+	}
+
+	if (read_chunks_file(job->sha1, &chunks_buff, &job->num_chunks)) {
+		fail_job(job);
+		goto end;
+	}
+
+	qsort(old, num_old, sizeof(struct target_chunk), compare_target_chunks);
+
+	for (int i=0;i<job->num_chunks;i++) {
+		if (__atomic_load_n(&restore_error, __ATOMIC_RELAXED)) {
+			fail_job(job);
+			goto end;
+		}
+
+		get_chunk_sha1(chunks_buff, i, sha1);
+
+		if (update_chunk(job, sha1, offset, find_target_chunk(old, num_old, sha1, offset), &len)) {
+			fail_job(job);
+			goto end;
+		}
+
+		offset += len;
+	}
+
+	// nothing was written past offset
+	if (sb.st_size != offset) {
+		if (ftruncate(job->fd, offset)) {
+			fprintf(stderr, "Error setting the size of output file: %s - %s\n", job->path, strerror(errno));
+			fail_job(job);
+			goto end;
+		}
+	}
+
+perms:
+	if ((int)(sb.st_mode & 0777) != job->perms && fchmod(job->fd, job->perms)) {
+		fprintf(stderr, "Error setting permissions of output file: %s - %s\n", job->path, strerror(errno));
+		fail_job(job);
+		goto end;
+	}
+
+	__atomic_add_fetch(&files_in_place, 1, __ATOMIC_RELAXED);
+
+end:
+	free(chunks_buff);
+	free(old);
+}
+
+/*
+ * The chunks of the existing file: from the filecache if the file
+ * wasn`t modified since the last backup, otherwise they are cut and
+ * hashed the way a backup would. num_chunks is set to -1 if the file
+ * is the one in the snapshot.
+ */
+static int read_target_chunks(struct restore_job *job, struct stat *sb, struct target_chunk **out_chunks, int *num_chunks)
+{
+	char path[PATH_MAX];
+	struct cache_entry *entry = NULL;
+	struct chunk_fp *fps = NULL;
+	int size = 0;
+	off_t offset = 0;
+
+	*out_chunks = NULL;
+	*num_chunks = 0;
+
+	if (target_cache) {
+		snprintf(path, PATH_MAX, "./%s", job->path + out_root_len);
+		entry = find_cache_entry(target_cache, path);
+	}
+
+	// content rewritten with the old size and mtime only changes the ctime
+	if (!entry || (cache_entry_changed(entry, sb) & ~CE_MODE_CHANGED))
+		return chunk_target_file(job, sb, out_chunks, num_chunks);
+
+	if (memcmp(entry->sha1, job->sha1, HASH_MAX_LEN) == 0) {
+		*num_chunks = -1;
+		return 0;
+	}
+
+	fps = cache_entry_chunks(entry);
+
+	for (int i=0;i<entry->num_chunks;i++) {
+		if (add_target_chunk(out_chunks, num_chunks, &size, fps[i].sha1, offset, fps[i].size))
+			return -1;
+
+		offset += fps[i].size;
+	}
+
+	return 0;
+}
+
+/*
+ * Object ids are only the hash of the chunk data since
+ * REPO_FORMAT_V2, in older repositories nothing can be matched
+ */
+static int chunk_target_file(struct restore_job *job, struct stat *sb, struct target_chunk **out_chunks, int *num_chunks)
+{
+	int ret = 0;
+	struct chunker_params *chunker = &repo_cfg.chunker;
+	char *buff = NULL;
+	int size = 0;
+	int filled = 0;
+	int bytes = 0;
+	int cut = 0;
+	off_t offset = 0;
+	unsigned char sha1[HASH_MAX_LEN];
+
+	if (repo_cfg.format < REPO_FORMAT_V2 || sb->st_size == 0)
+		return 0;
+
+	buff = malloc(chunker->max_size);
+	if (!buff) {
+		fprintf(stderr, "Error allocating memory for read buffer while restoring file!\n");
+		return -ENOMEM;
+	}
+
+	while (1) {
+		bytes = pread(job->fd, buff + filled, chunker->max_size - filled, offset + filled);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "Error reading output file: %s - %s\n", job->path, strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		filled += bytes;
+		if (filled == 0)
+			break;
+
+		// like in a backup, the chunker always gets a full buffer
+		if (bytes > 0 && filled < chunker->max_size)
+			continue;
+
+		cut = chunker_next_cut(chunker, (unsigned char *)buff, filled);
+
+		memset(sha1, 0, HASH_MAX_LEN);
+
+		if (repo_cfg.format >= REPO_FORMAT_V3 && is_zero_buffer(buff, cut))
+			hole_id(cut, sha1);
+		else if (hash_blob(buff, cut, sha1)) {
+			ret = -1;
+			break;
+		}
+
+		if (add_target_chunk(out_chunks, num_chunks, &size, sha1, offset, cut)) {
+			ret = -1;
+			break;
+		}
+
+		memmove(buff, buff + cut, filled - cut);
+		filled -= cut;
+		offset += cut;
+	}
+
+	free(buff);
+	return ret;
+}
+
+static int add_target_chunk(struct target_chunk **chunks, int *len, int *size, unsigned char *sha1, off_t offset, int chunk_len)
+{
+	if (*len == *size) {
+		int new_size = *size > 0 ? *size * 2 : 16;
+		struct target_chunk *tmp = realloc(*chunks, new_size * sizeof(struct target_chunk));
+
+		if (!tmp) {
+			fprintf(stderr, "Error allocating memory for the chunks of the output file!\n");
+			return -ENOMEM;
+		}
+
+		*chunks = tmp;
+		*size = new_size;
+	}
+
+	memcpy((*chunks)[*len].sha1, sha1, HASH_MAX_LEN);
+	(*chunks)[*len].offset = offset;
+	(*chunks)[*len].len = chunk_len;
+	(*len)++;
+
+	return 0;
+}
+
+static int compare_target_chunks(const void *a, const void *b)
+{
+	const struct target_chunk *c1 = a;
+	const struct target_chunk *c2 = b;
+	int cmp = memcmp(c1->sha1, c2->sha1, HASH_MAX_LEN);
+
+	if (cmp)
+		return cmp;
+
+	return c1->offset < c2->offset ? -1 : (c1->offset > c2->offset ? 1 : 0);
+}
+
+/*
+ * The first chunk with the id at offset or after it, the ones before
+ * offset may have been overwritten already
+ */
+static struct target_chunk *find_target_chunk(struct target_chunk *chunks, int num_chunks, unsigned char *sha1, off_t offset)
+{
+	int low = 0, high = num_chunks;
+
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+		int cmp = memcmp(chunks[mid].sha1, sha1, HASH_MAX_LEN);
+
+		if (cmp < 0 || (cmp == 0 && chunks[mid].offset < offset))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low < num_chunks && memcmp(chunks[low].sha1, sha1, HASH_MAX_LEN) == 0)
+		return &chunks[low];
+
+	return NULL;
+}
+
+/*
+ * Puts the chunk at offset, old is where the file already has it
+ */
+static int update_chunk(struct restore_job *job, unsigned char *sha1, off_t offset, struct target_chunk *old, int *len)
+{
+	int ret = 0;
+	char *buff = NULL;
+	struct cached_chunk *cached = NULL;
+
+	if (old && old->offset == offset) {
+		__atomic_add_fetch(&bytes_kept, old->len, __ATOMIC_RELAXED);
+		*len = old->len;
+		return 0;
+	}
+
+	if (is_hole_id(sha1, len)) {
+		if (punch_hole(job->fd, offset, *len) == 0)
+			return 0;
+
+		buff = calloc(1, *len);
+	}
+	else if (old) {
+		buff = malloc(old->len);
+		*len = old->len;
+
+		if (buff && pread_all(job->fd, buff, *len, old->offset)) {
+			fprintf(stderr, "Error reading output file: %s - %s\n", job->path, strerror(errno));
+			ret = -1;
+			goto end;
+		}
+	}
+	else if ((cached = chunk_cache_get(&chunk_cache, sha1)) != NULL) {
+		buff = cached->buff;
+		*len = cached->len;
+	}
+	else {
+		if (read_blob(sha1, &buff, len))
+			return -1;
+
+		if ((cached = chunk_cache_add(&chunk_cache, sha1, buff, *len)) != NULL)
+			buff = cached->buff;
+	}
+
+	if (!buff) {
+		fprintf(stderr, "Error allocating memory for restore chunk!\n");
+		return -ENOMEM;
+	}
+
+	if (pwrite_sparse(job->fd, buff, *len, offset)) {
+		fprintf(stderr, "Error writing to output file: %s - %s\n", job->path, strerror(errno));
+		ret = -1;
+		goto end;
+	}
+
+	__atomic_add_fetch(&bytes_written, *len, __ATOMIC_RELAXED);
+
+end:
+	if (cached)
+		chunk_cache_put(&chunk_cache, cached);
+	else
+		free(buff);
+
+	return ret;
+}
+
+static int pread_all(int fd, char *buff, int len, off_t offset)
+{
+	ssize_t bytes = 0;
+
+	while (len > 0) {
+		bytes = pread(fd, buff, len, offset);
+		if (bytes <= 0) {
+			if (bytes < 0 && errno == EINTR)
+				continue;
+
+			if (bytes == 0)
+				errno = EIO;
+
+			return -1;
+		}
+
+		buff += bytes;
+		len -= bytes;
+		offset += bytes;
+	}
+
+	return 0;
+}
+
+/*
+ * Like write_chunk(), blocks of zeros become holes. The file may
+ * have data there, so the holes are punched.
+ */
+static int pwrite_sparse(int fd, char *buff, int len, off_t offset)
+{
+	int pos = 0;
+	int start = 0; // of the run of data or zeros not written yet
+	int zeros = 0; // the run is of zeros
+	int block = 0;
+
+	while (pos < len) {
+		block = len - pos < SPARSE_BLOCK_SIZE ? len - pos : SPARSE_BLOCK_SIZE;
+
+		if (is_zero_buffer(buff + pos, block) != zeros) {
+			if (pos > start && write_run(fd, buff + start, pos - start, offset + start, zeros))
+				return -1;
+
+			zeros = !zeros;
+			start = pos;
+		}
+
+		pos += block;
+	}
+
+	return write_run(fd, buff + start, len - start, offset + start, zeros);
+}
+
+static int write_run(int fd, char *buff, int len, off_t offset, int zeros)
+{
+	if (zeros && punch_hole(fd, offset, len) == 0)
+		return 0;
+
+	return pwrite_all(fd, buff, len, offset);
+}
+
+/*
+ * Not every file system can punch holes, zeros are written then
+ */
+static int punch_hole(int fd, off_t offset, int len)
+{
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+static int pwrite_all(int fd, char *buff, int len, off_t offset)
+{
+	ssize_t bytes = 0;
+
+	while (len > 0) {
+		bytes = pwrite(fd, buff, len, offset);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		buff += bytes;
+		len -= bytes;
+		offset += bytes;
+	}
+
+	return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct restore_chunk *chunk = NULL;
+	struct restore_job *job = NULL;
+
+	(void)arg;
+
+	while ((chunk = queue_pop(&chunks_queue)) != NULL) {
+		job = chunk->job;
+
+		if (job->error) {
+			free(chunk);
+			put_job(job);
+			continue;
+		}
+
+		if (is_hole_id(chunk->sha1, &chunk->len))
+			__atomic_store_n(&job->holes, 1, __ATOMIC_RELAXED);
+		else if ((chunk->cached = chunk_cache_get(&chunk_cache, chunk->sha1)) != NULL) {
+			chunk->buff = chunk->cached->buff;
+			chunk->len = chunk->cached->len;
+		}
+		else if (read_blob(chunk->sha1, &chunk->buff, &chunk->len)) {
+			free(chunk);
+			fail_job(job);
+			put_job(job);
+			continue;
+		}
+		else if ((chunk->cached = chunk_cache_add(&chunk_cache, chunk->sha1, chunk->buff, chunk->len)) != NULL)
+			chunk->buff = chunk->cached->buff; // buff is freed if another worker added the chunk first
+
+		if (chunk->buff)
+			use_mem(chunk->len);
+
+		write_chunks(job, chunk);
+		put_job(job);
+	}
+
+	return NULL;
+}
+
+/*
+ * Parks the chunk in its job and, unless another thread is already
+ * doing it, writes the chunks which are next in line
+ */
+static void write_chunks(struct restore_job *job, struct restore_chunk *chunk)
+{
+	pthread_mutex_lock(&job->lock);
+
+	job->done[chunk->idx] = chunk;
+
+	if (job->writing) {
+		pthread_mutex_unlock(&job->lock);
+		return;
+	}
+
+	job->writing = 1;
+
+	while (!job->error && job->next < job->num_chunks && job->done[job->next]) {
+		chunk = job->done[job->next];
+		job->done[job->next] = NULL;
+		job->next++;
+
+		pthread_mutex_unlock(&job->lock);
+
+		if (write_chunk(job, chunk)) {
+			fprintf(stderr, "Error writing to output file: %s - %s\n", job->path, strerror(errno));
+			fail_job(job);
+		}
+
+		if (chunk->buff)
+			use_mem(-(ssize_t)chunk->len);
+
+		free_chunk(chunk);
+
+		pthread_mutex_lock(&job->lock);
+	}
+
+	job->writing = 0;
+	pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Writes the chunk, leaving holes where it has blocks of zeros
+ */
+static int write_chunk(struct restore_job *job, struct restore_chunk *chunk)
+{
+	int offset = 0;
+	int start = 0; // of the data not written yet
+	int len = 0;
+
+	if (!chunk->buff)
+		return lseek(job->fd, chunk->len, SEEK_CUR) < 0 ? -1 : 0;
+
+	while (offset < chunk->len) {
+		len = chunk->len - offset < SPARSE_BLOCK_SIZE ? chunk->len - offset : SPARSE_BLOCK_SIZE;
+
+		if (is_zero_buffer(chunk->buff + offset, len)) {
+			if (write_all(job->fd, chunk->buff + start, offset - start) ||
+				lseek(job->fd, len, SEEK_CUR) < 0)
+				return -1;
+
+			__atomic_store_n(&job->holes, 1, __ATOMIC_RELAXED);
+			start = offset + len;
+		}
+
+		offset += len;
+	}
+
+	return write_all(job->fd, chunk->buff + start, chunk->len - start);
+}
+
+static int write_all(int fd, char *buff, int len)
+{
+	ssize_t bytes = 0;
+
+	while (len > 0) {
+		bytes = write(fd, buff, len);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		buff += bytes;
+		len -= bytes;
+	}
+
+	return 0;
+}
+
+static void use_mem(ssize_t len)
+{
+	pthread_mutex_lock(&mem_lock);
+
+	mem_used += len;
+	if (len < 0)
+		pthread_cond_broadcast(&mem_freed);
+
+	pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * Blocks the file threads while too many decompressed chunks wait
+ * to be written. The workers never wait here, so the chunks before
+ * the waiting ones (already queued) always get written.
+ */
+static void wait_mem()
+{
+	pthread_mutex_lock(&mem_lock);
+
+	while (mem_used >= bkp_opts.restore_memory && !__atomic_load_n(&restore_error, __ATOMIC_RELAXED))
+		pthread_cond_wait(&mem_freed, &mem_lock);
+
+	pthread_mutex_unlock(&mem_lock);
+}
+
+static void free_chunk(struct restore_chunk *chunk)
+{
+	if (chunk->cached)
+		chunk_cache_put(&chunk_cache, chunk->cached);
+	else
+		free(chunk->buff);
+
+	free(chunk);
+}
+
+static void fail_job(struct restore_job *job)
+{
+	pthread_mutex_lock(&job->lock);
+	job->error = 1;
+	pthread_mutex_unlock(&job->lock);
+
+	__atomic_store_n(&restore_error, 1, __ATOMIC_RELAXED);
+
+	// file threads waiting for memory give up too
+	pthread_mutex_lock(&mem_lock);
+	pthread_cond_broadcast(&mem_freed);
+	pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * Drops a reference to the job. The last one closes the file,
+ * by then every chunk was written (unless the job failed).
+ */
+static void put_job(struct restore_job *job)
+{
+	int pending = 0;
+
+	pthread_mutex_lock(&job->lock);
+	pending = --job->pending;
+	pthread_mutex_unlock(&job->lock);
+
+	if (pending > 0)
+		return;
+
+	for (int i=0;job->done && i<job->num_chunks;i++) {
+		if (job->done[i]) {
+			if (job->done[i]->buff)
+				use_mem(-(ssize_t)job->done[i]->len);
+
+			free_chunk(job->done[i]);
+		}
+	}
+
+	// a hole at the end is not allocated by any write
+	if (job->fd >= 0 && job->holes && !job->error && ftruncate(job->fd, lseek(job->fd, 0, SEEK_CUR))) {
+		fprintf(stderr, "Error setting the size of output file: %s - %s\n", job->path, strerror(errno));
+		__atomic_store_n(&restore_error, 1, __ATOMIC_RELAXED);
+	}
+
+	if (job->fd >= 0 && close(job->fd)) {
+		fprintf(stderr, "Error closing output file: %s - %s\n", job->path, strerror(errno));
+		__atomic_store_n(&restore_error, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_destroy(&job->lock);
+	free(job->done);
+	free(job);
+}
+
+static int add_locked_dir(char *path, int perms)
+{
+	if (locked_dirs_len == locked_dirs_size) {
+		int size = locked_dirs_size > 0 ? locked_dirs_size * 2 : 16;
+		struct locked_dir *dirs = realloc(locked_dirs, size * sizeof(struct locked_dir));
+
+		if (!dirs) {
+			fprintf(stderr, "Error allocating memory for directory list!\n");
+			return -ENOMEM;
+		}
+
+		locked_dirs = dirs;
+		locked_dirs_size = size;
+	}
+
+	locked_dirs[locked_dirs_len].path = strdup(path);
+	if (!locked_dirs[locked_dirs_len].path) {
+		fprintf(stderr, "Error allocating memory for directory list!\n");
+		return -ENOMEM;
+	}
+
+	locked_dirs[locked_dirs_len].perms = perms;
+	locked_dirs_len++;
+
+	return 0;
+}
+
+/*
+ * Deepest directories first, their parents may not be writable
+ * (or searchable) anymore afterwards
+ */
+static int unlock_dirs()
+{
+	int ret = 0;
+
+	for (int i=locked_dirs_len-1;i>=0;i--) {
+		if (chmod(locked_dirs[i].path, locked_dirs[i].perms)) {
+			fprintf(stderr, "Error setting permissions of directory: %s\n", locked_dirs[i].path);
+			ret = -1;
+		}
+
+		free(locked_dirs[i].path);
+	}
+
+	free(locked_dirs);
+	locked_dirs = NULL;
+	locked_dirs_len = 0;
+	locked_dirs_size = 0;
+
+	return ret;
+}
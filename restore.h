@@ -17,6 +17,7 @@
 #ifndef RESTORE_H
 #define RESTORE_H
 
-int restore_snapshot(unsigned char *sha1, char *path, char *sub_path);
+int restore_snapshot(unsigned char *sha1, char *path, char **sub_paths, int num_sub_paths);
+int read_paths_file(char *file, char ***paths, int *num_paths);
 
 #endif
@@ -19,24 +19,43 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <errno.h>
-#include <openssl/sha.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <zlib.h>
+#include <sys/uio.h>
 
 #include "sha1-file.h"
+#include "pack.h"
+#include "config.h"
+#include "codec.h"
+#include "bkp.h"
+
+/*
+ * State of an object being written by write_sha1_iov()
+ */
+struct sha1_writer {
+	struct pack_stream ps;
+	struct hash_ctx ctx; // hashes the stored bytes, for REPO_FORMAT_V1
+	int hashing;
+	int streaming; // ps was started
+	char *held; // compressed data not streamed yet
+	int held_len;
+	int held_cap;
+};
 
 static int hexchar_to_int(char c);
-static int inflate_sha1_file(char *in_buff, size_t in_size, char **out_buff, int *out_size);
+static int emit_sha1_file(void *arg, char *buff, int len);
+static int hold_sha1_file(struct sha1_writer *sw, char *buff, int len);
+static int start_sha1_stream(struct sha1_writer *sw);
+static int read_stored_object(unsigned char *sha1, char **out_buff, int *out_len);
 
 int sha1_to_hex(unsigned char *sha1, char* out_hex)
 {
 	if (!out_hex)
 		return -1;
 
-	for (int i = 0; i < SHA_DIGEST_LENGTH; i++) 
+	for (int i = 0; i < repo_hash_len(); i++) 
         sprintf(out_hex + i*2, "%02x", sha1[i]);
 
 	return 0;
@@ -52,7 +71,9 @@ static int hexchar_to_int(char c)
 
 int hex_to_sha1(char *hex, unsigned char *out_sha1) 
 {
-    int len = 40;
+    int len = repo_hash_len() * 2;
+
+	memset(out_sha1, 0, HASH_MAX_LEN);
 
     for (int i = 0; i < len / 2; i++) {
         int hi = hexchar_to_int(hex[2 * i]);
@@ -69,7 +90,7 @@ int hex_to_sha1(char *hex, unsigned char *out_sha1)
 
 int sha1_is_valid(unsigned char *sha1)
 {
-	for (int i=0;i<SHA_DIGEST_LENGTH;i++) 
+	for (int i=0;i<HASH_MAX_LEN;i++) 
 		if (sha1[i] != 0)
 			return 1;
 
@@ -77,64 +98,143 @@ int sha1_is_valid(unsigned char *sha1)
 }
 
 int write_sha1_file(unsigned char *sha1, char *buffer, int len)
+{
+	struct iovec iov;
+
+	if (repo_cfg.format >= REPO_FORMAT_V2) {
+		// the id doesn`t depend on compression, so duplicates are never compressed
+		if (hash_buffer(repo_cfg.hash, buffer, len, sha1))
+			return -1;
+
+		if (has_sha1_file(sha1))
+			return 0;
+	}
+
+	iov.iov_base = buffer;
+	iov.iov_len = len;
+
+	return write_sha1_iov(sha1, &iov, 1);
+}
+
+/*
+ * Compresses an object given in segments (like a header and the
+ * payload) and streams it to the pack through a small fixed size
+ * buffer, so neither the object nor its compressed form is ever
+ * assembled in memory. In REPO_FORMAT_V2 repositories sha1 must
+ * already hold the id of the object, and the caller must have checked
+ * it isn't stored yet. Otherwise the id is computed here from the
+ * compressed stream, which is held in memory (up to SHA1_HOLD_MAX)
+ * until it is known whether the object exists. Objects which already
+ * exist are not stored again.
+ */
+int write_sha1_iov(unsigned char *sha1, struct iovec *iov, int iovcnt)
 {
 	int ret = 0;
-	int fd = -1;
-	int written = 0;
-	char path[PATH_MAX];
-	char sha1_hex[40+1];
-	char *compr_buff = NULL;
-	uLongf compr_len = 0;
+	size_t size = 0;
+	struct sha1_writer sw;
+	struct codec_stream cs;
+	struct codec_params codec = bkp_opts.codec.type ? bkp_opts.codec : repo_cfg.codec;
+	unsigned char *out = malloc(SHA1_STREAM_BUFF_SIZE);
 
-	compr_len = compressBound(len);
-	compr_buff = malloc(compr_len);
+	if (!out)
+		return -ENOMEM;
 
-	if (!compr_buff) {
-		ret = -1;
-		goto ret;
+	memset(&sw, 0, sizeof(sw));
+
+	if (repo_cfg.format < REPO_FORMAT_V2) {
+		if (hash_init(&sw.ctx, repo_cfg.hash)) {
+			free(out);
+			return -1;
+		}
+		sw.hashing = 1;
 	}
 
-	if (compress((Bytef *)compr_buff, &compr_len, (const Bytef *)buffer, len) != Z_OK) {
-		fprintf(stderr, "Compression of SHA1 file content failed!\n");
-		ret = -1;
-		goto ret;
+	for (int i=0;i<iovcnt;i++)
+		size += iov[i].iov_len;
+
+	/*
+	 * Not in REPO_FORMAT_V1 repositories, where it would change the
+	 * ids of objects older versions wrote compressed
+	 */
+	if (codec.type != CODEC_NONE && repo_cfg.format >= REPO_FORMAT_V2 && is_incompressible(iov, iovcnt))
+		codec_init(&codec, CODEC_NONE);
+
+	if (!sw.hashing) {
+		ret = start_sha1_stream(&sw);
+		if (ret) {
+			free(out);
+			return ret;
+		}
 	}
 
-	SHA1((const unsigned char *)compr_buff, compr_len, sha1);	
+	ret = codec_stream_init(&cs, &codec, size, out, SHA1_STREAM_BUFF_SIZE, emit_sha1_file, &sw);
 
-	sha1_to_hex(sha1, sha1_hex);
-	sprintf(path, ".bkp-data/%s", sha1_hex);
+	for (int i=0;i<iovcnt && !ret;i++)
+		ret = codec_stream_update(&cs, iov[i].iov_base, iov[i].iov_len);
 
-	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
-	if (fd < 0) 
-		return errno == EEXIST ? 0 : fd;
+	if (!ret)
+		ret = codec_stream_finish(&cs);
 
-	written = write(fd, compr_buff, compr_len);
+	codec_stream_end(&cs);
 
-	if (written != (int)compr_len) {
-		fprintf(stderr, "Error writing SHA1 file!\n");
-		ret = -1;
-		goto ret;
+	if (ret) {
+		fprintf(stderr, "Compression of SHA1 file content failed!\n");
+		if (sw.streaming)
+			pack_stream_abort(&sw.ps);
+		goto end;
 	}
 
-ret:
-	if (fd >= 0)
-		close(fd);
+	if (sw.hashing)
+		hash_final(&sw.ctx, sha1);
 
-	if (compr_buff)
-		free(compr_buff);
+	if (!sw.streaming) {
+		// the object only got its id now
+		if (has_sha1_file(sha1))
+			goto end;
+
+		ret = start_sha1_stream(&sw);
+		if (ret) {
+			if (sw.streaming)
+				pack_stream_abort(&sw.ps);
+			goto end;
+		}
+
+		ret = pack_stream_end(&sw.ps, sha1, 1);
+	}
+	else
+		ret = pack_stream_end(&sw.ps, sha1, !sw.hashing);
 
+end:
+	hash_end(&sw.ctx);
+	free(sw.held);
+	free(out);
 	return ret;
 }
 
+/*
+ * Checks if an object exists, loose or packed
+ */
+int has_sha1_file(unsigned char *sha1)
+{
+	char path[PATH_MAX];
+	char sha1_hex[HASH_MAX_HEX+1];
+
+	if (has_packed_object(sha1))
+		return 1;
+
+	if (!has_loose_objects())
+		return 0;
+
+	sha1_to_hex(sha1, sha1_hex);
+	sprintf(path, ".bkp-data/%s", sha1_hex);
+
+	return access(path, F_OK) == 0;
+}
+
 int read_sha1_file(unsigned char *sha1, char *type, char **out_buff, int *out_size)
 {
 	int ret = 0;
-	int bytes = 0;
-	struct stat stat;
-	char sha1_hex[40+1];
-	//char sha1_check_hex[40+1];
-	char path[PATH_MAX];
+	char sha1_hex[HASH_MAX_HEX+1];
 	char *buff = NULL;
 	int buff_len = 0;
 	char *uncompr_buff = NULL;
@@ -142,40 +242,12 @@ int read_sha1_file(unsigned char *sha1, char *type, char **out_buff, int *out_si
 	char hdr_len = 0;
 
 	sha1_to_hex(sha1, sha1_hex);
-	sprintf(path, ".bkp-data/%s", sha1_hex);
-
-	int fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "Unable to open SHA1 file: %s!\n", sha1_hex);
-		return -1;
-	}
-
-	if (fstat(fd, &stat)) {
-		fprintf(stderr, "Cannot stat SHA1 file: %s!\n", sha1_hex);
-		ret = -1;
-		goto end;
-	}
-
-	buff_len = stat.st_size;
-	buff = malloc(buff_len);
-	if (!buff) {
-		ret = -ENOMEM;
-		fprintf(stderr, "Error allocating memory for SHA1 file content: %s\n", sha1_hex);
-		goto end;
-	}
 
-	bytes = read(fd, buff, buff_len);
+	ret = read_stored_object(sha1, &buff, &buff_len);
+	if (ret)
+		return ret;
 
-	/*
-	 * TODO: this condition will need to be replaced with a 
-	 * while(bytes = read()...) just like we did in other places
-	 */
-	if (bytes != buff_len) { 
-		ret = -1;
-		fprintf(stderr, "Error reading from SHA1 file: %s!\n", sha1_hex);
-		goto end;
-	}
-	ret = inflate_sha1_file(buff, bytes, &uncompr_buff, &uncompr_len);
+	ret = codec_decode(buff, buff_len, &uncompr_buff, &uncompr_len);
 
 	if (ret != 0) {
 		fprintf(stderr, "Error uncompressing sha1 file %s!\n", sha1_hex);
@@ -183,22 +255,10 @@ int read_sha1_file(unsigned char *sha1, char *type, char **out_buff, int *out_si
 	}
 
 	/*
-	 * Checking if the content still has the same SHA1 hash
+	 * The content isn`t hashed again here, every read would pay for
+	 * it: objects are verified by --check (see verify_sha1_file())
 	 */
 
-	/* TODO - check suspended for the moment
-	unsigned char sha1_check[SHA_DIGEST_LENGTH];
-	SHA1((const unsigned char *)uncompr_buff, uncompr_len, sha1_check);
-
-	if (memcmp(sha1_check, sha1, SHA_DIGEST_LENGTH) != 0) {
-		ret = -1;
-
-		sha1_to_hex(sha1_check, sha1_check_hex);
-		fprintf(stderr, "SHA1 file corrupted! Expected \"%s\" but computed \"%s\"!\n", sha1_hex, sha1_check_hex);
-		goto end;
-	}
-	*/
-
 	hdr_len = strlen(uncompr_buff) + 1;
 
 	/*
@@ -233,66 +293,197 @@ end:
 	if (uncompr_buff)
 		free(uncompr_buff);
 
-	close(fd);
 	return ret;
 }
 
-static int inflate_sha1_file(char *in_buff, size_t in_size, char **out_buff, int *out_size)
+/*
+ * Checks that the content of an object still matches its id: the
+ * hash of the uncompressed content, or the hash of the stored bytes
+ * for objects written in REPO_FORMAT_V1. Returns 0 if it does,
+ * -EIO if it doesn`t and -1 if the object can`t be read. The size
+ * of the stored object goes to out_len.
+ */
+int verify_sha1_file(unsigned char *sha1, int *out_len)
+{
+	int ret = 0;
+	char sha1_hex[HASH_MAX_HEX+1];
+	unsigned char check[HASH_MAX_LEN];
+	char *buff = NULL;
+	int buff_len = 0;
+	char *uncompr_buff = NULL;
+	int uncompr_len = 0;
+
+	*out_len = 0;
+
+	ret = read_stored_object(sha1, &buff, &buff_len);
+	if (ret)
+		return ret;
+
+	*out_len = buff_len;
+
+	// the ids of REPO_FORMAT_V1 objects, upgraded repositories still have them
+	if (hash_buffer(repo_cfg.hash, buff, buff_len, check)) {
+		ret = -1;
+		goto end;
+	}
+
+	if (memcmp(check, sha1, HASH_MAX_LEN) == 0)
+		goto end;
+
+	if (repo_cfg.format < REPO_FORMAT_V2 || 
+		codec_decode(buff, buff_len, &uncompr_buff, &uncompr_len) != 0 ||
+		memchr(uncompr_buff, '\0', uncompr_len) == NULL) {
+		ret = -EIO;
+		goto end;
+	}
+
+	if (hash_buffer(repo_cfg.hash, uncompr_buff, uncompr_len, check)) {
+		ret = -1;
+		goto end;
+	}
+
+	if (memcmp(check, sha1, HASH_MAX_LEN) != 0)
+		ret = -EIO;
+
+end:
+	if (ret == -EIO) {
+		sha1_to_hex(sha1, sha1_hex);
+		fprintf(stderr, "Object %s is corrupted!\n", sha1_hex);
+	}
+
+	free(buff);
+	free(uncompr_buff);
+
+	return ret;
+}
+
+/*
+ * Reads the stored (compressed) content of an object, packed or loose
+ */
+static int read_stored_object(unsigned char *sha1, char **out_buff, int *out_len)
 {
 	int ret = 0;
-	unsigned char *buff = NULL;
-	int chunk_size = 1024 * 1024; // 1MB chunks
-	int offset = 0;
-
-	z_stream strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree  = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.avail_in = in_size;
-	strm.next_in  = (Bytef *)in_buff;
-
-	ret = inflateInit(&strm);
-	if (ret != Z_OK) {
-		fprintf(stderr, "Error inflating SHA1 file!\n");
+	int fd = -1;
+	struct stat stat;
+	char sha1_hex[HASH_MAX_HEX+1];
+	char path[PATH_MAX];
+	char *buff = NULL;
+	int buff_len = 0;
+	int bytes = 0;
+
+	// packed objects are found through the object index, without touching .bkp-data/
+	ret = read_packed_object(sha1, out_buff, out_len);
+	if (ret != -ENOENT)
+		return ret;
+
+	ret = 0;
+
+	sha1_to_hex(sha1, sha1_hex);
+	sprintf(path, ".bkp-data/%s", sha1_hex);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open SHA1 file: %s!\n", sha1_hex);
 		return -1;
 	}
-		
-	buff = malloc(chunk_size);
+
+	if (fstat(fd, &stat)) {
+		fprintf(stderr, "Cannot stat SHA1 file: %s!\n", sha1_hex);
+		ret = -1;
+		goto end;
+	}
+
+	buff_len = stat.st_size;
+	buff = malloc(buff_len > 0 ? buff_len : 1);
 	if (!buff) {
 		ret = -ENOMEM;
+		fprintf(stderr, "Error allocating memory for SHA1 file content: %s\n", sha1_hex);
 		goto end;
 	}
 
-	do {
-		if (!buff) 
-			buff = malloc(chunk_size);
-		else if (offset % chunk_size == 0)
-			buff = realloc(buff, offset + chunk_size);
+	bytes = read(fd, buff, buff_len);
 
-		if (!buff) {
-			ret = -ENOMEM;
-			fprintf(stderr, "Error allocating memory for zstream chunk!\n");
-			goto end;
-		}
+	/*
+	 * TODO: this condition will need to be replaced with a 
+	 * while(bytes = read()...) just like we did in other places
+	 */
+	if (bytes != buff_len) { 
+		ret = -1;
+		fprintf(stderr, "Error reading from SHA1 file: %s!\n", sha1_hex);
+		goto end;
+	}
 
-		strm.avail_out = chunk_size;
-		strm.next_out = buff + offset;
-		
-		if ((ret = inflate(&strm, Z_NO_FLUSH)) < 0) {
-			fprintf(stderr, "SHA1 file inflate returned code %d!\n", ret);
-			ret = -1;
-			goto end;
+	*out_buff = buff;
+	*out_len = buff_len;
+	buff = NULL;
+
+end:
+	free(buff);
+	close(fd);
+
+	return ret;
+}
+
+static int emit_sha1_file(void *arg, char *buff, int len)
+{
+	struct sha1_writer *sw = arg;
+
+	if (sw->hashing && hash_update(&sw->ctx, buff, len))
+		return -1;
+
+	if (!sw->streaming) {
+		if ((size_t)sw->held_len + len <= SHA1_HOLD_MAX)
+			return hold_sha1_file(sw, buff, len);
+
+		// too big to hold, stored even if it turns out to exist
+		if (start_sha1_stream(sw))
+			return -1;
+	}
+
+	return pack_stream_write(&sw->ps, buff, len);
+}
+
+static int hold_sha1_file(struct sha1_writer *sw, char *buff, int len)
+{
+	char *tmp = NULL;
+	int cap = sw->held_cap ? sw->held_cap : SHA1_STREAM_BUFF_SIZE;
+
+	while (cap < sw->held_len + len)
+		cap *= 2;
+
+	if (cap != sw->held_cap) {
+		tmp = realloc(sw->held, cap);
+		if (!tmp) {
+			fprintf(stderr, "Error allocating memory for SHA1 file content!\n");
+			return -ENOMEM;
 		}
 
-		offset += chunk_size - strm.avail_out;
-	} while (ret != Z_STREAM_END);
+		sw->held = tmp;
+		sw->held_cap = cap;
+	}
 
-	*out_buff = (char *) buff;
-	*out_size = offset;
-	ret = 0;
+	memcpy(sw->held + sw->held_len, buff, len);
+	sw->held_len += len;
 
-end:
-	inflateEnd(&strm);
-	return ret;
+	return 0;
 }
 
+/*
+ * Starts appending the object to the pack, with the data held so far
+ */
+static int start_sha1_stream(struct sha1_writer *sw)
+{
+	int ret = pack_stream_begin(&sw->ps);
+
+	if (ret)
+		return ret;
+
+	sw->streaming = 1;
+
+	if (sw->held_len > 0) {
+		ret = pack_stream_write(&sw->ps, sw->held, sw->held_len);
+		sw->held_len = 0;
+	}
+
+	return ret;
+}
@@ -17,14 +17,22 @@
 #ifndef SHA1_FILE_H
 #define SHA1_FILE_H
 
-#include <openssl/sha.h>
+#include <sys/uio.h>
+
+#include "hash.h"
+
+#define SHA1_STREAM_BUFF_SIZE (128 * 1024)
+#define SHA1_HOLD_MAX (16 * 1024 * 1024) // compressed REPO_FORMAT_V1 objects kept in memory
 
 
 int sha1_to_hex(unsigned char *sha1, char* out_hex);
 int hex_to_sha1(char *hex, unsigned char *out_sha1);
 
 int write_sha1_file(unsigned char *sha1, char *buffer, int len);
+int write_sha1_iov(unsigned char *sha1, struct iovec *iov, int iovcnt);
 int read_sha1_file(unsigned char *sha1, char *type, char **out_buff, int *out_size);
+int has_sha1_file(unsigned char *sha1);
+int verify_sha1_file(unsigned char *sha1, int *out_len);
 
 int sha1_is_valid(unsigned char *sha1);
 
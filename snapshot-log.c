@@ -0,0 +1,516 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot-log.h"
+#include "snapshot.h"
+#include "sha1-file.h"
+
+static int map_snapshot_log(struct snapshot_log *log, unsigned char *last_sha1);
+static int check_snapshot_log_header(struct snapshot_log_header *hdr, size_t len);
+static int rebuild_snapshot_log(struct snapshot_log_record *latest);
+static int read_old_records(struct snapshot_log_record **out_records, int *num_records);
+static int write_snapshot_log(struct snapshot_log_record *records, int num_records);
+static int compare_records(const void *a, const void *b);
+static int compare_sha1s(const void *a, const void *b);
+
+/*
+ * Maps the log, rebuilding it first if it doesn`t match the parent
+ * chain. Without snapshots the log is empty.
+ */
+int load_snapshot_log(struct snapshot_log *log)
+{
+	int ret = 0;
+	unsigned char last_sha1[HASH_MAX_LEN];
+
+	memset(log, 0, sizeof(struct snapshot_log));
+
+	if (read_last_sha1(last_sha1))
+		return 0;
+
+	ret = map_snapshot_log(log, last_sha1);
+	if (ret <= 0)
+		return ret;
+
+	if (rebuild_snapshot_log(NULL))
+		return -1;
+
+	ret = map_snapshot_log(log, last_sha1);
+	if (ret > 0) {
+		fprintf(stderr, "Error reading %s!\n", SNAPSHOT_LOG_FILE);
+		return -1;
+	}
+
+	return ret;
+}
+
+void free_snapshot_log(struct snapshot_log *log)
+{
+	if (log->map)
+		munmap(log->map, log->map_len);
+
+	memset(log, 0, sizeof(struct snapshot_log));
+}
+
+/*
+ * Appends the record of a new snapshot, parent_sha1 is the snapshot
+ * which was the last one before it
+ */
+int append_snapshot_log(struct snapshot_log_record *record, unsigned char *parent_sha1)
+{
+	int fd = -1;
+	struct stat sb;
+	struct snapshot_log_header hdr;
+	struct snapshot_log_record last;
+	int num_records = 0;
+	int stale = 1;
+
+	fd = open(SNAPSHOT_LOG_FILE, O_RDWR);
+	if (fd < 0)
+		return rebuild_snapshot_log(record);
+
+	if (fstat(fd, &sb) == 0 && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+		check_snapshot_log_header(&hdr, sb.st_size) == 0) {
+
+		num_records = (sb.st_size - sizeof(hdr)) / sizeof(struct snapshot_log_record);
+
+		if (!sha1_is_valid(parent_sha1))
+			stale = num_records > 0;
+		else if (num_records > 0 && pread(fd, &last, sizeof(last), sb.st_size - sizeof(last)) == sizeof(last))
+			stale = memcmp(last.sha1, parent_sha1, HASH_MAX_LEN) != 0;
+	}
+
+	if (stale) {
+		close(fd);
+		return rebuild_snapshot_log(record);
+	}
+
+	if (pwrite(fd, record, sizeof(struct snapshot_log_record), sb.st_size) != sizeof(struct snapshot_log_record)) {
+		fprintf(stderr, "Error writing %s (errno: %d)!\n", SNAPSHOT_LOG_FILE, errno);
+		// a partial record makes the next run rebuild the log
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Index of the last snapshot made at or before time, -1 if there
+ * is none. Snapshots are logged in the order they were made, so
+ * their times only go backwards if the clock did.
+ */
+int find_snapshot_log(struct snapshot_log *log, time_t time)
+{
+	int low = 0, high = log->num_records;
+
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+
+		if (log->records[mid].time <= time)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low - 1;
+}
+
+/*
+ * Removes the records of log whose keep flag is 0 and adds them to
+ * the pruned snapshots. The log is written first: if adding them
+ * fails, they are only missing from the log and their objects are
+ * still kept by the garbage collector.
+ */
+int prune_snapshot_log(struct snapshot_log *log, char *keep)
+{
+	int ret = 0;
+	int fd = -1;
+	struct snapshot_log_record *records = NULL;
+	unsigned char *sha1s = NULL;
+	unsigned char *tmp = NULL;
+	int num_records = 0;
+	int num_sha1s = 0;
+	size_t len = 0;
+
+	ret = read_pruned_snapshots(&sha1s, &num_sha1s);
+	if (ret)
+		return ret;
+
+	len = (num_sha1s + log->num_records) * HASH_MAX_LEN;
+
+	records = malloc((log->num_records > 0 ? log->num_records : 1) * sizeof(struct snapshot_log_record));
+	tmp = realloc(sha1s, len > 0 ? len : 1);
+
+	if (tmp)
+		sha1s = tmp;
+
+	if (!records || !tmp) {
+		fprintf(stderr, "Error allocating memory for the snapshot log!\n");
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	for (int i=0;i<log->num_records;i++) {
+		if (keep[i])
+			records[num_records++] = log->records[i];
+		else
+			memcpy(sha1s + (num_sha1s++) * HASH_MAX_LEN, log->records[i].sha1, HASH_MAX_LEN);
+	}
+
+	ret = write_snapshot_log(records, num_records);
+	if (ret)
+		goto end;
+
+	if (num_sha1s > 1)
+		qsort(sha1s, num_sha1s, HASH_MAX_LEN, compare_sha1s);
+
+	len = num_sha1s * HASH_MAX_LEN;
+
+	fd = open(PRUNED_SNAPSHOTS_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 || write(fd, sha1s, len) != (ssize_t)len || fsync(fd)) {
+		fprintf(stderr, "Error writing %s.tmp (errno: %d)!\n", PRUNED_SNAPSHOTS_FILE, errno);
+		ret = -1;
+	}
+
+	if (fd >= 0 && close(fd))
+		ret = -1;
+
+	if (!ret && rename(PRUNED_SNAPSHOTS_FILE ".tmp", PRUNED_SNAPSHOTS_FILE)) {
+		fprintf(stderr, "Error renaming %s.tmp (errno: %d)!\n", PRUNED_SNAPSHOTS_FILE, errno);
+		ret = -1;
+	}
+
+	if (ret)
+		unlink(PRUNED_SNAPSHOTS_FILE ".tmp");
+
+end:
+	free(records);
+	free(sha1s);
+
+	return ret;
+}
+
+/*
+ * Ids of the pruned snapshots, sorted. Without pruned snapshots
+ * out_sha1s is NULL.
+ */
+int read_pruned_snapshots(unsigned char **out_sha1s, int *num_sha1s)
+{
+	int fd = -1;
+	struct stat sb;
+
+	*out_sha1s = NULL;
+	*num_sha1s = 0;
+
+	fd = open(PRUNED_SNAPSHOTS_FILE, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -1;
+
+	if (fstat(fd, &sb) || sb.st_size % HASH_MAX_LEN != 0) {
+		fprintf(stderr, "Error reading %s!\n", PRUNED_SNAPSHOTS_FILE);
+		close(fd);
+		return -1;
+	}
+
+	if (sb.st_size > 0) {
+		*out_sha1s = malloc(sb.st_size);
+		if (!*out_sha1s) {
+			fprintf(stderr, "Error allocating memory for the pruned snapshots!\n");
+			close(fd);
+			return -ENOMEM;
+		}
+
+		if (pread(fd, *out_sha1s, sb.st_size, 0) != sb.st_size) {
+			fprintf(stderr, "Error reading %s!\n", PRUNED_SNAPSHOTS_FILE);
+			free(*out_sha1s);
+			*out_sha1s = NULL;
+			close(fd);
+			return -1;
+		}
+
+		*num_sha1s = sb.st_size / HASH_MAX_LEN;
+	}
+
+	close(fd);
+	return 0;
+}
+
+int is_pruned_snapshot(unsigned char *sha1s, int num_sha1s, unsigned char *sha1)
+{
+	return num_sha1s > 0 && bsearch(sha1, sha1s, num_sha1s, HASH_MAX_LEN, compare_sha1s) != NULL;
+}
+
+/*
+ * Returns 1 if the log is missing or doesn`t end with last_sha1
+ */
+static int map_snapshot_log(struct snapshot_log *log, unsigned char *last_sha1)
+{
+	int fd = -1;
+	struct stat sb;
+	void *map = NULL;
+	struct snapshot_log_record *records = NULL;
+	int num_records = 0;
+
+	fd = open(SNAPSHOT_LOG_FILE, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	if (fstat(fd, &sb)) {
+		fprintf(stderr, "Error calling fstat on %s!\n", SNAPSHOT_LOG_FILE);
+		close(fd);
+		return -1;
+	}
+
+	if ((size_t)sb.st_size <= sizeof(struct snapshot_log_header)) {
+		close(fd);
+		return 1;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "mmap failed while mapping %s into memory!\n", SNAPSHOT_LOG_FILE);
+		return -1;
+	}
+
+	if (check_snapshot_log_header(map, sb.st_size)) {
+		munmap(map, sb.st_size);
+		return 1;
+	}
+
+	records = (struct snapshot_log_record *)((char *)map + sizeof(struct snapshot_log_header));
+	num_records = (sb.st_size - sizeof(struct snapshot_log_header)) / sizeof(struct snapshot_log_record);
+
+	if (memcmp(records[num_records-1].sha1, last_sha1, HASH_MAX_LEN) != 0) {
+		munmap(map, sb.st_size);
+		return 1;
+	}
+
+	log->map = map;
+	log->map_len = sb.st_size;
+	log->records = records;
+	log->num_records = num_records;
+
+	return 0;
+}
+
+static int check_snapshot_log_header(struct snapshot_log_header *hdr, size_t len)
+{
+	if (len < sizeof(struct snapshot_log_header) ||
+		memcmp(hdr->magic, SNAPSHOT_LOG_MAGIC, 4) != 0 ||
+		hdr->version != SNAPSHOT_LOG_VERSION ||
+		hdr->record_size != sizeof(struct snapshot_log_record))
+		return -1;
+
+	if ((len - sizeof(struct snapshot_log_header)) % sizeof(struct snapshot_log_record) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Follows the parent chain from the last snapshot. The stats come
+ * from latest (the snapshot being logged) or the old log.
+ */
+static int rebuild_snapshot_log(struct snapshot_log_record *latest)
+{
+	int ret = 0;
+	unsigned char sha1[HASH_MAX_LEN];
+	struct snapshot snapshot;
+	struct snapshot_log_record *old = NULL;
+	struct snapshot_log_record *found = NULL;
+	struct snapshot_log_record *records = NULL;
+	struct snapshot_log_record *tmp = NULL;
+	struct snapshot_log_record key;
+	unsigned char *pruned = NULL;
+	int num_pruned = 0;
+	int num_old = 0;
+	int num_records = 0;
+	int size = 0;
+	int has_last = 0;
+
+	printf("Rebuilding the snapshot log... ");
+	fflush(stdout);
+
+	if (read_old_records(&old, &num_old) || read_pruned_snapshots(&pruned, &num_pruned)) {
+		free(old);
+		return -1;
+	}
+
+	if (num_old > 1)
+		qsort(old, num_old, sizeof(struct snapshot_log_record), compare_records);
+
+	has_last = read_last_sha1(sha1) == 0;
+
+	while (has_last) {
+		if (read_snapshot_file(sha1, &snapshot)) {
+			ret = -1;
+			goto end;
+		}
+
+		if (is_pruned_snapshot(pruned, num_pruned, sha1))
+			goto parent;
+
+		if (num_records == size) {
+			size = size > 0 ? size * 2 : 256;
+			tmp = realloc(records, size * sizeof(struct snapshot_log_record));
+			if (!tmp) {
+				fprintf(stderr, "Error allocating memory for the snapshot log!\n");
+				ret = -ENOMEM;
+				goto end;
+			}
+
+			records = tmp;
+		}
+
+		memcpy(key.sha1, sha1, HASH_MAX_LEN);
+
+		if (latest && memcmp(latest->sha1, sha1, HASH_MAX_LEN) == 0)
+			found = latest;
+		else
+			found = num_old > 0 ? bsearch(&key, old, num_old, sizeof(struct snapshot_log_record), compare_records) : NULL;
+
+		if (found)
+			records[num_records] = *found;
+		else {
+			memset(&records[num_records], 0, sizeof(struct snapshot_log_record));
+			memcpy(records[num_records].sha1, sha1, HASH_MAX_LEN);
+			memcpy(records[num_records].tree_sha1, snapshot.tree_sha1, HASH_MAX_LEN);
+			records[num_records].time = snapshot.time;
+			records[num_records].flags = SNAPSHOT_LOG_NO_STATS;
+		}
+
+		num_records++;
+
+parent:
+		if (!sha1_is_valid(snapshot.parent_sha1))
+			break;
+
+		memcpy(sha1, snapshot.parent_sha1, HASH_MAX_LEN);
+	}
+
+	// oldest first
+	for (int i=0;i<num_records/2;i++) {
+		key = records[i];
+		records[i] = records[num_records-1-i];
+		records[num_records-1-i] = key;
+	}
+
+	ret = write_snapshot_log(records, num_records);
+
+end:
+	free(old);
+	free(pruned);
+	free(records);
+
+	if (!ret)
+		printf("done\n");
+
+	return ret;
+}
+
+/*
+ * Records of the current log, even if it doesn`t match the chain
+ * anymore. A missing or damaged log has none.
+ */
+static int read_old_records(struct snapshot_log_record **out_records, int *num_records)
+{
+	int fd = -1;
+	struct stat sb;
+	struct snapshot_log_header hdr;
+	size_t len = 0;
+
+	*out_records = NULL;
+	*num_records = 0;
+
+	fd = open(SNAPSHOT_LOG_FILE, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &sb) || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		memcmp(hdr.magic, SNAPSHOT_LOG_MAGIC, 4) != 0 ||
+		hdr.version != SNAPSHOT_LOG_VERSION ||
+		hdr.record_size != sizeof(struct snapshot_log_record)) {
+		close(fd);
+		return 0;
+	}
+
+	// a partial record at the end is dropped
+	*num_records = (sb.st_size - sizeof(hdr)) / sizeof(struct snapshot_log_record);
+	len = *num_records * sizeof(struct snapshot_log_record);
+
+	if (*num_records > 0) {
+		*out_records = malloc(len);
+		if (!*out_records) {
+			fprintf(stderr, "Error allocating memory for the snapshot log!\n");
+			close(fd);
+			return -ENOMEM;
+		}
+
+		if (pread(fd, *out_records, len, sizeof(hdr)) != (ssize_t)len) {
+			free(*out_records);
+			*out_records = NULL;
+			*num_records = 0;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+static int write_snapshot_log(struct snapshot_log_record *records, int num_records)
+{
+	int fd = -1;
+	int ret = 0;
+	struct snapshot_log_header hdr;
+	size_t len = num_records * sizeof(struct snapshot_log_record);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_LOG_MAGIC, 4);
+	hdr.version = SNAPSHOT_LOG_VERSION;
+	hdr.record_size = sizeof(struct snapshot_log_record);
+
+	fd = open(SNAPSHOT_LOG_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "Error creating %s.tmp (errno: %d)!\n", SNAPSHOT_LOG_FILE, errno);
+		return -1;
+	}
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		(len > 0 && write(fd, records, len) != (ssize_t)len)) {
+		fprintf(stderr, "Error writing %s.tmp!\n", SNAPSHOT_LOG_FILE);
+		ret = -1;
+	}
+
+	if (close(fd))
+		ret = -1;
+
+	if (!ret && rename(SNAPSHOT_LOG_FILE ".tmp", SNAPSHOT_LOG_FILE)) {
+		fprintf(stderr, "Error renaming %s.tmp (errno: %d)!\n", SNAPSHOT_LOG_FILE, errno);
+		ret = -1;
+	}
+
+	if (ret)
+		unlink(SNAPSHOT_LOG_FILE ".tmp");
+
+	return ret;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+	return memcmp(((struct snapshot_log_record *)a)->sha1, ((struct snapshot_log_record *)b)->sha1, HASH_MAX_LEN);
+}
+
+static int compare_sha1s(const void *a, const void *b)
+{
+	return memcmp(a, b, HASH_MAX_LEN);
+}
@@ -0,0 +1,67 @@
+
+#ifndef SNAPSHOT_LOG_H
+#define SNAPSHOT_LOG_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "hash.h"
+
+#define SNAPSHOT_LOG_FILE ".bkp-data/snapshot-log"
+#define PRUNED_SNAPSHOTS_FILE ".bkp-data/pruned-snapshots"
+#define SNAPSHOT_LOG_MAGIC "BKPL"
+#define SNAPSHOT_LOG_VERSION 1
+
+#define SNAPSHOT_LOG_NO_STATS 0x01 // rebuilt from the snapshot object
+
+/*
+ * .bkp-data/snapshot-log lists the snapshots of the parent chain,
+ * oldest first, so they can be listed and looked up by time without
+ * reading the snapshot objects:
+ *
+ *	header | records
+ *
+ * A record is appended by every snapshot. The log is only a copy
+ * of the chain ending in last_snapshot: if it doesn`t end with the
+ * last snapshot (older bkp versions, interrupted writes) or it is
+ * missing, it is rebuilt from the snapshot objects. Stats can`t be
+ * rebuilt, they are kept for the snapshots already in the log.
+ *
+ * Pruned snapshots stay in the parent chain (their ids would
+ * change otherwise), only their trees are garbage collected.
+ * .bkp-data/pruned-snapshots lists their ids (sorted, HASH_MAX_LEN
+ * bytes each), they are left out of the log.
+ */
+struct snapshot_log_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t reserved;
+};
+
+struct snapshot_log_record {
+	unsigned char sha1[HASH_MAX_LEN];
+	unsigned char tree_sha1[HASH_MAX_LEN];
+	int64_t time;
+	uint64_t files; // read and chunked: new or modified
+	uint64_t new_bytes; // of the chunks stored, before compression
+	uint32_t duration_ms;
+	uint32_t flags;
+};
+
+struct snapshot_log {
+	void *map;
+	size_t map_len;
+	struct snapshot_log_record *records;
+	int num_records;
+};
+
+int load_snapshot_log(struct snapshot_log *log);
+void free_snapshot_log(struct snapshot_log *log);
+int append_snapshot_log(struct snapshot_log_record *record, unsigned char *parent_sha1);
+int find_snapshot_log(struct snapshot_log *log, time_t time);
+int prune_snapshot_log(struct snapshot_log *log, char *keep);
+int read_pruned_snapshots(unsigned char **out_sha1s, int *num_sha1s);
+int is_pruned_snapshot(unsigned char *sha1s, int num_sha1s, unsigned char *sha1);
+
+#endif
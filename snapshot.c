@@ -14,11 +14,12 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.  
  */
 
+#define _GNU_SOURCE // strptime()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <openssl/sha.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
@@ -27,51 +28,117 @@
 #include "cache.h"
 #include "tree.h"
 #include "sha1-file.h"
+#include "ingest.h"
+#include "config.h"
+#include "bkp.h"
+#include "pack.h"
+#include "snapshot-log.h"
 
-static int write_snapshot(unsigned char *tree_sha1, unsigned char *sha1);
-static int read_last_sha1(unsigned char *sha1);
+static int write_snapshot(unsigned char *tree_sha1, struct snapshot *snapshot);
 static int write_last_sha1(unsigned char *sha1);
+static void print_log_record(struct snapshot_log_record *record);
 
 int list_snapshots(int limit)
 {
-	int ret = 0;
-	unsigned char sha1[SHA_DIGEST_LENGTH];
-	char sha1_hex[40+1];
-	struct snapshot snapshot;
+	struct snapshot_log log;
 
-	ret = read_last_sha1(sha1);
-	if (ret) {
+	if (load_snapshot_log(&log))
+		return -1;
+
+	if (log.num_records == 0) {
 		fprintf(stderr, "No snapshots found!\n");
 		return -1;
 	}
 
-	while(limit > 0) {
-		ret = read_snapshot_file(sha1, &snapshot);
-		if (ret)
-			return -1;
+	for (int i=log.num_records-1;i>=0 && limit>0;i--,limit--)
+		print_log_record(&log.records[i]);
+
+	printf("%d snapshots in total\n", log.num_records);
+
+	free_snapshot_log(&log);
+	return 0;
+}
+
+/*
+ * Prints the last snapshot made at or before date
+ * (YYYY-MM-DD [HH:MM[:SS]], local time)
+ */
+int find_snapshot(char *date)
+{
+	struct snapshot_log log;
+	struct tm tm;
+	char *end = NULL;
+	time_t when = 0;
+	int idx = 0;
+
+	memset(&tm, 0, sizeof(tm));
+
+	end = strptime(date, "%Y-%m-%d %H:%M:%S", &tm);
+	if (!end || *end)
+		end = strptime(date, "%Y-%m-%d %H:%M", &tm);
+	if (!end || *end) {
+		// the whole day
+		end = strptime(date, "%Y-%m-%d", &tm);
+		tm.tm_hour = 23;
+		tm.tm_min = 59;
+		tm.tm_sec = 59;
+	}
 
-		sha1_to_hex(snapshot.sha1, sha1_hex);
+	if (!end || *end) {
+		fprintf(stderr, "Invalid date: %s! Use \"YYYY-MM-DD [HH:MM[:SS]]\"\n", date);
+		return -1;
+	}
 
-		printf("Snapshot SHA1: %s\n", sha1_hex);
-		printf("Created on: %s\n", snapshot.date);
-		printf("----------------------------------------------------------\n");
+	tm.tm_isdst = -1;
+	when = mktime(&tm);
 
-		if (!sha1_is_valid(snapshot.parent_sha1)) 
-			break;
+	if (load_snapshot_log(&log))
+		return -1;
 
-		memcpy(sha1, snapshot.parent_sha1, SHA_DIGEST_LENGTH);
-		limit--;
+	idx = find_snapshot_log(&log, when);
+	if (idx < 0) {
+		fprintf(stderr, "No snapshots found before %s!\n", date);
+		free_snapshot_log(&log);
+		return -1;
 	}
 
+	print_log_record(&log.records[idx]);
+
+	free_snapshot_log(&log);
 	return 0;
 }
 
+static void print_log_record(struct snapshot_log_record *record)
+{
+	char sha1_hex[HASH_MAX_HEX+1];
+	char date[20];
+	time_t when = record->time;
+
+	sha1_to_hex(record->sha1, sha1_hex);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&when));
+
+	printf("Snapshot SHA1: %s\n", sha1_hex);
+	printf("Created on: %s\n", date);
+
+	if (!(record->flags & SNAPSHOT_LOG_NO_STATS))
+		printf("Files backed up: %llu, new data: %llu bytes, took %.1fs\n", 
+				(unsigned long long)record->files, (unsigned long long)record->new_bytes, 
+				record->duration_ms / 1000.0);
+
+	printf("----------------------------------------------------------\n");
+}
+
 int create_snapshot()
 {
 	int ret = 0;
-	unsigned char tree_sha1[SHA_DIGEST_LENGTH];
-	unsigned char snap_sha1[SHA_DIGEST_LENGTH];
-	char sha1_hex[40+1];
+	unsigned char tree_sha1[HASH_MAX_LEN];
+	char sha1_hex[HASH_MAX_HEX+1];
+	struct journal journal;
+	struct snapshot snapshot;
+	struct snapshot_log_record record;
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	printf("Loading filecache into memory... ");
 	fflush(stdout);
@@ -82,59 +149,104 @@ int create_snapshot()
 
 	printf("done\n");
 
-	ret = create_tree("./", cache, tree_sha1);
+	ret = save_config();
+	if (ret)
+		return ret;
+
+	// changes made from now on are seen by the next snapshot
+	ret = read_journal(&journal);
+	if (ret)
+		return ret;
+
+	ret = ingest_start(bkp_opts.threads, &repo_cfg.chunker);
+	if (ret)
+		goto end;
+
+	ret = create_tree("./", cache, &journal, tree_sha1);
+	ingest_stop();
 
 	if (ret) {
 		fprintf(stderr, "Error generating tree (code: %d)!\n", ret);
-		return ret;
+		goto end;
 	}
 	
-	ret = write_snapshot(tree_sha1, snap_sha1);
+	ret = write_snapshot(tree_sha1, &snapshot);
+	if (ret)
+		goto end;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	memset(&record, 0, sizeof(record));
+	memcpy(record.sha1, snapshot.sha1, HASH_MAX_LEN);
+	memcpy(record.tree_sha1, tree_sha1, HASH_MAX_LEN);
+	record.time = snapshot.time;
+	record.files = ingest_stats.files;
+	record.new_bytes = ingest_stats.new_bytes;
+	record.duration_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+
+	// the log is rebuilt by the next run if this fails
+	append_snapshot_log(&record, snapshot.parent_sha1);
+
+	ret = merge_cache_entries(cache);
 	if (ret)
 		goto end;
 
 	printf("Writing %d entries to filecache... ", cache->entries_len);
 	fflush(stdout);
-	update_cache(cache);
+	// the journal is only followed from where the filecache is
+	if (update_cache(cache) == 0)
+		save_journal_state(&journal);
+
 	printf("done\n");
 
 	sha1_to_hex(tree_sha1, sha1_hex);
 	printf("\nTree sha1: %s\n", sha1_hex);
 
-	sha1_to_hex(snap_sha1, sha1_hex);
+	sha1_to_hex(snapshot.sha1, sha1_hex);
 	printf("Snapshot sha1: %s\n", sha1_hex);
 
 end:
+	free_journal(&journal);
 	return ret;
 }
 
-static int write_snapshot(unsigned char *tree_sha1, unsigned char *sha1)
+/*
+ * Fills in the sha1, parent, tree and time of snapshot
+ */
+static int write_snapshot(unsigned char *tree_sha1, struct snapshot *snapshot)
 {
-	unsigned char parent_sha1[SHA_DIGEST_LENGTH];
-	char *buffer = malloc(1024);
+	unsigned char *parent_sha1 = snapshot->parent_sha1;
+	unsigned char *sha1 = snapshot->sha1;
+	int len = repo_hash_len();
+	char buffer[1024] = {0};
 	int offset = 0;
 	int ret = 0;
 
-	memset(buffer, 0, 1024);
-
 	read_last_sha1(parent_sha1);
 
 	offset = 1 + sprintf(buffer, "snapshot");	
 	offset += 1 + sprintf(buffer+offset, "parent ");
-	memcpy(buffer+offset, parent_sha1, SHA_DIGEST_LENGTH);
-	offset += SHA_DIGEST_LENGTH;
+	memcpy(buffer+offset, parent_sha1, len);
+	offset += len;
 
 	offset += 1 + sprintf(buffer+offset, "tree ");
 
-	memcpy(buffer+offset, tree_sha1, SHA_DIGEST_LENGTH);
-	offset += SHA_DIGEST_LENGTH;
+	memcpy(buffer+offset, tree_sha1, len);
+	offset += len;
 
 	// writing time in sec
 	time_t now = time(NULL);
 	struct tm *local = localtime(&now);
 
+	memcpy(snapshot->tree_sha1, tree_sha1, HASH_MAX_LEN);
+	snapshot->time = now;
+
 	offset += 1 + sprintf(buffer+offset, "time %ld", (long)now);
 
+	// chunker used for the files of this snapshot
+	offset += sprintf(buffer+offset, "chunker ");
+	offset += 1 + chunker_format(&repo_cfg.chunker, buffer+offset, sizeof(buffer)-offset);
+
 	// writing date-time in human readable form
     offset += 1 + strftime(buffer+offset, sizeof(buffer)-offset, "date %Y-%m-%d %H:%M:%S", local);
 
@@ -146,12 +258,16 @@ static int write_snapshot(unsigned char *tree_sha1, unsigned char *sha1)
 		goto end;
 	}
 
+	// all objects of the snapshot must be on disk before it becomes the last one
+	ret = finish_pack();
+	if (ret) {
+		fprintf(stderr, "Error finishing pack file!\n");
+		goto end;
+	}
+
 	ret = write_last_sha1(sha1);
-	
-end:
-	if (buffer)
-		free(buffer);
 
+end:
 	return ret;
 }
 
@@ -163,25 +279,25 @@ static int write_last_sha1(unsigned char *sha1)
 		return -1;
 	}
 
-	write(fd, sha1, SHA_DIGEST_LENGTH);
+	write(fd, sha1, repo_hash_len());
 	close(fd);
 
 	return 0;
 }
 
-static int read_last_sha1(unsigned char *sha1)
+int read_last_sha1(unsigned char *sha1)
 {
 	int bytes = 0;
 	int fd = 0;
 	
-	memset(sha1, 0, SHA_DIGEST_LENGTH);
+	memset(sha1, 0, HASH_MAX_LEN);
 
 	fd = open(".bkp-data/last_snapshot", O_RDONLY);
 	if (fd < 0)
 		return -1;
 
-	bytes = read(fd, sha1, SHA_DIGEST_LENGTH);
-	if (bytes != SHA_DIGEST_LENGTH) 
+	bytes = read(fd, sha1, repo_hash_len());
+	if (bytes != repo_hash_len()) 
 		return -1;
 
 	close(fd);
@@ -198,7 +314,7 @@ int read_snapshot_file(unsigned char *sha1, struct snapshot *snapshot)
 	if (ret)
 		return ret;
 
-	memcpy(snapshot->sha1, sha1, SHA_DIGEST_LENGTH);
+	memcpy(snapshot->sha1, sha1, HASH_MAX_LEN);
 
 	ret = read_snapshot_buffer(buff, snapshot);
 
@@ -210,16 +326,21 @@ int read_snapshot_buffer(char *buff, struct snapshot *snapshot)
 {
 	int offset = 0;
 
+	// snapshots without a chunker line were split in fixed size chunks
+	chunker_init(&snapshot->chunker, CHUNKER_FIXED);
+	memset(snapshot->parent_sha1, 0, HASH_MAX_LEN);
+	memset(snapshot->tree_sha1, 0, HASH_MAX_LEN);
+
 	while(*(buff+offset) != '\0') {
 		if (strcmp(buff+offset, "parent ") == 0) {
 			offset += 8; // "parent \0"
-			memcpy(snapshot->parent_sha1, buff+offset, SHA_DIGEST_LENGTH);
-			offset += SHA_DIGEST_LENGTH;
+			memcpy(snapshot->parent_sha1, buff+offset, repo_hash_len());
+			offset += repo_hash_len();
 		}
 		else if (strcmp(buff+offset, "tree ") == 0) {
 			offset += 6; // "trree \0"
-			memcpy(snapshot->tree_sha1, buff+offset, SHA_DIGEST_LENGTH);
-			offset += SHA_DIGEST_LENGTH;
+			memcpy(snapshot->tree_sha1, buff+offset, repo_hash_len());
+			offset += repo_hash_len();
 		}
 		else if (strncmp(buff+offset, "date ", 5) == 0) {
 			offset += 5; // "date "
@@ -232,6 +353,17 @@ int read_snapshot_buffer(char *buff, struct snapshot *snapshot)
 			sscanf(buff+offset, "%ld%n", &snapshot->time, &consumed);
 			offset += consumed + 1;
 		}
+		else if (strncmp(buff+offset, "chunker cdc ", 12) == 0) {
+			snapshot->chunker.type = CHUNKER_CDC;
+			sscanf(buff+offset, "chunker cdc %d %d %d", &snapshot->chunker.min_size, 
+				&snapshot->chunker.avg_size, &snapshot->chunker.max_size);
+			offset += strlen(buff+offset)+1;
+		}
+		else if (strncmp(buff+offset, "chunker fixed ", 14) == 0) {
+			sscanf(buff+offset, "chunker fixed %d", &snapshot->chunker.max_size);
+			snapshot->chunker.min_size = snapshot->chunker.avg_size = snapshot->chunker.max_size;
+			offset += strlen(buff+offset)+1;
+		}
 		else {
 			offset += strlen(buff+offset)+1;
 		}
@@ -244,7 +376,8 @@ int print_snapshot_buffer(unsigned char *sha1, char *buff)
 {
 	int ret = 0;
 	struct snapshot snapshot;
-	char sha1_hex[40+1];
+	char sha1_hex[HASH_MAX_HEX+1];
+	char chunker[64];
 
 	ret = read_snapshot_buffer(buff, &snapshot);
 	if (ret)
@@ -261,5 +394,8 @@ int print_snapshot_buffer(unsigned char *sha1, char *buff)
 
 	printf("Created on: %s\n", snapshot.date);	
 
+	chunker_format(&snapshot.chunker, chunker, sizeof(chunker));
+	printf("Chunker: %s\n", chunker);
+
 	return 0;
 }
@@ -17,20 +17,25 @@
 #ifndef SNAPSHOT_H
 #define SNAPSHOT_H
 
-#include <openssl/sha.h>
 #include <time.h>
 #include <sys/stat.h>
 
+#include "chunker.h"
+#include "hash.h"
+
 struct snapshot {
-	unsigned char sha1[SHA_DIGEST_LENGTH];
-	unsigned char parent_sha1[SHA_DIGEST_LENGTH];
-	unsigned char tree_sha1[SHA_DIGEST_LENGTH];
+	unsigned char sha1[HASH_MAX_LEN];
+	unsigned char parent_sha1[HASH_MAX_LEN];
+	unsigned char tree_sha1[HASH_MAX_LEN];
 	char date[20]; // YYYY-MM-DD HH:ii:ss\0
 	time_t time;
+	struct chunker_params chunker;
 };
 
 int create_snapshot();
 int list_snapshots(int limit);
+int find_snapshot(char *date);
+int read_last_sha1(unsigned char *sha1);
 int read_snapshot_file(unsigned char *sha1, struct snapshot *snapshot);
 int read_snapshot_buffer(char *buff, struct snapshot *snapshot);
 int print_snapshot_buffer(unsigned char *sha1, char *buff);
@@ -0,0 +1,314 @@
+
+/*
+ * Batched lookup of directory entries.
+ *
+ * On network and spinning storage a synchronous stat() per entry
+ * keeps a single request outstanding, so the walk is bound by the
+ * latency of the storage. With io_uring all the entries of a
+ * directory are submitted as statx requests at once and their
+ * results are collected as they complete.
+ *
+ * Only the fields compared by cache_entry_changed(), the file type
+ * and the allocated blocks (to tell sparse files) are requested, the
+ * rest of the returned struct stat is 0.
+ */
+
+#define _GNU_SOURCE // struct statx
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+#include "stat-batch.h"
+
+#define STAT_MASK (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_BLOCKS | STATX_MTIME | STATX_CTIME)
+
+static void stat_sync(int dirfd, char **names, int num, struct stat *sbs, int *errs);
+
+#ifdef HAVE_IO_URING
+static int setup_ring(struct stat_ring *ring, unsigned int entries);
+static int statx_supported(int fd);
+static void queue_statx(struct stat_ring *ring, int dirfd, char *name, int idx);
+static int reap_statx(struct stat_ring *ring, struct stat *sbs, int *errs);
+#endif
+
+/*
+ * Sets up the ring of a thread. Any failure leaves it unused
+ * (fd -1), the entries are then looked up with fstatat().
+ */
+void stat_ring_init(struct stat_ring *ring, unsigned int entries)
+{
+	memset(ring, 0, sizeof(struct stat_ring));
+	ring->fd = -1;
+
+#ifdef HAVE_IO_URING
+	if (entries > 0 && setup_ring(ring, entries))
+		stat_ring_destroy(ring);
+#else
+	(void)entries;
+#endif
+}
+
+void stat_ring_destroy(struct stat_ring *ring)
+{
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	/*
+	 * After a failed io_uring_enter() requests may still be in
+	 * flight, writing into the buffers, so those are left behind
+	 */
+	if (!ring->broken)
+		free(ring->bufs);
+
+	free(ring->free_bufs);
+
+	memset(ring, 0, sizeof(struct stat_ring));
+	ring->fd = -1;
+}
+
+/*
+ * Looks up names (relative to dirfd, without following symlinks).
+ * errs[i] is 0 when sbs[i] was filled in, the errno of the lookup
+ * otherwise. The results are the same whichever way they were got.
+ */
+void stat_batch(struct stat_ring *ring, int dirfd, char **names, int num, struct stat *sbs, int *errs)
+{
+#ifdef HAVE_IO_URING
+	int next = 0; // first name not queued yet
+	int in_flight = 0;
+	unsigned int to_submit = 0;
+	int ret = 0;
+
+	if (ring->fd < 0 || ring->broken) {
+		stat_sync(dirfd, names, num, sbs, errs);
+		return;
+	}
+
+	for (int i=0;i<num;i++)
+		errs[i] = EINPROGRESS;
+
+	while (next < num || in_flight > 0) {
+		while (next < num && ring->num_free_bufs > 0) {
+			queue_statx(ring, dirfd, names[next], next);
+			next++;
+			to_submit++;
+			in_flight++;
+		}
+
+		ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				ret = 0;
+			else {
+				// whatever did not complete is looked up again below
+				ring->broken = 1;
+				break;
+			}
+		}
+
+		to_submit -= ret;
+		in_flight -= reap_statx(ring, sbs, errs);
+	}
+
+	if (ring->broken) {
+		for (int i=0;i<num;i++) {
+			if (errs[i] == EINPROGRESS)
+				stat_sync(dirfd, &names[i], 1, &sbs[i], &errs[i]);
+		}
+	}
+#else
+	(void)ring;
+	stat_sync(dirfd, names, num, sbs, errs);
+#endif
+}
+
+static void stat_sync(int dirfd, char **names, int num, struct stat *sbs, int *errs)
+{
+	for (int i=0;i<num;i++)
+		errs[i] = fstatat(dirfd, names[i], &sbs[i], AT_SYMLINK_NOFOLLOW) ? errno : 0;
+}
+
+#ifdef HAVE_IO_URING
+static int setup_ring(struct stat_ring *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(struct io_uring_params));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return -1;
+
+	// IORING_OP_STATX came with 5.6, the ring itself with 5.1
+	if (!statx_supported(ring->fd))
+		return -1;
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		return -1;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			return -1;
+		}
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return -1;
+	}
+
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_ring + params.sq_off.array);
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (char *)ring->cq_ring + params.cq_off.cqes;
+
+	/*
+	 * At most sq_entries requests are in flight (one buffer each),
+	 * so neither the submission nor the completion queue overflows
+	 */
+	ring->bufs = calloc(params.sq_entries, sizeof(struct statx));
+	ring->free_bufs = malloc(params.sq_entries * sizeof(int));
+	if (!ring->bufs || !ring->free_bufs)
+		return -1;
+
+	for (unsigned int i=0;i<params.sq_entries;i++)
+		ring->free_bufs[i] = i;
+
+	ring->num_free_bufs = params.sq_entries;
+
+	return 0;
+}
+
+static int statx_supported(int fd)
+{
+	int supported = 0;
+	struct io_uring_probe *probe = NULL;
+	size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+
+	probe = calloc(1, probe_size);
+	if (!probe)
+		return 0;
+
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+		supported = probe->last_op >= IORING_OP_STATX &&
+					(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	free(probe);
+	return supported;
+}
+
+/*
+ * The user data of a request holds the index of its name and
+ * of the buffer its result is written to
+ */
+static void queue_statx(struct stat_ring *ring, int dirfd, char *name, int idx)
+{
+	unsigned int tail = *ring->sq_tail; // only written by us
+	unsigned int sq_idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &((struct io_uring_sqe *)ring->sqes)[sq_idx];
+	int buf = ring->free_bufs[--ring->num_free_bufs];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)name;
+	sqe->len = STAT_MASK;
+	sqe->off = (uintptr_t)&((struct statx *)ring->bufs)[buf];
+	sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+	sqe->user_data = ((uint64_t)buf << 32) | (uint32_t)idx;
+
+	ring->sq_array[sq_idx] = sq_idx;
+
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Consumes the completed requests, returns their number
+ */
+static int reap_statx(struct stat_ring *ring, struct stat *sbs, int *errs)
+{
+	int reaped = 0;
+	unsigned int head = *ring->cq_head; // only written by us
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &((struct io_uring_cqe *)ring->cqes)[head & *ring->cq_mask];
+		int idx = (uint32_t)cqe->user_data;
+		int buf = cqe->user_data >> 32;
+		struct statx *stx = &((struct statx *)ring->bufs)[buf];
+		struct stat *sb = &sbs[idx];
+
+		if (cqe->res < 0)
+			errs[idx] = -cqe->res;
+		else {
+			memset(sb, 0, sizeof(struct stat));
+			sb->st_mode = stx->stx_mode;
+			sb->st_size = stx->stx_size;
+			sb->st_blocks = stx->stx_blocks;
+			sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+			sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+			sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+			sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+			errs[idx] = 0;
+		}
+
+		ring->free_bufs[ring->num_free_bufs++] = buf;
+		reaped++;
+		head++;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return reaped;
+}
+#endif
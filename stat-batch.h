@@ -0,0 +1,40 @@
+
+#ifndef STAT_BATCH_H
+#define STAT_BATCH_H
+
+#include <sys/stat.h>
+
+/*
+ * Looks up the entries of a directory with one io_uring per walker
+ * thread, keeping up to STAT_RING_ENTRIES statx requests in flight.
+ * Without io_uring (old kernel, seccomp, --no-io-uring) the ring
+ * is not set up and the entries are looked up with fstatat().
+ */
+#define STAT_RING_ENTRIES 256
+
+struct stat_ring {
+	int fd; // -1: no io_uring, fstatat() is used
+	int broken; // io_uring_enter() failed, fstatat() is used
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	void *sqes;
+	void *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	void *bufs; // a struct statx for each request in flight
+	int *free_bufs;
+	int num_free_bufs;
+};
+
+void stat_ring_init(struct stat_ring *ring, unsigned int entries);
+void stat_ring_destroy(struct stat_ring *ring);
+void stat_batch(struct stat_ring *ring, int dirfd, char **names, int num, struct stat *sbs, int *errs);
+
+#endif
@@ -20,152 +20,669 @@
 #include <dirent.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <openssl/sha.h>
 #include <stdbool.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "tree.h"
 #include "cache.h"
 #include "sha1-file.h"
+#include "ingest.h"
+#include "config.h"
+#include "deque.h"
+#include "stat-batch.h"
 
-static int scan_tree(char *path, struct cache *cache, unsigned char *sha1);
-static int add_tree_entry(struct tree *tree, struct tree_entry *entry);
+/*
+ * Files of a directory which are being backed up by the
+ * ingest pipeline. Their sha1 is only known (and copied
+ * into the tree entry) once the directory`s batch completes,
+ * that is also when their new cache entry gets into the cache.
+ */
+struct pending_file {
+	struct tree_entry *entry;
+	struct stat sb;
+	struct ingest_result result;
+	char path[0];
+};
+
+/*
+ * A directory being walked. Its tree object is written once its
+ * own entries were scanned and all of its subdirectories are
+ * complete, by whichever thread completes the last of them.
+ *
+ * Directories also have an entry in the cache (their path ends
+ * with a /) holding their stat and tree sha1. If the directory
+ * itself, its files and its subdirectories did not change, the
+ * tree is the same as last time and it isn`t written again.
+ */
+struct walk_dir {
+	struct walk_dir *parent;
+	struct tree_entry *entry; // entry of the directory in the parent tree
+	DIR *dirp;
+	int refs; // the scan + subdirectories not opened yet, dirp is closed at 0
+	int pending; // the scan + subdirectories not complete yet
+	struct stat sb;
+	struct cache_entry *c_entry; // of the previous snapshot
+	int changed; // the tree differs from the one in c_entry
+	int full; // walked without the journal, everything below may be new
+	struct tree tree;
+	int path_len;
+	char path[0]; // with the trailing /
+};
+
+/*
+ * Directories are walked by a pool of threads, each of them taking
+ * the directories it found from its own deque and stealing from
+ * the others when it runs out of work. The entries of a directory
+ * are read first and then looked up all together relative to its
+ * file descriptor (with io_uring, when available).
+ */
+struct walker {
+	struct deque_set dirs;
+	struct cache *cache;
+	struct journal *journal; // NULL, or the directories changed since the last snapshot
+	pthread_rwlock_t cache_lock; // the cache array changes as files complete
+	int error;
+	unsigned char sha1[HASH_MAX_LEN]; // of the root tree
+};
+
+struct walk_thread {
+	struct walker *walker;
+	int idx;
+	pthread_t thread;
+	struct stat_ring ring;
+
+	// entries of the directory being scanned, reused for the next one
+	char *names_buff;
+	size_t names_size;
+	char **names;
+	struct stat *sbs;
+	int *errs;
+	int names_len;
+	int names_cap;
+};
+
+static void *walk_thread(void *arg);
+static struct walk_dir *new_walk_dir(struct walk_dir *parent, struct tree_entry *entry, char *path, int path_len, struct stat *sb);
+static int open_walk_dir(struct walk_dir *dir);
+static void put_walk_dir_ref(struct walk_dir *dir);
+static int scan_dir(struct walker *walker, struct walk_thread *self, struct walk_dir *dir);
+static int read_dir_names(struct walk_thread *self, struct walk_dir *dir);
+static int reuse_subtree(struct walker *walker, struct walk_dir *dir, struct tree_entry *entry, char *path, struct stat *sb);
+static int complete_dir(struct walker *walker, struct walk_dir *dir);
+static int cache_dir(struct walker *walker, struct walk_dir *dir, unsigned char *sha1);
+static int queue_file(struct walk_dir *dir, struct ingest_batch *batch, struct pending_file ***pending, int *pending_len, 
+					struct tree_entry *entry, char *path, struct stat *sb, struct cache_entry *prev);
+static int finish_pending_file(struct cache *cache, struct pending_file *file);
+static struct tree_entry *new_tree_entry(struct tree *tree, char *name, int name_len, int st_mode);
 static int write_tree(struct tree *tree, unsigned char *sha1);
 
-int create_tree(char *path, struct cache *cache, unsigned char *sha1)
+/*
+ * Builds (and stores) the tree of path, backing up new and modified
+ * files. The trees come out the same as with a serial walk: entries
+ * keep the readdir() order of their directory. With a valid journal,
+ * directories with no change below them are not walked at all.
+ */
+int create_tree(char *path, struct cache *cache, struct journal *journal, unsigned char *sha1)
 {
-	return scan_tree(path, cache, sha1);
+	int ret = 0;
+	int num_threads = bkp_opts.threads > 0 ? bkp_opts.threads : 1;
+	int started = 0;
+	struct walker walker;
+	struct walk_thread *threads = NULL;
+	struct walk_dir *root = NULL;
+
+	walker.cache = cache;
+	walker.journal = journal && journal->valid ? journal : NULL;
+	walker.error = 0;
+	pthread_rwlock_init(&walker.cache_lock, NULL);
+
+	ret = deque_set_init(&walker.dirs, num_threads);
+	if (ret)
+		return ret;
+
+	threads = calloc(num_threads, sizeof(struct walk_thread));
+	root = new_walk_dir(NULL, NULL, path, strlen(path), NULL);
+	if (!threads || !root) {
+		fprintf(stderr, "Error allocating memory for directory walker!\n");
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	ret = deque_push(&walker.dirs, 0, root);
+	if (ret)
+		goto end;
+
+	root = NULL;
+
+	for (started=0;started<num_threads;started++) {
+		threads[started].walker = &walker;
+		threads[started].idx = started;
+
+		if (pthread_create(&threads[started].thread, NULL, walk_thread, &threads[started])) {
+			fprintf(stderr, "Error creating walker thread!\n");
+			walker.error = -1;
+			deque_close(&walker.dirs);
+			break;
+		}
+	}
+
+	for (int i=0;i<started;i++)
+		pthread_join(threads[i].thread, NULL);
+
+	ret = walker.error;
+	if (!ret)
+		memcpy(sha1, walker.sha1, HASH_MAX_LEN);
+
+	/*
+	 * After an error, directories still being walked are left
+	 * behind: their files may still be referenced by the ingest
+	 * pipeline until it stops
+	 */
+end:
+	free(root);
+	free(threads);
+	deque_set_destroy(&walker.dirs);
+	pthread_rwlock_destroy(&walker.cache_lock);
+
+	return ret;
 }
 
-static int scan_tree(char *path, struct cache *cache, unsigned char *sha1)
+static void *walk_thread(void *arg)
+{
+	struct walk_thread *self = arg;
+	struct walker *walker = self->walker;
+	struct walk_dir *dir = NULL;
+
+	stat_ring_init(&self->ring, bkp_opts.io_uring ? STAT_RING_ENTRIES : 0);
+
+	while ((dir = deque_pop(&walker->dirs, self->idx)) != NULL) {
+		if (scan_dir(walker, self, dir)) {
+			walker->error = -1;
+			deque_close(&walker->dirs);
+		}
+	}
+
+	stat_ring_destroy(&self->ring);
+
+	free(self->names_buff);
+	free(self->names);
+	free(self->sbs);
+	free(self->errs);
+
+	return NULL;
+}
+
+/*
+ * sb is the stat of the directory, got by the scan of its parent.
+ * The stat of the root is only got once it is opened.
+ */
+static struct walk_dir *new_walk_dir(struct walk_dir *parent, struct tree_entry *entry, char *path, int path_len, struct stat *sb)
+{
+	struct walk_dir *dir = malloc(sizeof(struct walk_dir) + path_len + 1);
+
+	if (!dir)
+		return NULL;
+
+	dir->parent = parent;
+	dir->entry = entry;
+	dir->dirp = NULL;
+	dir->refs = 1;
+	dir->pending = 1;
+	dir->c_entry = NULL;
+	dir->changed = 0;
+	dir->full = parent ? parent->full : 0;
+	dir->tree.entries = NULL;
+	dir->tree.entries_len = 0;
+	dir->tree.entries_size = 0;
+	arena_init(&dir->tree.arena, 0);
+	dir->path_len = path_len;
+	memcpy(dir->path, path, path_len + 1);
+
+	if (sb)
+		dir->sb = *sb;
+
+	return dir;
+}
+
+/*
+ * Subdirectories are opened relative to their parent, which
+ * stays open until the last of them was opened
+ */
+static int open_walk_dir(struct walk_dir *dir)
+{
+	int fd = -1;
+
+	if (dir->parent) {
+		fd = openat(dirfd(dir->parent->dirp), dir->entry->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		put_walk_dir_ref(dir->parent);
+	}
+	else
+		fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd >= 0)
+		dir->dirp = fdopendir(fd);
+
+	if (!dir->dirp) {
+		printf("Error opening directory %s (errno: %d)!\n", dir->path, errno);
+
+		if (fd >= 0)
+			close(fd);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static void put_walk_dir_ref(struct walk_dir *dir)
+{
+	if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		closedir(dir->dirp);
+		dir->dirp = NULL;
+	}
+}
+
+static int scan_dir(struct walker *walker, struct walk_thread *self, struct walk_dir *dir)
 {
-	DIR *dirp = opendir(path);
-	struct dirent *dirent = NULL;
 	struct stat sb;
 	int ret = 0;
 	char full_path[PATH_MAX];
+	int name_len = 0;
 
+	struct cache *cache = walker->cache;
 	struct cache_entry *c_entry = NULL;
-	struct tree tree;
 	struct tree_entry *entry;
-	
-	if (!dirp) {
-		printf("Error opening directory!\n");
+	struct walk_dir *subdir = NULL;
+	struct ingest_batch batch;
+	struct pending_file **pending = NULL;
+	int pending_len = 0;
+	int changed = 0; // subdirectories report their changes on their own
+
+	ingest_batch_init(&batch);
+
+	if (open_walk_dir(dir))
 		return -1;
+
+	// before any entry is read, so later changes are seen next time
+	if (!dir->parent && fstat(dirfd(dir->dirp), &dir->sb)) {
+		printf("Error calling stat on: %s\n", dir->path);
+		ret = -1;
+		goto end;
 	}
 
-	tree.entries = NULL;
-	tree.entries_len = 0;
+	pthread_rwlock_rdlock(&walker->cache_lock);
+	dir->c_entry = find_cache_entry(cache, dir->path);
+	pthread_rwlock_unlock(&walker->cache_lock);
 
-	while ((dirent = readdir(dirp)) != NULL) {
-		if (strcmp(dirent->d_name, ".") == 0 || 
-			strcmp(dirent->d_name, "..") == 0 ||
-			strcmp(dirent->d_name, ".bkp-data") == 0)
-			continue;
-		
-		snprintf(full_path, PATH_MAX, "%s%s", path, dirent->d_name);
+	// entries were added, removed or renamed, or the mode changed
+	if (!dir->c_entry || (cache_entry_changed(dir->c_entry, &dir->sb) & ~CE_CTIME_CHANGED))
+		changed = 1;
 
-		ret = lstat(full_path, &sb);
-		if (ret) {
+	memcpy(full_path, dir->path, dir->path_len);
+
+	ret = read_dir_names(self, dir);
+	if (ret)
+		goto end;
+
+	stat_batch(&self->ring, dirfd(dir->dirp), self->names, self->names_len, self->sbs, self->errs);
+
+	for (int i=0;i<self->names_len;i++) {
+		char *name = self->names[i];
+
+		name_len = strlen(name);
+		memcpy(full_path + dir->path_len, name, name_len + 1);
+
+		if (self->errs[i]) {
 			printf("Error calling stat on: %s\n", full_path);
+			ret = -1;
 			goto end;
 		}
 
+		sb = self->sbs[i];
+
 		if (!S_ISDIR(sb.st_mode) && !S_ISREG(sb.st_mode))
 			continue;
 		
-		entry = malloc(sizeof(struct tree_entry));
+		entry = new_tree_entry(&dir->tree, name, name_len, sb.st_mode);
 		if (!entry) {
-			fprintf(stderr, "Error allocating memory for tree entry!\n");
+			ret = -ENOMEM;
 			goto end;
 		}
 
-		memset(entry->sha1, 0, SHA_DIGEST_LENGTH);
-		strncpy(entry->name, dirent->d_name, NAME_MAX+1);
-		entry->name_len = strlen(dirent->d_name);
-		entry->st_mode = sb.st_mode;
-
 		if (S_ISDIR(sb.st_mode)) {
 			strcat(full_path, "/");
-			ret = scan_tree(full_path, cache, entry->sha1);
+
+			if (reuse_subtree(walker, dir, entry, full_path, &sb))
+				continue;
+
+			subdir = new_walk_dir(dir, entry, full_path, dir->path_len + name_len + 1, &sb);
+			if (!subdir) {
+				fprintf(stderr, "Error allocating memory for directory %s!\n", full_path);
+				ret = -ENOMEM;
+				goto end;
+			}
+
+			if (walker->journal && journal_path_changed(walker->journal, full_path) == JOURNAL_TREE)
+				subdir->full = 1;
+
+			__atomic_add_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL);
+			__atomic_add_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL);
+
+			ret = deque_push(&walker->dirs, self->idx, subdir);
 			if (ret)
 				goto end;
 		} 
 		else if (S_ISREG(sb.st_mode)) {
-			int path_len = strlen(full_path);	
-			int c_idx = find_cache_entry(cache, full_path, 0);
-
-			if (c_idx > -1) {
-				c_entry = cache->entries[c_idx];
-				
-				int changed = cache_entry_changed(c_entry, &sb);
-				if (changed) {
-					if (changed & CE_MODE_CHANGED) 
-						c_entry->st_mode = sb.st_mode;
-
-					if (changed & CE_TIME_CHANGED) {
-						c_entry->st_mtim.tv_sec = sb.st_mtim.tv_sec;
-						c_entry->st_mtim.tv_nsec = sb.st_mtim.tv_nsec;
-						c_entry->st_ctim.tv_sec = sb.st_ctim.tv_sec;
-						c_entry->st_ctim.tv_nsec = sb.st_ctim.tv_nsec;	
-					}
-					
-					if (changed & CE_SIZE_CHANGED) {
-						c_entry->st_size = sb.st_size;
-						// TODO update file
-					}
-				}
+			struct cache_entry *prev = NULL;
+
+			pthread_rwlock_rdlock(&walker->cache_lock);
+			c_entry = find_cache_entry(cache, full_path);
+			pthread_rwlock_unlock(&walker->cache_lock);
+
+			if (c_entry) {
+				int c_changed = cache_entry_changed(c_entry, &sb);
+
+				if (c_changed)
+					changed = 1;
+
+				/*
+				 * Modified content - the file is backed up again, reusing
+				 * the chunks of the previous version which did not change.
+				 * Content rewritten with the same size and the old mtime
+				 * put back (touch -d, rsync -t, cp -p) only changes the
+				 * ctime, so that counts as modified too.
+				 */
+				if (c_changed & (CE_SIZE_CHANGED | CE_TIME_CHANGED | CE_CTIME_CHANGED)) 
+					prev = c_entry;
+				else if (c_changed & CE_MODE_CHANGED) 
+					c_entry->st_mode = sb.st_mode;
 			}
-			else {
-				c_entry = malloc(sizeof(struct cache_entry) + path_len + 1);
-				if (!c_entry) {
-					ret = -ENOMEM;
-					fprintf(stderr, "Error allocating memory for cache entry!\n");
 
+			if (!c_entry)
+				changed = 1;
+
+			if (!c_entry || prev) {
+				ret = queue_file(dir, &batch, &pending, &pending_len, entry, full_path, &sb, prev);
+				if (ret)
 					goto end;
-				}
-
-				memset(c_entry->sha1, 0, SHA_DIGEST_LENGTH);
-				c_entry->st_mode = sb.st_mode;
-				c_entry->st_size = sb.st_size;
-				c_entry->st_mtim = sb.st_mtim;
-				c_entry->st_ctim = sb.st_ctim;
-				c_entry->path_len = strlen(full_path);
-				strcpy(c_entry->path, full_path);
-				//printf("%s .... %s\n", full_path, c_entry->path);	
-				add_cache_entry(cache, c_entry);
 			}
-			// add file sha1 to tree entry
-			memcpy(entry->sha1, c_entry->sha1, SHA_DIGEST_LENGTH);
+			else
+				memcpy(entry->sha1, c_entry->sha1, HASH_MAX_LEN);
 		}
-	
-		ret = add_tree_entry(&tree, entry);
-		if (ret) 
-			goto end;
 	}
 
-	ret = write_tree(&tree, sha1);
+	ret = ingest_batch_wait(&batch);
+	if (ret) 
+		goto end; 
+
+	pthread_rwlock_wrlock(&walker->cache_lock);
+
+	for (int i=0;i<pending_len && !ret;i++)
+		ret = finish_pending_file(cache, pending[i]);
+
+	pthread_rwlock_unlock(&walker->cache_lock);
+
+end:
+	/*
+	 * Files already queued still reference the tree and cache
+	 * entries, so they must complete before anything is freed
+	 */
+	ingest_batch_wait(&batch);
+
+	// the pending files themselves are in the arena of the tree
+	for (int i=0;i<pending_len;i++)
+		free(pending[i]->result.chunks);
+
+	if (pending)
+		free(pending);
+
+	put_walk_dir_ref(dir);
+
+	if (ret)
+		return ret;
+
+	if (changed)
+		__atomic_store_n(&dir->changed, 1, __ATOMIC_RELAXED);
 
-	goto end;
+	return complete_dir(walker, dir);
+}
 
 /*
- * TODO - free entry and c_entry
+ * Nothing was journaled in or below the directory at path since the
+ * last snapshot, so its tree is the one in the cache (if it was
+ * cached as it is now). The cache entries of everything below it
+ * are kept as they are.
  */
-end:
-	free_tree_entries(&tree);
+static int reuse_subtree(struct walker *walker, struct walk_dir *dir, struct tree_entry *entry, char *path, struct stat *sb)
+{
+	struct cache_entry *c_entry = NULL;
+
+	if (!walker->journal || dir->full || journal_path_changed(walker->journal, path))
+		return 0;
+
+	pthread_rwlock_rdlock(&walker->cache_lock);
+	c_entry = find_cache_entry(walker->cache, path);
+	pthread_rwlock_unlock(&walker->cache_lock);
+
+	if (!c_entry || (cache_entry_changed(c_entry, sb) & ~CE_CTIME_CHANGED))
+		return 0;
+
+	memcpy(entry->sha1, c_entry->sha1, HASH_MAX_LEN);
+
+	return 1;
+}
+
+/*
+ * Reads the names of the entries to look up into the buffers of the
+ * thread, in readdir() order. Entries whose type is known from the
+ * directory itself and are neither files nor directories are skipped.
+ */
+static int read_dir_names(struct walk_thread *self, struct walk_dir *dir)
+{
+	struct dirent *dirent = NULL;
+	size_t used = 0;
+	int name_len = 0;
+
+	self->names_len = 0;
+
+	while ((dirent = readdir(dir->dirp)) != NULL) {
+		if (strcmp(dirent->d_name, ".") == 0 || 
+			strcmp(dirent->d_name, "..") == 0 ||
+			strcmp(dirent->d_name, ".bkp-data") == 0)
+			continue;
+
+		if (dirent->d_type != DT_UNKNOWN && dirent->d_type != DT_DIR && dirent->d_type != DT_REG)
+			continue;
+
+		name_len = strlen(dirent->d_name);
+		if (dir->path_len + name_len + 2 > PATH_MAX) {
+			printf("Path too long: %s%s\n", dir->path, dirent->d_name);
+			return -1;
+		}
+
+		if (used + name_len + 1 > self->names_size) {
+			size_t size = self->names_size > 0 ? self->names_size * 2 : 4096;
+			char *buff = NULL;
+
+			while (used + name_len + 1 > size)
+				size *= 2;
+
+			buff = realloc(self->names_buff, size);
+			if (!buff) {
+				fprintf(stderr, "Error allocating memory for directory entries!\n");
+				return -ENOMEM;
+			}
+
+			self->names_buff = buff;
+			self->names_size = size;
+		}
+
+		if (self->names_len == self->names_cap) {
+			int cap = self->names_cap > 0 ? self->names_cap * 2 : 256;
+			char **names = realloc(self->names, cap * sizeof(char *));
+			struct stat *sbs = realloc(self->sbs, cap * sizeof(struct stat));
+			int *errs = realloc(self->errs, cap * sizeof(int));
+
+			// whatever was reallocated is kept, the next attempt starts from there
+			if (names)
+				self->names = names;
+			if (sbs)
+				self->sbs = sbs;
+			if (errs)
+				self->errs = errs;
+
+			if (!names || !sbs || !errs) {
+				fprintf(stderr, "Error allocating memory for directory entries!\n");
+				return -ENOMEM;
+			}
+
+			self->names_cap = cap;
+		}
+
+		// offsets until the buffer stops moving
+		self->names[self->names_len++] = (char *)used;
+
+		memcpy(self->names_buff + used, dirent->d_name, name_len + 1);
+		used += name_len + 1;
+	}
+
+	for (int i=0;i<self->names_len;i++)
+		self->names[i] = self->names_buff + (size_t)self->names[i];
+
+	return 0;
+}
+
+/*
+ * Drops the reference of the scan or of a completed subdirectory.
+ * The last one writes the tree of the directory (if it changed),
+ * which may in turn complete its parent.
+ */
+static int complete_dir(struct walker *walker, struct walk_dir *dir)
+{
+	int ret = 0;
+	struct walk_dir *parent = NULL;
+	unsigned char *sha1 = NULL;
+
+	while (dir && __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		parent = dir->parent;
+		sha1 = parent ? dir->entry->sha1 : walker->sha1;
+
+		if (__atomic_load_n(&dir->changed, __ATOMIC_RELAXED)) {
+			ret = write_tree(&dir->tree, sha1);
+
+			if (parent)
+				__atomic_store_n(&parent->changed, 1, __ATOMIC_RELAXED);
+		}
+		else
+			memcpy(sha1, dir->c_entry->sha1, HASH_MAX_LEN);
+
+		if (!ret)
+			ret = cache_dir(walker, dir, sha1);
+
+		free_tree_entries(&dir->tree);
+		free(dir);
+
+		if (ret)
+			return ret;
+
+		// the root is complete, so is the walk
+		if (!parent)
+			deque_close(&walker->dirs);
+
+		dir = parent;
+	}
+
+	return 0;
+}
+
+static int cache_dir(struct walker *walker, struct walk_dir *dir, unsigned char *sha1)
+{
+	int ret = 0;
+	struct cache_entry *c_entry = NULL;
+
+	pthread_rwlock_wrlock(&walker->cache_lock);
+
+	c_entry = new_cache_entry(walker->cache, dir->path, &dir->sb, NULL, 0);
+	if (c_entry) {
+		memcpy(c_entry->sha1, sha1, HASH_MAX_LEN);
+		ret = add_cache_entry(walker->cache, c_entry);
+	}
+	else
+		ret = -ENOMEM;
+
+	pthread_rwlock_unlock(&walker->cache_lock);
 
-	closedir(dirp);
 	return ret;
 }
 
+/*
+ * Submits a new or modified file to the ingest pipeline. The new 
+ * cache entry of the file is only created (and added to the cache)
+ * once its content was stored, see finish_pending_file().
+ */
+static int queue_file(struct walk_dir *dir, struct ingest_batch *batch, struct pending_file ***pending, int *pending_len, 
+					struct tree_entry *entry, char *path, struct stat *sb, struct cache_entry *prev)
+{
+	struct pending_file *file = NULL;
+	int path_len = strlen(path);
+
+	if (*pending_len % 100 == 0) {
+		struct pending_file **tmp = realloc(*pending, sizeof(struct pending_file *) * (*pending_len + 100));
+		if (!tmp) {
+			fprintf(stderr, "Error allocating memory for pending files!\n");
+			return -ENOMEM;
+		}
+		*pending = tmp;
+	}
+
+	file = arena_alloc(&dir->tree.arena, sizeof(struct pending_file) + path_len + 1);
+	if (!file)
+		return -ENOMEM;
+
+	memset(&file->result, 0, sizeof(struct ingest_result));
+	file->entry = entry;
+	file->sb = *sb;
+	memcpy(file->path, path, path_len + 1);
+
+	(*pending)[(*pending_len)++] = file;
+
+	return ingest_file(batch, file->path, &file->sb, prev, &file->result);
+}
+
+/*
+ * Called with the cache locked for writing
+ */
+static int finish_pending_file(struct cache *cache, struct pending_file *file)
+{
+	struct cache_entry *c_entry = NULL;
+
+	memcpy(file->entry->sha1, file->result.sha1, HASH_MAX_LEN);
+
+	c_entry = new_cache_entry(cache, file->path, &file->sb, file->result.chunks, file->result.num_chunks);
+	if (!c_entry)
+		return -ENOMEM;
+
+	memcpy(c_entry->sha1, file->result.sha1, HASH_MAX_LEN);
+
+	// replaces the entry of the previous version
+	return add_cache_entry(cache, c_entry);
+}
+
 static int write_tree(struct tree *tree, unsigned char *sha1)
 {
 	int ret = 0;
 	struct tree_entry *entry;
-	int size = 100 + (sizeof(struct tree_entry) * tree->entries_len);
-	char *buffer = malloc(size); 
+	int size = 100;
+	char *buffer = NULL;
+
+	// mode, space, name, \0 and id of each entry
+	for (int i=0;i<tree->entries_len;i++)
+		size += 12 + tree->entries[i]->name_len + 1 + HASH_MAX_LEN;
+
+	buffer = malloc(size);
 	int offset = 0;
 	
 	if (!buffer) {
@@ -181,8 +698,8 @@ static int write_tree(struct tree *tree, unsigned char *sha1)
 		offset += sprintf(buffer+offset, "%d %s", entry->st_mode, entry->name);
 		offset += 1; // we want to keep the \0
 
-		memcpy(buffer+offset, entry->sha1, SHA_DIGEST_LENGTH);
-		offset += SHA_DIGEST_LENGTH; 
+		memcpy(buffer+offset, entry->sha1, repo_hash_len());
+		offset += repo_hash_len(); 
 	}
 
 	ret = write_sha1_file(sha1, buffer, offset);
@@ -209,70 +726,84 @@ int read_tree_file(unsigned char *sha1, struct tree *tree)
 
 int read_tree_buffer(char *buff, int buff_len, struct tree *tree)
 {
-	int ret = 0;
 	struct tree_entry *entry = NULL;
 	int offset = 0;
 	int consumed = 0;
+	int st_mode = 0;
+	int name_len = 0;
 
 	tree->entries = NULL;
 	tree->entries_len = 0;
+	tree->entries_size = 0;
 
-	while(offset < buff_len) {
-		entry = malloc(sizeof(struct tree_entry));	
+	// the entries take about as much space as the buffer
+	arena_init(&tree->arena, buff_len * 2);
 
+	while(offset < buff_len) {
 		// read file mode + path + \0
-		sscanf(buff+offset, "%d %n", &entry->st_mode, &consumed);
+		sscanf(buff+offset, "%d %n", &st_mode, &consumed);
 		offset += consumed;
-		offset += snprintf(entry->name, FILENAME_MAX, "%s", buff+offset)+1;
 
-		// read referenced sha1 hash
-		memcpy(entry->sha1, buff+offset, 20);
-		offset += SHA_DIGEST_LENGTH;
+		name_len = strnlen(buff+offset, buff_len-offset);
 
-		ret = add_tree_entry(tree, entry);
-		if (ret) {
-			free(entry);
-			goto end;
-		}
+		entry = new_tree_entry(tree, buff+offset, name_len, st_mode);
+		if (!entry)
+			return -ENOMEM;
+
+		offset += name_len + 1;
+
+		// read referenced sha1 hash
+		memcpy(entry->sha1, buff+offset, repo_hash_len());
+		offset += repo_hash_len();
 	}
 
-end:
-	return ret;
+	return 0;
 }
 
-static int add_tree_entry(struct tree *tree, struct tree_entry *entry)
+/*
+ * Appends a new entry (with a zero sha1) to the tree, the entries
+ * follow each other in its arena
+ */
+static struct tree_entry *new_tree_entry(struct tree *tree, char *name, int name_len, int st_mode)
 {
-	if (!tree->entries) {
-		tree->entries = calloc(100, sizeof(struct tree_entry *));
-	}
-	else {
-		if (tree->entries_len % 100 == 0)
-			tree->entries = realloc(tree->entries, sizeof(struct tree_entry *) * (tree->entries_len + 100));
-	}
+	struct tree_entry *entry = NULL;
 
-	if (!tree->entries) {
-		fprintf(stderr, "Error allocating memory for tree entries!\n");
-		return -ENOMEM;
+	if (tree->entries_len == tree->entries_size) {
+		int size = tree->entries_size > 0 ? tree->entries_size * 2 : 64;
+		struct tree_entry **entries = realloc(tree->entries, sizeof(struct tree_entry *) * size);
+
+		if (!entries) {
+			fprintf(stderr, "Error allocating memory for tree entries!\n");
+			return NULL;
+		}
+
+		tree->entries = entries;
+		tree->entries_size = size;
 	}
 
+	entry = arena_alloc(&tree->arena, sizeof(struct tree_entry) + name_len + 1);
+	if (!entry)
+		return NULL;
+
+	entry->st_mode = st_mode;
+	memset(entry->sha1, 0, HASH_MAX_LEN);
+	entry->name_len = name_len;
+	memcpy(entry->name, name, name_len);
+	entry->name[name_len] = '\0';
+
 	tree->entries[tree->entries_len++] = entry;
 
-	return 0;
+	return entry;
 }
 
 void free_tree_entries(struct tree *tree)
 {
-	if (tree->entries_len == 0) 
-		return;
-
-	for (int i=0;i<tree->entries_len;i++) {
-		free(tree->entries[i]);
-		tree->entries[i] = NULL;
-	}
-
 	free(tree->entries);
 	tree->entries = NULL;
 	tree->entries_len = 0;
+	tree->entries_size = 0;
+
+	arena_free(&tree->arena);
 }
 
 int print_tree_buffer(char *buff, int buff_len)
@@ -280,7 +811,7 @@ int print_tree_buffer(char *buff, int buff_len)
 	int ret = 0;
 	struct tree tree;
 	struct tree_entry *entry;
-	char sha1_hex[40+1];
+	char sha1_hex[HASH_MAX_HEX+1];
 
 	ret = read_tree_buffer(buff, buff_len, &tree);
 	if (ret)
@@ -297,3 +828,111 @@ int print_tree_buffer(char *buff, int buff_len)
 	return 0;
 
 }
+
+/*
+ * Normalizes path into out_path (PATH_MAX bytes): "a//b/", "./a/b"
+ * and "/a/b" are all "/a/b", the root is "". Returns the length of
+ * out_path, or -1 if it is too long.
+ */
+int normalize_tree_path(char *path, char *out_path)
+{
+	int len = 0;
+
+	out_path[0] = '\0';
+	while (path && *path) {
+		char *name = path;
+		int name_len = 0;
+
+		while (*path && *path != '/')
+			path++;
+
+		name_len = path - name;
+
+		while (*path == '/')
+			path++;
+
+		if (name_len == 0 || (name_len == 1 && name[0] == '.'))
+			continue;
+
+		if (len + name_len + 2 > PATH_MAX) {
+			fprintf(stderr, "Path too long!\n");
+			return -1;
+		}
+
+		out_path[len++] = '/';
+		memcpy(out_path + len, name, name_len);
+		len += name_len;
+		out_path[len] = '\0';
+	}
+
+	return len;
+}
+
+/*
+ * Looks up the entry of path (normalized, starting with a /) in the
+ * tree. Only the trees on the path are read. The entry is copied to
+ * out_entry, which is left NULL if path is not in the tree.
+ */
+int find_tree_path(unsigned char *tree_sha1, char *path, struct tree_entry **out_entry)
+{
+	int ret = 0;
+	struct tree tree;
+	struct tree_entry *entry = NULL;
+	unsigned char sha1[HASH_MAX_LEN];
+	char *name = NULL;
+	int name_len = 0;
+
+	*out_entry = NULL;
+	memcpy(sha1, tree_sha1, HASH_MAX_LEN);
+
+	while (*path) {
+		name = ++path;
+		while (*path && *path != '/')
+			path++;
+
+		name_len = path - name;
+
+		if (read_tree_file(sha1, &tree))
+			return -1;
+
+		entry = NULL;
+		for (int i=0;i<tree.entries_len;i++) {
+			if (compare_tree_names(tree.entries[i]->name, tree.entries[i]->name_len, name, name_len) == 0) {
+				entry = tree.entries[i];
+				break;
+			}
+		}
+
+		// the last component can be anything, the others have to be directories
+		if (entry && !*path) {
+			*out_entry = malloc(sizeof(struct tree_entry) + entry->name_len + 1);
+			if (!*out_entry) {
+				fprintf(stderr, "Error allocating memory for tree entry!\n");
+				ret = -ENOMEM;
+			}
+			else
+				memcpy(*out_entry, entry, sizeof(struct tree_entry) + entry->name_len + 1);
+		}
+		else if (entry && S_ISDIR(entry->st_mode))
+			memcpy(sha1, entry->sha1, HASH_MAX_LEN);
+		else
+			path = "";
+
+		free_tree_entries(&tree);
+
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int compare_tree_names(char *name1, int len1, char *name2, int len2)
+{
+	int cmp = memcmp(name1, name2, len1 < len2 ? len1 : len2);
+
+	if (cmp)
+		return cmp;
+
+	return len1 - len2;
+}
@@ -19,10 +19,12 @@
 
 #include <stdint.h>
 #include <sys/stat.h>
-#include <openssl/sha.h>
+#include "hash.h"
 
 #include "bkp.h"
 #include "cache.h"
+#include "arena.h"
+#include "watch.h"
 
 enum tree_entry_type {
 	ENTRY_TYPE_DIR=1,
@@ -32,20 +34,29 @@ enum tree_entry_type {
 
 struct tree_entry {
 	int st_mode;
-	unsigned char sha1[SHA_DIGEST_LENGTH];
+	unsigned char sha1[HASH_MAX_LEN];
 	int name_len;
-	char name[NAME_MAX+1];
+	char name[0];
 };
 
+/*
+ * The entries (and whatever else belongs to the tree) live in
+ * its arena, they are all freed at once by free_tree_entries()
+ */
 typedef struct tree {
 	struct tree_entry **entries;
 	int entries_len;
+	int entries_size;
+	struct arena arena;
 } tree_t;
 
-int create_tree(char *path, struct cache *cache, unsigned char *sha1);
+int create_tree(char *path, struct cache *cache, struct journal *journal, unsigned char *sha1);
 int read_tree_file(unsigned char *sha1, struct tree *tree);
 int read_tree_buffer(char *buff, int buff_len, struct tree *tree);
 int print_tree_buffer(char *buff, int buff_len);
 void free_tree_entries(struct tree *tree);
+int normalize_tree_path(char *path, char *out_path);
+int find_tree_path(unsigned char *tree_sha1, char *path, struct tree_entry **out_entry);
+int compare_tree_names(char *name1, int len1, char *name2, int len2);
 
 #endif 
@@ -0,0 +1,781 @@
+
+/*
+ * Change journal kept by bkp --watch, see watch.h.
+ *
+ * The watcher puts an inotify watch on every directory of the
+ * backed up tree. An event in a directory journals the directory
+ * itself: the next snapshot lists it again and checks its entries
+ * against the filecache. A new directory is journaled as a whole
+ * new tree. Each path is journaled only once between two syncs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+					IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+#define JOURNAL_MAX_SIZE (16 * 1024 * 1024) // a new generation is started at the next sync
+#define JOURNAL_SYNC_TIMEOUT 2000 // ms
+#define JOURNAL_TOKEN_MAX 64
+
+#define EVENT_BUFF_SIZE (64 * 1024)
+
+struct watcher {
+	int fd; // inotify
+	int bkp_wd; // .bkp-data, for the sync requests
+	char **paths; // of the watched directories, by watch descriptor
+	int paths_size;
+	int num_watches;
+	int journal_fd;
+	uint64_t generation;
+	size_t journal_size;
+	char **journaled; // hash set of the records since the last sync
+	uint32_t journaled_size;
+	uint32_t journaled_len;
+};
+
+static int add_watches(struct watcher *w, char *path, int path_len);
+static int set_watch_path(struct watcher *w, int wd, char *path);
+static void remove_watches(struct watcher *w, char *path);
+static int handle_event(struct watcher *w, struct inotify_event *event);
+static int handle_sync(struct watcher *w);
+static int start_generation(struct watcher *w);
+static int journal_record(struct watcher *w, char type, char *path);
+static int write_record(int fd, char type, char *str);
+static void clear_journaled(struct watcher *w);
+static uint32_t hash_str(char *str);
+static int parse_journal(struct journal *journal, char *buff, size_t len, char *token);
+static int add_journal_path(char ***paths, int *len, char *path);
+static int compare_paths(const void *a, const void *b);
+
+int watch_repo()
+{
+	int ret = 0;
+	int lock_fd = -1;
+	ssize_t len = 0;
+	struct watcher w;
+	char *buff = NULL;
+
+	memset(&w, 0, sizeof(struct watcher));
+	w.fd = -1;
+	w.journal_fd = -1;
+
+	// held as long as the watcher runs, snapshots check it
+	lock_fd = open(WATCH_LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB)) {
+		fprintf(stderr, "Another bkp --watch is already running!\n");
+		ret = -1;
+		goto end;
+	}
+
+	buff = malloc(EVENT_BUFF_SIZE);
+	if (!buff) {
+		fprintf(stderr, "Error allocating memory for inotify events!\n");
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	w.fd = inotify_init1(IN_CLOEXEC);
+	if (w.fd < 0) {
+		fprintf(stderr, "Error initializing inotify (errno: %d)!\n", errno);
+		ret = -1;
+		goto end;
+	}
+
+	w.bkp_wd = inotify_add_watch(w.fd, ".bkp-data", IN_CLOSE_WRITE | IN_ONLYDIR);
+	if (w.bkp_wd < 0) {
+		fprintf(stderr, "Error watching .bkp-data (errno: %d)!\n", errno);
+		ret = -1;
+		goto end;
+	}
+
+	ret = add_watches(&w, "./", 2);
+	if (ret)
+		goto end;
+
+	// only once everything is watched, earlier changes are not journaled
+	ret = start_generation(&w);
+	if (ret)
+		goto end;
+
+	printf("Watching %d directories for changes, stop with Ctrl+C...\n", w.num_watches);
+	fflush(stdout);
+
+	while (1) {
+		len = read(w.fd, buff, EVENT_BUFF_SIZE);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "Error reading inotify events (errno: %d)!\n", errno);
+			ret = -1;
+			goto end;
+		}
+
+		for (ssize_t offset=0;offset<len;) {
+			struct inotify_event *event = (struct inotify_event *)(buff + offset);
+
+			ret = handle_event(&w, event);
+			if (ret)
+				goto end;
+
+			offset += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+end:
+	if (w.fd >= 0)
+		close(w.fd);
+
+	if (w.journal_fd >= 0)
+		close(w.journal_fd);
+
+	for (int i=0;i<w.paths_size;i++)
+		free(w.paths[i]);
+
+	clear_journaled(&w);
+	free(w.journaled);
+	free(w.paths);
+	free(buff);
+
+	if (lock_fd >= 0)
+		close(lock_fd);
+
+	return ret;
+}
+
+/*
+ * Watches path and every directory below it. The watch is added
+ * before the directory is read, so a subdirectory created in the
+ * meantime is either read or reported.
+ */
+static int add_watches(struct watcher *w, char *path, int path_len)
+{
+	int ret = 0;
+	int wd = -1;
+	int name_len = 0;
+	DIR *dir = NULL;
+	struct dirent *dirent = NULL;
+	struct stat sb;
+	char sub_path[PATH_MAX];
+
+	wd = inotify_add_watch(w->fd, path, WATCH_MASK);
+	if (wd < 0) {
+		// removed (or replaced) since it was found
+		if (errno == ENOENT || errno == ENOTDIR)
+			return 0;
+
+		if (errno == ENOSPC)
+			fprintf(stderr, "Can`t watch more directories, raise fs.inotify.max_user_watches!\n");
+		else
+			fprintf(stderr, "Error watching %s (errno: %d)!\n", path, errno);
+
+		return -1;
+	}
+
+	ret = set_watch_path(w, wd, path);
+	if (ret)
+		return ret;
+
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	while ((dirent = readdir(dir)) != NULL) {
+		if (strcmp(dirent->d_name, ".") == 0 ||
+			strcmp(dirent->d_name, "..") == 0 ||
+			strcmp(dirent->d_name, ".bkp-data") == 0)
+			continue;
+
+		if (dirent->d_type != DT_DIR && dirent->d_type != DT_UNKNOWN)
+			continue;
+
+		name_len = strlen(dirent->d_name);
+		if (path_len + name_len + 2 > PATH_MAX)
+			continue;
+
+		memcpy(sub_path, path, path_len);
+		memcpy(sub_path + path_len, dirent->d_name, name_len);
+		sub_path[path_len + name_len] = '/';
+		sub_path[path_len + name_len + 1] = '\0';
+
+		if (dirent->d_type == DT_UNKNOWN &&
+			(fstatat(dirfd(dir), dirent->d_name, &sb, AT_SYMLINK_NOFOLLOW) || !S_ISDIR(sb.st_mode)))
+			continue;
+
+		ret = add_watches(w, sub_path, path_len + name_len + 1);
+		if (ret)
+			break;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+static int set_watch_path(struct watcher *w, int wd, char *path)
+{
+	char *dup = NULL;
+
+	if (wd >= w->paths_size) {
+		int size = w->paths_size > 0 ? w->paths_size * 2 : 1024;
+		char **paths = NULL;
+
+		while (size <= wd)
+			size *= 2;
+
+		paths = realloc(w->paths, size * sizeof(char *));
+		if (!paths) {
+			fprintf(stderr, "Error allocating memory for watches!\n");
+			return -ENOMEM;
+		}
+
+		memset(paths + w->paths_size, 0, (size - w->paths_size) * sizeof(char *));
+		w->paths = paths;
+		w->paths_size = size;
+	}
+
+	dup = strdup(path);
+	if (!dup) {
+		fprintf(stderr, "Error allocating memory for watches!\n");
+		return -ENOMEM;
+	}
+
+	if (w->paths[wd])
+		free(w->paths[wd]);
+	else
+		w->num_watches++;
+
+	w->paths[wd] = dup;
+
+	return 0;
+}
+
+/*
+ * Drops the watches of a directory moved away (and of everything
+ * below it), their paths are not right anymore. If it was moved
+ * within the tree, it is watched again under its new path.
+ */
+static void remove_watches(struct watcher *w, char *path)
+{
+	int path_len = strlen(path);
+
+	for (int wd=0;wd<w->paths_size;wd++) {
+		if (w->paths[wd] && strncmp(w->paths[wd], path, path_len) == 0) {
+			inotify_rm_watch(w->fd, wd);
+			free(w->paths[wd]);
+			w->paths[wd] = NULL;
+			w->num_watches--;
+		}
+	}
+}
+
+static int handle_event(struct watcher *w, struct inotify_event *event)
+{
+	int ret = 0;
+	char *path = NULL;
+	char sub_path[PATH_MAX];
+	int path_len = 0;
+
+	if (event->mask & IN_Q_OVERFLOW) {
+		/*
+		 * Events were lost, among them maybe the creation of some
+		 * directories: everything is watched again and the next
+		 * snapshot walks the whole tree
+		 */
+		printf("The event queue overflowed, starting a new journal...\n");
+		fflush(stdout);
+
+		ret = add_watches(w, "./", 2);
+		if (!ret)
+			ret = start_generation(w);
+
+		return ret;
+	}
+
+	if (event->wd == w->bkp_wd) {
+		if (event->len > 0 && strcmp(event->name, "journal-sync") == 0)
+			return handle_sync(w);
+
+		return 0;
+	}
+
+	if (event->wd < 0 || event->wd >= w->paths_size || !w->paths[event->wd])
+		return 0;
+
+	if (event->mask & IN_IGNORED) {
+		free(w->paths[event->wd]);
+		w->paths[event->wd] = NULL;
+		w->num_watches--;
+		return 0;
+	}
+
+	path = w->paths[event->wd];
+	path_len = strlen(path);
+
+	if (event->len > 0 && path_len == 2 && strcmp(event->name, ".bkp-data") == 0)
+		return 0;
+
+	if (event->len > 0 && (event->mask & IN_ISDIR) &&
+		path_len + strlen(event->name) + 2 <= PATH_MAX) {
+		snprintf(sub_path, PATH_MAX, "%s%s/", path, event->name);
+
+		if (event->mask & IN_MOVED_FROM)
+			remove_watches(w, sub_path);
+
+		if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+			ret = journal_record(w, JOURNAL_TREE, sub_path);
+			if (!ret)
+				ret = add_watches(w, sub_path, strlen(sub_path));
+			if (ret)
+				return ret;
+		}
+	}
+
+	return journal_record(w, JOURNAL_DIR, path);
+}
+
+/*
+ * Answers a snapshot: everything reported before its request is
+ * journaled by now. Paths changed from now on must be journaled
+ * again.
+ */
+static int handle_sync(struct watcher *w)
+{
+	int ret = 0;
+	int fd = -1;
+	ssize_t len = 0;
+	char token[JOURNAL_TOKEN_MAX + 1];
+
+	fd = open(JOURNAL_SYNC_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	len = read(fd, token, JOURNAL_TOKEN_MAX);
+	close(fd);
+
+	if (len <= 0)
+		return 0;
+
+	token[len] = '\0';
+
+	if (w->journal_size > JOURNAL_MAX_SIZE) {
+		ret = start_generation(w);
+		if (ret)
+			return ret;
+	}
+
+	ret = write_record(w->journal_fd, JOURNAL_SYNC, token);
+	if (ret)
+		return ret;
+
+	w->journal_size += len + 2;
+	clear_journaled(w);
+
+	return 0;
+}
+
+/*
+ * Replaces the journal with an empty one of a new generation
+ */
+static int start_generation(struct watcher *w)
+{
+	int fd = -1;
+	struct timespec ts;
+	struct journal_header hdr;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	memset(&hdr, 0, sizeof(struct journal_header));
+	memcpy(hdr.magic, JOURNAL_MAGIC, 4);
+	hdr.version = JOURNAL_VERSION;
+	hdr.generation = ((uint64_t)ts.tv_sec << 30) ^ ts.tv_nsec ^ ((uint64_t)getpid() << 48);
+
+	if (hdr.generation == w->generation)
+		hdr.generation++;
+
+	fd = open(JOURNAL_FILE ".new", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0 || write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		rename(JOURNAL_FILE ".new", JOURNAL_FILE)) {
+		fprintf(stderr, "Error creating the journal (errno: %d)!\n", errno);
+
+		if (fd >= 0)
+			close(fd);
+
+		return -1;
+	}
+
+	if (w->journal_fd >= 0)
+		close(w->journal_fd);
+
+	w->journal_fd = fd;
+	w->generation = hdr.generation;
+	w->journal_size = sizeof(hdr);
+
+	clear_journaled(w);
+
+	return 0;
+}
+
+static int journal_record(struct watcher *w, char type, char *path)
+{
+	int ret = 0;
+	uint32_t mask = 0;
+	uint32_t i = 0;
+	int len = strlen(path);
+	char *record = NULL;
+
+	if ((w->journaled_len + 1) * 2 > w->journaled_size) {
+		uint32_t size = w->journaled_size > 0 ? w->journaled_size * 2 : 1024;
+		char **journaled = calloc(size, sizeof(char *));
+
+		if (!journaled) {
+			fprintf(stderr, "Error allocating memory for journaled paths!\n");
+			return -ENOMEM;
+		}
+
+		for (i=0;i<w->journaled_size;i++) {
+			uint32_t j = 0;
+
+			if (!w->journaled[i])
+				continue;
+
+			j = hash_str(w->journaled[i]) & (size - 1);
+			while (journaled[j])
+				j = (j + 1) & (size - 1);
+
+			journaled[j] = w->journaled[i];
+		}
+
+		free(w->journaled);
+		w->journaled = journaled;
+		w->journaled_size = size;
+	}
+
+	record = malloc(len + 2);
+	if (!record) {
+		fprintf(stderr, "Error allocating memory for journaled paths!\n");
+		return -ENOMEM;
+	}
+
+	record[0] = type;
+	memcpy(record + 1, path, len + 1);
+
+	mask = w->journaled_size - 1;
+	i = hash_str(record) & mask;
+
+	while (w->journaled[i]) {
+		if (strcmp(w->journaled[i], record) == 0) {
+			free(record);
+			return 0;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	ret = write_record(w->journal_fd, type, path);
+	if (ret) {
+		free(record);
+		return ret;
+	}
+
+	w->journaled[i] = record;
+	w->journaled_len++;
+	w->journal_size += len + 2;
+
+	return 0;
+}
+
+static int write_record(int fd, char type, char *str)
+{
+	int len = strlen(str);
+	char record[PATH_MAX + 2];
+
+	record[0] = type;
+	memcpy(record + 1, str, len + 1);
+
+	// appended in one write, readers never see half a record followed by another
+	if (write(fd, record, len + 2) != len + 2) {
+		fprintf(stderr, "Error writing the journal (errno: %d)!\n", errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void clear_journaled(struct watcher *w)
+{
+	for (uint32_t i=0;i<w->journaled_size;i++) {
+		free(w->journaled[i]);
+		w->journaled[i] = NULL;
+	}
+
+	w->journaled_len = 0;
+}
+
+static uint32_t hash_str(char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	for (unsigned char *p=(unsigned char *)str;*p;p++) {
+		hash ^= *p;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * Syncs with the watcher. Without a (responsive) watcher, or when
+ * the journal can`t be trusted, the journal is not valid and the
+ * whole tree has to be walked.
+ */
+int read_journal(struct journal *journal)
+{
+	int ret = 0;
+	int fd = -1;
+	int elapsed = 0;
+	struct stat sb;
+	struct journal_header hdr;
+	struct journal_state prev;
+	char token[JOURNAL_TOKEN_MAX + 1];
+	struct timespec ts;
+	size_t offset = 0;
+
+	memset(journal, 0, sizeof(struct journal));
+	memset(&prev, 0, sizeof(struct journal_state));
+
+	fd = open(WATCH_LOCK_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	// the watcher holds an exclusive lock
+	if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
+		close(fd);
+		return 0;
+	}
+
+	close(fd);
+
+	fd = open(JOURNAL_STATE_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		if (read(fd, &prev, sizeof(prev)) != sizeof(prev))
+			memset(&prev, 0, sizeof(struct journal_state));
+
+		close(fd);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	snprintf(token, sizeof(token), "%d-%lld.%09ld", getpid(), (long long)ts.tv_sec, ts.tv_nsec);
+
+	fd = open(JOURNAL_SYNC_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || write(fd, token, strlen(token)) != (ssize_t)strlen(token)) {
+		fprintf(stderr, "Error writing %s (errno: %d)!\n", JOURNAL_SYNC_FILE, errno);
+
+		if (fd >= 0)
+			close(fd);
+
+		return 0;
+	}
+
+	close(fd);
+
+	while (elapsed < JOURNAL_SYNC_TIMEOUT) {
+		usleep(5000);
+		elapsed += 5;
+
+		fd = open(JOURNAL_FILE, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		if (fstat(fd, &sb) || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			memcmp(hdr.magic, JOURNAL_MAGIC, 4) != 0 || hdr.version != JOURNAL_VERSION) {
+			close(fd);
+			continue;
+		}
+
+		// the records since the previous sync, or all of a new journal
+		offset = hdr.generation == prev.generation ? prev.offset : sizeof(hdr);
+		if (offset > (size_t)sb.st_size)
+			offset = sizeof(hdr);
+
+		free(journal->buff);
+		journal->buff = malloc(sb.st_size - offset + 1);
+		if (!journal->buff) {
+			fprintf(stderr, "Error allocating memory for the journal!\n");
+			close(fd);
+			return -ENOMEM;
+		}
+
+		if (pread(fd, journal->buff, sb.st_size - offset, offset) != sb.st_size - (ssize_t)offset) {
+			close(fd);
+			continue;
+		}
+
+		close(fd);
+
+		ret = parse_journal(journal, journal->buff, sb.st_size - offset, token);
+		if (ret < 0)
+			return ret;
+
+		if (ret > 0) {
+			journal->synced = 1;
+			journal->valid = hdr.generation == prev.generation;
+			journal->state.generation = hdr.generation;
+			journal->state.offset = offset + ret;
+
+			qsort(journal->paths, journal->paths_len, sizeof(char *), compare_paths);
+			qsort(journal->trees, journal->trees_len, sizeof(char *), compare_paths);
+
+			return 0;
+		}
+	}
+
+	printf("The watcher did not answer, walking the whole tree\n");
+
+	return 0;
+}
+
+/*
+ * Collects the paths up to the sync record with token. Returns the
+ * length of the records up to (and including) it, 0 when it isn`t
+ * journaled yet.
+ */
+static int parse_journal(struct journal *journal, char *buff, size_t len, char *token)
+{
+	size_t offset = 0;
+	char *end = NULL;
+	char type = 0;
+	char *str = NULL;
+
+	journal->paths_len = 0;
+	journal->trees_len = 0;
+
+	while (offset < len) {
+		end = memchr(buff + offset, '\0', len - offset);
+		if (!end)
+			break; // still being written
+
+		type = buff[offset];
+		str = buff + offset + 1;
+		offset = end - buff + 1;
+
+		if (type == JOURNAL_SYNC && strcmp(str, token) == 0)
+			return offset;
+
+		if (type == JOURNAL_TREE && add_journal_path(&journal->trees, &journal->trees_len, str))
+			return -ENOMEM;
+
+		if ((type == JOURNAL_DIR || type == JOURNAL_TREE) && add_journal_path(&journal->paths, &journal->paths_len, str))
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int add_journal_path(char ***paths, int *len, char *path)
+{
+	// the arrays are only grown, at powers of 2
+	if ((*len & (*len - 1)) == 0) {
+		char **tmp = realloc(*paths, (*len > 0 ? *len * 2 : 64) * sizeof(char *));
+
+		if (!tmp) {
+			fprintf(stderr, "Error allocating memory for the journal!\n");
+			return -ENOMEM;
+		}
+
+		*paths = tmp;
+	}
+
+	(*paths)[(*len)++] = path;
+
+	return 0;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * Returns JOURNAL_TREE if the directory at path is new, JOURNAL_DIR
+ * if it or anything below it changed and 0 if nothing did
+ */
+int journal_path_changed(struct journal *journal, char *path)
+{
+	int path_len = strlen(path);
+	int low = 0, high = journal->trees_len - 1;
+
+	while (low <= high) {
+		int mid = low + (high - low) / 2;
+		int cmp = strcmp(journal->trees[mid], path);
+
+		if (cmp == 0)
+			return JOURNAL_TREE;
+		else if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	// the paths below path (and path itself) follow each other
+	low = 0;
+	high = journal->paths_len;
+
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+
+		if (strcmp(journal->paths[mid], path) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low < journal->paths_len && strncmp(journal->paths[low], path, path_len) == 0)
+		return JOURNAL_DIR;
+
+	return 0;
+}
+
+int save_journal_state(struct journal *journal)
+{
+	int fd = -1;
+
+	if (!journal->synced)
+		return 0;
+
+	fd = open(JOURNAL_STATE_FILE ".new", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || write(fd, &journal->state, sizeof(journal->state)) != sizeof(journal->state)) {
+		fprintf(stderr, "Error writing the journal state (errno: %d)!\n", errno);
+
+		if (fd >= 0)
+			close(fd);
+
+		return -1;
+	}
+
+	close(fd);
+
+	return rename(JOURNAL_STATE_FILE ".new", JOURNAL_STATE_FILE);
+}
+
+void free_journal(struct journal *journal)
+{
+	free(journal->paths);
+	free(journal->trees);
+	free(journal->buff);
+
+	memset(journal, 0, sizeof(struct journal));
+}
@@ -0,0 +1,64 @@
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+
+/*
+ * bkp --watch keeps a journal of the directories changed since
+ * it started, so snapshots only have to walk those. The journal
+ * is a journal_header followed by records: a type and a \0
+ * terminated path (or sync token).
+ *
+ * A snapshot asks the watcher to sync (by writing a token into
+ * JOURNAL_SYNC) and waits for the token to appear in the journal.
+ * Every change made before the snapshot started is journaled by
+ * then. The records between the previous sync and this one are
+ * the changes the snapshot has to walk. They can only be trusted
+ * if the journal still has the generation of the previous sync. A
+ * new watcher, or one whose event queue overflowed, starts a new
+ * generation, and the next snapshot walks everything.
+ */
+#define JOURNAL_FILE ".bkp-data/journal"
+#define JOURNAL_STATE_FILE ".bkp-data/journal-state"
+#define JOURNAL_SYNC_FILE ".bkp-data/journal-sync"
+#define WATCH_LOCK_FILE ".bkp-data/watch.lock"
+
+#define JOURNAL_MAGIC "BKPJ"
+#define JOURNAL_VERSION 1
+
+#define JOURNAL_DIR 'd' // entries of the directory changed
+#define JOURNAL_TREE 't' // new directory, everything below it is new
+#define JOURNAL_SYNC 's'
+
+struct journal_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t generation;
+};
+
+// where the last snapshot synced with the watcher
+struct journal_state {
+	uint64_t generation;
+	uint64_t offset; // right after the sync record
+};
+
+struct journal {
+	int synced; // the watcher answered, the state can be saved
+	int valid; // the records can be used
+	struct journal_state state;
+	char **paths; // changed directories and trees, sorted
+	int paths_len;
+	char **trees; // new trees only, sorted
+	int trees_len;
+	char *buff;
+};
+
+int watch_repo();
+
+int read_journal(struct journal *journal);
+int journal_path_changed(struct journal *journal, char *path);
+int save_journal_state(struct journal *journal);
+void free_journal(struct journal *journal);
+
+#endif